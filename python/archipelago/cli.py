@@ -199,6 +199,21 @@ def archipelago_parser():
     restart_parser.add_argument('role', type=str, nargs='?',
                                 help='peer to restart')
 
+    import stats
+    stats_parser = subparsers.add_parser('stats',
+                                         help='Show live peer statistics')
+    stats_parser.set_defaults(func=stats.stats)
+    stats_parser.add_argument('role', type=str, nargs='?',
+                              help='peer to show')
+    stats_parser.add_argument('-p', '--prometheus', action='store_true',
+                              default=False,
+                              help='Print in the Prometheus text format')
+    stats_parser.add_argument('-w', '--watch', type=float, nargs='?',
+                              const=1.0,
+                              help='Print again every WATCH seconds '
+                                   '(default: 1), with the rates since the '
+                                   'last print')
+
     return parser
 
 
@@ -56,7 +56,8 @@ from pwd import getpwnam
 random.seed()
 hostname = socket.gethostname()
 
-valid_role_types = ['file_blocker', 'rados_blocker', 'mapperd', 'vlmcd']
+valid_role_types = ['file_blocker', 'rados_blocker', 'mem_blocker', 'mapperd',
+                    'vlmcd', 'cached', 'wbcached']
 valid_segment_types = ['posix']
 
 peers = dict()
@@ -69,6 +70,7 @@ DEFAULTS = '/etc/archipelago/archipelago.conf'
 ARCHIP_PREFIX = 'archip_'
 LOG_SUFFIX = '.log'
 PID_SUFFIX = '.pid'
+STATS_SUFFIX = '.stats'
 PIDFILE_PATH = "/var/run/archipelago"
 VLMC_LOCK_FILE = 'vlmc.lock'
 LOGS_PATH = "/var/log/archipelago"
@@ -79,6 +81,9 @@ REQS = 512
 
 FILE_BLOCKER = 'archip-filed'
 RADOS_BLOCKER = 'archip-radosd'
+MEM_BLOCKER = 'archip-memd'
+CACHED = 'archip-cached'
+WBCACHED = 'archip-wbcached'
 MAPPER = 'archip-mapperd'
 VLMC = 'archip-vlmcd'
 
@@ -114,7 +119,7 @@ class Peer(object):
     def __init__(self, role=None, daemon=True, nr_ops=16,
                  logfile=None, pidfile=None, portno_start=None,
                  portno_end=None, log_level=0, spec=None, threshold=None,
-                 cephx_id=None, user=None, group=None):
+                 cephx_id=None, user=None, group=None, stats=True):
         if not role:
             raise Error("Role was not provided")
         self.role = role
@@ -163,6 +168,11 @@ class Peer(object):
         else:
             self.pidfile = os.path.join(PIDFILE_PATH, role + PID_SUFFIX)
 
+        if stats:
+            self.statsfile = os.path.join(PIDFILE_PATH, role + STATS_SUFFIX)
+        else:
+            self.statsfile = None
+
         try:
             if not os.path.isdir(os.path.dirname(self.logfile)):
                 raise Error("Log path %s does not exist" % self.logfile)
@@ -259,6 +269,9 @@ class Peer(object):
         if self.pidfile:
             self.cli_opts.append("--pidfile")
             self.cli_opts.append(self.pidfile)
+        if self.statsfile:
+            self.cli_opts.append("--stats")
+            self.cli_opts.append(self.statsfile)
         if self.portno_start is not None:
             self.cli_opts.append("-sp")
             self.cli_opts.append(str(self.portno_start))
@@ -297,9 +310,10 @@ class MTpeer(Peer):
 
 
 class Radosd(MTpeer):
-    def __init__(self, pool=None, **kwargs):
+    def __init__(self, pool=None, read_split=None, **kwargs):
         self.executable = RADOS_BLOCKER
         self.pool = pool
+        self.read_split = read_split
         super(Radosd, self).__init__(**kwargs)
 
         if self.cli_opts is None:
@@ -313,6 +327,9 @@ class Radosd(MTpeer):
         if self.cephx_id:
             self.cli_opts.append("--cephx-id")
             self.cli_opts.append(self.cephx_id)
+        if self.read_split:
+            self.cli_opts.append("--read-split")
+            self.cli_opts.append(str(self.read_split))
 
 
 class Filed(MTpeer):
@@ -364,8 +381,114 @@ class Filed(MTpeer):
             self.cli_opts.append("--pithos-migrate")
 
 
+class Memd(MTpeer):
+    def __init__(self, arena_size=None, chunk_size=None, latency=None,
+                 bandwidth=None, **kwargs):
+        self.executable = MEM_BLOCKER
+        self.arena_size = arena_size
+        self.chunk_size = chunk_size
+        self.latency = latency
+        self.bandwidth = bandwidth
+        super(Memd, self).__init__(**kwargs)
+
+        if self.cli_opts is None:
+            self.cli_opts = []
+        self.set_memd_cli_options()
+
+    def set_memd_cli_options(self):
+        if self.arena_size:
+            self.cli_opts.append("--arena-size")
+            self.cli_opts.append(str(self.arena_size))
+        if self.chunk_size:
+            self.cli_opts.append("--chunk-size")
+            self.cli_opts.append(str(self.chunk_size))
+        if self.latency:
+            self.cli_opts.append("--latency")
+            self.cli_opts.append(str(self.latency))
+        if self.bandwidth:
+            self.cli_opts.append("--bandwidth")
+            self.cli_opts.append(str(self.bandwidth))
+
+
+class Cached(MTpeer):
+    def __init__(self, blocker_port=None, cache_size=None, ssd_path=None,
+                 ssd_size=None, admission=True, **kwargs):
+        self.executable = CACHED
+        if blocker_port is None:
+            raise Error("blocker_port must be provied for %s" % role)
+        self.blocker_port = blocker_port
+        self.cache_size = cache_size
+        self.ssd_path = ssd_path
+        self.ssd_size = ssd_size
+        self.admission = admission
+        super(Cached, self).__init__(**kwargs)
+
+        if self.cli_opts is None:
+            self.cli_opts = []
+        self.set_cached_cli_options()
+
+    def set_cached_cli_options(self):
+        self.cli_opts.append("-bp")
+        self.cli_opts.append(str(self.blocker_port))
+        if self.cache_size:
+            self.cli_opts.append("--cache-size")
+            self.cli_opts.append(str(self.cache_size))
+        if self.ssd_path:
+            self.cli_opts.append("--ssd-path")
+            self.cli_opts.append(self.ssd_path)
+            self.cli_opts.append("--ssd-size")
+            self.cli_opts.append(str(self.ssd_size))
+        if not self.admission:
+            self.cli_opts.append("--no-admission")
+
+
+class Wbcached(MTpeer):
+    def __init__(self, blocker_port=None, journal=None, journal_size=None,
+                 cache_size=None, volume_limit=None, max_write=None,
+                 max_flushes=None, **kwargs):
+        self.executable = WBCACHED
+        if blocker_port is None:
+            raise Error("blocker_port must be provied for %s" % role)
+        self.blocker_port = blocker_port
+        if journal is None:
+            raise Error("journal must be provied for %s" % role)
+        self.journal = journal
+        self.journal_size = journal_size
+        self.cache_size = cache_size
+        self.volume_limit = volume_limit
+        self.max_write = max_write
+        self.max_flushes = max_flushes
+        super(Wbcached, self).__init__(**kwargs)
+
+        if self.cli_opts is None:
+            self.cli_opts = []
+        self.set_wbcached_cli_options()
+
+    def set_wbcached_cli_options(self):
+        self.cli_opts.append("-bp")
+        self.cli_opts.append(str(self.blocker_port))
+        self.cli_opts.append("--journal")
+        self.cli_opts.append(self.journal)
+        if self.journal_size:
+            self.cli_opts.append("--journal-size")
+            self.cli_opts.append(str(self.journal_size))
+        if self.cache_size:
+            self.cli_opts.append("--cache-size")
+            self.cli_opts.append(str(self.cache_size))
+        if self.volume_limit:
+            self.cli_opts.append("--volume-limit")
+            self.cli_opts.append(str(self.volume_limit))
+        if self.max_write:
+            self.cli_opts.append("--max-write")
+            self.cli_opts.append(str(self.max_write))
+        if self.max_flushes:
+            self.cli_opts.append("--max-flushes")
+            self.cli_opts.append(str(self.max_flushes))
+
+
 class Mapperd(Peer):
-    def __init__(self, blockerm_port=None, blockerb_port=None, **kwargs):
+    def __init__(self, blockerm_port=None, blockerb_port=None,
+                 partitions=None, partition_port=None, **kwargs):
         self.executable = MAPPER
         if blockerm_port is None:
             raise Error("blockerm_port must be provied for %s" % role)
@@ -374,6 +497,8 @@ class Mapperd(Peer):
         if blockerb_port is None:
             raise Error("blockerb_port must be provied for %s" % role)
         self.blockerb_port = blockerb_port
+        self.partitions = partitions
+        self.partition_port = partition_port
         super(Mapperd, self).__init__(**kwargs)
 
         if self.cli_opts is None:
@@ -387,14 +512,23 @@ class Mapperd(Peer):
         if self.blockerb_port is not None:
             self.cli_opts.append("-bp")
             self.cli_opts.append(str(self.blockerb_port))
+        if self.partitions is not None:
+            self.cli_opts.append("--partitions")
+            self.cli_opts.append(str(self.partitions))
+        if self.partition_port is not None:
+            self.cli_opts.append("--partition-port")
+            self.cli_opts.append(str(self.partition_port))
 
 
 class Vlmcd(Peer):
-    def __init__(self, blocker_port=None, mapper_port=None, **kwargs):
+    def __init__(self, blocker_port=None, mapper_port=None, cache_flush=False,
+                 mapper_partitions=None, **kwargs):
         self.executable = VLMC
         if blocker_port is None:
             raise Error("blocker_port must be provied for %s" % role)
         self.blocker_port = blocker_port
+        self.cache_flush = cache_flush
+        self.mapper_partitions = mapper_partitions
 
         if mapper_port is None:
             raise Error("mapper_port must be provied for %s" % role)
@@ -412,6 +546,11 @@ class Vlmcd(Peer):
         if self.mapper_port is not None:
             self.cli_opts.append("-mp")
             self.cli_opts.append(str(self.mapper_port))
+        if self.cache_flush:
+            self.cli_opts.append("--cache-flush")
+        if self.mapper_partitions is not None:
+            self.cli_opts.append("--mapper-partitions")
+            self.cli_opts.append(str(self.mapper_partitions))
 
 
 config = {
@@ -598,12 +737,21 @@ def check_conf():
         elif role_type == 'rados_blocker':
             peers[role] = Radosd(role=role,
                                  spec=segment.get_spec(), **role_config)
+        elif role_type == 'mem_blocker':
+            peers[role] = Memd(role=role,
+                               spec=segment.get_spec(), **role_config)
         elif role_type == 'mapperd':
             peers[role] = Mapperd(role=role, spec=segment.get_spec(),
                                   **role_config)
         elif role_type == 'vlmcd':
             peers[role] = Vlmcd(role=role, spec=segment.get_spec(),
                                 **role_config)
+        elif role_type == 'cached':
+            peers[role] = Cached(role=role, spec=segment.get_spec(),
+                                 **role_config)
+        elif role_type == 'wbcached':
+            peers[role] = Wbcached(role=role, spec=segment.get_spec(),
+                                   **role_config)
         else:
             raise Error("No valid peer type: %s" % role_type)
         validatePortRange(peers[role].portno_start, peers[role].portno_end,
@@ -691,6 +839,8 @@ def createDict(cfg, section):
         sec_dic['threshold'] = cfg.getint(section, 'threshold')
     if cfg.has_option(section, 'log_level'):
         sec_dic['log_level'] = cfg.getint(section, 'log_level')
+    if cfg.has_option(section, 'stats'):
+        sec_dic['stats'] = cfg.getboolean(section, 'stats')
 
     t = str(cfg.get(section, 'type'))
     if t == 'file_blocker':
@@ -711,13 +861,44 @@ def createDict(cfg, section):
             sec_dic['nr_threads'] = cfg.getint(section, 'nr_threads')
         if cfg.has_option(section, 'cephx_id'):
             sec_dic['cephx_id'] = cfg.get(section, 'cephx_id');
+        if cfg.has_option(section, 'read_split'):
+            sec_dic['read_split'] = cfg.getint(section, 'read_split')
         sec_dic['pool'] = cfg.get(section, 'pool')
+    elif t == 'mem_blocker':
+        for opt in ['nr_threads', 'arena_size', 'chunk_size', 'latency',
+                    'bandwidth']:
+            if cfg.has_option(section, opt):
+                sec_dic[opt] = cfg.getint(section, opt)
     elif t == 'mapperd':
         sec_dic['blockerb_port'] = cfg.getint(section, 'blockerb_port')
         sec_dic['blockerm_port'] = cfg.getint(section, 'blockerm_port')
+        for opt in ['partitions', 'partition_port']:
+            if cfg.has_option(section, opt):
+                sec_dic[opt] = cfg.getint(section, opt)
     elif t == 'vlmcd':
         sec_dic['blocker_port'] = cfg.getint(section, 'blocker_port')
         sec_dic['mapper_port'] = cfg.getint(section, 'mapper_port')
+        if cfg.has_option(section, 'cache_flush'):
+            sec_dic['cache_flush'] = cfg.getboolean(section, 'cache_flush')
+        if cfg.has_option(section, 'mapper_partitions'):
+            sec_dic['mapper_partitions'] = cfg.getint(section,
+                                                      'mapper_partitions')
+    elif t == 'cached':
+        sec_dic['blocker_port'] = cfg.getint(section, 'blocker_port')
+        for opt in ['nr_threads', 'cache_size', 'ssd_size']:
+            if cfg.has_option(section, opt):
+                sec_dic[opt] = cfg.getint(section, opt)
+        if cfg.has_option(section, 'ssd_path'):
+            sec_dic['ssd_path'] = cfg.get(section, 'ssd_path')
+        if cfg.has_option(section, 'admission'):
+            sec_dic['admission'] = cfg.getboolean(section, 'admission')
+    elif t == 'wbcached':
+        sec_dic['blocker_port'] = cfg.getint(section, 'blocker_port')
+        sec_dic['journal'] = cfg.get(section, 'journal')
+        for opt in ['nr_threads', 'journal_size', 'cache_size', 'volume_limit',
+                    'max_write', 'max_flushes']:
+            if cfg.has_option(section, opt):
+                sec_dic[opt] = cfg.getint(section, opt)
 
     return sec_dic
 
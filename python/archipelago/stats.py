@@ -0,0 +1,234 @@
+#!/usr/bin/env python
+
+# Copyright (C) 2010-2014 GRNET S.A.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""Live statistics of the peers, as kept in their stats files (see peer.h)"""
+
+import os
+import sys
+import time
+import mmap
+import struct
+
+from .common import *
+
+STATS_MAGIC = 0x54415453
+STATS_VERSION = 2
+HEADER = struct.Struct('<IIIIIIQQ24x')
+# accepted, served, failed, bytes, lat_sum, forwarded, reserved[2]
+OP_COUNTERS = struct.Struct('<QQQQQQ16x')
+# ops of the peers that xseg does not know of (see peer.h)
+PEER_OPS = {30: 'discard'}
+
+
+def op_names():
+    import xseg.xprotocol as xprotocol
+    names = dict(PEER_OPS)
+    for name in dir(xprotocol):
+        value = getattr(xprotocol, name)
+        if name.startswith('X_') and isinstance(value, int):
+            names[value] = name[2:].lower()
+    return names
+
+
+class OpStats(object):
+    def __init__(self, nr_buckets):
+        self.accepted = 0
+        self.served = 0
+        self.failed = 0
+        self.bytes = 0
+        self.lat_sum = 0
+        self.forwarded = 0
+        self.lat = [0] * nr_buckets
+
+    def inflight(self):
+        return max(self.accepted - self.served - self.failed -
+                   self.forwarded, 0)
+
+    def percentile(self, pct):
+        """Upper bound of the pct percentile of the latency, in us"""
+        if not self.served:
+            return 0
+        rank = self.served * pct / 100.0
+        seen = 0
+        for i, count in enumerate(self.lat):
+            seen += count
+            if seen >= rank:
+                return 1 << i
+        return 1 << (len(self.lat) - 1)
+
+
+class PeerStats(object):
+    """The stats of a peer, summed over its threads and the shared slot"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            (magic, version, self.nr_threads, nr_ops, self.nr_buckets,
+             self.nr_reqs, self.pid, self.started) = HEADER.unpack_from(m, 0)
+            if magic != STATS_MAGIC or version != STATS_VERSION:
+                raise Error("%s is not a stats file" % path)
+            self.ops = {}
+            op_len = OP_COUNTERS.size + 8 * self.nr_buckets
+            base = HEADER.size
+            for t in range(self.nr_threads + 1):
+                for op in range(nr_ops):
+                    off = base + (t * nr_ops + op) * op_len
+                    counters = OP_COUNTERS.unpack_from(m, off)
+                    # requests may be concluded on another slot
+                    if not any(counters):
+                        continue
+                    lat = struct.unpack_from('<%dQ' % self.nr_buckets, m,
+                                             off + OP_COUNTERS.size)
+                    s = self.ops.setdefault(op, OpStats(self.nr_buckets))
+                    s.accepted += counters[0]
+                    s.served += counters[1]
+                    s.failed += counters[2]
+                    s.bytes += counters[3]
+                    s.lat_sum += counters[4]
+                    s.forwarded += counters[5]
+                    s.lat = [a + b for a, b in zip(s.lat, lat)]
+        finally:
+            m.close()
+
+    def inflight(self):
+        return sum(s.inflight() for s in self.ops.values())
+
+
+def stats_file(peer):
+    if not peer.statsfile or not os.path.exists(peer.statsfile):
+        raise Error("No stats for %s. Is it running with stats enabled?" %
+                    peer.role)
+    return PeerStats(peer.statsfile)
+
+
+def print_table(role, stats, prev, interval, names):
+    print "%s (pid %d, %d threads, %d/%d requests in flight)" % \
+        (role, stats.pid, stats.nr_threads, stats.inflight(), stats.nr_reqs)
+    print "  %-10s %12s %10s %10s %12s %10s %10s %10s" % \
+        ("op", "served", "failed", "req/s", "MB/s", "avg us", "p50 us",
+         "p99 us")
+    for op in sorted(stats.ops):
+        s = stats.ops[op]
+        p = prev.ops.get(op) if prev else None
+        if p:
+            served = s.served - p.served
+            nbytes = s.bytes - p.bytes
+            lat_sum = s.lat_sum - p.lat_sum
+            elapsed = interval
+        else:
+            served, nbytes, lat_sum = s.served, s.bytes, s.lat_sum
+            elapsed = max(time.time() - stats.started, 1)
+        print "  %-10s %12d %10d %10.1f %12.2f %10.1f %10d %10d" % \
+            (names.get(op, str(op)), s.served, s.failed,
+             served / float(elapsed), nbytes / float(elapsed) / (1 << 20),
+             served and lat_sum / float(served) or 0.0,
+             s.percentile(50), s.percentile(99))
+
+
+def print_prometheus(role, stats, names):
+    labels = 'role="%s"' % role
+    print 'archipelago_peer_inflight{%s} %d' % (labels, stats.inflight())
+    print 'archipelago_peer_max_inflight{%s} %d' % (labels, stats.nr_reqs)
+    print 'archipelago_peer_start_time_seconds{%s} %d' % (labels,
+                                                          stats.started)
+    for op in sorted(stats.ops):
+        s = stats.ops[op]
+        l = '%s,op="%s"' % (labels, names.get(op, str(op)))
+        print 'archipelago_requests_accepted_total{%s} %d' % (l, s.accepted)
+        print 'archipelago_requests_served_total{%s} %d' % (l, s.served)
+        print 'archipelago_requests_failed_total{%s} %d' % (l, s.failed)
+        print 'archipelago_requests_forwarded_total{%s} %d' % \
+            (l, s.forwarded)
+        print 'archipelago_bytes_served_total{%s} %d' % (l, s.bytes)
+        seen = 0
+        for i, count in enumerate(s.lat[:-1]):
+            seen += count
+            print 'archipelago_request_latency_seconds_bucket{%s,le="%g"} ' \
+                  '%d' % (l, (1 << i) / 1e6, seen)
+        print 'archipelago_request_latency_seconds_bucket{%s,le="+Inf"} %d' % \
+            (l, s.served)
+        print 'archipelago_request_latency_seconds_sum{%s} %g' % \
+            (l, s.lat_sum / 1e6)
+        print 'archipelago_request_latency_seconds_count{%s} %d' % \
+            (l, s.served)
+
+
+PROMETHEUS_HELP = [
+    ('archipelago_peer_inflight', 'gauge', 'Requests in flight'),
+    ('archipelago_peer_max_inflight', 'gauge', 'Max requests in flight'),
+    ('archipelago_peer_start_time_seconds', 'gauge',
+     'Start time of the peer since the epoch'),
+    ('archipelago_requests_accepted_total', 'counter', 'Accepted requests'),
+    ('archipelago_requests_served_total', 'counter', 'Served requests'),
+    ('archipelago_requests_failed_total', 'counter', 'Failed requests'),
+    ('archipelago_requests_forwarded_total', 'counter',
+     'Requests deferred or forwarded to other peers'),
+    ('archipelago_bytes_served_total', 'counter',
+     'Bytes serviced by served requests'),
+    ('archipelago_request_latency_seconds', 'histogram',
+     'Latency of served requests'),
+]
+
+
+def stats(role=None, prometheus=False, watch=None, cli=False, **kwargs):
+    peers = construct_peers()
+    if role:
+        if role not in peers:
+            raise Error("Invalid peer %s" % role)
+        roles = [role]
+    else:
+        roles = [r for r, _ in config['roles']]
+
+    try:
+        names = op_names()
+    except ImportError:
+        names = dict(PEER_OPS)
+
+    prev = {}
+    while True:
+        current = {}
+        for r in roles:
+            try:
+                current[r] = stats_file(peers[r])
+            except (Error, IOError, ValueError) as e:
+                if role:
+                    raise Error(str(e))
+        if prometheus:
+            for name, kind, text in PROMETHEUS_HELP:
+                print "# HELP %s %s" % (name, text)
+                print "# TYPE %s %s" % (name, kind)
+            for r in roles:
+                if r in current:
+                    print_prometheus(r, current[r], names)
+        else:
+            for r in roles:
+                if r in current:
+                    p = prev.get(r)
+                    if p and p.pid != current[r].pid:
+                        p = None
+                    print_table(r, current[r], p, watch, names)
+                else:
+                    print "%s: no stats" % r
+        sys.stdout.flush()
+        if not watch:
+            return 0
+        prev = current
+        time.sleep(watch)
+        if not prometheus:
+            print ""
@@ -262,3 +262,140 @@ int lfsr_init(struct bench_lfsr *lfsr, uint64_t nums, unsigned long seed,
 	return 0;
 }
 
+
+/*
+ * xorshift64* generator. The state must never be zero.
+ */
+uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Return a double uniformly distributed in (0, 1] */
+double bench_rand_double(uint64_t *state)
+{
+	return (double)((bench_rand(state) >> 11) + 1) / (double)(1ULL << 53);
+}
+
+/* FNV-1a hash of a 64-bit value */
+static uint64_t fnv_hash64(uint64_t val)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		hash ^= val & 0xFF;
+		hash *= 0x100000001B3ULL;
+		val >>= 8;
+	}
+	return hash;
+}
+
+/*
+ * Zipfian generator, as described in "Quickly Generating Billion-Record
+ * Synthetic Databases" by Gray et al. and used by YCSB.
+ *
+ * Value i (counting from 0) is drawn with probability proportional to
+ * 1 / (i + 1)^theta, where 0 < theta < 1. The computation of zeta(n) is
+ * O(n), but is done only once. The popular values are scattered over the
+ * range by hashing, so that they are not all at its start.
+ */
+int zipf_init(struct bench_zipf *zipf, uint64_t n, double theta)
+{
+	double zeta2;
+	uint64_t i;
+
+	if (!n || theta <= 0 || theta >= 1)
+		return 1;
+
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->zetan = 0;
+	for (i = 1; i <= n; i++)
+		zipf->zetan += 1.0 / pow((double)i, theta);
+	zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+	zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) /
+		(1.0 - zeta2 / zipf->zetan);
+
+	return 0;
+}
+
+uint64_t zipf_next(struct bench_zipf *zipf, uint64_t *state)
+{
+	double u = bench_rand_double(state);
+	double uz = u * zipf->zetan;
+	uint64_t rank;
+
+	if (uz < 1.0)
+		rank = 0;
+	else if (uz < 1.0 + pow(0.5, zipf->theta))
+		rank = 1;
+	else
+		rank = zipf->n * pow(zipf->eta * u - zipf->eta + 1.0,
+				zipf->alpha);
+	if (rank >= zipf->n)
+		rank = zipf->n - 1;
+
+	return fnv_hash64(rank) % zipf->n;
+}
+
+/*
+ * Hotspot generator: hot_prob of the values are drawn uniformly from the first
+ * hot_frac of the range and the rest uniformly from the remainder.
+ */
+int hotspot_init(struct bench_hotspot *hot, uint64_t n, double hot_frac,
+		double hot_prob)
+{
+	if (!n || hot_frac <= 0 || hot_frac > 1 || hot_prob < 0 ||
+			hot_prob > 1)
+		return 1;
+
+	hot->n = n;
+	hot->hot_n = n * hot_frac;
+	if (!hot->hot_n)
+		hot->hot_n = 1;
+	hot->hot_prob = hot_prob;
+	return 0;
+}
+
+uint64_t hotspot_next(struct bench_hotspot *hot, uint64_t *state)
+{
+	uint64_t cold_n = hot->n - hot->hot_n;
+
+	if (!cold_n || bench_rand_double(state) <= hot->hot_prob)
+		return bench_rand(state) % hot->hot_n;
+	return hot->hot_n + bench_rand(state) % cold_n;
+}
+
+int seqjump_init(struct bench_seqjump *jump, uint64_t n, uint64_t run)
+{
+	if (!n || !run)
+		return 1;
+
+	jump->n = n;
+	jump->run = run;
+	jump->left = 0;
+	jump->next = 0;
+	return 0;
+}
+
+uint64_t seqjump_next(struct bench_seqjump *jump, uint64_t *state)
+{
+	uint64_t val;
+
+	if (!jump->left) {
+		jump->next = bench_rand(state) % jump->n;
+		jump->left = jump->run;
+	}
+	val = jump->next;
+	jump->next = (jump->next + 1) % jump->n;
+	jump->left--;
+	return val;
+}
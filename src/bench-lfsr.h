@@ -38,6 +38,43 @@ struct bench_lfsr {
 	unsigned int spin;
 };
 
+/*
+ * Skewed generators. Unlike the LFSR, they do not produce a permutation of
+ * their range; values are drawn independently from a xorshift generator, whose
+ * state is kept by the caller so that it can be seeded deterministically.
+ */
+struct bench_zipf {
+	uint64_t n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+};
+
+struct bench_hotspot {
+	uint64_t n;
+	uint64_t hot_n;		/* first hot_n values are hot */
+	double hot_prob;	/* probability that a hot value is drawn */
+};
+
+/* Sequential runs of a fixed length, each one starting at a random value */
+struct bench_seqjump {
+	uint64_t n;
+	uint64_t run;
+	uint64_t left;		/* values left in the current run */
+	uint64_t next;
+};
+
+uint64_t bench_rand(uint64_t *state);
+double bench_rand_double(uint64_t *state);
+int zipf_init(struct bench_zipf *zipf, uint64_t n, double theta);
+uint64_t zipf_next(struct bench_zipf *zipf, uint64_t *state);
+int hotspot_init(struct bench_hotspot *hot, uint64_t n, double hot_frac,
+		double hot_prob);
+uint64_t hotspot_next(struct bench_hotspot *hot, uint64_t *state);
+int seqjump_init(struct bench_seqjump *jump, uint64_t n, uint64_t run);
+uint64_t seqjump_next(struct bench_seqjump *jump, uint64_t *state);
+
 uint64_t lfsr_next(struct bench_lfsr *lfsr);
 int lfsr_init(struct bench_lfsr *lfsr, uint64_t size,
 		unsigned long seed, unsigned int spin);
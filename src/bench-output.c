@@ -0,0 +1,319 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+#include <peer.h>
+#include <time.h>
+#include <xseg/util.h>
+#include <signal.h>
+#include <bench-xseg.h>
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Output for tools
+ *
+ * With --output json, a single JSON document is printed to stdout:
+ *
+ *     {"version": 1,
+ *      "config": {...},
+ *      "samples": [{...}, ...],
+ *      "totals": {...},
+ *      "histograms": {"rec": [[<low ns>, <high ns>, <count>], ...], ...}}
+ *
+ * Samples are printed at the progress intervals and describe the interval that
+ * has just ended. With --output csv, the configuration is printed as comment
+ * lines, followed by a header and one row per sample, plus a last row for the
+ * totals. Times are in seconds, latencies in ns and bandwidth in bytes/s.
+ */
+
+#define OUTPUT_VERSION 1
+
+static char *__op_name(uint32_t op)
+{
+	switch (op) {
+	case X_READ: return "read";
+	case X_WRITE: return "write";
+	case X_INFO: return "info";
+	case X_DELETE: return "delete";
+	case X_HASH: return "hash";
+	default: return "unknown";
+	}
+}
+
+static char *__pattern_name(struct bench *prefs)
+{
+	switch (GET_FLAG(PATTERN, prefs->flags)) {
+	case PATTERN_SEQ: return "seq";
+	case PATTERN_RAND: return "rand";
+	case PATTERN_ZIPF: return "zipf";
+	case PATTERN_HOTSPOT: return "hotspot";
+	case PATTERN_SEQJUMP: return "seqjump";
+	default: return "unknown";
+	}
+}
+
+static char *__mode_name(struct bench *prefs)
+{
+	if (prefs->profile)
+		return "profile";
+	if (prefs->replay)
+		return "replay";
+	switch (GET_FLAG(ARRIVAL, prefs->flags)) {
+	case ARRIVAL_CONST: return "open-const";
+	case ARRIVAL_POISSON: return "open-poisson";
+	default: return "closed";
+	}
+}
+
+/* Print a JSON string, escaping what needs to be escaped */
+static void __json_str(char *str, int len)
+{
+	int i;
+
+	fputc('"', stdout);
+	for (i = 0; i < len && str[i]; i++) {
+		if (str[i] == '"' || str[i] == '\\')
+			fputc('\\', stdout);
+		if ((unsigned char)str[i] < 0x20)
+			fprintf(stdout, "\\u%04x", str[i]);
+		else
+			fputc(str[i], stdout);
+	}
+	fputc('"', stdout);
+}
+
+static int __rec_enabled(struct bench *prefs)
+{
+	return GET_FLAG(INSANITY, prefs->flags) >= prefs->rec_tm->insanity;
+}
+
+static double __timespec2sec(struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / pow(10, 9);
+}
+
+void output_config(struct bench *prefs)
+{
+	struct object_vars *obv = prefs->objvars;
+
+	if (GET_FLAG(OUTPUT, prefs->flags) == OUTPUT_CSV) {
+		fprintf(stdout, "# op=%s pattern=%s mode=%s bs=%lu os=%lu "
+				"ts=%lu to=%lu iodepth=%u threads=%u rate=%lu "
+				"seed=%lu\n",
+				__op_name(prefs->op), __pattern_name(prefs),
+				__mode_name(prefs), prefs->bs, prefs->os,
+				prefs->ts, prefs->to, prefs->iodepth,
+				prefs->nr_threads, prefs->rate, obv->seed);
+		fprintf(stdout, "type,time,submitted,received,failed,iops,"
+				"bandwidth,p50,p90,p99,p99.9,max\n");
+		fflush(stdout);
+		return;
+	}
+
+	fprintf(stdout, "{\"version\": %d,\n", OUTPUT_VERSION);
+	fprintf(stdout, " \"config\": {\"op\": \"%s\", \"pattern\": \"%s\", "
+			"\"mode\": \"%s\", ", prefs->profile || prefs->replay ?
+			"mixed" : __op_name(prefs->op), __pattern_name(prefs),
+			__mode_name(prefs));
+	fprintf(stdout, "\"bs\": %lu, \"os\": %lu, \"ts\": %lu, \"to\": %lu, "
+			"\"iodepth\": %u, \"threads\": %u, \"rate\": %lu, "
+			"\"seed\": %lu, \"max\": %lu, \"verify\": %lu, ",
+			prefs->bs, prefs->os, prefs->ts, prefs->to,
+			prefs->iodepth, prefs->nr_threads, prefs->rate,
+			obv->seed, prefs->status->max,
+			GET_FLAG(VERIFY, prefs->flags));
+	fprintf(stdout, "\"target\": ");
+	if (obv->prefix[0])
+		__json_str(obv->prefix, obv->prefixlen);
+	else
+		__json_str(obv->name, obv->namelen);
+	fprintf(stdout, "},\n \"samples\": [");
+	fflush(stdout);
+}
+
+static void __percentiles_json(struct histogram *hist)
+{
+	fprintf(stdout, "{\"count\": %lu, \"p50\": %lu, \"p90\": %lu, "
+			"\"p99\": %lu, \"p99.9\": %lu, \"p99.99\": %lu, "
+			"\"max\": %lu}", hist->count,
+			hist_percentile(hist, 50), hist_percentile(hist, 90),
+			hist_percentile(hist, 99), hist_percentile(hist, 99.9),
+			hist_percentile(hist, 99.99), hist->max);
+}
+
+static void __percentiles_csv(struct histogram *hist, int enabled)
+{
+	if (!enabled || !hist->count) {
+		fprintf(stdout, ",,,,,\n");
+		return;
+	}
+	fprintf(stdout, ",%lu,%lu,%lu,%lu,%lu\n", hist_percentile(hist, 50),
+			hist_percentile(hist, 90), hist_percentile(hist, 99),
+			hist_percentile(hist, 99.9), hist->max);
+}
+
+/*
+ * Print a sample of the interval that has just ended. Like print_progress(),
+ * it must be called after collect_progress().
+ */
+void output_sample(struct bench *prefs)
+{
+	struct req_status *status = prefs->status;
+	struct timer *tm = prefs->total_tm;
+	struct histogram *hist = &prefs->rec_tm->ihist;
+	double elapsed, iops, bw;
+
+	timer_stop(prefs, tm, NULL);
+	elapsed = __timespec2sec(&tm->elapsed_time);
+	iops = elapsed > 0 ? (status->received - prefs->rep->prev_recv) /
+		elapsed : 0;
+	bw = elapsed > 0 ? (status->bytes - prefs->rep->prev_bytes) /
+		elapsed : 0;
+	prefs->rep->prev_recv = status->received;
+	prefs->rep->prev_bytes = status->bytes;
+
+	if (GET_FLAG(OUTPUT, prefs->flags) == OUTPUT_CSV) {
+		fprintf(stdout, "sample,%.6lf,%lu,%lu,%lu,%.3lf,%.0lf",
+				__timespec2sec(&tm->sum), status->submitted,
+				status->received, status->failed, iops, bw);
+		__percentiles_csv(hist, __rec_enabled(prefs));
+	} else {
+		fprintf(stdout, "%s\n  {\"time\": %.6lf, \"elapsed\": %.6lf, "
+				"\"submitted\": %lu, \"received\": %lu, "
+				"\"failed\": %lu, \"iops\": %.3lf, "
+				"\"bandwidth\": %.0lf",
+				prefs->rep->samples ? "," : "",
+				__timespec2sec(&tm->sum), elapsed,
+				status->submitted, status->received,
+				status->failed, iops, bw);
+		if (__rec_enabled(prefs)) {
+			fprintf(stdout, ", \"latency\": ");
+			__percentiles_json(hist);
+		}
+		fprintf(stdout, "}");
+	}
+	prefs->rep->samples++;
+	hist_reset(hist);
+	fflush(stdout);
+
+	timer_start(prefs, tm);
+}
+
+static void __histogram_json(char *name, struct histogram *hist, int first)
+{
+	int i, n = 0;
+
+	fprintf(stdout, "%s\n  \"%s\": [", first ? "" : ",", name);
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		fprintf(stdout, "%s[%lu, %lu, %lu]", n++ ? ", " : "",
+				hist_bucket_low(i), hist_bucket_high(i),
+				hist->buckets[i]);
+	}
+	fprintf(stdout, "]");
+}
+
+/* Setup times and the vlmcd timing of a volume benchmark */
+static void __volume_json(struct bench *prefs)
+{
+	struct bench_volume *vol = prefs->volume;
+
+	fprintf(stdout, ", \"volume\": {\"setup\": %lu, \"snapshot\": %lu, "
+			"\"timed\": %lu, \"untimed\": %lu", vol->setup_ns,
+			vol->snap_ns, vol->timed, vol->untimed);
+	if (vol->timed) {
+		fprintf(stdout, ", \"queue\": ");
+		__percentiles_json(&vol->queue);
+		fprintf(stdout, ", \"map\": ");
+		__percentiles_json(&vol->map);
+		fprintf(stdout, ", \"io\": ");
+		__percentiles_json(&vol->io);
+	}
+	fprintf(stdout, "}");
+}
+
+/* Print the totals, once the results of all threads have been collected */
+void output_results(struct bench *prefs)
+{
+	struct req_status *status = prefs->status;
+	struct timer *rec = prefs->rec_tm;
+	int insanity = GET_FLAG(INSANITY, prefs->flags);
+	double elapsed, iops, bw;
+	int first = 1;
+
+	elapsed = __timespec2sec(&prefs->total_tm->sum);
+	iops = elapsed > 0 ? status->received / elapsed : 0;
+	bw = elapsed > 0 ? status->bytes / elapsed : 0;
+
+	if (GET_FLAG(OUTPUT, prefs->flags) == OUTPUT_CSV) {
+		fprintf(stdout, "total,%.6lf,%lu,%lu,%lu,%.3lf,%.0lf",
+				elapsed, status->submitted, status->received,
+				status->failed, iops, bw);
+		__percentiles_csv(&rec->hist, __rec_enabled(prefs));
+		fflush(stdout);
+		return;
+	}
+
+	fprintf(stdout, "],\n \"totals\": {\"time\": %.6lf, "
+			"\"submitted\": %lu, \"received\": %lu, "
+			"\"failed\": %lu, \"corrupted\": %lu, \"iops\": %.3lf, "
+			"\"bandwidth\": %.0lf", elapsed, status->submitted,
+			status->received, status->failed, status->corrupted,
+			iops, bw);
+	if (__rec_enabled(prefs)) {
+		fprintf(stdout, ", \"latency\": ");
+		__percentiles_json(&rec->hist);
+		if (status->received)
+			fprintf(stdout, ", \"latency_avg\": %.0lf",
+					__timespec2sec(&rec->sum) * pow(10, 9) /
+					status->received);
+	}
+	if (GET_FLAG(ARRIVAL, prefs->flags) != ARRIVAL_CLOSED) {
+		fprintf(stdout, ", \"lag\": ");
+		__percentiles_json(&prefs->lag_tm->hist);
+	}
+	if (prefs->volume)
+		__volume_json(prefs);
+	fprintf(stdout, "},\n \"histograms\": {");
+
+	if (insanity >= rec->insanity) {
+		__histogram_json("rec", &rec->hist, first);
+		first = 0;
+	}
+	if (insanity >= prefs->sub_tm->insanity) {
+		__histogram_json("sub", &prefs->sub_tm->hist, first);
+		first = 0;
+	}
+	if (insanity >= prefs->get_tm->insanity) {
+		__histogram_json("get", &prefs->get_tm->hist, first);
+		first = 0;
+	}
+	if (GET_FLAG(ARRIVAL, prefs->flags) != ARRIVAL_CLOSED)
+		__histogram_json("lag", &prefs->lag_tm->hist, first);
+	fprintf(stdout, "}}\n");
+	fflush(stdout);
+}
@@ -0,0 +1,607 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+#include <peer.h>
+#include <time.h>
+#include <xseg/util.h>
+#include <signal.h>
+#include <bench-xseg.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Workload profiles
+ *
+ * A profile describes a sequence of phases, each one with its own mix of reads
+ * and writes, block sizes, access distribution and think time. The profile
+ * file is line based: a phase starts with a "phase <name>" line and is
+ * followed by "key = value" lines. Empty lines and lines starting with '#' are
+ * ignored. For example:
+ *
+ *     phase warmup
+ *     duration = 30s
+ *     access = uniform
+ *
+ *     phase steady
+ *     duration = 2m
+ *     read = 70
+ *     bs = 4k:60, 64k:30, 1M:10
+ *     access = zipf:0.99
+ *     think = 100us
+ *
+ * The keys of a phase are:
+ *
+ *     duration  length of the phase in [us|ms|s|m], or
+ *     requests  number of requests of the phase
+ *     read      percentage of reads, the rest are writes (default 100)
+ *     bs        block size or comma-separated list of <size>:<weight>
+ *               (default 4k)
+ *     access    seq, uniform, zipf[:<theta>] (default theta 0.99) or
+ *               hotspot[:<% of objects>:<% of requests>] (default 20:80)
+ *               (default uniform)
+ *     think     time between a reply and the next request, in [us|ms|s|m]
+ *               (default 0)
+ */
+
+#define PROFILE_MAX_LINE 256
+
+/*
+ * Convert a time with an optional unit (default is seconds) to nanoseconds.
+ * On invalid syntax, set err.
+ */
+static uint64_t __str2ns(char *str, int *err)
+{
+	char *unit;
+	double val;
+
+	*err = 0;
+	val = strtod(str, &unit);
+	if (unit == str || val < 0)
+		goto fail;
+
+	if (!unit[0] || !strcmp(unit, "s"))
+		return val * 1000000000;
+	if (!strcmp(unit, "ms"))
+		return val * 1000000;
+	if (!strcmp(unit, "us"))
+		return val * 1000;
+	if (!strcmp(unit, "m"))
+		return val * 60 * 1000000000;
+fail:
+	*err = 1;
+	return 0;
+}
+
+static char *__strip(char *str)
+{
+	char *end;
+
+	while (isspace(*str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace(end[-1]))
+		end--;
+	*end = 0;
+	return str;
+}
+
+/* Read a plain decimal number, with no sign and nothing after it */
+static int __read_num(char *val, uint64_t *num)
+{
+	char *rem;
+
+	if (!isdigit(val[0]))
+		return -1;
+	errno = 0;
+	*num = strtoull(val, &rem, 10);
+	if (rem[0] || errno)
+		return -1;
+	return 0;
+}
+
+static int __read_bs(struct bench *prefs, struct bench_phase *phase,
+		char *val, unsigned int page_size)
+{
+	struct bench_bs *bs;
+	char *tok, *weight, *saveptr, *rem;
+
+	phase->nr_bs = 0;
+	phase->bs_weight = 0;
+	for (tok = strtok_r(val, ",", &saveptr); tok;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		if (phase->nr_bs == PROFILE_MAX_BS)
+			return -1;
+		bs = &phase->bs[phase->nr_bs++];
+
+		weight = strchr(tok, ':');
+		if (weight)
+			*weight++ = 0;
+		bs->size = str2num(__strip(tok));
+		bs->weight = 1;
+		if (weight) {
+			weight = __strip(weight);
+			bs->weight = strtoul(weight, &rem, 10);
+			if (rem == weight || rem[0])
+				return -1;
+		}
+		if (!bs->size || bs->size % page_size ||
+				bs->size > prefs->os || !bs->weight)
+			return -1;
+		phase->bs_weight += bs->weight;
+	}
+	return phase->nr_bs ? 0 : -1;
+}
+
+static int __read_access(struct bench_phase *phase, char *val)
+{
+	char *arg = strchr(val, ':');
+	char *rem;
+
+	if (arg)
+		*arg++ = 0;
+
+	if (!strcmp(val, "seq")) {
+		phase->access = ACCESS_SEQ;
+	} else if (!strcmp(val, "uniform")) {
+		phase->access = ACCESS_UNIFORM;
+	} else if (!strcmp(val, "zipf")) {
+		phase->access = ACCESS_ZIPF;
+		phase->theta = 0.99;
+		if (arg) {
+			phase->theta = strtod(arg, &rem);
+			if (rem == arg || rem[0])
+				return -1;
+		}
+		if (phase->theta <= 0 || phase->theta >= 1)
+			return -1;
+		return 0;
+	} else if (!strcmp(val, "hotspot")) {
+		phase->access = ACCESS_HOTSPOT;
+		phase->hot_frac = 0.2;
+		phase->hot_prob = 0.8;
+		if (arg) {
+			phase->hot_frac = strtod(arg, &rem) / 100;
+			if (rem == arg || rem[0] != ':')
+				return -1;
+			arg = rem + 1;
+			phase->hot_prob = strtod(arg, &rem) / 100;
+			if (rem == arg || rem[0])
+				return -1;
+		}
+		if (phase->hot_frac <= 0 || phase->hot_frac > 1 ||
+				phase->hot_prob < 0 || phase->hot_prob > 1)
+			return -1;
+		return 0;
+	} else {
+		return -1;
+	}
+
+	return arg ? -1 : 0;
+}
+
+static int __read_phase_key(struct bench *prefs, struct bench_phase *phase,
+		char *key, char *val, unsigned int page_size)
+{
+	uint64_t num;
+	int err;
+
+	if (!strcmp(key, "duration")) {
+		phase->duration = __str2ns(val, &err);
+		return (err || !phase->duration) ? -1 : 0;
+	}
+	if (!strcmp(key, "requests")) {
+		if (__read_num(val, &num) < 0 || !num)
+			return -1;
+		phase->requests = num;
+		return 0;
+	}
+	if (!strcmp(key, "read")) {
+		if (__read_num(val, &num) < 0 || num > 100)
+			return -1;
+		phase->read_pct = num;
+		return 0;
+	}
+	if (!strcmp(key, "bs"))
+		return __read_bs(prefs, phase, val, page_size);
+	if (!strcmp(key, "access"))
+		return __read_access(phase, val);
+	if (!strcmp(key, "think")) {
+		phase->think = __str2ns(val, &err);
+		return err ? -1 : 0;
+	}
+	return -1;
+}
+
+static void __init_phase(struct bench *prefs, struct bench_phase *phase,
+		char *name)
+{
+	memset(phase, 0, sizeof(struct bench_phase));
+	strncpy(phase->name, name, PROFILE_NAME_LEN);
+	phase->read_pct = 100;
+	phase->nr_bs = 1;
+	phase->bs[0].size = prefs->bs;
+	phase->bs[0].weight = 1;
+	phase->bs_weight = 1;
+	phase->access = ACCESS_UNIFORM;
+}
+
+static int __check_phase(struct bench_phase *phase)
+{
+	if (!phase->duration == !phase->requests) {
+		XSEGLOG2(&lc, E, "Phase %s: exactly one of duration and "
+				"requests must be given", phase->name);
+		return -1;
+	}
+	return 0;
+}
+
+static struct bench_profile *__alloc_profile(uint32_t nr_phases)
+{
+	struct bench_profile *prof;
+	uint32_t i;
+	int j;
+
+	prof = calloc(1, sizeof(struct bench_profile));
+	if (!prof)
+		return NULL;
+	prof->res = calloc(nr_phases, sizeof(struct phase_result));
+	if (!prof->res) {
+		free(prof);
+		return NULL;
+	}
+	for (i = 0; i < nr_phases; i++)
+		for (j = 0; j < PROFILE_NR_OPS; j++)
+			hist_reset(&prof->res[i].ops[j].hist);
+	prof->nr_phases = nr_phases;
+	return prof;
+}
+
+void free_profile(struct bench_profile *prof)
+{
+	if (!prof)
+		return;
+	free(prof->ready);
+	free(prof->res);
+	free(prof);
+}
+
+/*
+ * Read the profile at path and attach it to the global struct bench. The
+ * object space of the profile is defined by -to, -ts or --objname, which must
+ * have already been read.
+ */
+int read_profile(struct bench *prefs, char *path, unsigned int page_size)
+{
+	struct bench_phase *phases, *phase = NULL;
+	char line[PROFILE_MAX_LINE];
+	char *str, *val;
+	uint32_t nr_phases = 0;
+	int lineno = 0;
+	FILE *fp;
+
+	phases = calloc(PROFILE_MAX_PHASES, sizeof(struct bench_phase));
+	if (!phases) {
+		perror("calloc");
+		return -1;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		XSEGLOG2(&lc, E, "Cannot open profile %s: %s", path,
+				strerror(errno));
+		goto out_free;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		str = __strip(line);
+		if (!str[0] || str[0] == '#')
+			continue;
+
+		if (!strncmp(str, "phase", 5) && (!str[5] || isspace(str[5]))) {
+			if (phase && __check_phase(phase) < 0)
+				goto out_close;
+			if (nr_phases == PROFILE_MAX_PHASES) {
+				XSEGLOG2(&lc, E, "%s:%d: Too many phases",
+						path, lineno);
+				goto out_close;
+			}
+			phase = &phases[nr_phases++];
+			__init_phase(prefs, phase, __strip(str + 5));
+			continue;
+		}
+
+		val = strchr(str, '=');
+		if (!phase || !val) {
+			XSEGLOG2(&lc, E, "%s:%d: Invalid syntax", path, lineno);
+			goto out_close;
+		}
+		*val++ = 0;
+		if (__read_phase_key(prefs, phase, __strip(str), __strip(val),
+					page_size) < 0) {
+			XSEGLOG2(&lc, E, "%s:%d: Invalid value for %s",
+					path, lineno, __strip(str));
+			goto out_close;
+		}
+	}
+
+	if (!phase) {
+		XSEGLOG2(&lc, E, "Profile %s has no phases", path);
+		goto out_close;
+	}
+	if (__check_phase(phase) < 0)
+		goto out_close;
+	fclose(fp);
+
+	prefs->profile = __alloc_profile(nr_phases);
+	if (!prefs->profile) {
+		perror("calloc");
+		goto out_free;
+	}
+	prefs->profile->phases = phases;
+
+	if (prefs->objvars->name[0])
+		prefs->profile->objects = 1;
+	else if (prefs->to)
+		prefs->profile->objects = prefs->to;
+	else
+		prefs->profile->objects = (prefs->ts + prefs->os - 1) / prefs->os;
+	return 0;
+
+out_close:
+	fclose(fp);
+out_free:
+	free(phases);
+	return -1;
+}
+
+int init_thread_profile(struct bench *prefs, struct bench *tprefs)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct bench_profile *tprof;
+	uint64_t per_thread;
+
+	tprof = __alloc_profile(prof->nr_phases);
+	if (!tprof)
+		return -1;
+
+	tprof->phases = prof->phases;
+	tprof->objects = prof->objects;
+	tprof->rand_state = (tprefs->arrival_state ^ 0x5DEECE66DULL) |
+		(1ULL << 63);
+
+	/* Sequential access of each thread starts from its own region */
+	per_thread = prof->objects / prefs->nr_threads;
+	tprof->seq_pos = tprefs->thread_no * per_thread * prefs->os;
+
+	/* Initially, all request slots are ready */
+	tprof->ready_size = prefs->iodepth;
+	tprof->ready_count = prefs->iodepth;
+	tprof->ready = calloc(prefs->iodepth, sizeof(uint64_t));
+	if (!tprof->ready) {
+		free_profile(tprof);
+		return -1;
+	}
+
+	tprefs->profile = tprof;
+	return 0;
+}
+
+static inline uint64_t __now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_BENCH, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Requests of a request bounded phase that this thread must send */
+static uint64_t __phase_requests(struct bench *prefs, struct bench_phase *phase)
+{
+	return phase->requests / prefs->nr_threads +
+		(prefs->thread_no < phase->requests % prefs->nr_threads);
+}
+
+static void __enter_phase(struct bench *prefs, struct timespec *now)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct bench_phase *phase = &prof->phases[prof->cur];
+
+	prof->res[prof->cur].start = *now;
+	prof->submitted = 0;
+
+	if (phase->access == ACCESS_ZIPF)
+		zipf_init(&prof->zipf, prof->objects, phase->theta);
+	else if (phase->access == ACCESS_HOTSPOT)
+		hotspot_init(&prof->hot, prof->objects, phase->hot_frac,
+				phase->hot_prob);
+}
+
+static int __phase_over(struct bench *prefs, struct timespec *now)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct bench_phase *phase = &prof->phases[prof->cur];
+
+	if (phase->duration)
+		return timespec_diff_ns(now, &prof->res[prof->cur].start) >=
+			(int64_t)phase->duration;
+	return prof->submitted >= __phase_requests(prefs, phase);
+}
+
+static uint64_t __pick_bs(struct bench_profile *prof,
+		struct bench_phase *phase)
+{
+	uint64_t w;
+	uint32_t i;
+
+	if (phase->nr_bs == 1)
+		return phase->bs[0].size;
+
+	w = bench_rand(&prof->rand_state) % phase->bs_weight;
+	for (i = 0; i < phase->nr_bs - 1; i++) {
+		if (w < phase->bs[i].weight)
+			break;
+		w -= phase->bs[i].weight;
+	}
+	return phase->bs[i].size;
+}
+
+static void __pick_target(struct bench *prefs, struct bench_phase *phase,
+		struct profile_req *preq)
+{
+	struct bench_profile *prof = prefs->profile;
+	uint64_t os = prefs->os;
+	uint64_t pos;
+
+	switch (phase->access) {
+	case ACCESS_SEQ:
+		pos = prof->seq_pos;
+		if (pos % os + preq->size > os)
+			pos += os - pos % os;
+		if (pos / os >= prof->objects)
+			pos = 0;
+		preq->objnum = pos / os;
+		preq->offset = pos % os;
+		prof->seq_pos = pos + preq->size;
+		return;
+	case ACCESS_ZIPF:
+		preq->objnum = zipf_next(&prof->zipf, &prof->rand_state);
+		break;
+	case ACCESS_HOTSPOT:
+		preq->objnum = hotspot_next(&prof->hot, &prof->rand_state);
+		break;
+	default:
+		preq->objnum = bench_rand(&prof->rand_state) % prof->objects;
+	}
+
+	preq->offset = (bench_rand(&prof->rand_state) % (os / preq->size)) *
+		preq->size;
+}
+
+/*
+ * Describe the next request of the profile in preq. Return -1 if the profile
+ * is over, in which case the thread must not send more requests.
+ */
+int profile_next(struct bench *prefs, struct profile_req *preq)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct bench_phase *phase;
+	struct timespec now;
+
+	clock_gettime(CLOCK_BENCH, &now);
+
+	while (prof->cur < prof->nr_phases) {
+		if (!prof->res[prof->cur].start.tv_sec &&
+				!prof->res[prof->cur].start.tv_nsec)
+			__enter_phase(prefs, &now);
+		if (!__phase_over(prefs, &now))
+			break;
+		prof->res[prof->cur].end = now;
+		prof->cur++;
+	}
+
+	if (prof->cur == prof->nr_phases) {
+		prefs->status->max = prefs->status->submitted;
+		return -1;
+	}
+
+	phase = &prof->phases[prof->cur];
+	if (bench_rand(&prof->rand_state) % 100 < phase->read_pct)
+		preq->op = PROFILE_READ;
+	else
+		preq->op = PROFILE_WRITE;
+	preq->size = __pick_bs(prof, phase);
+	__pick_target(prefs, phase, preq);
+
+	if (prof->ready_count) {
+		prof->ready_head = (prof->ready_head + 1) % prof->ready_size;
+		prof->ready_count--;
+	}
+	prof->submitted++;
+	return 0;
+}
+
+/*
+ * Check if the think time of the next idle request slot has passed. If not,
+ * store in wait_us how long it will take.
+ */
+int profile_ready(struct bench *prefs, uint64_t *wait_us)
+{
+	struct bench_profile *prof = prefs->profile;
+	uint64_t ready, now;
+
+	if (!prof->ready_count)
+		return 1;
+	ready = prof->ready[prof->ready_head];
+	if (!ready)
+		return 1;
+
+	now = __now_ns();
+	if (ready <= now)
+		return 1;
+	*wait_us = (ready - now) / 1000 + 1;
+	return 0;
+}
+
+void profile_received(struct bench *prefs, struct bench_req *breq,
+		int failed, uint64_t size, uint64_t latency)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct phase_stats *stats = &prof->res[breq->phase].ops[breq->op];
+	uint64_t think = prof->phases[breq->phase].think;
+	uint32_t tail;
+
+	stats->requests++;
+	if (failed) {
+		stats->failed++;
+	} else {
+		stats->bytes += size;
+		stats->lat_sum += latency;
+		hist_record(&stats->hist, latency);
+	}
+
+	if (prof->ready_count == prof->ready_size)
+		return;
+	tail = (prof->ready_head + prof->ready_count) % prof->ready_size;
+	prof->ready[tail] = think ? __now_ns() + think : 0;
+	prof->ready_count++;
+}
+
+/*
+ * Called by a thread when it stops, to close the phase it was in, in case it
+ * was interrupted.
+ */
+void profile_finish(struct bench *prefs)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct timespec now;
+
+	if (prof->cur == prof->nr_phases)
+		return;
+	clock_gettime(CLOCK_BENCH, &now);
+	prof->res[prof->cur].end = now;
+}
@@ -0,0 +1,157 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+#include <peer.h>
+#include <time.h>
+#include <xseg/util.h>
+#include <signal.h>
+#include <bench-xseg.h>
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Trace replay
+ *
+ * A trace recorded by archip-monitor (see xtrace.h) is re-issued either with
+ * its original timing, as an open loop whose arrivals are the timestamps of
+ * the trace, or as fast as --iodepth allows. Only reads and writes are
+ * replayed; the rest of the records are skipped.
+ */
+
+/* Read the next record that can be replayed into replay->next */
+static void __read_next(struct bench_replay *replay)
+{
+	struct xtrace_record *rec = &replay->next;
+	int r;
+
+	for (;;) {
+		r = xtrace_read(&replay->trace, rec, replay->next_target,
+				XSEG_MAX_TARGETLEN);
+		if (r < 0)
+			XSEGLOG2(&lc, E, "Cannot read trace record %llu: %s",
+					(unsigned long long)replay->trace.records,
+					strerror(errno));
+		if (r <= 0) {
+			replay->has_next = 0;
+			return;
+		}
+		if (rec->op == X_READ || rec->op == X_WRITE)
+			break;
+		replay->skipped++;
+	}
+	replay->has_next = 1;
+}
+
+int open_replay(struct bench *prefs, char *path, int timing)
+{
+	struct bench_replay *replay;
+
+	replay = calloc(1, sizeof(struct bench_replay));
+	if (!replay) {
+		perror("calloc");
+		return -1;
+	}
+
+	if (xtrace_open(&replay->trace, path) < 0) {
+		XSEGLOG2(&lc, E, "Cannot open trace %s: %s", path,
+				strerror(errno));
+		free(replay);
+		return -1;
+	}
+	replay->timing = timing;
+	hist_reset(&replay->orig);
+	hist_reset(&replay->now);
+
+	__read_next(replay);
+	if (!replay->has_next) {
+		XSEGLOG2(&lc, E, "Trace %s has no requests to replay", path);
+		free_replay(replay);
+		return -1;
+	}
+
+	prefs->replay = replay;
+	return 0;
+}
+
+void free_replay(struct bench_replay *replay)
+{
+	if (!replay)
+		return;
+	xtrace_close(&replay->trace);
+	free(replay);
+}
+
+/*
+ * Make the next record of the trace the current one. Return -1 if the trace is
+ * over, in which case no more requests must be sent.
+ */
+int replay_next(struct bench *prefs)
+{
+	struct bench_replay *replay = prefs->replay;
+
+	if (!replay->has_next) {
+		prefs->status->max = prefs->status->submitted;
+		return -1;
+	}
+
+	replay->cur = replay->next;
+	memcpy(replay->cur_target, replay->next_target,
+			replay->next.targetlen + 1);
+	if (replay->cur.ts > replay->last_ts)
+		replay->last_ts = replay->cur.ts;
+
+	__read_next(replay);
+	return 0;
+}
+
+/*
+ * Time from the current request to the next one. Requests that completed out
+ * of order were recorded out of order, so a request that was submitted
+ * earlier than the current one is sent right away.
+ */
+uint64_t replay_delay(struct bench *prefs)
+{
+	struct bench_replay *replay = prefs->replay;
+
+	if (!replay->has_next || replay->next.ts <= replay->last_ts)
+		return 0;
+	return replay->next.ts - replay->last_ts;
+}
+
+void replay_received(struct bench *prefs, struct bench_req *breq,
+		int failed, uint64_t latency)
+{
+	struct bench_replay *replay = prefs->replay;
+
+	if (failed || !breq->orig_latency)
+		return;
+
+	replay->compared++;
+	if (latency > breq->orig_latency)
+		replay->slower++;
+	hist_record(&replay->orig, breq->orig_latency);
+	hist_record(&replay->now, latency);
+}
@@ -31,6 +31,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <math.h>
 #include <string.h>
+#include <errno.h>
 
 /******************************\
  * Static miscellaneous tools *
@@ -63,9 +64,9 @@ static struct tm_result __separate_by_order(double num)
 	return res;
 }
 
-static void __calculate_bw(struct bench *prefs, double iops, struct bw *bw)
+static void __bytes_to_bw(double bytes_per_sec, struct bw *bw)
 {
-	bw->val = iops * prefs->bs;
+	bw->val = bytes_per_sec;
 
 	if (bw->val < 1024) {
 		strcpy(bw->unit, "B/s");
@@ -90,6 +91,15 @@ static void __calculate_bw(struct bench *prefs, double iops, struct bw *bw)
 	strcpy(bw->unit, "GB/s");
 }
 
+/*
+ * The bandwidth is calculated from the bytes that were served, since the
+ * block size may change during a profile or replay run.
+ */
+static void __calculate_bw(uint64_t bytes, double elapsed_ns, struct bw *bw)
+{
+	__bytes_to_bw(bytes / (elapsed_ns / pow(10, 9)), bw);
+}
+
 static double __calculate_iops(uint64_t requests, double elapsed_ns)
 {
 	/* elapsed_ns is in nanoseconds, so we convert it to seconds */
@@ -97,6 +107,161 @@ static double __calculate_iops(uint64_t requests, double elapsed_ns)
 	return (requests / elapsed);
 }
 
+/*********************\
+ * Collect functions *
+\*********************/
+
+/*
+ * The generator threads keep their statistics in their own struct bench and
+ * never share them, so that they don't contend while the benchmark runs.
+ * The functions below gather them in the global struct bench, which is then
+ * used for reporting.
+ *
+ * While the benchmark runs, the counters of the other threads are read
+ * racily. This is fine for progress reports, since they only increase.
+ */
+void collect_status(struct bench *prefs)
+{
+	struct req_status *status = prefs->status;
+	struct req_status *tstatus;
+	uint32_t i;
+
+	status->submitted = 0;
+	status->received = 0;
+	status->corrupted = 0;
+	status->failed = 0;
+	status->bytes = 0;
+	for (i = 0; i < prefs->nr_threads; i++) {
+		tstatus = prefs->threads[i].status;
+		status->submitted += tstatus->submitted;
+		status->received += tstatus->received;
+		status->corrupted += tstatus->corrupted;
+		status->failed += tstatus->failed;
+		status->bytes += tstatus->bytes;
+	}
+}
+
+/*
+ * Gather the request latencies that have been recorded since the last call in
+ * the interval histogram of the global rec_tm. Its cumulative histogram keeps
+ * the snapshot of the previous call.
+ */
+void collect_progress(struct bench *prefs)
+{
+	struct timer *tm = prefs->rec_tm;
+	struct histogram *cur;
+	uint32_t i;
+
+	collect_status(prefs);
+	if (GET_FLAG(INSANITY, prefs->flags) < tm->insanity)
+		return;
+
+	cur = malloc(sizeof(struct histogram));
+	if (!cur) {
+		hist_reset(&tm->ihist);
+		return;
+	}
+
+	hist_reset(cur);
+	for (i = 0; i < prefs->nr_threads; i++)
+		hist_merge(cur, &prefs->threads[i].rec_tm->hist);
+	hist_diff(&tm->ihist, cur, &tm->hist);
+	hist_merge(&tm->hist, &tm->ihist);
+	free(cur);
+}
+
+/*
+ * Merge the results of all threads, once they have finished. The total time
+ * of the benchmark is the time of the slowest thread.
+ */
+void collect_results(struct bench *prefs)
+{
+	struct bench *tprefs;
+	uint32_t i;
+
+	collect_status(prefs);
+
+	hist_reset(&prefs->rec_tm->hist);
+	prefs->total_tm->sum.tv_sec = 0;
+	prefs->total_tm->sum.tv_nsec = 0;
+	for (i = 0; i < prefs->nr_threads; i++) {
+		tprefs = &prefs->threads[i];
+		if (__timespec2double(tprefs->total_tm->sum) >
+				__timespec2double(prefs->total_tm->sum))
+			prefs->total_tm->sum = tprefs->total_tm->sum;
+		timer_merge(prefs->rec_tm, tprefs->rec_tm);
+		timer_merge(prefs->sub_tm, tprefs->sub_tm);
+		timer_merge(prefs->get_tm, tprefs->get_tm);
+		timer_merge(prefs->lag_tm, tprefs->lag_tm);
+	}
+
+	if (prefs->profile)
+		collect_profile(prefs);
+	if (prefs->volume)
+		collect_volume(prefs);
+}
+
+/* Merge the vlmcd timing of all threads */
+void collect_volume(struct bench *prefs)
+{
+	struct bench_volume *vol = prefs->volume;
+	struct bench_volume *tvol;
+	uint32_t i;
+
+	vol->timed = 0;
+	vol->untimed = 0;
+	hist_reset(&vol->queue);
+	hist_reset(&vol->map);
+	hist_reset(&vol->io);
+	for (i = 0; i < prefs->nr_threads; i++) {
+		tvol = prefs->threads[i].volume;
+		vol->timed += tvol->timed;
+		vol->untimed += tvol->untimed;
+		hist_merge(&vol->queue, &tvol->queue);
+		hist_merge(&vol->map, &tvol->map);
+		hist_merge(&vol->io, &tvol->io);
+	}
+}
+
+/*
+ * Merge the per-phase results of all threads. A phase lasts from the time the
+ * first thread entered it until the last one left it.
+ */
+void collect_profile(struct bench *prefs)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct phase_result *res, *tres;
+	uint32_t i, p;
+	int op;
+
+	prefs->status->max = 0;
+	for (i = 0; i < prefs->nr_threads; i++)
+		prefs->status->max += prefs->threads[i].status->max;
+
+	for (p = 0; p < prof->nr_phases; p++) {
+		res = &prof->res[p];
+		for (i = 0; i < prefs->nr_threads; i++) {
+			tres = &prefs->threads[i].profile->res[p];
+			if (!tres->start.tv_sec && !tres->start.tv_nsec)
+				continue;
+			if ((!res->start.tv_sec && !res->start.tv_nsec) ||
+					timespec_diff_ns(&tres->start,
+						&res->start) < 0)
+				res->start = tres->start;
+			if (timespec_diff_ns(&tres->end, &res->end) > 0)
+				res->end = tres->end;
+			for (op = 0; op < PROFILE_NR_OPS; op++) {
+				res->ops[op].requests += tres->ops[op].requests;
+				res->ops[op].failed += tres->ops[op].failed;
+				res->ops[op].bytes += tres->ops[op].bytes;
+				res->ops[op].lat_sum += tres->ops[op].lat_sum;
+				hist_merge(&res->ops[op].hist,
+						&tres->ops[op].hist);
+			}
+		}
+	}
+}
+
 /*******************\
  * Print functions *
 \*******************/
@@ -116,6 +281,8 @@ int calculate_report_lines(struct bench *prefs)
 		lines += 1;
 		if (prefs->op == X_READ || prefs->op == X_WRITE)
 			lines++;
+		if (GET_FLAG(INSANITY, prefs->flags) >= prefs->rec_tm->insanity)
+			lines++;
 	}
 
 	return lines;
@@ -146,8 +313,12 @@ void print_io_stats(struct bench *prefs)
 	}
 
 	elapsed = __timespec2double(tm->elapsed_time);
-	iops = __calculate_iops(prefs->rep->interval, elapsed);
-	__calculate_bw(prefs, iops, &bw);
+	iops = __calculate_iops(prefs->status->received -
+			prefs->rep->prev_recv, elapsed);
+	prefs->rep->prev_recv = prefs->status->received;
+	__calculate_bw(prefs->status->bytes - prefs->rep->prev_bytes, elapsed,
+			&bw);
+	prefs->rep->prev_bytes = prefs->status->bytes;
 
 	if (prefs->op == X_READ || prefs->op == X_WRITE)
 		fprintf(stdout, "Bandwidth:    %.3lf %s\n", bw.val, bw.unit);
@@ -200,10 +371,19 @@ void print_total_res(struct bench *prefs)
 			res.s, res.ms, res.us, res.ns);
 }
 
+static void __print_latency(char *label, double ns)
+{
+	struct tm_result res;
+
+	res = __separate_by_order(ns);
+	fprintf(stdout, "%-14s%3u. %03u  %03u  %03u\n",
+			label, res.s, res.ms, res.us, res.ns);
+}
+
 void print_rec_res(struct bench *prefs)
 {
 	struct timer *tm = prefs->rec_tm;
-	struct tm_result res;
+	struct histogram *hist = &tm->hist;
 	double sum;
 
 	if (!prefs->status->received) {
@@ -212,10 +392,246 @@ void print_rec_res(struct bench *prefs)
 	}
 
 	sum = __timespec2double(tm->sum);
-	res = __separate_by_order(sum / prefs->status->received);
+	__print_latency("Avg. latency:", sum / prefs->status->received);
+	__print_latency("p50:", hist_percentile(hist, 50));
+	__print_latency("p90:", hist_percentile(hist, 90));
+	__print_latency("p99:", hist_percentile(hist, 99));
+	__print_latency("p99.9:", hist_percentile(hist, 99.9));
+	__print_latency("p99.99:", hist_percentile(hist, 99.99));
+	__print_latency("Max latency:", hist->max);
+}
 
-	fprintf(stdout, "Avg. latency: %3u. %03u  %03u  %03u\n",
-			res.s, res.ms, res.us, res.ns);
+/*
+ * In open loop mode, show how far submissions lagged behind their intended
+ * time. Large lags mean that the target rate could not be sustained with the
+ * given iodepth.
+ */
+void print_lag_res(struct bench *prefs)
+{
+	struct timer *tm = prefs->lag_tm;
+	struct histogram *hist = &tm->hist;
+	double sum;
+
+	if (GET_FLAG(ARRIVAL, prefs->flags) == ARRIVAL_TRACE)
+		fprintf(stdout, "Offered load: as recorded in trace\n");
+	else
+		fprintf(stdout, "Offered load: %lu IOPS (%s arrivals)\n",
+				prefs->rate,
+				GET_FLAG(ARRIVAL, prefs->flags) == ARRIVAL_POISSON ?
+				"poisson" : "const");
+	if (!tm->completed) {
+		fprintf(stdout, "Avg. lag:     NaN\n");
+		return;
+	}
+
+	sum = __timespec2double(tm->sum);
+	__print_latency("Avg. lag:", sum / tm->completed);
+	__print_latency("p99 lag:", hist_percentile(hist, 99));
+	__print_latency("Max lag:", hist->max);
+}
+
+/*
+ * Print the latency percentiles of the requests received in the last progress
+ * interval and start a new interval.
+ */
+void print_interval_lat(struct bench *prefs)
+{
+	struct histogram *hist = &prefs->rec_tm->ihist;
+
+	if (!hist->count) {
+		fprintf(stdout, "Latency (us): NaN\n");
+		return;
+	}
+
+	fprintf(stdout, "Latency (us): p50 %.1lf, p99 %.1lf, p99.9 %.1lf, "
+			"max %.1lf\n",
+			hist_percentile(hist, 50) / 1000.0,
+			hist_percentile(hist, 99) / 1000.0,
+			hist_percentile(hist, 99.9) / 1000.0,
+			hist->max / 1000.0);
+	hist_reset(hist);
+}
+
+static void __dump_histogram(FILE *fp, char *name, struct timer *tm)
+{
+	struct histogram *hist = &tm->hist;
+	int i;
+
+	fprintf(fp, "timer %s sub_bits %d max_bits %d count %lu min %lu "
+			"max %lu\n", name, HIST_SUB_BITS, HIST_MAX_BITS,
+			hist->count, hist->count ? hist->min : 0, hist->max);
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		fprintf(fp, "%d %lu %lu %lu\n", i, hist_bucket_low(i),
+				hist_bucket_high(i), hist->buckets[i]);
+	}
+}
+
+/*
+ * Dump the raw histograms of the enabled timers to prefs->hist_path.
+ *
+ * The dump is plain text. Each timer starts with a header line, followed by a
+ * line for each non-empty bucket:
+ *
+ *     timer <name> sub_bits <n> max_bits <n> count <n> min <ns> max <ns>
+ *     <bucket index> <lowest ns> <highest ns> <count>
+ *
+ * Dumps with the same sub_bits and max_bits can be merged by adding the
+ * counts of buckets with the same index.
+ */
+int dump_histograms(struct bench *prefs)
+{
+	int insanity = GET_FLAG(INSANITY, prefs->flags);
+	FILE *fp;
+
+	fp = fopen(prefs->hist_path, "w");
+	if (!fp) {
+		XSEGLOG2(&lc, E, "Cannot open %s: %s", prefs->hist_path,
+				strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "# archip-bench latency histograms (ns)\n");
+	if (insanity >= prefs->rec_tm->insanity)
+		__dump_histogram(fp, "rec", prefs->rec_tm);
+	if (insanity >= prefs->sub_tm->insanity)
+		__dump_histogram(fp, "sub", prefs->sub_tm);
+	if (insanity >= prefs->get_tm->insanity)
+		__dump_histogram(fp, "get", prefs->get_tm);
+	if (GET_FLAG(ARRIVAL, prefs->flags) != ARRIVAL_CLOSED)
+		__dump_histogram(fp, "lag", prefs->lag_tm);
+
+	if (fclose(fp)) {
+		XSEGLOG2(&lc, E, "Cannot write %s: %s", prefs->hist_path,
+				strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void __print_phase_op(char *op, struct phase_stats *stats,
+		double elapsed)
+{
+	uint64_t served = stats->requests - stats->failed;
+	struct bw bw;
+
+	if (!stats->requests)
+		return;
+
+	__bytes_to_bw(stats->bytes / (elapsed / pow(10, 9)), &bw);
+	fprintf(stdout, "  %-6s requests %lu, failed %lu, IOPS %.3lf, "
+			"bandwidth %.3lf %s\n", op, stats->requests,
+			stats->failed, __calculate_iops(stats->requests, elapsed),
+			bw.val, bw.unit);
+	if (!served)
+		return;
+	fprintf(stdout, "         latency (us): avg %.1lf, p50 %.1lf, "
+			"p99 %.1lf, p99.9 %.1lf, max %.1lf\n",
+			(double)stats->lat_sum / served / 1000,
+			hist_percentile(&stats->hist, 50) / 1000.0,
+			hist_percentile(&stats->hist, 99) / 1000.0,
+			hist_percentile(&stats->hist, 99.9) / 1000.0,
+			stats->hist.max / 1000.0);
+}
+
+void print_profile_res(struct bench *prefs)
+{
+	struct bench_profile *prof = prefs->profile;
+	struct phase_result *res;
+	double elapsed;
+	uint32_t p;
+
+	fprintf(stdout, "\n");
+	fprintf(stdout, "               Phase results\n");
+	fprintf(stdout, "           ========================\n");
+	for (p = 0; p < prof->nr_phases; p++) {
+		res = &prof->res[p];
+		if (!res->start.tv_sec && !res->start.tv_nsec) {
+			fprintf(stdout, "Phase %s: not run\n",
+					prof->phases[p].name);
+			continue;
+		}
+		elapsed = timespec_diff_ns(&res->end, &res->start);
+		fprintf(stdout, "Phase %s: %.3lf s\n", prof->phases[p].name,
+				elapsed / pow(10, 9));
+		__print_phase_op("read", &res->ops[PROFILE_READ], elapsed);
+		__print_phase_op("write", &res->ops[PROFILE_WRITE], elapsed);
+	}
+}
+
+static void __print_replay_pct(char *label, struct bench_replay *replay,
+		double pct)
+{
+	double orig = hist_percentile(&replay->orig, pct);
+	double now = hist_percentile(&replay->now, pct);
+
+	fprintf(stdout, "%-7s recorded %10.1lf us, replayed %10.1lf us (x%.2lf)\n",
+			label, orig / 1000, now / 1000, orig ? now / orig : 0);
+}
+
+void print_replay_res(struct bench *prefs)
+{
+	struct bench_replay *replay = prefs->replay;
+
+	fprintf(stdout, "\n");
+	fprintf(stdout, "               Replay results\n");
+	fprintf(stdout, "           ========================\n");
+	fprintf(stdout, "Timing:   %s\n", replay->timing == REPLAY_FAST ?
+			"as fast as possible" : "original");
+	fprintf(stdout, "Replayed: %lu requests (%lu trace records read)\n",
+			prefs->status->submitted, replay->trace.records);
+	fprintf(stdout, "Skipped:  %lu (not reads or writes)\n",
+			replay->skipped);
+	if (!replay->compared) {
+		fprintf(stdout, "No request was served both when recorded and "
+				"when replayed\n");
+		return;
+	}
+	fprintf(stdout, "Compared: %lu requests, %lu (%.1lf%%) slower than "
+			"recorded\n", replay->compared, replay->slower,
+			100.0 * replay->slower / replay->compared);
+	__print_replay_pct("p50:", replay, 50);
+	__print_replay_pct("p90:", replay, 90);
+	__print_replay_pct("p99:", replay, 99);
+	__print_replay_pct("p99.9:", replay, 99.9);
+}
+
+static void __print_stage_pct(char *label, struct histogram *hist)
+{
+	fprintf(stdout, "%-9s p50 %10.1lf us, p99 %10.1lf us, p99.9 %10.1lf us\n",
+			label, hist_percentile(hist, 50) / 1000.0,
+			hist_percentile(hist, 99) / 1000.0,
+			hist_percentile(hist, 99.9) / 1000.0);
+}
+
+void print_volume_res(struct bench *prefs)
+{
+	struct bench_volume *vol = prefs->volume;
+
+	fprintf(stdout, "\n");
+	fprintf(stdout, "               Volume results\n");
+	fprintf(stdout, "           ========================\n");
+	fprintf(stdout, "Volume:   %s\n", prefs->objvars->name);
+	if (vol->create)
+		fprintf(stdout, "Created:  in %.3lf ms\n",
+				vol->setup_ns / 1000000.0);
+	else if (vol->clone[0])
+		fprintf(stdout, "Cloned:   from %s in %.3lf ms\n", vol->clone,
+				vol->setup_ns / 1000000.0);
+	if (vol->snap[0])
+		fprintf(stdout, "Snapshot: %s in %.3lf ms\n", vol->snap,
+				vol->snap_ns / 1000000.0);
+	if (!vol->timed) {
+		fprintf(stdout, "No request was timed by vlmcd (%lu served)\n",
+				vol->untimed);
+		return;
+	}
+	fprintf(stdout, "Timed:    %lu requests (%lu served without timing)\n",
+			vol->timed, vol->untimed);
+	__print_stage_pct("Queue:", &vol->queue);
+	__print_stage_pct("Mapper:", &vol->map);
+	__print_stage_pct("Blocker:", &vol->io);
 }
 
 static void __print_progress(struct bench *prefs)
@@ -224,8 +640,11 @@ static void __print_progress(struct bench *prefs)
 
 	if (ptype == PTYPE_REQ || ptype == PTYPE_BOTH)
 			print_req_stats(prefs);
-	if (ptype == PTYPE_IO || ptype == PTYPE_BOTH)
-			print_io_stats(prefs);
+	if (ptype == PTYPE_IO || ptype == PTYPE_BOTH) {
+		print_io_stats(prefs);
+		if (GET_FLAG(INSANITY, prefs->flags) >= prefs->rec_tm->insanity)
+			print_interval_lat(prefs);
+	}
 	fflush(stdout);
 }
 
@@ -241,5 +660,3 @@ void print_progress(struct bench *prefs)
 	__print_progress(prefs);
 	timer_start(prefs, prefs->total_tm);
 }
-
-
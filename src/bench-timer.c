@@ -28,6 +28,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <signal.h>
 #include <bench-xseg.h>
 #include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 
 #define SEC 1000000000 //1sec = 10^9 nsec
 #define SEC2 (uint64_t) SEC*SEC //1sec*1sec = 10^18 nsec^2
@@ -60,6 +63,20 @@ static inline void timespecadd(struct timespec *a,
 	}
 }
 
+void timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / SEC;
+	ts->tv_nsec = ns % SEC;
+}
+
+/* Signed difference end - start, in nanoseconds */
+int64_t timespec_diff_ns(struct timespec *end, struct timespec *start)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * SEC +
+		(end->tv_nsec - start->tv_nsec);
+}
+
 int init_timer(struct timer **tm, int insanity)
 {
 	*tm = malloc(sizeof(struct timer));
@@ -69,10 +86,149 @@ int init_timer(struct timer **tm, int insanity)
 	}
 
 	memset(*tm, 0, sizeof(struct timer));
+	hist_reset(&(*tm)->hist);
+	hist_reset(&(*tm)->ihist);
 	(*tm)->insanity = insanity;
 	return 0;
 }
 
+/*
+ * Histogram functions
+ *
+ * The bucket of a value is found by its most significant bit (msb). Values
+ * with msb < HIST_SUB_BITS are stored as is. For the rest, the value is shifted
+ * right so that only HIST_SUB_BITS bits remain after the msb, and the shift
+ * selects the group of buckets while the remaining bits select the bucket in
+ * the group.
+ */
+static inline int __hist_index(uint64_t val)
+{
+	int msb, shift;
+
+	if (val < (1UL << HIST_SUB_BITS))
+		return val;
+
+	msb = 63 - __builtin_clzl(val);
+	if (msb >= HIST_MAX_BITS)
+		return HIST_NR_BUCKETS - 1;
+
+	shift = msb - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) +
+		(val >> shift) - (1UL << HIST_SUB_BITS);
+}
+
+uint64_t hist_bucket_low(int idx)
+{
+	int group = idx >> HIST_SUB_BITS;
+	uint64_t sub = idx & ((1UL << HIST_SUB_BITS) - 1);
+
+	if (!group)
+		return sub;
+	return (sub + (1UL << HIST_SUB_BITS)) << (group - 1);
+}
+
+uint64_t hist_bucket_high(int idx)
+{
+	int group = idx >> HIST_SUB_BITS;
+
+	if (!group)
+		return hist_bucket_low(idx);
+	return hist_bucket_low(idx) + (1UL << (group - 1)) - 1;
+}
+
+void hist_reset(struct histogram *hist)
+{
+	memset(hist, 0, sizeof(struct histogram));
+	hist->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *hist, uint64_t val)
+{
+	hist->buckets[__hist_index(val)]++;
+	hist->count++;
+	if (val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+void hist_merge(struct histogram *dst, struct histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_NR_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * Store in dst the values recorded in a but not in b, where b is an earlier
+ * snapshot of a. The exact min and max of the difference are lost, so the
+ * bounds of its first and last non-empty bucket are used instead.
+ */
+void hist_diff(struct histogram *dst, struct histogram *a,
+		struct histogram *b)
+{
+	int i;
+
+	hist_reset(dst);
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		dst->buckets[i] = a->buckets[i] - b->buckets[i];
+		if (!dst->buckets[i])
+			continue;
+		dst->count += dst->buckets[i];
+		if (dst->min == UINT64_MAX)
+			dst->min = hist_bucket_low(i);
+		dst->max = hist_bucket_high(i);
+	}
+}
+
+/*
+ * Return the smallest recorded value (well, the upper bound of its bucket) such
+ * that percentile% of the recorded values are less than or equal to it.
+ */
+uint64_t hist_percentile(struct histogram *hist, double percentile)
+{
+	uint64_t target, seen = 0;
+	uint64_t val;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	target = ceil(hist->count * percentile / 100);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	val = hist_bucket_high(i);
+	if (val > hist->max)
+		val = hist->max;
+	if (val < hist->min)
+		val = hist->min;
+	return val;
+}
+
+/*
+ * Add the measurements of src to dst. The elapsed time of a timer is not a
+ * measurement, so it is left intact.
+ */
+void timer_merge(struct timer *dst, struct timer *src)
+{
+	timespecadd(&dst->sum, &src->sum, &dst->sum);
+	dst->completed += src->completed;
+	hist_merge(&dst->hist, &src->hist);
+}
+
 void timer_start(struct bench *prefs, struct timer *timer)
 {
 	//We need a low-latency way to get current time in nanoseconds.
@@ -87,6 +243,7 @@ void timer_stop(struct bench *prefs, struct timer *timer,
 		struct timespec *start_time)
 {
 	struct timespec end_time;
+	uint64_t elapsed_ns;
 
 	if (GET_FLAG(INSANITY, prefs->flags) < timer->insanity)
 		return;
@@ -109,6 +266,11 @@ void timer_stop(struct bench *prefs, struct timer *timer,
 	//For accuracy, nanoseconds' sum has to be always less that 10^9
 	timespecadd(&timer->elapsed_time, &timer->sum, &timer->sum);
 
+	elapsed_ns = timer->elapsed_time.tv_sec * (uint64_t)SEC +
+		timer->elapsed_time.tv_nsec;
+	hist_record(&timer->hist, elapsed_ns);
+	hist_record(&timer->ihist, elapsed_ns);
+
 #if 0
 	struct timespec2 elapsed_time_sq;
 
@@ -104,6 +104,8 @@ int read_op(char *op)
 		return X_INFO;
 	if (strncmp(op, "delete", MAX_ARG_LEN + 1) == 0)
 		return X_DELETE;
+	if (strncmp(op, "hash", MAX_ARG_LEN + 1) == 0)
+		return X_HASH;
 	return -1;
 }
 
@@ -170,15 +172,166 @@ int read_ping(char *ping)
 	return -1;
 }
 
-int read_pattern(char *pattern)
+int read_arrivals(char *arrivals)
 {
-	if (strncmp(pattern, "seq", MAX_ARG_LEN + 1) == 0)
-		return PATTERN_SEQ;
-	if (strncmp(pattern, "rand", MAX_ARG_LEN + 1) == 0)
-		return PATTERN_RAND;
+	if (strncmp(arrivals, "const", MAX_ARG_LEN + 1) == 0)
+		return ARRIVAL_CONST;
+	if (strncmp(arrivals, "poisson", MAX_ARG_LEN + 1) == 0)
+		return ARRIVAL_POISSON;
 	return -1;
 }
 
+int read_output(char *output)
+{
+	if (strncmp(output, "text", MAX_ARG_LEN + 1) == 0)
+		return OUTPUT_TEXT;
+	if (strncmp(output, "json", MAX_ARG_LEN + 1) == 0)
+		return OUTPUT_JSON;
+	if (strncmp(output, "csv", MAX_ARG_LEN + 1) == 0)
+		return OUTPUT_CSV;
+	return -1;
+}
+
+int read_replay_timing(char *timing)
+{
+	if (strncmp(timing, "original", MAX_ARG_LEN + 1) == 0)
+		return REPLAY_ORIGINAL;
+	if (strncmp(timing, "fast", MAX_ARG_LEN + 1) == 0)
+		return REPLAY_FAST;
+	return -1;
+}
+
+/*
+ * Read a port or a range of ports in the form <start>-<end>.
+ * If syntax is invalid, return -1.
+ */
+int read_port_range(char *str, long *start, long *end)
+{
+	char *rem;
+
+	*start = strtol(str, &rem, 10);
+	if (rem == str || *start < 0)
+		return -1;
+	if (!rem[0]) {
+		*end = *start;
+		return 0;
+	}
+	if (rem[0] != '-' || !rem[1])
+		return -1;
+
+	str = rem + 1;
+	*end = strtol(str, &rem, 10);
+	if (rem[0] || *end < *start)
+		return -1;
+	return 0;
+}
+
+/*
+ * Read the pattern type and the arguments of the skewed patterns:
+ *     zipf[:<theta>]			(default 0.99)
+ *     hotspot[:<% of chunks>:<% of requests>]	(default 20:80)
+ *     seqjump[:<chunks per run>]		(default 16)
+ */
+int read_pattern(char *pattern, struct bench_pattern *pat)
+{
+	char *arg = strchr(pattern, ':');
+	char *rem;
+
+	if (arg)
+		*arg++ = 0;
+
+	if (strncmp(pattern, "seq", MAX_PATTERN_LEN + 1) == 0)
+		return arg ? -1 : PATTERN_SEQ;
+	if (strncmp(pattern, "rand", MAX_PATTERN_LEN + 1) == 0)
+		return arg ? -1 : PATTERN_RAND;
+
+	if (strncmp(pattern, "zipf", MAX_PATTERN_LEN + 1) == 0) {
+		pat->theta = 0.99;
+		if (arg) {
+			pat->theta = strtod(arg, &rem);
+			if (rem == arg || rem[0])
+				return -1;
+		}
+		if (pat->theta <= 0 || pat->theta >= 1)
+			return -1;
+		return PATTERN_ZIPF;
+	}
+
+	if (strncmp(pattern, "hotspot", MAX_PATTERN_LEN + 1) == 0) {
+		pat->hot_frac = 0.2;
+		pat->hot_prob = 0.8;
+		if (arg) {
+			pat->hot_frac = strtod(arg, &rem) / 100;
+			if (rem == arg || rem[0] != ':')
+				return -1;
+			arg = rem + 1;
+			pat->hot_prob = strtod(arg, &rem) / 100;
+			if (rem == arg || rem[0])
+				return -1;
+		}
+		if (pat->hot_frac <= 0 || pat->hot_frac > 1 ||
+				pat->hot_prob < 0 || pat->hot_prob > 1)
+			return -1;
+		return PATTERN_HOTSPOT;
+	}
+
+	if (strncmp(pattern, "seqjump", MAX_PATTERN_LEN + 1) == 0) {
+		pat->run = 16;
+		if (arg) {
+			pat->run = strtoull(arg, &rem, 10);
+			if (rem == arg || rem[0])
+				return -1;
+		}
+		if (!pat->run)
+			return -1;
+		return PATTERN_SEQJUMP;
+	}
+
+	return -1;
+}
+
+/*
+ * Initialize the generator of a skewed pattern over all the chunks of the
+ * benchmark. It must be called before the request cap is enforced, like
+ * lfsr_init().
+ */
+int init_pattern(struct bench *prefs, uint64_t seed)
+{
+	struct bench_pattern *pat = &prefs->pat;
+	uint64_t n = prefs->status->max;
+
+	/* xorshift state must not be zero */
+	pat->state = (seed ^ 0xD1B54A32D192ED03ULL) | (1ULL << 63);
+
+	switch (GET_FLAG(PATTERN, prefs->flags)) {
+	case PATTERN_ZIPF:
+		return zipf_init(&pat->zipf, n, pat->theta);
+	case PATTERN_HOTSPOT:
+		return hotspot_init(&pat->hot, n, pat->hot_frac, pat->hot_prob);
+	case PATTERN_SEQJUMP:
+		return seqjump_init(&pat->jump, n, pat->run);
+	default:
+		return 0;
+	}
+}
+
+/* Draw the next chunk from the generator of the (non sequential) pattern */
+uint64_t pattern_next(struct bench *prefs)
+{
+	struct bench_pattern *pat = &prefs->pat;
+
+	switch (GET_FLAG(PATTERN, prefs->flags)) {
+	case PATTERN_ZIPF:
+		return zipf_next(&pat->zipf, &pat->state);
+	case PATTERN_HOTSPOT:
+		return hotspot_next(&pat->hot, &pat->state);
+	case PATTERN_SEQJUMP:
+		return seqjump_next(&pat->jump, &pat->state);
+	default:
+		return lfsr_next(prefs->lfsr);
+	}
+}
+
 int validate_seed(struct bench *prefs, unsigned long seed)
 {
 	if (seed < pow(10, prefs->objvars->seedlen))
@@ -226,12 +379,47 @@ void create_target(struct bench *prefs, struct xseg_request *req)
 	XSEGLOG2(&lc, D, "Target name of request is %s\n", req_target);
 }
 
+/*
+ * With more than one generator threads, the sequence of requests is dealt to
+ * the threads round robin, so each thread takes every nr_threads-th element,
+ * starting from the element with its thread number. For the random pattern,
+ * the LFSR of each thread has already been advanced by its thread number.
+ */
 uint64_t determine_next(struct bench *prefs)
 {
+	uint64_t new;
+	uint32_t i;
+
 	if (GET_FLAG(PATTERN, prefs->flags) == PATTERN_SEQ)
-		return prefs->status->submitted;
-	else
-		return lfsr_next(prefs->lfsr);
+		return prefs->status->submitted * prefs->nr_threads +
+			prefs->thread_no;
+
+	new = pattern_next(prefs);
+	for (i = 1; i < prefs->nr_threads; i++)
+		pattern_next(prefs);
+	return new;
+}
+
+/*
+ * Return the time (in nanoseconds) between the intended submission of the
+ * current and the next request in open loop mode. For Poisson arrivals, the
+ * inter-arrival times are exponentially distributed and are drawn from
+ * bench_rand() seeded with the benchmark seed, so that the schedule is
+ * reproducible.
+ */
+uint64_t next_arrival(struct bench *prefs)
+{
+	double mean;
+
+	if (GET_FLAG(ARRIVAL, prefs->flags) == ARRIVAL_TRACE)
+		return replay_delay(prefs);
+
+	/* The target rate is shared by all generator threads */
+	mean = (double)1000000000 * prefs->nr_threads / prefs->rate;
+	if (GET_FLAG(ARRIVAL, prefs->flags) != ARRIVAL_POISSON)
+		return mean;
+
+	return -log(bench_rand_double(&prefs->arrival_state)) * mean;
 }
 
 uint64_t calculate_offset(struct bench *prefs, uint64_t new)
@@ -0,0 +1,207 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+#include <peer.h>
+#include <time.h>
+#include <xseg/util.h>
+#include <signal.h>
+#include <bench-xseg.h>
+
+#include <string.h>
+
+/*
+ * Volume benchmarks
+ *
+ * With --volume, requests are sent to a vlmcd port, on a real volume, so that
+ * their latency includes mapping and, for clones and snapshotted volumes,
+ * copy-ups and map updates. vlmcd reports the time each request spent waiting
+ * for the mapper and for the blockers (see vlmcd.h).
+ */
+
+/*
+ * Send a setup request to the mapper and wait for its reply. The generator
+ * threads have not started yet, so the reply is polled for.
+ */
+static int __setup_request(struct peerd *peer, struct bench *prefs,
+		uint32_t op, char *volume, char *source, uint64_t size,
+		uint64_t *elapsed)
+{
+	struct bench_volume *vol = prefs->volume;
+	struct xseg *xseg = peer->xseg;
+	struct xseg_request *req;
+	struct xseg_request_clone *xclone;
+	struct xseg_request_snapshot *xsnapshot;
+	struct timespec start, end;
+	uint32_t targetlen = strlen(volume);
+	uint64_t datalen;
+	xport srcport = prefs->src_port;
+	xport p;
+	int r;
+
+	datalen = op == X_CLONE ? sizeof(struct xseg_request_clone) :
+		sizeof(struct xseg_request_snapshot);
+
+	req = xseg_get_request(xseg, srcport, vol->mportno, X_ALLOC);
+	if (!req) {
+		XSEGLOG2(&lc, E, "Cannot get request\n");
+		return -1;
+	}
+	r = xseg_prep_request(xseg, req, targetlen, datalen);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot prepare request\n");
+		goto out_put;
+	}
+	strncpy(xseg_get_target(xseg, req), volume, targetlen);
+	req->op = op;
+	req->offset = 0;
+	req->size = datalen;
+
+	if (op == X_CLONE) {
+		xclone = (struct xseg_request_clone *)xseg_get_data(xseg, req);
+		memset(xclone, 0, datalen);
+		if (source) {
+			strncpy(xclone->target, source, XSEG_MAX_TARGETLEN);
+			xclone->targetlen = strlen(source);
+		}
+		xclone->size = size;
+	} else {
+		xsnapshot = (struct xseg_request_snapshot *)
+			xseg_get_data(xseg, req);
+		memset(xsnapshot, 0, datalen);
+		strncpy(xsnapshot->target, source, XSEG_MAX_TARGETLEN);
+		xsnapshot->targetlen = strlen(source);
+	}
+
+	clock_gettime(CLOCK_BENCH, &start);
+	p = xseg_submit(xseg, req, srcport, X_ALLOC);
+	if (p == NoPort) {
+		XSEGLOG2(&lc, E, "Cannot submit request\n");
+		goto out_put;
+	}
+	xseg_signal(xseg, p);
+
+	/* The request is still in flight if we are interrupted */
+	while (!(req = xseg_receive(xseg, srcport, X_NONBLOCK))) {
+		if (isTerminate())
+			return -1;
+		usleep(100);
+	}
+	clock_gettime(CLOCK_BENCH, &end);
+	*elapsed = timespec_diff_ns(&end, &start);
+
+	r = req->state & XS_SERVED ? 0 : -1;
+	if (xseg_put_request(xseg, req, srcport))
+		XSEGLOG2(&lc, W, "Cannot put request\n");
+	return r;
+
+out_put:
+	if (xseg_put_request(xseg, req, srcport))
+		XSEGLOG2(&lc, W, "Cannot put request\n");
+	return -1;
+}
+
+/* Create or clone the volume, and snapshot it, as asked */
+int volume_setup(struct peerd *peer, struct bench *prefs, char *volume)
+{
+	struct bench_volume *vol = prefs->volume;
+
+	if (vol->create || vol->clone[0]) {
+		if (__setup_request(peer, prefs, X_CLONE, volume,
+					vol->clone[0] ? vol->clone : NULL,
+					prefs->os, &vol->setup_ns) < 0) {
+			if (vol->create)
+				XSEGLOG2(&lc, E, "Cannot create volume %s",
+						volume);
+			else
+				XSEGLOG2(&lc, E, "Cannot clone %s from %s",
+						volume, vol->clone);
+			return -1;
+		}
+		XSEGLOG2(&lc, I, "Volume %s set up in %lu ns", volume,
+				vol->setup_ns);
+	}
+
+	if (vol->snap[0]) {
+		if (__setup_request(peer, prefs, X_SNAPSHOT, volume,
+					vol->snap, 0, &vol->snap_ns) < 0) {
+			XSEGLOG2(&lc, E, "Cannot snapshot %s to %s", volume,
+					vol->snap);
+			return -1;
+		}
+		XSEGLOG2(&lc, I, "Snapshot %s of %s taken in %lu ns",
+				vol->snap, volume, vol->snap_ns);
+	}
+	return 0;
+}
+
+int init_thread_volume(struct bench *prefs, struct bench *tprefs)
+{
+	tprefs->volume = malloc(sizeof(struct bench_volume));
+	if (!tprefs->volume)
+		return -1;
+
+	memcpy(tprefs->volume, prefs->volume, sizeof(struct bench_volume));
+	tprefs->volume->timed = 0;
+	tprefs->volume->untimed = 0;
+	hist_reset(&tprefs->volume->queue);
+	hist_reset(&tprefs->volume->map);
+	hist_reset(&tprefs->volume->io);
+	return 0;
+}
+
+static struct vlmc_timing *__get_timing(struct bench *prefs,
+		struct xseg_request *req)
+{
+	return (struct vlmc_timing *)(xseg_get_data(prefs->peer->xseg, req) +
+			req->size);
+}
+
+/*
+ * Ask vlmcd for the timing of a request. Its data must have room for it after
+ * the request's size.
+ */
+void volume_prep_timing(struct bench *prefs, struct xseg_request *req)
+{
+	struct vlmc_timing *timing = __get_timing(prefs, req);
+
+	memset(timing, 0, sizeof(struct vlmc_timing));
+	timing->magic = VLMC_TIMING_REQUEST;
+}
+
+void volume_received(struct bench *prefs, struct xseg_request *req)
+{
+	struct bench_volume *vol = prefs->volume;
+	struct vlmc_timing *timing = __get_timing(prefs, req);
+
+	if (timing->magic != VLMC_TIMING_REPLY) {
+		vol->untimed++;
+		return;
+	}
+
+	vol->timed++;
+	hist_record(&vol->queue, timing->queue);
+	hist_record(&vol->map, timing->map);
+	hist_record(&vol->io, timing->io);
+}
@@ -45,13 +45,42 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 	(GET_FLAG(PING, __p->flags) == PING_MODE_OFF) &&                    \
 	 !isTerminate())
 
+/*
+ * Same as above, for the open loop mode. The iodepth here is only an upper
+ * bound of in-flight requests; when it is reached, requests are sent late and
+ * the lag is accounted.
+ */
+#define CAN_SEND_SCHEDULED(__p)                                             \
+	((__p->status->submitted - __p->status->received < __p->iodepth) && \
+	(__p->status->submitted < __p->status->max) &&                      \
+	(GET_FLAG(PING, __p->flags) == PING_MODE_OFF) &&                    \
+	 !isTerminate())
+
+#define IS_OPEN_LOOP(__p)                                                   \
+	(GET_FLAG(ARRIVAL, __p->flags) != ARRIVAL_CLOSED)
+
 #define CAN_VERIFY(__p)                                                     \
 	((GET_FLAG(VERIFY, __p->flags) != VERIFY_NO) && __p->op == X_READ)
 
 #define CAN_PRINT_PROGRESS(__p, __nr)                                       \
 	((GET_FLAG(PROGRESS, __p->flags) != PROGRESS_NO) &&                 \
 	(GET_FLAG(PING, __p->flags) == PING_MODE_OFF) &&                    \
-	(__p->status->received == __nr))
+	(__p->status->received >= __nr))
+
+/*
+ * With more than one generator threads, the thread that could not be woken up
+ * by the signal of its port will sleep at most for this long (in usec).
+ */
+#define MT_MAX_SLEEP 1000
+
+#ifdef MT
+#define bench_alloc_peer_req(__peer, __p)                                   \
+	alloc_peer_req(__peer, &(__peer)->thread[(__p)->thread_no])
+#define bench_nr_threads(__peer) ((__peer)->nr_threads)
+#else
+#define bench_alloc_peer_req(__peer, __p) alloc_peer_req(__peer)
+#define bench_nr_threads(__peer) 1
+#endif
 
 void custom_peer_usage()
 {
@@ -61,28 +90,43 @@ void custom_peer_usage()
 		"a) Benchmark options: \n"
 		"  --------------------------------------------\n"
 		"    -op       | None    | XSEG operation:\n"
-		"              |         |     [read|write|info|delete]\n"
-		"    --pattern | None    | I/O pattern [seq|rand]\n"
+		"              |         |     [read|write|info|delete|hash]\n"
+		"    --pattern | None    | I/O pattern:\n"
+		"              |         |     [seq|rand|zipf|hotspot|seqjump]\n"
 		"    -rc       | None    | Request cap\n"
 		"    -to       | None    | Total objects\n"
 		"    -ts       | None    | Total I/O size\n"
 		"    -os       | 4M      | Object size\n"
 		"    -bs       | 4k      | Block size\n"
-		"    -tp       | None    | Target port\n"
+		"    -tp       | None    | Target port or range of ports\n"
 		"    --iodepth | 1       | Number of in-flight I/O requests\n"
 		"    --seed    | None    | Initialize LFSR and target names\n"
+		"    --rate    | None    | Target IOPS (open loop mode)\n"
+		"    --arrivals| const   | Arrival process of open loop mode:\n"
+		"              |         |     [const|poisson]\n"
 		"\n"
 		"b) Object naming options: \n"
 		"  --------------------------------------------\n"
 		"    --prefix  | bench   | Add a common prefix to all object names\n"
 		"    --objname | None    | Use only one object with this name\n"
 		"\n"
-		"c) Data verification options: \n"
+		"c) Volume options: \n"
+		"  --------------------------------------------\n"
+		"    --volume  | None    | Benchmark this volume through the\n"
+		"              |         | vlmcd of -tp, with -os as its size\n"
+		"    -mp       | None    | Mapper port, to set up the volume\n"
+		"    --create  | -       | Create the volume first\n"
+		"    --clone   | None    | Clone the volume from this snapshot\n"
+		"              |         | first\n"
+		"    --snapshot| None    | Take a snapshot with this name\n"
+		"              |         | before the benchmark\n"
+		"\n"
+		"d) Data verification options: \n"
 		"  --------------------------------------------\n"
 		"    --verify  | no      | Verify written requests:\n"
 		"              |         |     [no|meta|full]\n"
 		"\n"
-		"d) Progress report options: \n"
+		"e) Progress report options: \n"
 		"  --------------------------------------------\n"
 		"    --progress  | yes     | Show progress of benchmark:\n"
 		"                |         |     [yes|no]\n"
@@ -92,10 +136,18 @@ void custom_peer_usage()
 		"    --insanity  | sane    | Adjust insanity level of benchmark:\n"
 		"                |         |     [sane|eccentric|manic|paranoid]\n"
 		"\n"
-		"e) Misc options: \n"
+		"f) Misc options: \n"
 		"  --------------------------------------------\n"
 		"    --ping    | no      | Ping target before starting:\n"
 		"              |         |     [yes|no]\n"
+		"    --output  | text    | Output format: [text|json|csv]\n"
+		"    --hist-dump | None  | Dump the raw latency histograms\n"
+		"                |       | to this file\n"
+		"    --profile | None    | Run the workload profile of this\n"
+		"              |         | file\n"
+		"    --replay  | None    | Replay the trace of this file\n"
+		"    --replay-timing | original | Timing of the replayed\n"
+		"              |         | requests: [original|fast]\n"
 		"\n"
 		"Additional information:\n"
 		"  --------------------------------------------\n"
@@ -151,9 +203,212 @@ void custom_peer_usage()
 		"\n"
 		"  and the progress report will be printed every 1234\n"
 		"  requests.\n"
+		"\n"
+		" * By default, the benchmark is closed loop: a new request is\n"
+		"   sent only when one of the --iodepth in-flight requests\n"
+		"   is received. With --rate, requests are sent at the given\n"
+		"   rate, regardless of how fast they are served (open loop).\n"
+		"   Their latency is measured from the time they should have\n"
+		"   been sent and the lag of the actual submissions is also\n"
+		"   reported. In this mode, --iodepth only bounds the\n"
+		"   in-flight requests and defaults to the number of peer\n"
+		"   requests (-n) of each thread. It also implies at least the\n"
+		"   eccentric insanity level.\n"
+		"\n"
+		" * The benchmark can run on many generator threads (-t),\n"
+		"   each one with its own source port, starting from -sp,\n"
+		"   and its own --iodepth. Requests are dealt to the threads\n"
+		"   round robin and the statistics of all threads are merged\n"
+		"   in the reports. If -tp is a range of ports, e.g. -tp 10-13,\n"
+		"   the threads target these ports round robin. Threads can be\n"
+		"   pinned to CPUs with --cpus.\n"
+		"\n"
+		" * Latencies are recorded in log-linear histograms with a\n"
+		"   relative error of less than 2%%. Percentiles of the\n"
+		"   request latency are printed in the final report and, for\n"
+		"   the io and both progress types, for each interval.\n"
+		"   Histograms dumped with --hist-dump can be merged across\n"
+		"   runs by adding the counts of buckets with the same index.\n"
+		"\n"
+		" * The rand pattern accesses every chunk once, in random\n"
+		"   order. The skewed patterns draw chunks independently, so\n"
+		"   some chunks are accessed many times and others never:\n"
+		"\n"
+		"   a. zipf[:<theta>]: zipfian with 0 < theta < 1 (default\n"
+		"      0.99). The popular chunks are scattered over all\n"
+		"      objects.\n"
+		"   b. hotspot[:<x>:<y>]: y%% of the requests access the\n"
+		"      first x%% of the chunks (default 20:80).\n"
+		"   c. seqjump[:<run>]: runs of <run> sequential chunks, each\n"
+		"      one starting at a random chunk (default 16).\n"
+		"\n"
+		"   All patterns are determined by --seed, so a read\n"
+		"   benchmark with the same seed, sizes and pattern as a\n"
+		"   write benchmark reads only chunks it has written and can\n"
+		"   use --verify.\n"
+		"\n"
+		" * A workload profile (--profile) is a sequence of phases,\n"
+		"   each one with its own read/write mix, block sizes, access\n"
+		"   distribution and think time, e.g.:\n"
+		"\n"
+		"           phase steady\n"
+		"           duration = 2m\n"
+		"           read = 70\n"
+		"           bs = 4k:60, 64k:30, 1M:10\n"
+		"           access = zipf:0.99\n"
+		"           think = 100us\n"
+		"\n"
+		"   A phase lasts for a duration or a number of requests and\n"
+		"   its access is [seq|uniform|zipf[:<theta>]|\n"
+		"   hotspot[:<%% objects>:<%% requests>]]. The objects are\n"
+		"   given by -to, -ts or --objname. It replaces -op and\n"
+		"   --pattern and cannot be used with -rc, --verify or\n"
+		"   --progress. The results of each phase are reported\n"
+		"   separately.\n"
+		"\n"
+		" * With --output json or csv, the results are printed for\n"
+		"   tools such as tools/archip-bench-compare. Progress\n"
+		"   reports become samples of each interval, with its IOPS,\n"
+		"   bandwidth and latency percentiles. JSON output also\n"
+		"   includes the configuration and the latency histograms.\n"
+		"   Profile and replay results are available only as text.\n"
+		"\n"
+		" * A trace recorded by archip-monitor --trace can be replayed\n"
+		"   with --replay, by a single thread. With the original\n"
+		"   timing, requests are sent at their recorded times (open\n"
+		"   loop), else as fast as --iodepth allows. Both default\n"
+		"   --iodepth to the number of peer requests (-n). Only reads\n"
+		"   and writes are replayed, on their recorded targets, and\n"
+		"   their latency is compared to the recorded one.\n"
+		"\n"
+		" * With --volume, reads and writes are sent to a vlmcd, on\n"
+		"   offsets of the volume, so that their latency includes\n"
+		"   mapping and, on clones and snapshotted volumes, copy-ups\n"
+		"   and map updates. vlmcd reports how long each request\n"
+		"   waited for the mapper and the blockers, and the report\n"
+		"   splits the latency accordingly. The volume can be\n"
+		"   created (--create) or cloned (--clone) with size -os,\n"
+		"   and then snapshotted (--snapshot), through the mapper\n"
+		"   of -mp. After a snapshot, the first write to each object\n"
+		"   is a copy-up.\n"
 		"\n");
 }
 
+static void free_thread_prefs(struct bench *tprefs)
+{
+	free(tprefs->lfsr);
+	free(tprefs->total_tm);
+	free(tprefs->sub_tm);
+	free(tprefs->get_tm);
+	free(tprefs->rec_tm);
+	free(tprefs->lag_tm);
+	free(tprefs->objvars);
+	free(tprefs->status);
+	free_profile(tprefs->profile);
+	free(tprefs->volume);
+}
+
+/*
+ * Each generator thread works on its own copy of the benchmark state, so that
+ * threads never contend for it. The requests of the benchmark are dealt to the
+ * threads round robin (see determine_next()).
+ */
+static int init_thread_prefs(struct bench *prefs, struct bench *tprefs,
+		uint32_t thread_no)
+{
+	uint32_t nr_threads = prefs->nr_threads;
+	uint64_t max = prefs->status->max;
+	uint32_t i;
+
+	memcpy(tprefs, prefs, sizeof(struct bench));
+	tprefs->thread_no = thread_no;
+	tprefs->threads = NULL;
+	tprefs->lfsr = NULL;
+	tprefs->total_tm = NULL;
+	tprefs->sub_tm = NULL;
+	tprefs->get_tm = NULL;
+	tprefs->rec_tm = NULL;
+	tprefs->lag_tm = NULL;
+	tprefs->objvars = NULL;
+	tprefs->profile = NULL;
+	tprefs->volume = NULL;
+
+	tprefs->status = calloc(1, sizeof(struct req_status));
+	if (!tprefs->status)
+		goto fail;
+	tprefs->status->max = max / nr_threads + (thread_no < max % nr_threads);
+
+	tprefs->objvars = malloc(sizeof(struct object_vars));
+	if (!tprefs->objvars)
+		goto fail;
+	memcpy(tprefs->objvars, prefs->objvars, sizeof(struct object_vars));
+
+	if (init_timer(&tprefs->total_tm, prefs->total_tm->insanity) ||
+			init_timer(&tprefs->sub_tm, prefs->sub_tm->insanity) ||
+			init_timer(&tprefs->get_tm, prefs->get_tm->insanity) ||
+			init_timer(&tprefs->rec_tm, prefs->rec_tm->insanity) ||
+			init_timer(&tprefs->lag_tm, prefs->lag_tm->insanity))
+		goto fail;
+
+	if (prefs->lfsr) {
+		tprefs->lfsr = malloc(sizeof(struct bench_lfsr));
+		if (!tprefs->lfsr)
+			goto fail;
+		memcpy(tprefs->lfsr, prefs->lfsr, sizeof(struct bench_lfsr));
+	}
+	if (GET_FLAG(PATTERN, prefs->flags) != PATTERN_SEQ)
+		for (i = 0; i < thread_no; i++)
+			pattern_next(tprefs);
+
+	tprefs->src_port = prefs->src_port + thread_no;
+	tprefs->dst_port = prefs->dst_port + thread_no % prefs->nr_dst_ports;
+	tprefs->arrival_state = (prefs->arrival_state +
+			thread_no * 0x9E3779B97F4A7C15ULL) | (1ULL << 63);
+
+	if (prefs->profile && init_thread_profile(prefs, tprefs) < 0)
+		goto fail;
+	if (prefs->volume && init_thread_volume(prefs, tprefs) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	perror("malloc");
+	free_thread_prefs(tprefs);
+	return -1;
+}
+
+static int init_threads(struct peerd *peer, struct bench *prefs)
+{
+	uint32_t i;
+
+	if (prefs->status->max < prefs->nr_threads) {
+		XSEGLOG2(&lc, E, "Not enough requests for %u threads\n",
+				prefs->nr_threads);
+		return -1;
+	}
+
+	prefs->threads = calloc(prefs->nr_threads, sizeof(struct bench));
+	if (!prefs->threads) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (i = 0; i < prefs->nr_threads; i++) {
+		if (init_thread_prefs(prefs, &prefs->threads[i], i) < 0)
+			goto fail;
+#ifdef MT
+		peer->thread[i].priv = &prefs->threads[i];
+#endif
+	}
+	return 0;
+
+fail:
+	while (i--)
+		free_thread_prefs(&prefs->threads[i]);
+	free(prefs->threads);
+	return -1;
+}
+
 int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 {
 	struct bench *prefs;
@@ -163,25 +418,40 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	char object_size[MAX_ARG_LEN + 1];
 	char block_size[MAX_ARG_LEN + 1];
 	char op[MAX_ARG_LEN + 1];
-	char pattern[MAX_ARG_LEN + 1];
+	char pattern[MAX_PATTERN_LEN + 1];
 	char insanity[MAX_ARG_LEN + 1];
 	char verify[MAX_ARG_LEN + 1];
 	char progress[MAX_ARG_LEN + 1];
 	char ptype[MAX_ARG_LEN + 1];
 	char pinterval[MAX_ARG_LEN + 1];
 	char ping[MAX_ARG_LEN + 1];
+	char output[MAX_ARG_LEN + 1];
+	char arrivals[MAX_ARG_LEN + 1];
+	char dst_ports[MAX_ARG_LEN + 1];
 	char prefix[XSEG_MAX_TARGETLEN + 1];
 	char objname[XSEG_MAX_TARGETLEN + 1];
+	char volume[XSEG_MAX_TARGETLEN + 1];
+	char clone[XSEG_MAX_TARGETLEN + 1];
+	char snapshot[XSEG_MAX_TARGETLEN + 1];
+	char hist_path[PATH_MAX + 1];
+	char profile_path[PATH_MAX + 1];
+	char replay_path[PATH_MAX + 1];
+	char replay_timing[MAX_ARG_LEN + 1];
 	struct xseg *xseg = peer->xseg;
 	struct object_vars *obv;
 	unsigned int xseg_page_size = 1 << xseg->config.page_shift;
 	long iodepth = -1;
 	long dst_port = -1;
+	long dst_port_end = -1;
+	long rate = -1;
+	long mportno = -1;
+	int create = 0;
 	unsigned long seed = -1;
 	unsigned long seed_max;
 	uint64_t rc;
-	struct timespec *ts;
+	struct bench_req *breq;
 	int set_by_hand = 1;
+	int replay_mode = REPLAY_ORIGINAL;
 	int j, r;
 
 	op[0] = 0;
@@ -197,8 +467,18 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	ptype[0] = 0;
 	pinterval[0] = 0;
 	ping[0] = 0;
+	output[0] = 0;
+	arrivals[0] = 0;
+	dst_ports[0] = 0;
 	prefix[0] = 0;
 	objname[0] = 0;
+	volume[0] = 0;
+	clone[0] = 0;
+	snapshot[0] = 0;
+	hist_path[0] = 0;
+	profile_path[0] = 0;
+	replay_path[0] = 0;
+	replay_timing[0] = 0;
 
 	/* allocate struct bench */
 	prefs = malloc(sizeof(struct bench));
@@ -232,38 +512,94 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	}
 	memset(prefs->rep, 0, sizeof(struct progress_report));
 
-	/* allocate a struct timespec for each peer request */
+	/* allocate a struct bench_req for each peer request */
 	for (j = 0; j < peer->nr_ops; j++) {
-		ts = malloc(sizeof(struct timespec));
-		if (!ts) {
+		breq = malloc(sizeof(struct bench_req));
+		if (!breq) {
 			perror("malloc");
 			goto priv_fail;
 		}
-		peer->peer_reqs[j].priv = ts;
+		peer->peer_reqs[j].priv = breq;
 	}
 
 	//Begin reading the benchmark-specific arguments
 	BEGIN_READ_ARGS(argc, argv);
 	READ_ARG_STRING("-rc", request_cap, MAX_ARG_LEN);
 	READ_ARG_STRING("-op", op, MAX_ARG_LEN);
-	READ_ARG_STRING("--pattern", pattern, MAX_ARG_LEN);
+	READ_ARG_STRING("--pattern", pattern, MAX_PATTERN_LEN);
 	READ_ARG_STRING("-to", total_objects, MAX_ARG_LEN);
 	READ_ARG_STRING("-ts", total_size, MAX_ARG_LEN);
 	READ_ARG_STRING("-os", object_size, MAX_ARG_LEN);
 	READ_ARG_STRING("-bs", block_size, MAX_ARG_LEN);
 	READ_ARG_ULONG("--iodepth", iodepth);
-	READ_ARG_ULONG("-tp", dst_port);
+	READ_ARG_STRING("-tp", dst_ports, MAX_ARG_LEN);
 	READ_ARG_ULONG("--seed", seed);
+	READ_ARG_ULONG("--rate", rate);
+	READ_ARG_STRING("--arrivals", arrivals, MAX_ARG_LEN);
 	READ_ARG_STRING("--insanity", insanity, MAX_ARG_LEN);
 	READ_ARG_STRING("--verify", verify, MAX_ARG_LEN);
 	READ_ARG_STRING("--progress", progress, MAX_ARG_LEN);
 	READ_ARG_STRING("--ptype", ptype, MAX_ARG_LEN);
 	READ_ARG_STRING("--pinterval", pinterval, MAX_ARG_LEN);
 	READ_ARG_STRING("--ping", ping, MAX_ARG_LEN);
+	READ_ARG_STRING("--output", output, MAX_ARG_LEN);
 	READ_ARG_STRING("--prefix", prefix, XSEG_MAX_TARGETLEN);
 	READ_ARG_STRING("--objname", objname, XSEG_MAX_TARGETLEN);
+	READ_ARG_STRING("--hist-dump", hist_path, PATH_MAX);
+	READ_ARG_STRING("--profile", profile_path, PATH_MAX);
+	READ_ARG_STRING("--replay", replay_path, PATH_MAX);
+	READ_ARG_STRING("--replay-timing", replay_timing, MAX_ARG_LEN);
+	READ_ARG_STRING("--volume", volume, XSEG_MAX_TARGETLEN);
+	READ_ARG_STRING("--clone", clone, XSEG_MAX_TARGETLEN);
+	READ_ARG_STRING("--snapshot", snapshot, XSEG_MAX_TARGETLEN);
+	READ_ARG_BOOL("--create", create);
+	READ_ARG_ULONG("-mp", mportno);
 	END_READ_ARGS();
 
+	/***************************\
+	 * Check volume parameters *
+	\***************************/
+
+	//A volume is benchmarked like a single object of -os size, through
+	//vlmcd. It can be set up through the mapper beforehand.
+	if (volume[0]) {
+		if (objname[0] || prefix[0] || profile_path[0] ||
+				replay_path[0]) {
+			XSEGLOG2(&lc, E, "--objname, --prefix, --profile and "
+					"--replay cannot be used with --volume\n");
+			goto arg_fail;
+		}
+		if (!object_size[0]) {
+			XSEGLOG2(&lc, E, "The volume size (-os) must be "
+					"supplied with --volume\n");
+			goto arg_fail;
+		}
+		if (create && clone[0]) {
+			XSEGLOG2(&lc, E, "--create and --clone are mutually "
+					"exclusive\n");
+			goto arg_fail;
+		}
+		if ((create || clone[0] || snapshot[0]) && mportno < 0) {
+			XSEGLOG2(&lc, E, "Mapper port (-mp) must be supplied "
+					"to set up a volume\n");
+			goto arg_fail;
+		}
+		prefs->volume = calloc(1, sizeof(struct bench_volume));
+		if (!prefs->volume) {
+			perror("calloc");
+			goto arg_fail;
+		}
+		prefs->volume->mportno = (xport) mportno;
+		prefs->volume->create = create;
+		strcpy(prefs->volume->clone, clone);
+		strcpy(prefs->volume->snap, snapshot);
+		strcpy(objname, volume);
+	} else if (create || clone[0] || snapshot[0] || mportno >= 0) {
+		XSEGLOG2(&lc, E, "--create, --clone, --snapshot and -mp "
+				"require --volume\n");
+		goto arg_fail;
+	}
+
 	/********************************\
 	 * Check object name parameters *
 	\********************************/
@@ -303,27 +639,72 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	//We support 4 xseg operations: X_READ, X_WRITE, X_DELETE, X_INFO
 	//The I/O pattern of these operations can be either sequential (seq) or
 	//random (rand)
-	if (!op[0]) {
-		XSEGLOG2(&lc, E, "xseg operation needs to be supplied\n");
+	//With a workload profile, the operations and the pattern are defined by
+	//the profile instead.
+	//A replayed trace defines the targets and the timing of the requests
+	//too.
+	if (profile_path[0] && (op[0] || pattern[0])) {
+		XSEGLOG2(&lc, E, "-op and --pattern cannot be used with "
+				"--profile\n");
 		goto arg_fail;
 	}
-	r = read_op(op);
-	if (r < 0) {
-		XSEGLOG2(&lc, E, "Invalid syntax: -op %s\n", op);
+	if (replay_path[0] && (op[0] || pattern[0] || profile_path[0] ||
+				total_objects[0] || total_size[0] ||
+				objname[0] || rate > 0)) {
+		XSEGLOG2(&lc, E, "-op, --pattern, --profile, -to, -ts, "
+				"--objname and --rate cannot be used with "
+				"--replay\n");
 		goto arg_fail;
 	}
-	prefs->op = r;
+	if (replay_timing[0] && !replay_path[0]) {
+		XSEGLOG2(&lc, E, "Cannot define replay timing without "
+				"a trace\n");
+		goto arg_fail;
+	}
+	if (replay_path[0]) {
+		if (!replay_timing[0])
+			strcpy(replay_timing, "original");
+		replay_mode = read_replay_timing(replay_timing);
+		if (replay_mode < 0) {
+			XSEGLOG2(&lc, E, "Invalid syntax: --replay-timing %s\n",
+					replay_timing);
+			goto arg_fail;
+		}
+		if (replay_mode == REPLAY_ORIGINAL)
+			SET_FLAG(ARRIVAL, prefs->flags, ARRIVAL_TRACE);
+	}
 
-	if (!pattern[0]) {
-		XSEGLOG2(&lc, E, "I/O pattern needs to be supplied\n");
+	if (!op[0] && !profile_path[0] && !replay_path[0]) {
+		XSEGLOG2(&lc, E, "xseg operation needs to be supplied\n");
 		goto arg_fail;
 	}
-	r = read_pattern(pattern);
-	if (r < 0) {
-		XSEGLOG2(&lc, E, "Invalid syntax: --pattern %s\n", pattern);
+	if (op[0]) {
+		r = read_op(op);
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Invalid syntax: -op %s\n", op);
+			goto arg_fail;
+		}
+		prefs->op = r;
+		if (prefs->volume && r != X_READ && r != X_WRITE) {
+			XSEGLOG2(&lc, E, "Only reads and writes can be sent "
+					"to a volume\n");
+			goto arg_fail;
+		}
+	}
+
+	if (!pattern[0] && !profile_path[0] && !replay_path[0]) {
+		XSEGLOG2(&lc, E, "I/O pattern needs to be supplied\n");
 		goto arg_fail;
 	}
-	SET_FLAG(PATTERN, prefs->flags, r);
+	if (pattern[0]) {
+		r = read_pattern(pattern, &prefs->pat);
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Invalid syntax: --pattern %s\n",
+					pattern);
+			goto arg_fail;
+		}
+		SET_FLAG(PATTERN, prefs->flags, r);
+	}
 
 	if (!verify[0])
 		strcpy(verify, "no");
@@ -334,8 +715,33 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	}
 	SET_FLAG(VERIFY, prefs->flags, r);
 
-	//Default iodepth value is 1
-	if (iodepth < 0)
+	//Open loop mode is enabled by giving a target rate
+	if (arrivals[0] && rate < 0) {
+		XSEGLOG2(&lc, E, "Cannot define arrival process without "
+				"a target rate\n");
+		goto arg_fail;
+	}
+	if (rate == 0) {
+		XSEGLOG2(&lc, E, "Invalid syntax: --rate %ld\n", rate);
+		goto arg_fail;
+	} else if (rate > 0) {
+		if (!arrivals[0])
+			strcpy(arrivals, "const");
+		r = read_arrivals(arrivals);
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Invalid syntax: --arrivals %s\n",
+					arrivals);
+			goto arg_fail;
+		}
+		SET_FLAG(ARRIVAL, prefs->flags, r);
+		prefs->rate = rate;
+	}
+
+	//Default iodepth value is 1, or the number of peer requests in open
+	//loop and replay mode
+	if (iodepth < 0 && (IS_OPEN_LOOP(prefs) || replay_path[0]))
+		prefs->iodepth = peer->nr_ops / bench_nr_threads(peer);
+	else if (iodepth < 0)
 		prefs->iodepth = 1;
 	else
 		prefs->iodepth = iodepth;
@@ -358,6 +764,11 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	}
 	SET_FLAG(INSANITY, prefs->flags, r);
 
+	//Open loop mode and profiles are pointless without request latencies
+	if ((IS_OPEN_LOOP(prefs) || profile_path[0] || replay_path[0]) &&
+			r < INSANITY_ECCENTRIC)
+		SET_FLAG(INSANITY, prefs->flags, INSANITY_ECCENTRIC);
+
 	/*****************************\
 	 * Check I/O size parameters *
 	\*****************************/
@@ -412,7 +823,8 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		//number of objects we will handle
 		prefs->status->max = prefs->to;
 	} else if (total_size[0]) {
-		if (prefs->op != X_READ && prefs->op != X_WRITE) {
+		if (prefs->op != X_READ && prefs->op != X_WRITE &&
+				!profile_path[0]) {
 			XSEGLOG2(&lc, E, "Total objects must be supplied "
 					"(required by -op %s)\n", op);
 			goto arg_fail;
@@ -428,7 +840,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		//In this case, the maximum number of requests is the number of
 		//blocks we need to cover the total I/O size
 		prefs->status->max = prefs->ts / prefs->bs;
-	} else if (!objname[0]) {
+	} else if (!objname[0] && !replay_path[0]) {
 		XSEGLOG2(&lc, E, "Total objects or total size must be supplied\n");
 		goto arg_fail;
 	}
@@ -448,7 +860,8 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 					"--objname %s\n",
 					total_size, object_size, objname);
 			goto arg_fail;
-		} else if (prefs->op == X_READ || prefs->op == X_WRITE) {
+		} else if (prefs->op == X_READ || prefs->op == X_WRITE ||
+				profile_path[0]) {
 			prefs->ts = prefs->os;
 			prefs->status->max = prefs->ts / prefs->bs;
 		} else {
@@ -460,17 +873,65 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	if (prefs->status->max == 1)
 		SET_FLAG(PATTERN, prefs->flags, PATTERN_SEQ);
 
+	/*
+	 * A profile runs until its last phase is over, so the number of its
+	 * requests is not known beforehand.
+	 */
+	if (profile_path[0]) {
+		if (GET_FLAG(VERIFY, prefs->flags) != VERIFY_NO ||
+				request_cap[0]) {
+			XSEGLOG2(&lc, E, "--verify and -rc cannot be used with "
+					"--profile\n");
+			goto arg_fail;
+		}
+		if (read_profile(prefs, profile_path, xseg_page_size) < 0)
+			goto arg_fail;
+		prefs->status->max = UINT64_MAX;
+	}
+
+	//The same holds for a trace
+	if (replay_path[0]) {
+		if (GET_FLAG(VERIFY, prefs->flags) != VERIFY_NO) {
+			XSEGLOG2(&lc, E, "--verify cannot be used with "
+					"--replay\n");
+			goto arg_fail;
+		}
+		if (open_replay(prefs, replay_path, replay_mode) < 0)
+			goto arg_fail;
+		prefs->status->max = UINT64_MAX;
+	}
+
 	/*************************\
 	 * Check port parameters *
 	\*************************/
 
-	if (dst_port < 0){
+	if (!dst_ports[0]){
 		XSEGLOG2(&lc, E, "Target port must be supplied\n");
 		goto arg_fail;
 	}
+	if (read_port_range(dst_ports, &dst_port, &dst_port_end) < 0) {
+		XSEGLOG2(&lc, E, "Invalid syntax: -tp %s\n", dst_ports);
+		goto arg_fail;
+	}
 
-	prefs->src_port = peer->portno_start; //TODO: allow user to change this
+	//Every generator thread needs its own source port
+	prefs->nr_threads = bench_nr_threads(peer);
+	if (peer->portno_end - peer->portno_start + 1 < prefs->nr_threads) {
+		XSEGLOG2(&lc, E, "Not enough ports for %u threads\n",
+				prefs->nr_threads);
+		goto arg_fail;
+	}
+	//A trace is replayed in order, by a single thread
+	if (prefs->replay && prefs->nr_threads > 1) {
+		XSEGLOG2(&lc, E, "--replay requires a single thread\n");
+		goto arg_fail;
+	}
+	prefs->src_port = peer->portno_start;
 	prefs->dst_port = (xport) dst_port;
+	prefs->nr_dst_ports = dst_port_end - dst_port + 1;
+
+	if (prefs->volume && volume_setup(peer, prefs, volume) < 0)
+		goto threads_fail;
 
 	/*********************************\
 	 * Create timers for all metrics *
@@ -484,6 +945,8 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		goto tm_fail;
 	if (init_timer(&prefs->rec_tm, INSANITY_ECCENTRIC))
 		goto tm_fail;
+	if (init_timer(&prefs->lag_tm, INSANITY_SANE))
+		goto tm_fail;
 
 	/***********************\
 	 * Initialize the LFSR *
@@ -524,6 +987,15 @@ reseed:
 	}
 	obv->seed = seed;
 
+	if (init_pattern(prefs, seed)) {
+		XSEGLOG2(&lc, E, "Pattern %s could not be initialized.\n",
+				pattern);
+		goto lfsr_fail;
+	}
+
+	/* xorshift state must not be zero */
+	prefs->arrival_state = seed | (1ULL << 63);
+
 	/*********************************\
 	 * Miscellaneous initializations *
 	\*********************************/
@@ -545,14 +1017,23 @@ reseed:
 	 * Progress report initialization *
 	\**********************************/
 
-	/* Progress report is on by default */
+	/*
+	 * Progress report is on by default. Profiles are reported per phase
+	 * instead.
+	 */
 	if (!progress[0])
-		strcpy(progress, "yes");
+		strcpy(progress, profile_path[0] || replay_path[0] ?
+				"no" : "yes");
 	r = read_progress(progress);
 	if (r < 0) {
 		XSEGLOG2(&lc, E, "Invalid syntax: --progress %s\n", progress);
 		goto arg_fail;
 	}
+	if (r != PROGRESS_NO && (profile_path[0] || replay_path[0])) {
+		XSEGLOG2(&lc, E, "Cannot show progress of a profile or a "
+				"replay\n");
+		goto arg_fail;
+	}
 	SET_FLAG(PROGRESS, prefs->flags, r);
 
 	/*
@@ -600,7 +1081,29 @@ reseed:
 	}
 	SET_FLAG(PING, prefs->flags, r);
 
+	/* Results are printed as text by default */
+	if (!output[0])
+		strcpy(output, "text");
+	r = read_output(output);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Invalid syntax: --output %s\n", output);
+		goto arg_fail;
+	}
+	SET_FLAG(OUTPUT, prefs->flags, r);
+
+	if (hist_path[0]) {
+		prefs->hist_path = strdup(hist_path);
+		if (!prefs->hist_path) {
+			perror("strdup");
+			goto arg_fail;
+		}
+	}
+
 	prefs->peer = peer;
+	r = init_threads(peer, prefs);
+	if (r < 0)
+		goto threads_fail;
+
 	peer->peerd_loop = bench_peerd_loop;
 	peer->priv = (void *) prefs;
 
@@ -615,6 +1118,13 @@ reseed:
 
 arg_fail:
 	custom_peer_usage();
+threads_fail:
+	free(prefs->hist_path);
+	if (prefs->profile)
+		free(prefs->profile->phases);
+	free_profile(prefs->profile);
+	free_replay(prefs->replay);
+	free(prefs->volume);
 lfsr_fail:
 	free(prefs->lfsr);
 tm_fail:
@@ -622,6 +1132,7 @@ tm_fail:
 	free(prefs->sub_tm);
 	free(prefs->get_tm);
 	free(prefs->rec_tm);
+	free(prefs->lag_tm);
 priv_fail:
 	j--;
 	for (; j >= 0; j--) {
@@ -639,7 +1150,12 @@ prefs_fail:
 }
 
 
-static int send_request(struct peerd *peer, struct bench *prefs)
+/*
+ * Send a new request. In open loop mode, sched is the time the request should
+ * have been sent, from which its latency is measured.
+ */
+static int send_request(struct peerd *peer, struct bench *prefs,
+		struct timespec *sched)
 {
 	struct xseg_request *req;
 	struct xseg *xseg = peer->xseg;
@@ -650,9 +1166,28 @@ static int send_request(struct peerd *peer, struct bench *prefs)
 	xport p;
 
 	int r;
-	uint64_t new;
+	uint64_t new = 0;
 	uint64_t size = prefs->bs;
-	struct timespec *ts;
+	uint32_t namelen = obv->namelen;
+	struct bench_req *breq;
+	struct profile_req preq;
+	struct xtrace_record *rec = NULL;
+
+	//With a profile, the next request is described by the current phase
+	if (prefs->profile) {
+		if (profile_next(prefs, &preq) < 0)
+			return -1;
+		size = preq.size;
+	}
+
+	//With a replay, it is the next record of the trace
+	if (prefs->replay) {
+		if (replay_next(prefs) < 0)
+			return -1;
+		rec = &prefs->replay->cur;
+		size = rec->size;
+		namelen = rec->targetlen;
+	}
 
 	//srcport and dstport must already be provided by the user.
 	//returns struct xseg_request with basic initializations
@@ -672,14 +1207,34 @@ static int send_request(struct peerd *peer, struct bench *prefs)
 	 * counted as part of the target's name.
 	 */
 	XSEGLOG2(&lc, D, "Prepare new request\n");
-	r = xseg_prep_request(xseg, req, obv->namelen + 1, size);
+	r = xseg_prep_request(xseg, req, namelen + 1, size +
+			(prefs->volume ? sizeof(struct vlmc_timing) : 0));
 	if (r < 0) {
 		XSEGLOG2(&lc, W, "Cannot prepare request! (%lu, %llu)\n",
-				obv->namelen + 1, (unsigned long long)size);
+				namelen + 1, (unsigned long long)size);
 		goto put_xseg_request;
 	}
 	req->targetlen--;
 
+	if (rec) {
+		req->op = rec->op;
+		req->flags = rec->flags;
+		strncpy(xseg_get_target(xseg, req), prefs->replay->cur_target,
+				namelen);
+		req->size = size;
+		req->offset = rec->offset;
+		goto alloc_peer_req;
+	}
+
+	if (prefs->profile) {
+		req->op = preq.op == PROFILE_READ ? X_READ : X_WRITE;
+		obv->objnum = preq.objnum;
+		create_target(prefs, req);
+		req->size = size;
+		req->offset = preq.offset;
+		goto alloc_peer_req;
+	}
+
 	//Determine what the next target/chunk will be, based on I/O pattern
 	new = determine_next(prefs);
 	req->op = prefs->op;
@@ -695,10 +1250,17 @@ static int send_request(struct peerd *peer, struct bench *prefs)
 
 		if (prefs->op == X_WRITE)
 			create_chunk(prefs, req, new);
+		if (prefs->volume)
+			volume_prep_timing(prefs, req);
+	} else if (prefs->op == X_HASH) {
+		//The whole object is hashed
+		req->size = prefs->os;
+		req->offset = 0;
 	}
 
+alloc_peer_req:
 	XSEGLOG2(&lc, D, "Allocate peer request\n");
-	pr = alloc_peer_req(peer);
+	pr = bench_alloc_peer_req(peer, prefs);
 	if (!pr) {
 		XSEGLOG2(&lc, W, "Cannot allocate peer request (%ld remaining)\n",
 				peer->nr_ops - xq_count(&peer->free_reqs));
@@ -722,11 +1284,20 @@ static int send_request(struct peerd *peer, struct bench *prefs)
 	 * QUESTION: Is this the fastest way?
 	 */
 	timer_start(prefs, prefs->rec_tm);
+	breq = (struct bench_req *)pr->priv;
 	if (prefs->rec_tm->insanity <= GET_FLAG(INSANITY, prefs->flags)) {
-		ts = (struct timespec *)pr->priv;
-		ts->tv_sec = prefs->rec_tm->start_time.tv_sec;
-		ts->tv_nsec = prefs->rec_tm->start_time.tv_nsec;
+		if (sched)
+			breq->submission = *sched;
+		else
+			breq->submission = prefs->rec_tm->start_time;
 	}
+	if (prefs->profile) {
+		breq->phase = prefs->profile->cur;
+		breq->op = preq.op;
+	}
+	if (rec)
+		breq->orig_latency = rec->state == XTRACE_SERVED ?
+			rec->latency : 0;
 
 	//Submit the request from the source port to the target port
 	XSEGLOG2(&lc, D, "Submit request %lu\n", new);
@@ -738,6 +1309,8 @@ static int send_request(struct peerd *peer, struct bench *prefs)
 	}
 	prefs->status->submitted++;
 	timer_stop(prefs, prefs->sub_tm, NULL);
+	if (sched)
+		timer_stop(prefs, prefs->lag_tm, sched);
 
 	//Send SIGIO to the process that has bound this port to inform that
 	//IO is possible
@@ -777,7 +1350,7 @@ static int send_ping_request(struct peerd *peer, struct bench *prefs)
 	req->op = X_PING;
 
 	XSEGLOG2(&lc, D, "Allocate peer request\n");
-	pr = alloc_peer_req(peer);
+	pr = bench_alloc_peer_req(peer, prefs);
 	if (!pr) {
 		XSEGLOG2(&lc, W, "Cannot allocate peer request (%ld remaining)\n",
 				peer->nr_ops - xq_count(&peer->free_reqs));
@@ -818,6 +1391,95 @@ put_xseg_request:
 	return -1;
 }
 
+/*
+ * Send every request whose intended submission time has passed and return the
+ * time until the next one is due, in microseconds.
+ */
+static uint64_t send_scheduled(struct peerd *peer, struct bench *prefs)
+{
+	struct timespec now;
+	int64_t ahead;
+	int r;
+
+	clock_gettime(CLOCK_BENCH, &now);
+
+	while (CAN_SEND_SCHEDULED(prefs)) {
+		/* The schedule starts with the first request */
+		if (!prefs->sched.tv_sec && !prefs->sched.tv_nsec)
+			prefs->sched = now;
+		ahead = timespec_diff_ns(&prefs->sched, &now);
+		if (ahead > 0)
+			return ahead / 1000 + 1;
+		xseg_cancel_wait(peer->xseg, prefs->src_port);
+		r = send_request(peer, prefs, &prefs->sched);
+		if (r < 0)
+			break;
+		timespec_add_ns(&prefs->sched, next_arrival(prefs));
+	}
+	return 0;
+}
+
+static int scheduled_is_due(struct bench *prefs)
+{
+	struct timespec now;
+
+	if (!CAN_SEND_SCHEDULED(prefs))
+		return 0;
+	clock_gettime(CLOCK_BENCH, &now);
+	return timespec_diff_ns(&prefs->sched, &now) <= 0;
+}
+
+static void handle_received(struct peerd *peer, struct bench *prefs,
+		struct peer_req *pr);
+
+/*
+ * Unlike check_ports() of peer.c, check only the source port of the generator
+ * thread, so that the replies of a thread are always handled by the thread
+ * itself.
+ */
+static int check_bench_port(struct peerd *peer, struct bench *prefs)
+{
+	struct xseg *xseg = peer->xseg;
+	struct xseg_request *req;
+	struct peer_req *pr;
+	int r;
+
+	req = xseg_receive(xseg, prefs->src_port, X_NONBLOCK);
+	if (!req)
+		return 0;
+
+	r = xseg_get_req_data(xseg, req, (void **) &pr);
+	if (r < 0 || !pr) {
+		XSEGLOG2(&lc, W, "Received request with no pr data\n");
+		if (xseg_put_request(xseg, req, prefs->src_port))
+			XSEGLOG2(&lc, W, "Cannot put xseg request\n");
+		return 1;
+	}
+
+	xseg_cancel_wait(xseg, prefs->src_port);
+	handle_received(peer, prefs, pr);
+	return 1;
+}
+
+/*
+ * Progress is reported by the first generator thread, on behalf of all
+ * threads.
+ */
+static void report_progress(struct bench *gprefs, uint64_t *next_report)
+{
+	collect_status(gprefs);
+	if (!CAN_PRINT_PROGRESS(gprefs, *next_report))
+		return;
+
+	collect_progress(gprefs);
+	if (GET_FLAG(OUTPUT, gprefs->flags) == OUTPUT_TEXT)
+		print_progress(gprefs);
+	else
+		output_sample(gprefs);
+	while (*next_report <= gprefs->status->received)
+		*next_report += gprefs->rep->interval;
+}
+
 /*
  * This function substitutes the default generic_peerd_loop of peer.c.
  * It's plugged to struct peerd at custom peer's initialisation
@@ -827,85 +1489,133 @@ int bench_peerd_loop(void *arg)
 #ifdef MT
 	struct thread *t = (struct thread *) arg;
 	struct peerd *peer = t->peer;
+	struct bench *prefs = t->priv;
 	char *id = t->arg;
 #else
 	struct peerd *peer = (struct peerd *) arg;
+	struct bench *prefs = ((struct bench *)peer->priv)->threads;
 	char id[4] = {'P','e','e','r'};
 #endif
 	struct xseg *xseg = peer->xseg;
-	struct bench *prefs = peer->priv;
-	xport portno_start = peer->portno_start;
-	xport portno_end = peer->portno_end;
+	struct bench *gprefs = peer->priv;
+	int reporter = (prefs->thread_no == 0);
 	pid_t pid = syscall(SYS_gettid);
 	uint64_t threshold = peer->threshold;
-        threshold /= (1 + portno_end - portno_start);
+	threshold /= (1 + peer->portno_end - peer->portno_start);
 	threshold += 1;
-	uint64_t next_report = prefs->rep->interval;
+	uint64_t next_report = gprefs->rep->interval;
 	uint64_t loops;
+	uint64_t timeout, next;
 	int r;
 
 	XSEGLOG2(&lc, I, "%s has tid %u.\n",id, pid);
-	xseg_init_local_signal(xseg, peer->portno_start);
+	xseg_init_local_signal(xseg, prefs->src_port);
 
-	if (GET_FLAG(PROGRESS, prefs->flags) != PROGRESS_NO)
-		print_dummy_progress(prefs);
+	if (reporter && GET_FLAG(OUTPUT, prefs->flags) != OUTPUT_TEXT)
+		output_config(gprefs);
+	else if (reporter && GET_FLAG(PROGRESS, prefs->flags) != PROGRESS_NO)
+		print_dummy_progress(gprefs);
 
 	/* If no ping is going to be sent, we can begin the benchmark now. */
-	if (GET_FLAG(PING, prefs->flags) == PING_MODE_ON)
+	if (GET_FLAG(PING, prefs->flags) == PING_MODE_ON) {
 		send_ping_request(peer, prefs);
-	else
+	} else {
 		timer_start(prefs, prefs->total_tm);
+		if (reporter)
+			timer_start(gprefs, gprefs->total_tm);
+	}
 
 send_request:
 	while (!(isTerminate() && all_peer_reqs_free(peer))) {
-		while (CAN_SEND_REQUEST(prefs)) {
-			xseg_cancel_wait(xseg, peer->portno_start);
+		//A profile may end without any request in flight
+		if (GET_FLAG(PING, prefs->flags) == PING_MODE_OFF &&
+				prefs->status->received >= prefs->status->max)
+			goto out;
+		timeout = 10000000UL;
+		if (IS_OPEN_LOOP(prefs)) {
+			next = send_scheduled(peer, prefs);
+			if (next && next < timeout)
+				timeout = next;
+		}
+		if (prefs->nr_threads > 1 && timeout > MT_MAX_SLEEP)
+			timeout = MT_MAX_SLEEP;
+		while (!IS_OPEN_LOOP(prefs) && CAN_SEND_REQUEST(prefs)) {
+			xseg_cancel_wait(xseg, prefs->src_port);
 			XSEGLOG2(&lc, D, "...because %lu < %lu && %lu < %lu\n",
 				prefs->status->submitted - prefs->status->received,
 				prefs->iodepth, prefs->status->received,
 				prefs->status->max);
+			if (prefs->profile && !profile_ready(prefs, &next)) {
+				if (next < timeout)
+					timeout = next;
+				break;
+			}
 			XSEGLOG2(&lc, D, "Start sending new request\n");
-			r = send_request(peer, prefs);
+			r = send_request(peer, prefs, NULL);
 			if (r < 0)
 				break;
 		}
 		//Heart of peerd_loop. This loop is common for everyone.
 		for (loops = threshold; loops > 0; loops--) {
 			if (loops == 1)
-				xseg_prepare_wait(xseg, peer->portno_start);
+				xseg_prepare_wait(xseg, prefs->src_port);
 
-			if (CAN_PRINT_PROGRESS(prefs, next_report)) {
-				print_progress(prefs);
-				next_report += prefs->rep->interval;
-			}
+			if (reporter)
+				report_progress(gprefs, &next_report);
+
+			if (IS_OPEN_LOOP(prefs) && scheduled_is_due(prefs))
+				goto send_request;
+
+			if (prefs->profile && !IS_OPEN_LOOP(prefs) &&
+					CAN_SEND_REQUEST(prefs) &&
+					profile_ready(prefs, &next))
+				goto send_request;
 
-			if (check_ports(peer)) {
+			if (check_bench_port(peer, prefs)) {
 				//If an old request has just been acked, the
 				//most sensible thing to do is to immediately
 				//send a new one
 				if (prefs->status->received < prefs->status->max)
 					goto send_request;
 				else
-					return 0;
+					goto out;
 			}
 		}
 		XSEGLOG2(&lc, I, "%s goes to sleep\n", id);
-		xseg_wait_signal(xseg, peer->sd, 10000000UL);
-		xseg_cancel_wait(xseg, peer->portno_start);
+		xseg_wait_signal(xseg, peer->sd, timeout);
+		xseg_cancel_wait(xseg, prefs->src_port);
 		XSEGLOG2(&lc, I, "%s woke up\n", id);
 	}
 
 	XSEGLOG2(&lc, I, "peer->free_reqs = %d, peer->nr_ops = %d\n",
 			xq_count(&peer->free_reqs), peer->nr_ops);
+out:
+	timer_stop(prefs, prefs->total_tm, NULL);
+	if (prefs->profile)
+		profile_finish(prefs);
 	return 0;
 }
 
+/*
+ * In MT builds, this is called by every generator thread when it finishes.
+ * The last one reports the merged results of all threads.
+ */
 void custom_peer_finalize(struct peerd *peer)
 {
 	struct bench *prefs = peer->priv;
 	//TODO: Measure mean time, standard variation
 
-	timer_stop(prefs, prefs->total_tm, NULL);
+	if (__sync_add_and_fetch(&prefs->finished, 1) < prefs->nr_threads)
+		return;
+
+	collect_results(prefs);
+
+	if (GET_FLAG(OUTPUT, prefs->flags) != OUTPUT_TEXT) {
+		output_results(prefs);
+		if (prefs->hist_path)
+			dump_histograms(prefs);
+		return;
+	}
 
 	if (GET_FLAG(PROGRESS, prefs->flags) != PROGRESS_NO)
 		clear_report_lines(prefs->rep->lines);
@@ -916,6 +1626,14 @@ void custom_peer_finalize(struct peerd *peer)
 
 	if (GET_FLAG(INSANITY, prefs->flags) >= prefs->rec_tm->insanity)
 		print_rec_res(prefs);
+	if (IS_OPEN_LOOP(prefs))
+		print_lag_res(prefs);
+	if (prefs->profile)
+		print_profile_res(prefs);
+	if (prefs->replay)
+		print_replay_res(prefs);
+	if (prefs->volume)
+		print_volume_res(prefs);
 
 	print_divider();
 	/*
@@ -928,9 +1646,13 @@ void custom_peer_finalize(struct peerd *peer)
 	 * cases
 	 */
 	prefs->total_tm->elapsed_time = prefs->total_tm->sum;
-	prefs->rep->interval = prefs->status->received;
+	prefs->rep->prev_recv = 0;
+	prefs->rep->prev_bytes = 0;
 	print_io_stats(prefs);
 	fflush(stdout);
+
+	if (prefs->hist_path)
+		dump_histograms(prefs);
 	return;
 }
 
@@ -939,11 +1661,14 @@ void custom_peer_finalize(struct peerd *peer)
  * Do some sanity checks and then check if request is failed.
  * If not try to verify the request if asked.
  */
-static void handle_received(struct peerd *peer, struct peer_req *pr)
+static void handle_received(struct peerd *peer, struct bench *prefs,
+		struct peer_req *pr)
 {
 	//FIXME: handle null pointer
-	struct bench *prefs = peer->priv;
+	struct bench *gprefs = peer->priv;
 	struct timer *rec = prefs->rec_tm;
+	struct bench_req *breq = (struct bench_req *)pr->priv;
+	uint64_t latency;
 	int start_timer = 0;
 
 	if (!pr->req) {
@@ -971,12 +1696,27 @@ static void handle_received(struct peerd *peer, struct peer_req *pr)
 		return;
 	}
 
-	timer_stop(prefs, rec, (struct timespec *)pr->priv);
+	timer_stop(prefs, rec, &breq->submission);
+
+	latency = rec->elapsed_time.tv_sec * 1000000000ULL +
+		rec->elapsed_time.tv_nsec;
+	if (prefs->profile)
+		profile_received(prefs, breq, !(pr->req->state & XS_SERVED),
+				pr->req->size, latency);
+	if (prefs->replay)
+		replay_received(prefs, breq, !(pr->req->state & XS_SERVED),
+				latency);
+
+	if (prefs->volume && (pr->req->state & XS_SERVED))
+		volume_received(prefs, pr->req);
 
-	if (!(pr->req->state & XS_SERVED))
+	if (!(pr->req->state & XS_SERVED)) {
 		prefs->status->failed++;
-	else if (CAN_VERIFY(prefs) && read_chunk(prefs, pr->req))
-		prefs->status->corrupted++;
+	} else {
+		prefs->status->bytes += pr->req->serviced;
+		if (CAN_VERIFY(prefs) && read_chunk(prefs, pr->req))
+			prefs->status->corrupted++;
+	}
 
 out:
 	if (xseg_put_request(peer->xseg, pr->req, pr->portno))
@@ -984,13 +1724,24 @@ out:
 
 	free_peer_req(peer, pr);
 
-	if (start_timer)
+	if (start_timer) {
 		timer_start(prefs, prefs->total_tm);
+		if (prefs->thread_no == 0)
+			timer_start(gprefs, gprefs->total_tm);
+	}
 }
 
 int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
 		enum dispatch_reason reason)
 {
+	struct bench *prefs = peer->priv;
+
+#ifdef MT
+	prefs = &prefs->threads[pr->thread_no];
+#else
+	prefs = prefs->threads;
+#endif
+
 	switch (reason) {
 		case dispatch_accept:
 			//This is wrong, benchmarking peer should not accept requests,
@@ -999,7 +1750,7 @@ int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
 			complete(peer, pr);
 			break;
 		case dispatch_receive:
-			handle_received(peer, pr);
+			handle_received(peer, prefs, pr);
 			break;
 		default:
 			fail(peer, pr);
@@ -17,6 +17,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <xseg/protocol.h>
 #include <bench-lfsr.h>
+#include <xtrace.h>
+#include <vlmcd.h>
 
 #ifdef __GNUC__
 #define LIKELY(x)       __builtin_expect(!!(x),1)
@@ -40,13 +42,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_ARG_LEN 10
 
 /*
- * Pattern type occupies 1st flag bit.
- * If 0, it's sequential, if 1, it's random.
+ * Pattern type occupies 11th to 13th flag bit.
+ * If 000, it's sequential, if 001, it's random (a permutation of all chunks).
+ * The rest are skewed: zipfian (010), hotspot (011) and sequential runs with
+ * random jumps (100).
  */
-#define PATTERN_FLAG_POS 0
-#define PATTERN_BITMASK 1
+#define PATTERN_FLAG_POS 10
+#define PATTERN_BITMASK 7	/* i.e. "111" in binary form */
 #define PATTERN_SEQ 0
 #define PATTERN_RAND 1
+#define PATTERN_ZIPF 2
+#define PATTERN_HOTSPOT 3
+#define PATTERN_SEQJUMP 4
+
+#define MAX_PATTERN_LEN 31
 
 /*
  * Verify mode occupies 2nd and 3rd flag bit.
@@ -84,13 +93,44 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define PING_MODE_OFF 0
 #define PING_MODE_ON 1
 
+/*
+ * Arrival process occupies 9th and 10th flag bit.
+ * If 00, requests are sent as soon as iodepth allows (closed loop). Else,
+ * requests are sent at a target rate (open loop), with constant (01) or
+ * exponentially distributed (10) inter-arrival times, or at the times of a
+ * replayed trace (11).
+ */
+#define ARRIVAL_FLAG_POS 8
+#define ARRIVAL_BITMASK 3	/* i.e. "11" in binary form */
+#define ARRIVAL_CLOSED 0
+#define ARRIVAL_CONST 1
+#define ARRIVAL_POISSON 2
+#define ARRIVAL_TRACE 3
+
+/*
+ * Output format occupies 14th and 15th flag bit.
+ * If 00, results are printed as text. Else, they are printed for tools, as a
+ * JSON document (01) or CSV rows (10).
+ */
+#define OUTPUT_FLAG_POS 13
+#define OUTPUT_BITMASK 3	/* i.e. "11" in binary form */
+#define OUTPUT_TEXT 0
+#define OUTPUT_JSON 1
+#define OUTPUT_CSV 2
+
+/* Timing of a replayed trace */
+#define REPLAY_ORIGINAL 0
+#define REPLAY_FAST 1
+
 /*
  * Current bench flags representation:
  * 63
  * .
  * .
  * .
- * 8
+ * 10
+ * 9 <-- arrival
+ * 8 <--   〃
  * 7 <-- ping
  * 6 <-- progress
  * 5 <--   〃
@@ -120,6 +160,33 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define SEEDLEN 9
 #define OBJNUMLEN 15
 
+/*
+ * Latency histograms are log-linear: values below 2^HIST_SUB_BITS ns have
+ * their own bucket and every following power of two is split in
+ * 2^HIST_SUB_BITS equal buckets, so the relative error of a recorded value is
+ * at most 1/2^HIST_SUB_BITS. Values of 2^(HIST_MAX_BITS) ns (~18 min) or
+ * more are recorded in the last bucket.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_MAX_BITS 40
+#define HIST_NR_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * Generators of the skewed patterns. Their arguments are read from --pattern
+ * and their state is derived from the seed, so that the same chunks are
+ * accessed by runs with the same seed.
+ */
+struct bench_pattern {
+	uint64_t state;		/* xorshift state */
+	double theta;		/* zipf */
+	double hot_frac;	/* hotspot */
+	double hot_prob;
+	uint64_t run;		/* seqjump */
+	struct bench_zipf zipf;
+	struct bench_hotspot hot;
+	struct bench_seqjump jump;
+};
+
 struct bench {
 	uint64_t to; //Total number of objects (not for read/write)
 	uint64_t ts; //Total I/O size
@@ -128,18 +195,32 @@ struct bench {
 	uint32_t iodepth; //Num of in-flight xseg reqs
 	xport dst_port;
 	xport src_port;
+	uint32_t nr_dst_ports; //Destination ports are dst_port + [0, nr_dst_ports)
 	uint32_t op;	//xseg operation
 	uint64_t flags;
 	unsigned int interval;
 	struct peerd *peer;
 	struct req_status *status;
 	struct bench_lfsr *lfsr;
+	struct bench_pattern pat;
 	struct object_vars *objvars;
 	struct progress_report *rep;
 	struct timer *total_tm; //Total time for benchmark
 	struct timer *get_tm;	//Time for xseg_get_request
 	struct timer *sub_tm;	//Time for xseg_submit_request
 	struct timer *rec_tm;	//Time for xseg_receive_request
+	struct timer *lag_tm;	//Lag of submissions behind schedule
+	char *hist_path;	//Where to dump the raw histograms
+	uint64_t rate;		//Target IOPS of open loop mode
+	uint64_t arrival_state;	//PRNG state for Poisson arrivals
+	struct timespec sched;	//Intended submission time of next request
+	uint32_t nr_threads;	//Number of generator threads
+	uint32_t thread_no;	//Generator thread that owns this struct
+	struct bench *threads;	//Per-thread state, only in the global struct
+	uint32_t finished;	//Generator threads that have finished
+	struct bench_profile *profile; //Workload profile, if any
+	struct bench_replay *replay; //Replayed trace, if any
+	struct bench_volume *volume; //Benchmarked volume, if any
 };
 
 struct object_vars {
@@ -159,13 +240,16 @@ struct req_status {
 	uint64_t received;
 	uint64_t corrupted;	/* Requests that did not pass verification */
 	uint64_t failed;
+	uint64_t bytes;		/* Serviced by the served requests */
 };
 
 struct progress_report {
 	int type;
 	uint64_t prev_recv;
+	uint64_t prev_bytes;
 	uint64_t interval;
 	int lines;
+	uint64_t samples;	/* samples printed in JSON/CSV output */
 };
 
 /*
@@ -178,6 +262,14 @@ struct timespec2 {
 	uint64_t tv_nsec2;
 };
 
+/* Latency histogram, in nanoseconds */
+struct histogram {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_NR_BUCKETS];
+};
+
 /*
  * struct timer fields
  * ====================
@@ -185,6 +277,8 @@ struct timespec2 {
  * start_time: submission time of a request
  * sum: the sum of elapsed times of every completed request
  * sum_sq: the sum of the squares of elapsed times
+ * hist: latency histogram of every completed request
+ * ihist: latency histogram of the current progress interval
  * insanity: benchmarking level, higher means that the request associated with
  *           this timer is more trivial.
  */
@@ -194,9 +288,142 @@ struct timer {
 	struct timespec start_time;
 	struct timespec elapsed_time;
 	uint64_t completed;
+	struct histogram hist;
+	struct histogram ihist;
 	int insanity;
 };
 
+/*
+ * Workload profiles (see bench-profile.c)
+ */
+#define PROFILE_MAX_PHASES 16
+#define PROFILE_MAX_BS 8
+#define PROFILE_NAME_LEN 31
+
+#define ACCESS_SEQ 0
+#define ACCESS_UNIFORM 1
+#define ACCESS_ZIPF 2
+#define ACCESS_HOTSPOT 3
+
+/* Operations of a profile, as indices of per-op statistics */
+#define PROFILE_READ 0
+#define PROFILE_WRITE 1
+#define PROFILE_NR_OPS 2
+
+struct bench_bs {
+	uint64_t size;
+	uint32_t weight;
+};
+
+struct bench_phase {
+	char name[PROFILE_NAME_LEN + 1];
+	uint64_t duration;	/* in ns, 0 if the phase is bounded by requests */
+	uint64_t requests;
+	uint32_t read_pct;	/* the rest are writes */
+	uint32_t nr_bs;
+	uint32_t bs_weight;	/* sum of block size weights */
+	struct bench_bs bs[PROFILE_MAX_BS];
+	int access;
+	double theta;		/* ACCESS_ZIPF */
+	double hot_frac;	/* ACCESS_HOTSPOT */
+	double hot_prob;	/* ACCESS_HOTSPOT */
+	uint64_t think;		/* in ns, between a reply and the next request */
+};
+
+struct phase_stats {
+	uint64_t requests;
+	uint64_t failed;
+	uint64_t bytes;
+	uint64_t lat_sum;	/* in ns */
+	struct histogram hist;
+};
+
+struct phase_result {
+	struct timespec start;
+	struct timespec end;
+	struct phase_stats ops[PROFILE_NR_OPS];
+};
+
+/*
+ * Per thread state of a workload profile. The phases are shared by all
+ * threads, everything else is private.
+ */
+struct bench_profile {
+	uint32_t nr_phases;
+	struct bench_phase *phases;
+	struct phase_result *res;
+	uint32_t cur;		/* current phase */
+	uint64_t submitted;	/* requests submitted in current phase */
+	uint64_t objects;	/* size of the object space */
+	uint64_t seq_pos;	/* next byte of ACCESS_SEQ */
+	uint64_t rand_state;
+	struct bench_zipf zipf;
+	struct bench_hotspot hot;
+	/* ready times (in ns) of idle request slots, for think times */
+	uint64_t *ready;
+	uint32_t ready_head;
+	uint32_t ready_count;
+	uint32_t ready_size;
+};
+
+/* What the next request of a profile will be */
+struct profile_req {
+	uint32_t op;
+	uint64_t size;
+	uint64_t objnum;
+	uint64_t offset;
+};
+
+/*
+ * State of a trace replay. The trace is read one record ahead, so that the
+ * time until the next request is known when a request is sent.
+ */
+struct bench_replay {
+	struct xtrace trace;
+	int timing;
+	struct xtrace_record cur;	/* the request being sent */
+	char cur_target[XSEG_MAX_TARGETLEN + 1];
+	struct xtrace_record next;
+	char next_target[XSEG_MAX_TARGETLEN + 1];
+	int has_next;
+	uint64_t last_ts;	/* latest timestamp replayed so far */
+	uint64_t skipped;	/* records with unsupported operations */
+	uint64_t compared;	/* requests served both when recorded and now */
+	uint64_t slower;	/* of the above, slower than when recorded */
+	struct histogram orig;	/* recorded latencies of compared requests */
+	struct histogram now;	/* replayed latencies of compared requests */
+};
+
+/*
+ * State of a volume benchmark. The volume can be created, or cloned, and
+ * snapshotted through the mapper before the benchmark starts. Its requests ask
+ * vlmcd for their timing (see vlmcd.h), which splits their latency.
+ */
+struct bench_volume {
+	xport mportno;		/* mapper port, for the setup requests */
+	int create;
+	char clone[XSEG_MAX_TARGETLEN + 1];	/* snapshot to clone from */
+	char snap[XSEG_MAX_TARGETLEN + 1];	/* snapshot to take */
+	uint64_t setup_ns;	/* creation or cloning time */
+	uint64_t snap_ns;	/* snapshot time */
+	uint64_t timed;		/* requests with vlmcd timing */
+	uint64_t untimed;	/* served requests without it */
+	struct histogram queue;
+	struct histogram map;
+	struct histogram io;
+};
+
+/*
+ * Per request state, stored in pr->priv. The submission time must be the
+ * first member.
+ */
+struct bench_req {
+	struct timespec submission;
+	uint32_t phase;
+	uint32_t op;
+	uint64_t orig_latency;	/* recorded latency of a replayed request */
+};
+
 struct tm_result {
 	unsigned int s;
 	unsigned int ms;
@@ -221,18 +448,42 @@ void timer_start(struct bench *prefs, struct timer *sample_req);
 void timer_stop(struct bench *prefs, struct timer *sample_tm,
 		struct timespec *start);
 int init_timer(struct timer **tm, int insanity);
+void timer_merge(struct timer *dst, struct timer *src);
+void hist_reset(struct histogram *hist);
+void hist_merge(struct histogram *dst, struct histogram *src);
+void hist_diff(struct histogram *dst, struct histogram *a,
+		struct histogram *b);
+void hist_record(struct histogram *hist, uint64_t val);
+uint64_t hist_percentile(struct histogram *hist, double percentile);
+uint64_t hist_bucket_low(int idx);
+uint64_t hist_bucket_high(int idx);
+void timespec_add_ns(struct timespec *ts, uint64_t ns);
+int64_t timespec_diff_ns(struct timespec *end, struct timespec *start);
 uint64_t str2num(char *str);
 int read_op(char *op);
-int read_pattern(char *pattern);
+int read_pattern(char *pattern, struct bench_pattern *pat);
+int init_pattern(struct bench *prefs, uint64_t seed);
+uint64_t pattern_next(struct bench *prefs);
 int read_insanity(char *insanity);
 int read_verify(char *insanity);
 int read_progress(char *progress);
 int read_progress_type(char *ptype);
 uint64_t read_interval(struct bench *prefs, char *str_interval);
 int read_ping(char *progress);
+int read_arrivals(char *arrivals);
+int read_replay_timing(char *timing);
+int read_output(char *output);
+int read_port_range(char *str, long *start, long *end);
+uint64_t next_arrival(struct bench *prefs);
 void clear_report_lines(int lines);
 void print_total_res(struct bench *prefs);
 void print_rec_res(struct bench *prefs);
+void print_interval_lat(struct bench *prefs);
+void print_lag_res(struct bench *prefs);
+void collect_status(struct bench *prefs);
+void collect_progress(struct bench *prefs);
+void collect_results(struct bench *prefs);
+int dump_histograms(struct bench *prefs);
 void print_divider();
 void print_req_stats(struct bench *prefs);
 void print_io_stats(struct bench *prefs);
@@ -248,6 +499,36 @@ uint64_t calculate_interval(struct bench *prefs, uint64_t percentage);
 int calculate_report_lines(struct bench *prefs);
 int validate_seed(struct bench *prefs, unsigned long seed);
 
+int read_profile(struct bench *prefs, char *path, unsigned int page_size);
+int init_thread_profile(struct bench *prefs, struct bench *tprefs);
+void free_profile(struct bench_profile *prof);
+int profile_next(struct bench *prefs, struct profile_req *preq);
+int profile_ready(struct bench *prefs, uint64_t *wait_us);
+void profile_received(struct bench *prefs, struct bench_req *breq,
+		int failed, uint64_t size, uint64_t latency);
+void profile_finish(struct bench *prefs);
+void collect_profile(struct bench *prefs);
+void print_profile_res(struct bench *prefs);
+
+int open_replay(struct bench *prefs, char *path, int timing);
+void free_replay(struct bench_replay *replay);
+int replay_next(struct bench *prefs);
+uint64_t replay_delay(struct bench *prefs);
+void replay_received(struct bench *prefs, struct bench_req *breq,
+		int failed, uint64_t latency);
+void print_replay_res(struct bench *prefs);
+
+int volume_setup(struct peerd *peer, struct bench *prefs, char *volume);
+int init_thread_volume(struct bench *prefs, struct bench *tprefs);
+void volume_prep_timing(struct bench *prefs, struct xseg_request *req);
+void volume_received(struct bench *prefs, struct xseg_request *req);
+void collect_volume(struct bench *prefs);
+void print_volume_res(struct bench *prefs);
+
+void output_config(struct bench *prefs);
+void output_sample(struct bench *prefs);
+void output_results(struct bench *prefs);
+
 void inspect_obv(struct object_vars *obv);
 uint64_t __get_object(struct bench *prefs, uint64_t new);
 
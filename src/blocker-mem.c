@@ -0,0 +1,751 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-memory blocker backend (archip-memd).
+ *
+ * Objects are kept in process memory, so their contents are lost when the
+ * peer exits. Meant for benchmarking and testing the upper layers (mapperd,
+ * vlmcd) without any real storage.
+ *
+ * Object data live in fixed size chunks, carved out of an arena that is
+ * allocated once at startup, backed by hugepages if possible. Chunks that have
+ * never been written are not allocated and read back as zeros.
+ *
+ * Optionally, a simple device model delays the completion of data operations:
+ * every operation costs a fixed latency, and its data are transferred over a
+ * single link of fixed bandwidth, shared by all operations.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <xseg/xseg.h>
+#include <xseg/xhash.h>
+#include <peer.h>
+#include <blocker.h>
+
+#define MEMD_DEFAULT_ARENA_SIZE	1024	/* in MiB */
+#define MEMD_DEFAULT_CHUNK_SIZE	1024	/* in KiB */
+
+struct mem_object {
+	char name[BLOCKER_MAX_OBJ_NAME + 1];
+	char **chunks;
+	uint64_t nr_chunks;
+	uint64_t size;
+	/* lock state, for lock objects */
+	int locked;
+	struct peer_req *waiters, *waiters_tail;
+};
+
+struct mem_arena {
+	char *base;
+	uint64_t size;
+	uint64_t chunk_size;
+	uint64_t nr_chunks;
+	/* stack of free chunk indexes */
+	uint64_t *free_chunks;
+	uint64_t nr_free;
+	int hugepages;
+};
+
+/* a data operation whose completion is delayed by the device model */
+struct mem_delayed {
+	uint64_t due;
+	struct peer_req *pr;
+	ssize_t ret;
+};
+
+struct memd {
+	xhash_t *objects;
+	struct mem_arena arena;
+	pthread_mutex_t lock;
+	/* device model */
+	uint64_t latency;	/* in ns */
+	uint64_t bandwidth;	/* in bytes per second */
+	uint64_t busy_until;
+	/* min heap of delayed completions, ordered by due time */
+	struct mem_delayed *delayed;
+	uint64_t nr_delayed;
+};
+
+static struct memd * __get_memd(struct peerd *peer)
+{
+	return (struct memd *) __get_blockerd(peer)->priv;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Arena
+ */
+static int arena_init(struct mem_arena *arena, uint64_t size,
+		uint64_t chunk_size)
+{
+	uint64_t i;
+
+	arena->chunk_size = chunk_size;
+	arena->nr_chunks = size / chunk_size;
+	arena->size = arena->nr_chunks * chunk_size;
+	if (!arena->nr_chunks) {
+		XSEGLOG2(&lc, E, "Arena size is less than chunk size");
+		return -1;
+	}
+
+	/* Hugepages must be reserved up front. Otherwise the mapping succeeds
+	 * on a host without free hugepages and the first write faults.
+	 */
+	arena->hugepages = 1;
+	arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena->base == MAP_FAILED) {
+		XSEGLOG2(&lc, W, "Cannot map arena on hugepages. "
+				"Falling back to normal pages");
+		arena->hugepages = 0;
+		arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				-1, 0);
+		if (arena->base == MAP_FAILED) {
+			XSEGLOG2(&lc, E, "Cannot map arena of %llu bytes",
+					(unsigned long long) arena->size);
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		(void) madvise(arena->base, arena->size, MADV_HUGEPAGE);
+#endif
+	}
+
+	arena->free_chunks = malloc(arena->nr_chunks * sizeof(uint64_t));
+	if (!arena->free_chunks) {
+		munmap(arena->base, arena->size);
+		return -1;
+	}
+	for (i = 0; i < arena->nr_chunks; i++)
+		arena->free_chunks[i] = arena->nr_chunks - i - 1;
+	arena->nr_free = arena->nr_chunks;
+
+	XSEGLOG2(&lc, I, "Arena of %llu chunks of %llu bytes (hugepages: %s)",
+			(unsigned long long) arena->nr_chunks,
+			(unsigned long long) arena->chunk_size,
+			arena->hugepages ? "yes" : "no");
+	return 0;
+}
+
+static char * chunk_alloc(struct mem_arena *arena, int zero)
+{
+	char *chunk;
+
+	if (!arena->nr_free)
+		return NULL;
+	arena->nr_free--;
+	chunk = arena->base +
+		arena->free_chunks[arena->nr_free] * arena->chunk_size;
+	/* chunks are recycled, so they may hold stale data */
+	if (zero)
+		memset(chunk, 0, arena->chunk_size);
+	return chunk;
+}
+
+static void chunk_free(struct mem_arena *arena, char *chunk)
+{
+	arena->free_chunks[arena->nr_free] =
+		(chunk - arena->base) / arena->chunk_size;
+	arena->nr_free++;
+}
+
+/*
+ * Device model
+ */
+static uint64_t model_due(struct memd *memd, uint64_t size)
+{
+	uint64_t now, start;
+
+	if (!memd->latency && !memd->bandwidth)
+		return 0;
+
+	now = now_ns();
+	start = (memd->busy_until > now) ? memd->busy_until : now;
+	if (memd->bandwidth)
+		start += size * 1000000000UL / memd->bandwidth;
+	memd->busy_until = start;
+	return start + memd->latency;
+}
+
+static void delayed_push(struct memd *memd, struct mem_delayed *d)
+{
+	struct mem_delayed tmp;
+	uint64_t i = memd->nr_delayed++, parent;
+
+	memd->delayed[i] = *d;
+	while (i) {
+		parent = (i - 1) / 2;
+		if (memd->delayed[parent].due <= memd->delayed[i].due)
+			break;
+		tmp = memd->delayed[parent];
+		memd->delayed[parent] = memd->delayed[i];
+		memd->delayed[i] = tmp;
+		i = parent;
+	}
+}
+
+static void delayed_pop(struct memd *memd, struct mem_delayed *d)
+{
+	struct mem_delayed tmp;
+	uint64_t i = 0, child;
+
+	*d = memd->delayed[0];
+	memd->delayed[0] = memd->delayed[--memd->nr_delayed];
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= memd->nr_delayed)
+			break;
+		if (child + 1 < memd->nr_delayed &&
+			memd->delayed[child + 1].due < memd->delayed[child].due)
+			child++;
+		if (memd->delayed[i].due <= memd->delayed[child].due)
+			break;
+		tmp = memd->delayed[child];
+		memd->delayed[child] = memd->delayed[i];
+		memd->delayed[i] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * Complete a data operation of size bytes, now or when the device model says
+ * so. Must be called with the memd lock held, which is released.
+ */
+static void mem_complete(struct peerd *peer, struct peer_req *pr, ssize_t ret,
+		uint64_t size)
+{
+	struct memd *memd = __get_memd(peer);
+	struct mem_delayed d;
+
+	d.due = (ret < 0) ? 0 : model_due(memd, size);
+	if (d.due) {
+		d.pr = pr;
+		d.ret = ret;
+		delayed_push(memd, &d);
+		pthread_mutex_unlock(&memd->lock);
+		return;
+	}
+	pthread_mutex_unlock(&memd->lock);
+	blocker_io_done(peer, pr, ret);
+}
+
+/*
+ * Complete the delayed operations that are due. Returns 1 if any operation
+ * was completed and stores the time until the next one (in us) in *next.
+ */
+static int delayed_drain(struct peerd *peer, uint64_t *next)
+{
+	struct memd *memd = __get_memd(peer);
+	struct mem_delayed d;
+	uint64_t now;
+	int c = 0;
+
+	*next = 0;
+	if (!memd->nr_delayed)
+		return 0;
+
+	pthread_mutex_lock(&memd->lock);
+	now = now_ns();
+	while (memd->nr_delayed && memd->delayed[0].due <= now) {
+		delayed_pop(memd, &d);
+		pthread_mutex_unlock(&memd->lock);
+		blocker_io_done(peer, d.pr, d.ret);
+		c = 1;
+		pthread_mutex_lock(&memd->lock);
+		now = now_ns();
+	}
+	if (memd->nr_delayed)
+		*next = (memd->delayed[0].due - now) / 1000 + 1;
+	pthread_mutex_unlock(&memd->lock);
+	return c;
+}
+
+static struct mem_object * find_object(struct memd *memd, char *name)
+{
+	struct mem_object *obj = NULL;
+	int r = xhash_lookup(memd->objects, (xhashidx) name, (xhashidx *) &obj);
+	if (r < 0)
+		return NULL;
+	return obj;
+}
+
+static int insert_object(struct memd *memd, struct mem_object *obj)
+{
+	int r;
+
+	r = xhash_insert(memd->objects, (xhashidx) obj->name, (xhashidx) obj);
+	while (r == -XHASH_ERESIZE) {
+		xhashidx shift = xhash_grow_size_shift(memd->objects);
+		xhash_t *new_objects = xhash_resize(memd->objects, shift, 0, NULL);
+		if (!new_objects) {
+			XSEGLOG2(&lc, E, "Cannot grow objects to sizeshift %llu",
+					(unsigned long long) shift);
+			return -1;
+		}
+		memd->objects = new_objects;
+		r = xhash_insert(memd->objects, (xhashidx) obj->name, (xhashidx) obj);
+	}
+	return r;
+}
+
+static int remove_object(struct memd *memd, struct mem_object *obj)
+{
+	int r;
+
+	r = xhash_delete(memd->objects, (xhashidx) obj->name);
+	while (r == -XHASH_ERESIZE) {
+		xhashidx shift = xhash_shrink_size_shift(memd->objects);
+		xhash_t *new_objects = xhash_resize(memd->objects, shift, 0, NULL);
+		if (!new_objects) {
+			XSEGLOG2(&lc, E, "Cannot shrink objects to sizeshift %llu",
+					(unsigned long long) shift);
+			return -1;
+		}
+		memd->objects = new_objects;
+		r = xhash_delete(memd->objects, (xhashidx) obj->name);
+	}
+	return r;
+}
+
+static struct mem_object * create_object(struct memd *memd, char *name)
+{
+	struct mem_object *obj;
+
+	obj = calloc(1, sizeof(struct mem_object));
+	if (!obj)
+		return NULL;
+	strncpy(obj->name, name, BLOCKER_MAX_OBJ_NAME);
+	obj->name[BLOCKER_MAX_OBJ_NAME] = 0;
+	if (insert_object(memd, obj) < 0) {
+		free(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+static void free_object(struct memd *memd, struct mem_object *obj)
+{
+	uint64_t i;
+
+	for (i = 0; i < obj->nr_chunks; i++) {
+		if (obj->chunks[i])
+			chunk_free(&memd->arena, obj->chunks[i]);
+	}
+	free(obj->chunks);
+	free(obj);
+}
+
+static int grow_object(struct mem_object *obj, uint64_t nr_chunks)
+{
+	char **chunks;
+
+	if (nr_chunks <= obj->nr_chunks)
+		return 0;
+	chunks = realloc(obj->chunks, nr_chunks * sizeof(char *));
+	if (!chunks)
+		return -1;
+	memset(chunks + obj->nr_chunks, 0,
+			(nr_chunks - obj->nr_chunks) * sizeof(char *));
+	obj->chunks = chunks;
+	obj->nr_chunks = nr_chunks;
+	return 0;
+}
+
+static int mem_read(struct peerd *peer, struct peer_req *pr, char *target,
+		char *buf, uint64_t size, uint64_t offset)
+{
+	struct memd *memd = __get_memd(peer);
+	uint64_t chunk_size = memd->arena.chunk_size;
+	struct mem_object *obj;
+	uint64_t idx, off, len, done = 0;
+	ssize_t ret;
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, target);
+	if (!obj) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if (offset >= obj->size) {
+		ret = 0;
+		goto out;
+	}
+	if (size > obj->size - offset)
+		size = obj->size - offset;
+
+	while (done < size) {
+		idx = (offset + done) / chunk_size;
+		off = (offset + done) % chunk_size;
+		len = chunk_size - off;
+		if (len > size - done)
+			len = size - done;
+		if (idx < obj->nr_chunks && obj->chunks[idx])
+			memcpy(buf + done, obj->chunks[idx] + off, len);
+		else
+			memset(buf + done, 0, len);
+		done += len;
+	}
+	ret = size;
+out:
+	mem_complete(peer, pr, ret, size);
+	return 0;
+}
+
+static int mem_write(struct peerd *peer, struct peer_req *pr, char *target,
+		char *buf, uint64_t size, uint64_t offset)
+{
+	struct memd *memd = __get_memd(peer);
+	uint64_t chunk_size = memd->arena.chunk_size;
+	struct mem_object *obj;
+	uint64_t end = offset + size;
+	uint64_t idx, off, len, done = 0;
+	ssize_t ret = 0;
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, target);
+	if (!obj)
+		obj = create_object(memd, target);
+	if (!obj) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (grow_object(obj, (end + chunk_size - 1) / chunk_size) < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (done < size) {
+		idx = (offset + done) / chunk_size;
+		off = (offset + done) % chunk_size;
+		len = chunk_size - off;
+		if (len > size - done)
+			len = size - done;
+		if (!obj->chunks[idx]) {
+			/* no need to zero a chunk that is fully written */
+			obj->chunks[idx] = chunk_alloc(&memd->arena,
+					len != chunk_size);
+			if (!obj->chunks[idx]) {
+				XSEGLOG2(&lc, E, "Arena is full");
+				ret = -ENOSPC;
+				break;
+			}
+		}
+		memcpy(obj->chunks[idx] + off, buf + done, len);
+		done += len;
+	}
+	/* writing past the end of the object leaves a zero filled hole */
+	if (offset + done > obj->size)
+		obj->size = offset + done;
+out:
+	mem_complete(peer, pr, ret, size);
+	return 0;
+}
+
+/* Give whole chunks of the range back to the arena and zero the rest */
+static int mem_discard(struct peerd *peer, struct peer_req *pr, char *target,
+		uint64_t size, uint64_t offset)
+{
+	struct memd *memd = __get_memd(peer);
+	uint64_t chunk_size = memd->arena.chunk_size;
+	struct mem_object *obj;
+	uint64_t idx, off, len, done = 0;
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, target);
+	if (!obj || offset >= obj->size)
+		goto out;
+	if (size > obj->size - offset)
+		size = obj->size - offset;
+
+	while (done < size) {
+		idx = (offset + done) / chunk_size;
+		off = (offset + done) % chunk_size;
+		len = chunk_size - off;
+		if (len > size - done)
+			len = size - done;
+		if (idx < obj->nr_chunks && obj->chunks[idx]) {
+			if (len == chunk_size) {
+				chunk_free(&memd->arena, obj->chunks[idx]);
+				obj->chunks[idx] = NULL;
+			} else {
+				memset(obj->chunks[idx] + off, 0, len);
+			}
+		}
+		done += len;
+	}
+out:
+	mem_complete(peer, pr, 0, 0);
+	return 0;
+}
+
+static int mem_stat(struct peerd *peer, struct peer_req *pr, char *target,
+		uint64_t *size)
+{
+	struct memd *memd = __get_memd(peer);
+	struct mem_object *obj;
+	ssize_t ret = 0;
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, target);
+	if (!obj)
+		ret = -ENOENT;
+	else
+		*size = obj->size;
+	mem_complete(peer, pr, ret, 0);
+	return 0;
+}
+
+static int mem_remove(struct peerd *peer, struct peer_req *pr, char *target)
+{
+	struct memd *memd = __get_memd(peer);
+	struct mem_object *obj;
+	ssize_t ret = 0;
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, target);
+	if (!obj) {
+		ret = -ENOENT;
+	} else if (remove_object(memd, obj) < 0) {
+		ret = -EIO;
+	} else {
+		free_object(memd, obj);
+	}
+	mem_complete(peer, pr, ret, 0);
+	return 0;
+}
+
+static void lock_object_name(char *lock_name, char *target)
+{
+	uint32_t len = strlen(target);
+
+	strncpy(lock_name, target, len);
+	strncpy(lock_name + len, BLOCKER_LOCK_SUFFIX, BLOCKER_LOCK_SUFFIX_LEN);
+	lock_name[len + BLOCKER_LOCK_SUFFIX_LEN] = 0;
+}
+
+/*
+ * Locks are held by the peer, as with the rados blocker, so any request may
+ * release them. Requests waiting for a lock are queued on the lock object and
+ * the lock is handed over to the first of them on release.
+ */
+static int mem_lock(struct peerd *peer, struct peer_req *pr, char *target,
+		int nosync)
+{
+	struct memd *memd = __get_memd(peer);
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct mem_object *obj;
+	char lock_name[BLOCKER_MAX_OBJ_NAME + BLOCKER_LOCK_SUFFIX_LEN + 1];
+	ssize_t ret = 0;
+
+	lock_object_name(lock_name, target);
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, lock_name);
+	if (!obj)
+		obj = create_object(memd, lock_name);
+	if (!obj) {
+		ret = -ENOMEM;
+	} else if (!obj->locked) {
+		obj->locked = 1;
+	} else if (nosync) {
+		ret = -EBUSY;
+	} else {
+		XSEGLOG2(&lc, D, "Lock for %s is taken, waiting", target);
+		bio->next = NULL;
+		if (obj->waiters_tail)
+			__get_blocker_io(obj->waiters_tail)->next = pr;
+		else
+			obj->waiters = pr;
+		obj->waiters_tail = pr;
+		pthread_mutex_unlock(&memd->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&memd->lock);
+
+	blocker_io_done(peer, pr, ret);
+	return 0;
+}
+
+static int mem_unlock(struct peerd *peer, struct peer_req *pr, char *target,
+		int force)
+{
+	struct memd *memd = __get_memd(peer);
+	struct mem_object *obj;
+	struct peer_req *waiter = NULL;
+	char lock_name[BLOCKER_MAX_OBJ_NAME + BLOCKER_LOCK_SUFFIX_LEN + 1];
+	ssize_t ret = 0;
+
+	lock_object_name(lock_name, target);
+
+	pthread_mutex_lock(&memd->lock);
+	obj = find_object(memd, lock_name);
+	if (!obj || !obj->locked) {
+		ret = -ENOENT;
+	} else if (obj->waiters) {
+		/* hand the lock over to the first waiter */
+		waiter = obj->waiters;
+		obj->waiters = __get_blocker_io(waiter)->next;
+		if (!obj->waiters)
+			obj->waiters_tail = NULL;
+		__get_blocker_io(waiter)->next = NULL;
+	} else {
+		obj->locked = 0;
+	}
+	pthread_mutex_unlock(&memd->lock);
+
+	blocker_io_done(peer, pr, ret);
+	if (waiter)
+		blocker_io_done(peer, waiter, 0);
+	return 0;
+}
+
+/*
+ * This function substitutes the default generic_peerd_loop of peer.c.
+ * Apart from checking the ports, it also completes the delayed operations and
+ * does not sleep past the due time of the next one.
+ */
+static int memd_peerd_loop(void *arg)
+{
+	struct thread *t = (struct thread *) arg;
+	struct peerd *peer = t->peer;
+	char *id = t->arg;
+	struct xseg *xseg = peer->xseg;
+	xport portno_start = peer->portno_start;
+	xport portno_end = peer->portno_end;
+	pid_t pid = syscall(SYS_gettid);
+	uint64_t threshold = peer->threshold;
+	threshold /= (1 + portno_end - portno_start);
+	threshold += 1;
+	uint64_t loops, next;
+	int c;
+
+	XSEGLOG2(&lc, I, "%s has tid %u.\n", id, pid);
+	xseg_init_local_signal(xseg, peer->portno_start);
+	for (;!(isTerminate() && all_peer_reqs_free(peer));) {
+		for(loops = threshold; loops > 0; loops--) {
+			if (loops == 1)
+				xseg_prepare_wait(xseg, peer->portno_start);
+			c = delayed_drain(peer, &next);
+			c |= check_ports(peer, t);
+			if (c)
+				loops = threshold;
+		}
+		XSEGLOG2(&lc, I, "%s goes to sleep\n", id);
+		xseg_wait_signal(xseg, peer->sd, next ? next : 10000000UL);
+		xseg_cancel_wait(xseg, peer->portno_start);
+		XSEGLOG2(&lc, I, "%s woke up\n", id);
+	}
+	return 0;
+}
+
+static int mem_init(struct peerd *peer, int argc, char *argv[])
+{
+	struct blockerd *blocker = __get_blockerd(peer);
+	struct memd *memd;
+	unsigned long arena_size = MEMD_DEFAULT_ARENA_SIZE;
+	unsigned long chunk_size = MEMD_DEFAULT_CHUNK_SIZE;
+	unsigned long latency = 0, bandwidth = 0;
+
+	BEGIN_READ_ARGS(argc, argv);
+	READ_ARG_ULONG("--arena-size", arena_size);
+	READ_ARG_ULONG("--chunk-size", chunk_size);
+	READ_ARG_ULONG("--latency", latency);
+	READ_ARG_ULONG("--bandwidth", bandwidth);
+	END_READ_ARGS();
+
+	if (!chunk_size) {
+		XSEGLOG2(&lc, E, "Chunk size must be positive");
+		return -1;
+	}
+
+	memd = calloc(1, sizeof(struct memd));
+	if (!memd) {
+		perror("malloc");
+		return -1;
+	}
+	memd->latency = (uint64_t) latency * 1000;
+	memd->bandwidth = (uint64_t) bandwidth << 20;
+	memd->delayed = calloc(peer->nr_ops, sizeof(struct mem_delayed));
+	if (!memd->delayed) {
+		perror("malloc");
+		goto out_free;
+	}
+	memd->objects = xhash_new(3, 0, XHASH_STRING);
+	if (!memd->objects) {
+		XSEGLOG2(&lc, E, "Cannot allocate object hash table");
+		goto out_free;
+	}
+	if (arena_init(&memd->arena, (uint64_t) arena_size << 20,
+				(uint64_t) chunk_size << 10) < 0) {
+		XSEGLOG2(&lc, E, "Cannot initialize arena");
+		goto out_free;
+	}
+	pthread_mutex_init(&memd->lock, NULL);
+	blocker->priv = memd;
+	peer->peerd_loop = memd_peerd_loop;
+	return 0;
+
+out_free:
+	if (memd->objects)
+		xhash_free(memd->objects);
+	free(memd->delayed);
+	free(memd);
+	return -1;
+}
+
+static void mem_usage(void)
+{
+	fprintf(stderr, "Custom peer options:\n"
+		"  Option         | Default | \n"
+		"  --------------------------------------------\n"
+		"    --arena-size | %-7d | Arena size in MiB\n"
+		"    --chunk-size | %-7d | Allocation chunk size in KiB\n"
+		"    --latency    | 0       | Latency of each data op in us\n"
+		"    --bandwidth  | 0       | Bandwidth in MiB/s (0: unlimited)\n"
+		"\n", MEMD_DEFAULT_ARENA_SIZE, MEMD_DEFAULT_CHUNK_SIZE);
+}
+
+struct blocker_backend blocker_backend = {
+	.name = "mem",
+	.caps = BLOCKER_CAP_DISCARD,
+	.init = mem_init,
+	.usage = mem_usage,
+	.read = mem_read,
+	.write = mem_write,
+	.stat = mem_stat,
+	.remove = mem_remove,
+	.discard = mem_discard,
+	.lock = mem_lock,
+	.unlock = mem_unlock
+};
@@ -0,0 +1,697 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <xseg/xseg.h>
+#include <xseg/protocol.h>
+#include <peer.h>
+#include <hash.h>
+#include <blocker.h>
+
+/*
+ * The handlers below are state machines driven by the completions of the
+ * backend primitives (see blocker_io_done). Since a backend may complete an
+ * operation before the primitive returns, a handler must not touch the peer
+ * request after it has successfully issued a primitive.
+ */
+
+void custom_peer_usage()
+{
+	fprintf(stderr, "Blocker backend: %s\n", blocker_backend.name);
+	if (blocker_backend.usage)
+		blocker_backend.usage();
+}
+
+void blocker_io_done(struct peerd *peer, struct peer_req *pr, ssize_t ret)
+{
+	pr->retval = ret;
+	dispatch(peer, pr, pr->req, dispatch_internal);
+}
+
+static void blocker_finish(struct peerd *peer, struct peer_req *pr, int r)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+
+	free(bio->buf);
+	free(bio->second_name);
+	bio->buf = NULL;
+	bio->second_name = NULL;
+	bio->read = 0;
+
+	if (r < 0)
+		fail(peer, pr);
+	else
+		complete(peer, pr);
+}
+
+static void hash_object_name(char *hash_name, char *target)
+{
+	uint32_t pos = strlen(target);
+
+	strncpy(hash_name, target, pos);
+	strncpy(hash_name + pos, BLOCKER_HASH_SUFFIX, BLOCKER_HASH_SUFFIX_LEN);
+	pos += BLOCKER_HASH_SUFFIX_LEN;
+	hash_name[pos] = 0;
+}
+
+static int do_read(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	char *data = xseg_get_data(peer->xseg, req);
+
+	return blocker_backend.read(peer, pr, bio->obj_name,
+			data + req->serviced, req->size - req->serviced,
+			req->offset + req->serviced);
+}
+
+/*
+ * Read the whole range of the request from target into bio->buf, resubmitting
+ * short reads. Returns 1 when done, 0 if a read was issued and -1 on error.
+ */
+static int read_to_buf(struct peerd *peer, struct peer_req *pr, char *target)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+
+	if (bio->read >= req->size)
+		return 1;
+
+	if (blocker_backend.read(peer, pr, target, bio->buf + bio->read,
+				req->size - bio->read,
+				req->offset + bio->read) < 0) {
+		XSEGLOG2(&lc, E, "Reading of %s failed on read", target);
+		return -1;
+	}
+	return 0;
+}
+
+static void handle_read(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	char *data;
+
+	if (req->datalen < req->size) {
+		XSEGLOG2(&lc, E, "Request datalen is less than req size");
+		fail(peer, pr);
+		return;
+	}
+
+	if (bio->state == BLOCKER_ACCEPTED) {
+		if (!req->size) {
+			complete(peer, pr);
+			return;
+		}
+		bio->state = BLOCKER_READING;
+		XSEGLOG2(&lc, I, "Reading %s", bio->obj_name);
+		if (do_read(peer, pr) < 0) {
+			XSEGLOG2(&lc, E, "Reading of %s failed on read",
+					bio->obj_name);
+			fail(peer, pr);
+		}
+		return;
+	}
+
+	XSEGLOG2(&lc, I, "Reading of %s callback", bio->obj_name);
+	data = xseg_get_data(peer->xseg, req);
+	if (pr->retval > 0) {
+		req->serviced += pr->retval;
+	} else if (pr->retval == 0) {
+		XSEGLOG2(&lc, I, "Reading of %s reached end of file at "
+				"%llu bytes. Zeroing out rest", bio->obj_name,
+				(unsigned long long) req->serviced);
+		memset(data + req->serviced, 0, req->size - req->serviced);
+		req->serviced = req->size;
+	} else {
+		XSEGLOG2(&lc, E, "Reading of %s failed", bio->obj_name);
+		fail(peer, pr);
+		return;
+	}
+
+	if (req->serviced >= req->size) {
+		XSEGLOG2(&lc, I, "Reading of %s completed", bio->obj_name);
+		complete(peer, pr);
+		return;
+	}
+
+	XSEGLOG2(&lc, I, "Resubmitting read of %s", bio->obj_name);
+	if (do_read(peer, pr) < 0) {
+		XSEGLOG2(&lc, E, "Reading of %s failed on read", bio->obj_name);
+		fail(peer, pr);
+	}
+}
+
+static void handle_write(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	char *data;
+
+	if (req->datalen < req->size) {
+		XSEGLOG2(&lc, E, "Request datalen is less than req size");
+		fail(peer, pr);
+		return;
+	}
+
+	if (bio->state == BLOCKER_ACCEPTED) {
+		/* no FLUSH/FUA support yet */
+		if (!req->size) {
+			complete(peer, pr);
+			return;
+		}
+		bio->state = BLOCKER_WRITING;
+		XSEGLOG2(&lc, I, "Writing %s", bio->obj_name);
+		data = xseg_get_data(peer->xseg, req);
+		if (blocker_backend.write(peer, pr, bio->obj_name, data,
+					req->size, req->offset) < 0) {
+			XSEGLOG2(&lc, E, "Writing of %s failed on write",
+					bio->obj_name);
+			fail(peer, pr);
+		}
+		return;
+	}
+
+	XSEGLOG2(&lc, I, "Writing of %s callback", bio->obj_name);
+	if (pr->retval < 0) {
+		XSEGLOG2(&lc, E, "Writing of %s failed", bio->obj_name);
+		fail(peer, pr);
+		return;
+	}
+	XSEGLOG2(&lc, I, "Writing of %s completed", bio->obj_name);
+	req->serviced = req->size;
+	complete(peer, pr);
+}
+
+static void handle_info(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	struct xseg_reply_info *xinfo;
+	char buf[XSEG_MAX_TARGETLEN + 1];
+	char *target;
+	int r;
+
+	if (bio->state == BLOCKER_ACCEPTED) {
+		XSEGLOG2(&lc, I, "Getting info of %s", bio->obj_name);
+		bio->state = BLOCKER_STATING;
+		if (blocker_backend.stat(peer, pr, bio->obj_name,
+					&bio->size) < 0) {
+			XSEGLOG2(&lc, E, "Getting info of %s failed",
+					bio->obj_name);
+			fail(peer, pr);
+		}
+		return;
+	}
+
+	if (req->datalen < sizeof(struct xseg_reply_info)) {
+		target = xseg_get_target(peer->xseg, req);
+		strncpy(buf, target, req->targetlen);
+		r = xseg_resize_request(peer->xseg, req, req->targetlen,
+				sizeof(struct xseg_reply_info));
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Cannot resize request");
+			fail(peer, pr);
+			return;
+		}
+		target = xseg_get_target(peer->xseg, req);
+		strncpy(target, buf, req->targetlen);
+	}
+
+	xinfo = (struct xseg_reply_info *) xseg_get_data(peer->xseg, req);
+	if (pr->retval < 0) {
+		xinfo->size = 0;
+		XSEGLOG2(&lc, E, "Getting info of %s failed", bio->obj_name);
+		fail(peer, pr);
+		return;
+	}
+	xinfo->size = bio->size;
+	req->serviced = req->size;
+	XSEGLOG2(&lc, I, "Getting info of %s completed", bio->obj_name);
+	complete(peer, pr);
+}
+
+static void handle_delete(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+
+	if (bio->state == BLOCKER_ACCEPTED) {
+		XSEGLOG2(&lc, I, "Deleting %s", bio->obj_name);
+		bio->state = BLOCKER_PENDING;
+		if (blocker_backend.remove(peer, pr, bio->obj_name) < 0) {
+			XSEGLOG2(&lc, E, "Deletion of %s failed", bio->obj_name);
+			fail(peer, pr);
+		}
+		return;
+	}
+
+	if (pr->retval < 0) {
+		XSEGLOG2(&lc, E, "Deletion of %s failed", bio->obj_name);
+		fail(peer, pr);
+	} else {
+		XSEGLOG2(&lc, I, "Deletion of %s completed", bio->obj_name);
+		complete(peer, pr);
+	}
+}
+
+/*
+ * Discards are only a hint, so they complete without doing anything if the
+ * backend cannot free object ranges.
+ */
+static void handle_discard(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+
+	if (bio->state == BLOCKER_ACCEPTED) {
+		if (!(blocker_backend.caps & BLOCKER_CAP_DISCARD) ||
+				!req->size) {
+			req->serviced = req->size;
+			complete(peer, pr);
+			return;
+		}
+		XSEGLOG2(&lc, I, "Discarding %s", bio->obj_name);
+		bio->state = BLOCKER_PENDING;
+		if (blocker_backend.discard(peer, pr, bio->obj_name,
+					req->size, req->offset) < 0) {
+			XSEGLOG2(&lc, E, "Discard of %s failed", bio->obj_name);
+			fail(peer, pr);
+		}
+		return;
+	}
+
+	if (pr->retval < 0) {
+		XSEGLOG2(&lc, E, "Discard of %s failed", bio->obj_name);
+		fail(peer, pr);
+	} else {
+		XSEGLOG2(&lc, I, "Discard of %s completed", bio->obj_name);
+		req->serviced = req->size;
+		complete(peer, pr);
+	}
+}
+
+/*
+ * Copy is served by the backend if it supports server side copies. Otherwise
+ * the source range is streamed through a buffer: it is read in full, zero
+ * filled past the end of the source object, and written to the destination.
+ */
+static void handle_copy(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	struct xseg_request_copy *xcopy;
+	unsigned int end;
+	int r;
+
+	switch (bio->state) {
+	case BLOCKER_ACCEPTED:
+		if (!req->size) {
+			complete(peer, pr);
+			return;
+		}
+
+		xcopy = (struct xseg_request_copy *) xseg_get_data(peer->xseg, req);
+		bio->second_name = malloc(BLOCKER_MAX_OBJ_NAME + 1);
+		if (!bio->second_name) {
+			r = -1;
+			goto out;
+		}
+		end = (xcopy->targetlen > BLOCKER_MAX_OBJ_NAME) ?
+			BLOCKER_MAX_OBJ_NAME : xcopy->targetlen;
+		strncpy(bio->second_name, xcopy->target, end);
+		bio->second_name[end] = 0;
+		XSEGLOG2(&lc, I, "Copy of object %s to object %s started",
+				bio->second_name, bio->obj_name);
+
+		if (blocker_backend.caps & BLOCKER_CAP_COPY) {
+			bio->state = BLOCKER_COPYING;
+			if (blocker_backend.copy(peer, pr, bio->obj_name,
+					bio->second_name, req->size,
+					req->offset) < 0) {
+				r = -1;
+				goto out;
+			}
+			return;
+		}
+
+		bio->buf = malloc(req->size);
+		if (!bio->buf) {
+			r = -1;
+			goto out;
+		}
+		bio->state = BLOCKER_READING;
+		bio->read = 0;
+		if (read_to_buf(peer, pr, bio->second_name) < 0) {
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_READING:
+		if (pr->retval > 0) {
+			bio->read += pr->retval;
+		} else if (pr->retval == 0) {
+			memset(bio->buf + bio->read, 0, req->size - bio->read);
+			bio->read = req->size;
+		} else {
+			XSEGLOG2(&lc, E, "Reading of %s failed", bio->second_name);
+			r = -1;
+			goto out;
+		}
+
+		r = read_to_buf(peer, pr, bio->second_name);
+		if (r < 0)
+			goto out;
+		if (!r)
+			return;
+
+		bio->state = BLOCKER_WRITING;
+		XSEGLOG2(&lc, I, "Writing %s", bio->obj_name);
+		if (blocker_backend.write(peer, pr, bio->obj_name, bio->buf,
+					req->size, req->offset) < 0) {
+			XSEGLOG2(&lc, E, "Writing of %s failed on write",
+					bio->obj_name);
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_WRITING:
+	case BLOCKER_COPYING:
+		r = (pr->retval < 0) ? -1 : 0;
+		break;
+
+	default:
+		XSEGLOG2(&lc, E, "Unknown state");
+		r = -1;
+		break;
+	}
+
+out:
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Copy of object %s to object %s failed",
+				bio->second_name, bio->obj_name);
+	} else {
+		XSEGLOG2(&lc, I, "Copy of object %s to object %s completed",
+				bio->second_name, bio->obj_name);
+		req->serviced = req->size;
+	}
+	blocker_finish(peer, pr, r);
+}
+
+static int hash_reply(struct peerd *peer, struct peer_req *pr, char *hash)
+{
+	struct xseg_request *req = pr->req;
+	struct xseg_reply_hash *xreply;
+	int r;
+
+	r = xseg_resize_request(peer->xseg, req, req->targetlen,
+			sizeof(struct xseg_reply_hash));
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Resize request failed");
+		return -1;
+	}
+	xreply = (struct xseg_reply_hash *) xseg_get_data(peer->xseg, req);
+	strncpy(xreply->target, hash, HEXLIFIED_SHA256_DIGEST_SIZE);
+	xreply->targetlen = HEXLIFIED_SHA256_DIGEST_SIZE;
+	req->serviced = req->size;
+	return 0;
+}
+
+/*
+ * Hash the request range of an object and store it as a content-addressed
+ * object named after the hash:
+ *   PREHASHING: look for a precalculated hash in <target>_hash
+ *   READING: read the data and calculate its hash
+ *   STATING: check whether the hashed object already exists
+ *   WRITING: write the hashed object
+ *   POSTHASHING: store the precalculated hash
+ */
+static void handle_hash(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	char hash_name[BLOCKER_MAX_OBJ_NAME + BLOCKER_HASH_SUFFIX_LEN + 1];
+	int r;
+
+	switch (bio->state) {
+	case BLOCKER_ACCEPTED:
+		XSEGLOG2(&lc, I, "Starting hashing of object %s", bio->obj_name);
+		if (!req->size) {
+			fail(peer, pr);
+			return;
+		}
+		bio->second_name = malloc(HEXLIFIED_SHA256_DIGEST_SIZE + 1);
+		bio->buf = malloc(req->size);
+		if (!bio->second_name || !bio->buf) {
+			r = -1;
+			goto out;
+		}
+		bio->second_name[0] = 0;
+		bio->state = BLOCKER_PREHASHING;
+		hash_object_name(hash_name, bio->obj_name);
+		if (blocker_backend.read(peer, pr, hash_name, bio->second_name,
+					HEXLIFIED_SHA256_DIGEST_SIZE, 0) < 0) {
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_PREHASHING:
+		if (pr->retval == HEXLIFIED_SHA256_DIGEST_SIZE) {
+			bio->second_name[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+			XSEGLOG2(&lc, D, "Precalculated hash found");
+			r = hash_reply(peer, pr, bio->second_name);
+			goto out;
+		}
+		bio->state = BLOCKER_READING;
+		bio->read = 0;
+		XSEGLOG2(&lc, I, "Reading %s", bio->obj_name);
+		if (read_to_buf(peer, pr, bio->obj_name) < 0) {
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_READING:
+		if (pr->retval < 0) {
+			XSEGLOG2(&lc, E, "Reading of %s failed", bio->obj_name);
+			r = -1;
+			goto out;
+		}
+		bio->read += pr->retval;
+		if (pr->retval && bio->read < req->size) {
+			if (read_to_buf(peer, pr, bio->obj_name) < 0) {
+				r = -1;
+				goto out;
+			}
+			return;
+		}
+
+		bio->read = hash_object_data((unsigned char *) bio->buf,
+				bio->read, bio->second_name);
+		XSEGLOG2(&lc, I, "Calculated %s as hash of %s",
+				bio->second_name, bio->obj_name);
+		r = hash_reply(peer, pr, bio->second_name);
+		if (r < 0)
+			goto out;
+
+		bio->state = BLOCKER_STATING;
+		if (blocker_backend.stat(peer, pr, bio->second_name,
+					&bio->size) < 0) {
+			XSEGLOG2(&lc, E, "Stating %s failed", bio->second_name);
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_STATING:
+		if (pr->retval >= 0) {
+			XSEGLOG2(&lc, I, "Stating %s completed Successfully."
+					"No need to write.", bio->second_name);
+			r = 0;
+			goto out;
+		}
+		XSEGLOG2(&lc, I, "Stating %s failed. Writing.",
+				bio->second_name);
+		bio->state = BLOCKER_WRITING;
+		if (blocker_backend.write(peer, pr, bio->second_name, bio->buf,
+					bio->read, 0) < 0) {
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_WRITING:
+		if (pr->retval < 0) {
+			XSEGLOG2(&lc, E, "Writing of %s failed", bio->second_name);
+			r = -1;
+			goto out;
+		}
+		bio->state = BLOCKER_POSTHASHING;
+		hash_object_name(hash_name, bio->obj_name);
+		if (blocker_backend.write(peer, pr, hash_name, bio->second_name,
+					HEXLIFIED_SHA256_DIGEST_SIZE, 0) < 0) {
+			r = -1;
+			goto out;
+		}
+		return;
+
+	case BLOCKER_POSTHASHING:
+		/* the hash object is there, a missing prehash is not fatal */
+		if (pr->retval < 0)
+			XSEGLOG2(&lc, W, "Writing of prehash failed");
+		r = 0;
+		break;
+
+	default:
+		XSEGLOG2(&lc, E, "Unknown state");
+		r = -1;
+		break;
+	}
+
+out:
+	if (r < 0)
+		XSEGLOG2(&lc, E, "Hash of object %s failed", bio->obj_name);
+	else
+		XSEGLOG2(&lc, I, "Hash of object %s completed", bio->obj_name);
+	blocker_finish(peer, pr, r);
+}
+
+static void handle_lock_op(struct peerd *peer, struct peer_req *pr)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	struct xseg_request *req = pr->req;
+	int r;
+
+	if (bio->state == BLOCKER_ACCEPTED) {
+		bio->state = BLOCKER_PENDING;
+		if (req->op == X_ACQUIRE)
+			r = blocker_backend.lock(peer, pr, bio->obj_name,
+					req->flags & XF_NOSYNC);
+		else
+			r = blocker_backend.unlock(peer, pr, bio->obj_name,
+					req->flags & XF_FORCE);
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Lock op for %s failed", bio->obj_name);
+			fail(peer, pr);
+		}
+		return;
+	}
+
+	if (pr->retval < 0) {
+		XSEGLOG2(&lc, E, "Lock op for %s failed", bio->obj_name);
+		fail(peer, pr);
+	} else {
+		XSEGLOG2(&lc, I, "Successfull lock op for %s", bio->obj_name);
+		complete(peer, pr);
+	}
+}
+
+int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
+		enum dispatch_reason reason)
+{
+	struct blocker_io *bio = __get_blocker_io(pr);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	unsigned int end = (pr->req->targetlen > BLOCKER_MAX_OBJ_NAME) ?
+		BLOCKER_MAX_OBJ_NAME : pr->req->targetlen;
+
+	if (reason == dispatch_accept) {
+		/* leave the slower ops to the defer port, if there is one */
+		if ((req->op == X_DELETE || req->op == X_INFO ||
+					req->op == X_COPY) && canDefer(peer)) {
+			defer_request(peer, pr);
+			return 0;
+		}
+		strncpy(bio->obj_name, target, end);
+		bio->obj_name[end] = 0;
+		bio->state = BLOCKER_ACCEPTED;
+		bio->read = 0;
+	}
+
+	switch (pr->req->op) {
+		case X_READ:
+			handle_read(peer, pr); break;
+		case X_WRITE:
+			handle_write(peer, pr); break;
+		case X_DELETE:
+			handle_delete(peer, pr); break;
+		case X_INFO:
+			handle_info(peer, pr); break;
+		case X_COPY:
+			handle_copy(peer, pr); break;
+		case X_HASH:
+			handle_hash(peer, pr); break;
+		case X_DISCARD:
+			handle_discard(peer, pr); break;
+		case X_ACQUIRE:
+		case X_RELEASE:
+			handle_lock_op(peer, pr); break;
+		default:
+			fail(peer, pr);
+	}
+	return 0;
+}
+
+int custom_peer_init(struct peerd *peer, int argc, char *argv[])
+{
+	struct blockerd *blocker;
+	struct blocker_io *bio;
+	int i;
+
+	blocker = malloc(sizeof(struct blockerd));
+	if (!blocker) {
+		perror("malloc");
+		return -1;
+	}
+	blocker->backend = &blocker_backend;
+	blocker->priv = NULL;
+
+	for (i = 0; i < peer->nr_ops; i++) {
+		bio = calloc(1, sizeof(struct blocker_io));
+		if (!bio) {
+			perror("malloc");
+			goto out_free;
+		}
+		peer->peer_reqs[i].priv = (void *) bio;
+	}
+	peer->priv = (void *) blocker;
+
+	if (blocker_backend.init(peer, argc, argv) < 0) {
+		XSEGLOG2(&lc, E, "Could not initialize %s backend",
+				blocker_backend.name);
+		goto out_free;
+	}
+	return 0;
+
+out_free:
+	for (i = 0; i < peer->nr_ops; i++) {
+		free(peer->peer_reqs[i].priv);
+		peer->peer_reqs[i].priv = NULL;
+	}
+	free(blocker);
+	peer->priv = NULL;
+	return -1;
+}
+
+void custom_peer_finalize(struct peerd *peer)
+{
+	if (blocker_backend.finalize)
+		blocker_backend.finalize(peer);
+}
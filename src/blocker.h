@@ -0,0 +1,173 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCKER_H
+
+#define BLOCKER_H
+
+#include <peer.h>
+#include <hash.h>
+
+/*
+ * Blocker core.
+ *
+ * The blocker core implements the xseg side of a blocker (dispatch and the
+ * request state machines for read, write, info, delete, copy, hash, discard,
+ * acquire and release) on top of a small set of storage primitives provided by a
+ * backend. The backend is selected at link time: every backend defines the
+ * blocker_backend symbol and a blocker peer is built from peer.c, blocker.c
+ * and a single backend source file. archip-radosd (radosd.c) and archip-memd
+ * (blocker-mem.c) are built this way.
+ *
+ * filed is not. It serves requests synchronously from its peer threads,
+ * through its cache of open fds, and keeps its locks in lock files, which the
+ * asynchronous primitives below do not fit.
+ *
+ * All primitives are asynchronous. They return < 0 if the operation could not
+ * be issued, or 0 if it was, in which case the backend must later call
+ * blocker_io_done() exactly once with the result of the operation, from a peer
+ * thread. A backend may complete an operation before the primitive returns.
+ */
+
+#define BLOCKER_LOCK_SUFFIX "_lock"
+#define BLOCKER_LOCK_SUFFIX_LEN 5
+#define BLOCKER_HASH_SUFFIX "_hash"
+#define BLOCKER_HASH_SUFFIX_LEN 5
+#define BLOCKER_MAX_OBJ_NAME (XSEG_MAX_TARGETLEN + BLOCKER_LOCK_SUFFIX_LEN + 1)
+
+/* optional backend capabilities */
+#define BLOCKER_CAP_COPY	(1 << 0)	/* server side copy */
+#define BLOCKER_CAP_DISCARD	(1 << 1)	/* freeing of object ranges */
+
+struct blocker_backend {
+	const char *name;
+	uint32_t caps;
+
+	int (*init)(struct peerd *peer, int argc, char *argv[]);
+	void (*finalize)(struct peerd *peer);
+	void (*usage)(void);
+
+	/*
+	 * Read up to size bytes. Completes with the number of bytes read,
+	 * which is less than size (or 0) only if the end of the object was
+	 * reached, or with a negative error.
+	 */
+	int (*read)(struct peerd *peer, struct peer_req *pr, char *target,
+			char *buf, uint64_t size, uint64_t offset);
+	/* Write size bytes, creating the object. Completes with 0 or error */
+	int (*write)(struct peerd *peer, struct peer_req *pr, char *target,
+			char *buf, uint64_t size, uint64_t offset);
+	/* Store the size of an object in *size. Completes with 0 or error */
+	int (*stat)(struct peerd *peer, struct peer_req *pr, char *target,
+			uint64_t *size);
+	int (*remove)(struct peerd *peer, struct peer_req *pr, char *target);
+	/*
+	 * Take the lock of target. Unless nosync is set, wait until the lock
+	 * can be taken. Completes with 0 or error.
+	 */
+	int (*lock)(struct peerd *peer, struct peer_req *pr, char *target,
+			int nosync);
+	/* Release the lock of target, even if owned by others when force */
+	int (*unlock)(struct peerd *peer, struct peer_req *pr, char *target,
+			int force);
+
+	/* BLOCKER_CAP_COPY: copy size bytes from src to dst */
+	int (*copy)(struct peerd *peer, struct peer_req *pr, char *dst,
+			char *src, uint64_t size, uint64_t offset);
+	/*
+	 * BLOCKER_CAP_DISCARD: free size bytes of target at offset, so that
+	 * they read as zeros. A missing object is not an error. Completes
+	 * with 0 or error.
+	 */
+	int (*discard)(struct peerd *peer, struct peer_req *pr, char *target,
+			uint64_t size, uint64_t offset);
+};
+
+/*
+ * Allocated extents of an object.
+ *
+ * A client asks for the extents of an object that hold data with an X_INFO
+ * request whose data has room for a struct blocker_extents, with max_extents
+ * extents, right after the struct xseg_reply_info. It sets the magic to
+ * BLOCKER_EXTENTS_REQUEST and the range to query. A blocker that supports the
+ * query clamps the range to the object, fills in the extents in offset order,
+ * sets next to where a query for more extents should start (the end of the
+ * clamped range if there are no more) and the magic to BLOCKER_EXTENTS_REPLY.
+ * The rest of the range reads as zeros.
+ */
+#define BLOCKER_EXTENTS_REQUEST	0x514552544e545842ULL	/* "BXTNTREQ" */
+#define BLOCKER_EXTENTS_REPLY	0x504552544e545842ULL	/* "BXTNTREP" */
+
+struct blocker_extent {
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct blocker_extents {
+	uint64_t magic;
+	uint64_t offset;		/* range to query */
+	uint64_t length;
+	uint64_t next;
+	uint32_t max_extents;
+	uint32_t nr_extents;
+	struct blocker_extent extents[];
+};
+
+enum blocker_state {
+	BLOCKER_ACCEPTED = 0,
+	BLOCKER_PENDING = 1,
+	BLOCKER_READING = 2,
+	BLOCKER_WRITING = 3,
+	BLOCKER_STATING = 4,
+	BLOCKER_PREHASHING = 5,
+	BLOCKER_POSTHASHING = 6,
+	BLOCKER_COPYING = 7
+};
+
+/* per request state of the blocker core */
+struct blocker_io {
+	char obj_name[BLOCKER_MAX_OBJ_NAME + 1];
+	enum blocker_state state;
+	uint64_t size;
+	char *second_name, *buf;
+	uint64_t read;
+	/* link for backends that need to queue requests */
+	struct peer_req *next;
+	/* backend private data */
+	void *priv;
+};
+
+struct blockerd {
+	struct blocker_backend *backend;
+	void *priv;
+};
+
+extern struct blocker_backend blocker_backend;
+
+void blocker_io_done(struct peerd *peer, struct peer_req *pr, ssize_t ret);
+
+static inline struct blocker_io * __get_blocker_io(struct peer_req *pr)
+{
+	return (struct blocker_io *) pr->priv;
+}
+
+static inline struct blockerd * __get_blockerd(struct peerd *peer)
+{
+	return (struct blockerd *) peer->priv;
+}
+
+#endif /* end of BLOCKER_H */
@@ -0,0 +1,903 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host-local read cache of immutable blocks.
+ *
+ * cached sits in front of the blocker port (-bp) of a host, in place of the
+ * blocker as far as vlmcd and the mapper are concerned. Reads of hash-named
+ * objects, which never change, are served from a cache of fixed size blocks
+ * keyed by object name and block index, shared by all the volumes of the
+ * host. Everything else is passed through to the blocker untouched, so that
+ * nothing ever needs to be invalidated.
+ *
+ * A block that misses is fetched from the blocker once: reads that need it
+ * while it is being fetched wait for that fetch, so that a boot storm of
+ * clones of the same image costs one blocker read per block.
+ *
+ * A block is only admitted to the cache on its second miss (a doorkeeper
+ * bitmap, aged when half full), so that a single sequential scan does not
+ * evict the working set. Blocks evicted from memory may be kept in a direct
+ * mapped file on a local SSD (--ssd-path), which is checked before fetching.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+#include <xseg/protocol.h>
+#include <xseg/xcache.h>
+#include <peer.h>
+
+#define CACHED_BLOCK_SHIFT 17
+#define CACHED_BLOCK_SIZE (1UL << CACHED_BLOCK_SHIFT)
+/* a whole 4MB object */
+#define CACHED_MAX_BLOCKS 32
+#define CACHED_DEFAULT_SIZE 512		/* MiB */
+#define CACHED_DOORKEEPER_BITS (1UL << 20)
+#define HASH_NAME_LEN 64
+#define MAX_BLOCK_NAME (HASH_NAME_LEN + 1 + 16)
+
+enum block_state {
+	BLOCK_FETCHING = 0,
+	BLOCK_VALID = 1,
+	BLOCK_INVALID = 2
+};
+
+enum cio_state {
+	CIO_CACHED = 0,
+	CIO_PASSTHROUGH = 1
+};
+
+struct block_waiter {
+	struct peer_req *pr;
+	uint32_t idx;			/* block of the request it waits for */
+	struct block_waiter *next;
+};
+
+struct cache_block {
+	volatile enum block_state state;
+	struct block_waiter *waiters;
+	char name[MAX_BLOCK_NAME + 1];
+	uint64_t hash;
+	char *data;
+};
+
+/*
+ * A block of a cached read is either served from a cache entry (h), or read
+ * directly into the data of the request (breqs[i] with no h), when the block
+ * is not admitted or the cache has no free entry.
+ */
+struct cached_io {
+	enum cio_state state;
+	int err;
+	uint32_t nr_blocks;
+	uint32_t pending;		/* blocks not yet copied to the request */
+	uint64_t first;			/* first block of the request */
+	xcache_handler h[CACHED_MAX_BLOCKS];
+	struct xseg_request *breqs[CACHED_MAX_BLOCKS];
+	struct block_waiter waiters[CACHED_MAX_BLOCKS];
+	struct peer_req *next_done;
+};
+
+struct ssd_tier {
+	int fd;
+	uint64_t nr_slots;
+	/* name of the block in each slot, empty if none */
+	char (*names)[MAX_BLOCK_NAME + 1];
+	pthread_mutex_t lock;
+};
+
+struct cached {
+	xport bportno;
+	unsigned long cache_size;	/* MiB */
+	int no_admission;
+	struct xcache cache;
+	pthread_mutex_t lock;		/* protects the state of the blocks */
+	uint64_t *doorkeeper;
+	uint64_t doorkeeper_set;
+	struct ssd_tier *ssd;
+	int finalized;
+	/* counters, logged on exit */
+	uint64_t hits, misses, coalesced, ssd_hits, uncached, passthrough;
+};
+
+void custom_peer_usage()
+{
+	fprintf(stderr, "Custom peer options: \n"
+			"-bp : blocker port to cache\n"
+			"--cache-size : memory of the cache in MiB (default: %d)\n"
+			"--ssd-path : file of the SSD tier of the cache (default: none)\n"
+			"--ssd-size : size of the SSD tier in MiB\n"
+			"--no-admission : cache blocks on their first miss\n"
+			"\n", CACHED_DEFAULT_SIZE);
+}
+
+static inline struct cached * __get_cached(struct peerd *peer)
+{
+	return (struct cached *) peer->priv;
+}
+
+static inline struct cached_io * __get_cachedio(struct peer_req *pr)
+{
+	return (struct cached_io *) pr->priv;
+}
+
+static int is_hash_name(char *target, uint32_t targetlen)
+{
+	uint32_t i;
+
+	if (targetlen != HASH_NAME_LEN)
+		return 0;
+	for (i = 0; i < targetlen; i++) {
+		if (!((target[i] >= '0' && target[i] <= '9') ||
+					(target[i] >= 'a' && target[i] <= 'f')))
+			return 0;
+	}
+	return 1;
+}
+
+static void block_name(char *target, uint64_t block, char *name)
+{
+	snprintf(name, MAX_BLOCK_NAME + 1, "%.*s_%llx", HASH_NAME_LEN, target,
+			(unsigned long long)block);
+}
+
+/* The name is a sha256, so its first bits are as good as any hash of it */
+static uint64_t block_hash(char *target, uint64_t block)
+{
+	uint64_t h = 0;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		h = (h << 4) | (target[i] <= '9' ? target[i] - '0' :
+				target[i] - 'a' + 10);
+	return h ^ ((block + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Must be called with the lock held */
+static int admit_block(struct cached *cached, char *target, uint64_t block)
+{
+	uint64_t bit = block_hash(target, block) % CACHED_DOORKEEPER_BITS;
+	uint64_t mask = 1ULL << (bit % 64);
+
+	if (cached->no_admission)
+		return 1;
+	if (cached->doorkeeper[bit / 64] & mask)
+		return 1;
+
+	cached->doorkeeper[bit / 64] |= mask;
+	if (++cached->doorkeeper_set > CACHED_DOORKEEPER_BITS / 2) {
+		memset(cached->doorkeeper, 0, CACHED_DOORKEEPER_BITS / 8);
+		cached->doorkeeper_set = 0;
+	}
+	return 0;
+}
+
+static int ssd_read(struct ssd_tier *ssd, char *name, uint64_t hash,
+		char *data)
+{
+	uint64_t slot = hash % ssd->nr_slots;
+	ssize_t r;
+
+	pthread_mutex_lock(&ssd->lock);
+	if (strcmp(ssd->names[slot], name)) {
+		pthread_mutex_unlock(&ssd->lock);
+		return -1;
+	}
+	r = pread(ssd->fd, data, CACHED_BLOCK_SIZE, slot * CACHED_BLOCK_SIZE);
+	pthread_mutex_unlock(&ssd->lock);
+
+	return r == CACHED_BLOCK_SIZE ? 0 : -1;
+}
+
+static void ssd_write(struct ssd_tier *ssd, char *name, uint64_t hash,
+		char *data)
+{
+	uint64_t slot = hash % ssd->nr_slots;
+	ssize_t r;
+
+	pthread_mutex_lock(&ssd->lock);
+	if (!strcmp(ssd->names[slot], name)) {
+		pthread_mutex_unlock(&ssd->lock);
+		return;
+	}
+	ssd->names[slot][0] = 0;
+	r = pwrite(ssd->fd, data, CACHED_BLOCK_SIZE, slot * CACHED_BLOCK_SIZE);
+	if (r == CACHED_BLOCK_SIZE)
+		strcpy(ssd->names[slot], name);
+	pthread_mutex_unlock(&ssd->lock);
+}
+
+static struct ssd_tier *ssd_init(char *path, unsigned long size)
+{
+	struct ssd_tier *ssd = malloc(sizeof(struct ssd_tier));
+
+	if (!ssd)
+		return NULL;
+	ssd->nr_slots = ((uint64_t)size << 20) / CACHED_BLOCK_SIZE;
+	if (!ssd->nr_slots) {
+		XSEGLOG2(&lc, E, "SSD tier of %lu MiB is too small", size);
+		goto out_free;
+	}
+	ssd->names = calloc(ssd->nr_slots, sizeof(*ssd->names));
+	if (!ssd->names) {
+		XSEGLOG2(&lc, E, "Cannot allocate the index of the SSD tier");
+		goto out_free;
+	}
+	/* Its contents are not trusted across restarts, the index is lost */
+	ssd->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (ssd->fd < 0) {
+		XSEGLOG2(&lc, E, "Cannot open %s: %s", path, strerror(errno));
+		goto out_names;
+	}
+	if (ftruncate(ssd->fd, ssd->nr_slots * CACHED_BLOCK_SIZE) < 0) {
+		XSEGLOG2(&lc, E, "Cannot resize %s: %s", path, strerror(errno));
+		close(ssd->fd);
+		goto out_names;
+	}
+	pthread_mutex_init(&ssd->lock, NULL);
+	return ssd;
+
+out_names:
+	free(ssd->names);
+out_free:
+	free(ssd);
+	return NULL;
+}
+
+/* cache ops */
+static void * cache_node_init(void *p, void *xh)
+{
+	struct cache_block *block = malloc(sizeof(struct cache_block));
+
+	if (!block)
+		return NULL;
+	block->data = malloc(CACHED_BLOCK_SIZE);
+	if (!block->data) {
+		free(block);
+		return NULL;
+	}
+	block->state = BLOCK_INVALID;
+	block->waiters = NULL;
+	return block;
+}
+
+static int cache_init(void *p, void *e)
+{
+	struct cache_block *block = (struct cache_block *)e;
+
+	block->state = BLOCK_FETCHING;
+	block->waiters = NULL;
+	return 0;
+}
+
+/*
+ * Called when the last reference to an evicted block is dropped, so nothing
+ * else uses it. Valid blocks are kept in the SSD tier, if any.
+ */
+static void cache_put(void *p, void *e)
+{
+	struct peerd *peer = (struct peerd *)p;
+	struct cached *cached = __get_cached(peer);
+	struct cache_block *block = (struct cache_block *)e;
+
+	if (block->state == BLOCK_VALID && cached->ssd)
+		ssd_write(cached->ssd, block->name, block->hash, block->data);
+	block->state = BLOCK_INVALID;
+	block->waiters = NULL;
+}
+
+static void put_handlers(struct cached *cached, struct cached_io *cio)
+{
+	uint32_t i;
+
+	for (i = 0; i < cio->nr_blocks; i++) {
+		if (cio->h[i] != NoEntry)
+			xcache_put(&cached->cache, cio->h[i]);
+		cio->h[i] = NoEntry;
+	}
+}
+
+static void finish_done(struct peerd *peer, struct peer_req *done)
+{
+	struct cached *cached = __get_cached(peer);
+	struct cached_io *cio;
+	struct peer_req *pr;
+
+	while (done) {
+		pr = done;
+		cio = __get_cachedio(pr);
+		done = cio->next_done;
+		cio->next_done = NULL;
+		put_handlers(cached, cio);
+		if (cio->err) {
+			fail(peer, pr);
+		} else {
+			pr->req->serviced = pr->req->size;
+			complete(peer, pr);
+		}
+	}
+}
+
+/* Must be called with the lock held */
+static void __put_pending(struct peer_req *pr, struct peer_req **done)
+{
+	struct cached_io *cio = __get_cachedio(pr);
+
+	if (--cio->pending)
+		return;
+	cio->next_done = *done;
+	*done = pr;
+}
+
+/* The part of block idx of the request that the request covers */
+static void block_range(struct peer_req *pr, uint32_t idx, uint64_t *lo,
+		uint64_t *hi)
+{
+	struct cached_io *cio = __get_cachedio(pr);
+	struct xseg_request *req = pr->req;
+	uint64_t start = (cio->first + idx) << CACHED_BLOCK_SHIFT;
+	uint64_t end = start + CACHED_BLOCK_SIZE;
+
+	*lo = req->offset > start ? req->offset : start;
+	*hi = req->offset + req->size < end ? req->offset + req->size : end;
+}
+
+static void copy_block(struct peerd *peer, struct peer_req *pr, uint32_t idx,
+		char *block_data)
+{
+	struct cached_io *cio = __get_cachedio(pr);
+	char *data = xseg_get_data(peer->xseg, pr->req);
+	uint64_t start = (cio->first + idx) << CACHED_BLOCK_SHIFT;
+	uint64_t lo, hi;
+
+	block_range(pr, idx, &lo, &hi);
+	memcpy(data + (lo - pr->req->offset), block_data + (lo - start), hi - lo);
+}
+
+/*
+ * Serve the waiters of a block that was fetched, or fail them if the fetch
+ * failed. Must be called with the lock held.
+ */
+static void __wake_waiters(struct peerd *peer, struct cache_block *block,
+		struct peer_req **done)
+{
+	struct block_waiter *w, *next;
+
+	for (w = block->waiters; w; w = next) {
+		next = w->next;
+		if (block->state == BLOCK_VALID)
+			copy_block(peer, w->pr, w->idx, block->data);
+		else
+			__get_cachedio(w->pr)->err = 1;
+		__put_pending(w->pr, done);
+	}
+	block->waiters = NULL;
+}
+
+/*
+ * Send a read of block idx of the request to the blocker. A direct read
+ * lands in the data of the request, a fetch in its own buffer.
+ */
+static int send_read(struct peerd *peer, struct peer_req *pr, uint32_t idx,
+		int direct)
+{
+	struct cached *cached = __get_cached(peer);
+	struct cached_io *cio = __get_cachedio(pr);
+	struct xseg_request *breq;
+	uint64_t offset, size, hi;
+	char *target;
+	xport p;
+	int r;
+
+	if (direct) {
+		block_range(pr, idx, &offset, &hi);
+		size = hi - offset;
+	} else {
+		offset = (cio->first + idx) << CACHED_BLOCK_SHIFT;
+		size = CACHED_BLOCK_SIZE;
+	}
+
+	breq = xseg_get_request(peer->xseg, pr->portno, cached->bportno,
+			X_ALLOC);
+	if (!breq) {
+		XSEGLOG2(&lc, E, "Cannot get request");
+		return -1;
+	}
+	r = xseg_prep_request(peer->xseg, breq, pr->req->targetlen, size);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot prepare request");
+		goto out_put;
+	}
+	target = xseg_get_target(peer->xseg, breq);
+	strncpy(target, xseg_get_target(peer->xseg, pr->req),
+			pr->req->targetlen);
+	breq->op = X_READ;
+	breq->offset = offset;
+	breq->size = size;
+	if (direct)
+		breq->data = pr->req->data + (offset - pr->req->offset);
+
+	r = xseg_set_req_data(peer->xseg, breq, pr);
+	if (r < 0)
+		goto out_put;
+	cio->breqs[idx] = breq;
+	peer_trace(pr, breq, PEER_TRACE_SUBMIT);
+	p = xseg_submit(peer->xseg, breq, pr->portno, X_ALLOC);
+	if (p == NoPort) {
+		void *dummy;
+		cio->breqs[idx] = NULL;
+		xseg_get_req_data(peer->xseg, breq, &dummy);
+		goto out_put;
+	}
+	r = xseg_signal(peer->xseg, p);
+	if (r < 0)
+		XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+	return 0;
+
+out_put:
+	xseg_put_request(peer->xseg, breq, pr->portno);
+	return -1;
+}
+
+static void fetch_failed(struct peerd *peer, struct cache_block *block)
+{
+	struct cached *cached = __get_cached(peer);
+	struct peer_req *done = NULL;
+
+	pthread_mutex_lock(&cached->lock);
+	block->state = BLOCK_INVALID;
+	__wake_waiters(peer, block, &done);
+	pthread_mutex_unlock(&cached->lock);
+
+	xcache_invalidate(&cached->cache, block->name);
+	finish_done(peer, done);
+}
+
+/*
+ * Look up a block of a read, and insert it as being fetched if it is
+ * admitted. Returns NoEntry if the block is to be read directly, and sets
+ * fetch if the caller is the one to fetch it.
+ */
+static xcache_handler get_block(struct peerd *peer, char *target,
+		uint64_t block, int *fetch)
+{
+	struct cached *cached = __get_cached(peer);
+	struct cache_block *e;
+	char name[MAX_BLOCK_NAME + 1];
+	xcache_handler h, nh;
+	int admit;
+
+	*fetch = 0;
+	block_name(target, block, name);
+	h = xcache_lookup(&cached->cache, name);
+	if (h != NoEntry)
+		return h;
+
+	pthread_mutex_lock(&cached->lock);
+	admit = admit_block(cached, target, block);
+	pthread_mutex_unlock(&cached->lock);
+	if (!admit)
+		return NoEntry;
+
+	h = xcache_alloc_init(&cached->cache, name);
+	if (h == NoEntry) {
+		XSEGLOG2(&lc, D, "No free cache entry for %s", name);
+		return NoEntry;
+	}
+	e = xcache_get_entry(&cached->cache, h);
+	strcpy(e->name, name);
+	e->hash = block_hash(target, block);
+	if (cached->ssd && !ssd_read(cached->ssd, e->name, e->hash, e->data)) {
+		e->state = BLOCK_VALID;
+		__sync_fetch_and_add(&cached->ssd_hits, 1);
+	} else {
+		*fetch = 1;
+	}
+
+	nh = xcache_insert(&cached->cache, h);
+	if (nh != h) {
+		/* someone else inserted it meanwhile */
+		xcache_put(&cached->cache, h);
+		*fetch = 0;
+	}
+	return nh;
+}
+
+static int handle_read(struct peerd *peer, struct peer_req *pr)
+{
+	struct cached *cached = __get_cached(peer);
+	struct cached_io *cio = __get_cachedio(pr);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	struct peer_req *done = NULL;
+	struct cache_block *e;
+	xcache_handler h;
+	uint32_t i;
+	int fetch;
+
+	/* the extra pending block keeps the request until all are sent */
+	cio->pending = 1;
+	for (i = 0; i < cio->nr_blocks; i++) {
+		h = get_block(peer, target, cio->first + i, &fetch);
+		if (h == NoEntry)
+			goto direct;
+
+		e = xcache_get_entry(&cached->cache, h);
+		pthread_mutex_lock(&cached->lock);
+		if (e->state == BLOCK_INVALID) {
+			/* its fetch failed, do not retry it through the cache */
+			pthread_mutex_unlock(&cached->lock);
+			xcache_put(&cached->cache, h);
+			goto direct;
+		}
+		cio->h[i] = h;
+		if (e->state == BLOCK_VALID) {
+			copy_block(peer, pr, i, e->data);
+			cached->hits++;
+		} else {
+			cio->waiters[i].pr = pr;
+			cio->waiters[i].idx = i;
+			cio->waiters[i].next = e->waiters;
+			e->waiters = &cio->waiters[i];
+			cio->pending++;
+			if (fetch)
+				cached->misses++;
+			else
+				cached->coalesced++;
+		}
+		pthread_mutex_unlock(&cached->lock);
+
+		if (fetch && send_read(peer, pr, i, 0) < 0) {
+			XSEGLOG2(&lc, E, "Cannot fetch %s", e->name);
+			fetch_failed(peer, e);
+		}
+		continue;
+
+direct:
+		pthread_mutex_lock(&cached->lock);
+		cio->pending++;
+		cached->uncached++;
+		pthread_mutex_unlock(&cached->lock);
+		if (send_read(peer, pr, i, 1) < 0) {
+			pthread_mutex_lock(&cached->lock);
+			cio->err = 1;
+			__put_pending(pr, &done);
+			pthread_mutex_unlock(&cached->lock);
+		}
+	}
+
+	pthread_mutex_lock(&cached->lock);
+	__put_pending(pr, &done);
+	pthread_mutex_unlock(&cached->lock);
+	finish_done(peer, done);
+	return 0;
+}
+
+static int handle_read_reply(struct peerd *peer, struct peer_req *pr,
+		struct xseg_request *breq)
+{
+	struct cached *cached = __get_cached(peer);
+	struct cached_io *cio = __get_cachedio(pr);
+	struct peer_req *done = NULL;
+	struct cache_block *e;
+	int failed = !(breq->state & XS_SERVED);
+	char *data;
+	uint32_t i;
+
+	for (i = 0; i < cio->nr_blocks; i++) {
+		if (cio->breqs[i] == breq)
+			break;
+	}
+	if (i == cio->nr_blocks) {
+		XSEGLOG2(&lc, E, "Received unknown request %p", breq);
+		xseg_put_request(peer->xseg, breq, pr->portno);
+		return -1;
+	}
+	cio->breqs[i] = NULL;
+
+	if (failed)
+		XSEGLOG2(&lc, E, "Read of block %llu of request %p failed",
+				(unsigned long long)(cio->first + i), pr->req);
+
+	/* blockers read zeros past the end of an object */
+	data = xseg_get_data(peer->xseg, breq);
+	if (!failed && breq->serviced < breq->size)
+		memset(data + breq->serviced, 0, breq->size - breq->serviced);
+
+	if (cio->h[i] == NoEntry) {
+		xseg_put_request(peer->xseg, breq, pr->portno);
+		pthread_mutex_lock(&cached->lock);
+		if (failed)
+			cio->err = 1;
+		__put_pending(pr, &done);
+		pthread_mutex_unlock(&cached->lock);
+		finish_done(peer, done);
+		return 0;
+	}
+
+	e = xcache_get_entry(&cached->cache, cio->h[i]);
+	if (failed) {
+		xseg_put_request(peer->xseg, breq, pr->portno);
+		fetch_failed(peer, e);
+		return 0;
+	}
+	memcpy(e->data, data, CACHED_BLOCK_SIZE);
+	xseg_put_request(peer->xseg, breq, pr->portno);
+
+	pthread_mutex_lock(&cached->lock);
+	e->state = BLOCK_VALID;
+	__wake_waiters(peer, e, &done);
+	pthread_mutex_unlock(&cached->lock);
+	finish_done(peer, done);
+	return 0;
+}
+
+/* Send the request as is to the blocker, sharing its data */
+static int passthrough(struct peerd *peer, struct peer_req *pr)
+{
+	struct cached *cached = __get_cached(peer);
+	struct cached_io *cio = __get_cachedio(pr);
+	struct xseg_request *req = pr->req, *breq;
+	char *target;
+	xport p;
+	int r;
+
+	cio->state = CIO_PASSTHROUGH;
+	__sync_fetch_and_add(&cached->passthrough, 1);
+
+	breq = xseg_get_request(peer->xseg, pr->portno, cached->bportno,
+			X_ALLOC);
+	if (!breq) {
+		XSEGLOG2(&lc, E, "Cannot get request");
+		return -1;
+	}
+	r = xseg_prep_request(peer->xseg, breq, req->targetlen, req->datalen);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot prepare request");
+		goto out_put;
+	}
+	target = xseg_get_target(peer->xseg, breq);
+	strncpy(target, xseg_get_target(peer->xseg, req), req->targetlen);
+	breq->op = req->op;
+	breq->offset = req->offset;
+	breq->size = req->size;
+	breq->flags = req->flags;
+	breq->data = req->data;
+
+	r = xseg_set_req_data(peer->xseg, breq, pr);
+	if (r < 0)
+		goto out_put;
+	cio->breqs[0] = breq;
+	peer_trace(pr, breq, PEER_TRACE_SUBMIT);
+	p = xseg_submit(peer->xseg, breq, pr->portno, X_ALLOC);
+	if (p == NoPort) {
+		void *dummy;
+		xseg_get_req_data(peer->xseg, breq, &dummy);
+		goto out_put;
+	}
+	r = xseg_signal(peer->xseg, p);
+	if (r < 0)
+		XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+	return 0;
+
+out_put:
+	xseg_put_request(peer->xseg, breq, pr->portno);
+	return -1;
+}
+
+static int handle_passthrough_reply(struct peerd *peer, struct peer_req *pr,
+		struct xseg_request *breq)
+{
+	struct cached_io *cio = __get_cachedio(pr);
+	struct xseg_request *req = pr->req;
+	char buf[XSEG_MAX_TARGETLEN + 1];
+	char *target;
+	int r;
+
+	cio->breqs[0] = NULL;
+	if (!(breq->state & XS_SERVED)) {
+		xseg_put_request(peer->xseg, breq, pr->portno);
+		fail(peer, pr);
+		return 0;
+	}
+
+	/* the blocker resized its request (e.g. for a hash reply) */
+	if (breq->data != req->data) {
+		if (req->datalen < breq->datalen) {
+			target = xseg_get_target(peer->xseg, req);
+			strncpy(buf, target, req->targetlen);
+			r = xseg_resize_request(peer->xseg, req,
+					req->targetlen, breq->datalen);
+			if (r < 0) {
+				XSEGLOG2(&lc, E, "Cannot resize request");
+				xseg_put_request(peer->xseg, breq, pr->portno);
+				fail(peer, pr);
+				return 0;
+			}
+			target = xseg_get_target(peer->xseg, req);
+			strncpy(target, buf, req->targetlen);
+		}
+		memcpy(xseg_get_data(peer->xseg, req),
+				xseg_get_data(peer->xseg, breq), breq->datalen);
+	}
+	req->serviced = breq->serviced;
+	xseg_put_request(peer->xseg, breq, pr->portno);
+	complete(peer, pr);
+	return 0;
+}
+
+static int handle_accepted(struct peerd *peer, struct peer_req *pr)
+{
+	struct cached_io *cio = __get_cachedio(pr);
+	struct xseg_request *req = pr->req;
+	char *target = xseg_get_target(peer->xseg, req);
+	uint64_t last;
+	uint32_t i;
+
+	cio->err = 0;
+	cio->nr_blocks = 0;
+	cio->next_done = NULL;
+	if (req->op != X_READ || !req->size ||
+			!is_hash_name(target, req->targetlen))
+		goto out_passthrough;
+
+	cio->first = req->offset >> CACHED_BLOCK_SHIFT;
+	last = (req->offset + req->size - 1) >> CACHED_BLOCK_SHIFT;
+	if (last - cio->first >= CACHED_MAX_BLOCKS)
+		goto out_passthrough;
+
+	cio->state = CIO_CACHED;
+	cio->nr_blocks = last - cio->first + 1;
+	for (i = 0; i < cio->nr_blocks; i++) {
+		cio->h[i] = NoEntry;
+		cio->breqs[i] = NULL;
+	}
+	return handle_read(peer, pr);
+
+out_passthrough:
+	if (passthrough(peer, pr) < 0)
+		fail(peer, pr);
+	return 0;
+}
+
+int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
+		enum dispatch_reason reason)
+{
+	struct cached_io *cio = __get_cachedio(pr);
+
+	if (reason == dispatch_accept)
+		return handle_accepted(peer, pr);
+
+	if (cio->state == CIO_PASSTHROUGH)
+		return handle_passthrough_reply(peer, pr, req);
+	return handle_read_reply(peer, pr, req);
+}
+
+int custom_peer_init(struct peerd *peer, int argc, char *argv[])
+{
+	struct cached *cached = malloc(sizeof(struct cached));
+	struct cached_io *cio;
+	char ssd_path[XSEG_MAX_TARGETLEN + 1];
+	unsigned long ssd_size = 0;
+	uint64_t nr_blocks;
+	int i, r;
+	struct xcache_ops c_ops = {
+		.on_node_init = cache_node_init,
+		.on_init = cache_init,
+		.on_put = cache_put,
+	};
+
+	if (!cached) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return -1;
+	}
+	memset(cached, 0, sizeof(struct cached));
+	peer->priv = cached;
+	cached->bportno = NoPort;
+	cached->cache_size = CACHED_DEFAULT_SIZE;
+	pthread_mutex_init(&cached->lock, NULL);
+	ssd_path[0] = 0;
+
+	BEGIN_READ_ARGS(argc, argv);
+	READ_ARG_ULONG("-bp", cached->bportno);
+	READ_ARG_ULONG("--cache-size", cached->cache_size);
+	READ_ARG_STRING("--ssd-path", ssd_path, XSEG_MAX_TARGETLEN);
+	READ_ARG_ULONG("--ssd-size", ssd_size);
+	READ_ARG_BOOL("--no-admission", cached->no_admission);
+	END_READ_ARGS();
+
+	if (cached->bportno == NoPort) {
+		XSEGLOG2(&lc, E, "bportno must be provided");
+		usage(argv[0]);
+		return -1;
+	}
+
+	nr_blocks = ((uint64_t)cached->cache_size << 20) / CACHED_BLOCK_SIZE;
+	if (nr_blocks < CACHED_MAX_BLOCKS) {
+		XSEGLOG2(&lc, E, "Cache size must be at least %lu MiB",
+				(CACHED_MAX_BLOCKS * CACHED_BLOCK_SIZE) >> 20);
+		return -1;
+	}
+	if (nr_blocks < peer->nr_ops * CACHED_MAX_BLOCKS)
+		XSEGLOG2(&lc, W, "Cache of %llu blocks is smaller than nr_ops "
+				"requests may hold, some reads will bypass it",
+				(unsigned long long)nr_blocks);
+
+	cached->doorkeeper = calloc(CACHED_DOORKEEPER_BITS / 64,
+			sizeof(uint64_t));
+	if (!cached->doorkeeper) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return -1;
+	}
+
+	if (ssd_path[0]) {
+		cached->ssd = ssd_init(ssd_path, ssd_size);
+		if (!cached->ssd)
+			return -1;
+	}
+
+	for (i = 0; i < peer->nr_ops; i++) {
+		cio = malloc(sizeof(struct cached_io));
+		if (!cio) {
+			XSEGLOG2(&lc, E, "Out of memory");
+			return -1;
+		}
+		cio->nr_blocks = 0;
+		cio->next_done = NULL;
+		peer->peer_reqs[i].priv = cio;
+	}
+
+	r = xcache_init(&cached->cache, nr_blocks, &c_ops, XCACHE_LRU_HEAP,
+			peer);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot initialize a cache of %llu blocks",
+				(unsigned long long)nr_blocks);
+		return -1;
+	}
+
+	XSEGLOG2(&lc, I, "Caching blocker port %u in %llu blocks of %lu bytes",
+			cached->bportno, (unsigned long long)nr_blocks,
+			CACHED_BLOCK_SIZE);
+	return 0;
+}
+
+void custom_peer_finalize(struct peerd *peer)
+{
+	struct cached *cached = __get_cached(peer);
+
+	/* called by each thread */
+	pthread_mutex_lock(&cached->lock);
+	if (!cached->finalized) {
+		cached->finalized = 1;
+		XSEGLOG2(&lc, I, "Block hits: %llu, misses: %llu, coalesced: "
+				"%llu, SSD hits: %llu, uncached: %llu, "
+				"passed through: %llu",
+				(unsigned long long)cached->hits,
+				(unsigned long long)cached->misses,
+				(unsigned long long)cached->coalesced,
+				(unsigned long long)cached->ssd_hits,
+				(unsigned long long)cached->uncached,
+				(unsigned long long)cached->passthrough);
+	}
+	pthread_mutex_unlock(&cached->lock);
+}
@@ -29,7 +29,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <limits.h>
 #include <pthread.h>
 #include <syscall.h>
-#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/fs.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <peer.h>
 #include <openssl/sha.h>
 #include <sys/resource.h>
@@ -37,10 +44,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xseg.h>
 #include <xseg/protocol.h>
 #include <hash.h>
+#include <blocker.h>
 #include "filed.h"
 
 #define min(_a, _b) (_a < _b ? _a : _b)
 
+/* Reflink ioctls, missing from kernel headers older than 4.5 */
+#ifndef FICLONE
+struct file_clone_range {
+	int64_t src_fd;
+	uint64_t src_offset;
+	uint64_t src_length;
+	uint64_t dest_offset;
+};
+#define FICLONE		_IOW(0x94, 9, int)
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
 /*
  * Globals, holding command-line arguments
  */
@@ -54,6 +74,13 @@ void custom_peer_usage(char *argv0)
                 "    --archip    | None       | Archipelago directory\n"
                 "    --prefix    | None       | Common prefix of objects that should be stripped\n"
                 "    --uniquestr | None       | Unique string for this instance\n"
+                "    --lock-timeout | 0       | Seconds to wait for a held lock,\n"
+                "                   |         | 0 to wait forever\n"
+                "    --no-sparse | No         | Write zeros instead of punching holes\n"
+                "    --dir-hash  | sha256     | Hash placing objects in directories,\n"
+                "                |            | sha256 or fnv1a. Must be the same\n"
+                "                |            | for all peers sharing --archip,\n"
+                "                |            | so fnv1a is for new deployments\n"
                 "\n"
                );
 }
@@ -187,12 +214,49 @@ static int create_dir(char *path)
 	return 0;
 }
 
+/*
+ * Index of the leaf directory named by dirs in the leaf_dirs bitmap, or -1 if
+ * the name is not hex.
+ */
+static long leaf_dir_index(char dirs[6])
+{
+	long idx = 0;
+	int i, c;
+
+	for (i = 0; i < 6; i++) {
+		c = dirs[i];
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else
+			return -1;
+		idx = (idx << 4) | c;
+	}
+	return idx;
+}
+
 static int __create_path(char *buf, struct pfiled *pfiled, char dirs[6],
 			char *target, uint32_t targetlen, int mkdirs)
 {
 	int i, r;
 	char *path = pfiled->vpath;
 	uint32_t pathlen = pfiled->vpath_len;
+	long idx = -1;
+	uint64_t bit = 0;
+
+	/*
+	 * A leaf directory, once created or found, is remembered for the
+	 * lifetime of the peer, so that most paths need no stat() at all.
+	 */
+	if (mkdirs == 1 && pfiled->leaf_dirs) {
+		idx = leaf_dir_index(dirs);
+		if (idx >= 0) {
+			bit = 1ULL << (idx & 63);
+			if (pfiled->leaf_dirs[idx >> 6] & bit)
+				mkdirs = 0;
+		}
+	}
 
 	strncpy(buf, path, pathlen);
 
@@ -208,6 +272,8 @@ static int __create_path(char *buf, struct pfiled *pfiled, char dirs[6],
 			}
 		}
 	}
+	if (mkdirs == 1 && idx >= 0)
+		__sync_fetch_and_or(&pfiled->leaf_dirs[idx >> 6], bit);
 
 	strncpy(&buf[pathlen + 9], target, targetlen);
 	buf[pathlen + 9 + targetlen] = '\0';
@@ -215,13 +281,34 @@ static int __create_path(char *buf, struct pfiled *pfiled, char dirs[6],
 	return 0;
 }
 
+/* 64-bit FNV-1a */
+static uint64_t fnv1a(char *s, uint32_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 static int get_dirs_filed(char buf[6], struct pfiled *pfiled, char *target,
 				uint32_t targetlen)
 {
 	unsigned char sha[SHA256_DIGEST_SIZE];
 	char hex[HEXLIFIED_SHA256_DIGEST_SIZE];
+	uint64_t h;
 
-	SHA256((unsigned char *)target, targetlen, sha);
+	if (pfiled->dir_hash == DIR_HASH_FNV1A) {
+		h = fnv1a(target, targetlen);
+		sha[0] = h >> 56;
+		sha[1] = h >> 48;
+		sha[2] = h >> 40;
+	} else {
+		SHA256((unsigned char *)target, targetlen, sha);
+	}
 	hexlify(sha, 3, hex);
 	strncpy(buf, hex, 6);
 
@@ -236,23 +323,17 @@ static int get_dirs_pithos(char buf[6], struct pfiled *pfiled, char *target,
 				uint32_t targetlen)
 {
 	int ret, r, pithos_fd;
-	char *pithos_path=NULL, *filed_path=NULL;
+	char pithos_path[MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1];
+	char filed_path[MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1];
 	struct stat pithos_st, filed_st;
 
-	pithos_path = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1);
-	filed_path= malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1);
-	if (!pithos_path || !filed_path) {
-		ret = -ENOMEM;
-		goto out;
-	}
-
 	strncpy(buf, target, 6);
 	__create_path(pithos_path, pfiled, buf, target, targetlen, 0);
 
 	pithos_fd = open_file_read_path(pfiled, pithos_path);
 	if (pithos_fd < 0) {
-		ret = -errno;
-		goto out_free;
+		ret = pithos_fd;
+		goto out;
 	}
 	XSEGLOG2(&lc, I, "Found pithos file %s to on old path", pithos_path);
 
@@ -324,9 +405,6 @@ static int get_dirs_pithos(char buf[6], struct pfiled *pfiled, char *target,
 
 out_close_pithos:
 	close(pithos_fd);
-out_free:
-	free(pithos_path);
-	free(filed_path);
 out:
 	return ret;
 }
@@ -611,6 +689,142 @@ static ssize_t pfiled_write(struct pfiled *pfiled, int fd, void *data, size_t si
 	return filed_write(fd, data, size, offset, pfiled->directio);
 }
 
+/*
+ * Sparse objects
+ *
+ * Unless --no-sparse is given, writes of zeros punch holes in the object
+ * instead of writing, reads of holes are served without reading, and copies
+ * to empty objects skip the holes of the source.
+ */
+
+/*
+ * Check if a buffer is all zeros. Blocks of ZERO_CHECK_BLOCK bytes are ORed
+ * together with no branch and tested once, 16 bytes at a time with SSE2, so
+ * that data is rejected at its first block and zeros are scanned fast.
+ */
+#define ZERO_CHECK_BLOCK 4096
+
+static int is_zero(const char *data, uint64_t size)
+{
+	const uint64_t *w;
+	uint64_t i, j, n, acc;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vacc;
+
+	for (; size >= ZERO_CHECK_BLOCK; size -= ZERO_CHECK_BLOCK,
+			data += ZERO_CHECK_BLOCK) {
+		vacc = zero;
+		for (i = 0; i < ZERO_CHECK_BLOCK; i += 16)
+			vacc = _mm_or_si128(vacc,
+					_mm_loadu_si128((const __m128i *)(data + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(vacc, zero)) != 0xffff)
+			return 0;
+	}
+#endif
+
+	while (size && ((unsigned long)data & 7)) {
+		if (*data++)
+			return 0;
+		size--;
+	}
+
+	w = (const uint64_t *)data;
+	n = size / 8;
+	for (i = 0; i < n; i = j) {
+		acc = 0;
+		for (j = i; j < n && j < i + ZERO_CHECK_BLOCK / 8; j++)
+			acc |= w[j];
+		if (acc)
+			return 0;
+	}
+
+	data = (const char *)(w + n);
+	for (i = 0; i < size % 8; i++) {
+		if (data[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Make size bytes at offset read as zeros by punching a hole. Returns size, or
+ * -1 if they must be written instead.
+ */
+static ssize_t pfiled_write_zeros(struct pfiled *pfiled, int fd, size_t size,
+		off_t offset)
+{
+	struct stat st;
+	char zero = 0;
+
+	if (pfiled->punch_disabled)
+		return -1;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	/*
+	 * Holes do not extend the file, so write its last byte first. Unlike
+	 * ftruncate(), this cannot shrink the file if it is extended
+	 * meanwhile.
+	 */
+	if (st.st_size < offset + size &&
+			pfiled_write(pfiled, fd, &zero, 1, offset + size - 1) != 1)
+		return -1;
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset,
+				size) < 0) {
+		if (errno == EOPNOTSUPP) {
+			XSEGLOG2(&lc, W, "Filesystem cannot punch holes, "
+					"writing zeros");
+			pfiled->punch_disabled = 1;
+		}
+		return -1;
+	}
+	return size;
+}
+
+/* Check if size bytes at offset are all a hole, or past the end */
+static int is_hole(struct pfiled *pfiled, int fd, size_t size, off_t offset)
+{
+	off_t data;
+
+	if (pfiled->nosparse)
+		return 0;
+	data = lseek(fd, offset, SEEK_DATA);
+	if (data < 0)
+		return errno == ENXIO;
+	return data >= offset + size;
+}
+
+/*
+ * Find the first data extent of fd in [offset, end). Returns 0 and sets
+ * *start and *stop to it, or 1 if there is none. Without SEEK_DATA support,
+ * the whole range is one extent.
+ */
+static int next_data_extent(int fd, off_t offset, off_t end, off_t *start,
+		off_t *stop)
+{
+	off_t data, hole;
+
+	data = lseek(fd, offset, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+		return 1;
+	if (data < 0) {
+		*start = offset;
+		*stop = end;
+		return 0;
+	}
+	if (data >= end)
+		return 1;
+
+	hole = lseek(fd, data, SEEK_HOLE);
+	if (hole < 0 || hole > end)
+		hole = end;
+	*start = data;
+	*stop = hole;
+	return 0;
+}
+
 static ssize_t generic_io_path(char *path, void *data, size_t size, off_t offset, int write, int flags, mode_t mode)
 {
 	int fd;
@@ -733,7 +947,13 @@ static int open_file_path(struct pfiled *pfiled, char *path, int create)
 	if (pfiled->directio)
 		flags |= O_DIRECT;
 
-	fd = open(path, flags, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	/* Skip resolving the archipelago directory again */
+	if (pfiled->vpath_fd >= 0 &&
+			!strncmp(path, pfiled->vpath, pfiled->vpath_len))
+		fd = openat(pfiled->vpath_fd, path + pfiled->vpath_len, flags,
+				S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	else
+		fd = open(path, flags, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
 	if (fd < 0){
 		XSEGLOG2(&lc, E, "Could not open file %s. Error: %s", path, strerror_r(errno, error_str, 1023));
 		return -errno;
@@ -911,7 +1131,10 @@ static void handle_read(struct peerd *peer, struct peer_req *pr)
 
 	XSEGLOG2(&lc, D, "req->serviced: %llu, req->size: %llu", req->serviced,
 			req->size);
-	r = pfiled_read(pfiled, fd, data, req->size, req->offset);
+	if (is_hole(pfiled, fd, req->size, req->offset))
+		r = 0;
+	else
+		r = pfiled_read(pfiled, fd, data, req->size, req->offset);
 	if (r < 0) {
 		XSEGLOG2(&lc, E, "Cannot read");
 		req->serviced = 0;
@@ -979,7 +1202,12 @@ static void handle_write(struct peerd *peer, struct peer_req *pr)
 
 	XSEGLOG2(&lc, D, "req->serviced: %llu, req->size: %llu", req->serviced,
 			req->size);
-	r = pfiled_write(pfiled, fd, data, req->size, req->offset);
+	r = -1;
+	if (!pfiled->nosparse && req->size >= ZERO_PUNCH_MIN &&
+			is_zero(data, req->size))
+		r = pfiled_write_zeros(pfiled, fd, req->size, req->offset);
+	if (r < 0)
+		r = pfiled_write(pfiled, fd, data, req->size, req->offset);
 	if (r < 0) {
 		req->serviced = 0;
 	} else {
@@ -1007,6 +1235,99 @@ static void handle_write(struct peerd *peer, struct peer_req *pr)
 	return;
 }
 
+/*
+ * Punch a hole in the discarded range. Discards are only a hint, so a missing
+ * file, or a filesystem that cannot punch holes, is not an error.
+ */
+static void handle_discard(struct peerd *peer, struct peer_req *pr)
+{
+	struct pfiled *pfiled = __get_pfiled(peer);
+	struct fio *fio = __get_fio(pr);
+	struct xseg_request *req = pr->req;
+	char *target = xseg_get_target(peer->xseg, req);
+	int fd;
+
+	XSEGLOG2(&lc, I, "Handle discard started for pr: %p, req: %p",
+			pr, pr->req);
+
+	if (!req->size || pfiled->punch_disabled)
+		goto out;
+
+	fd = dir_open(pfiled, fio, target, req->targetlen, READ);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			goto out;
+		XSEGLOG2(&lc, E, "Open failed");
+		pfiled_fail(peer, pr);
+		return;
+	}
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				req->offset, req->size) < 0) {
+		if (errno != EOPNOTSUPP) {
+			XSEGLOG2(&lc, E, "Handle discard failed for pr: %p, "
+					"req: %p", pr, pr->req);
+			pfiled_fail(peer, pr);
+			return;
+		}
+		XSEGLOG2(&lc, W, "Filesystem cannot punch holes, "
+				"ignoring discards");
+		pfiled->punch_disabled = 1;
+	}
+out:
+	XSEGLOG2(&lc, I, "Handle discard completed for pr: %p, req: %p",
+			pr, pr->req);
+	req->serviced = req->size;
+	pfiled_complete(peer, pr);
+}
+
+/* Answer a query for the allocated extents, if the request has one */
+static void fill_extents(struct pfiled *pfiled, int fd,
+		struct xseg_request *req, char *data, uint64_t size)
+{
+	struct blocker_extents *xext;
+	off_t offset, end, start, stop;
+	uint64_t length;
+	uint32_t max;
+
+	if (req->datalen < sizeof(struct xseg_reply_info) +
+			sizeof(struct blocker_extents))
+		return;
+	xext = (struct blocker_extents *)(data + sizeof(struct xseg_reply_info));
+	if (xext->magic != BLOCKER_EXTENTS_REQUEST)
+		return;
+
+	max = (req->datalen - sizeof(struct xseg_reply_info) -
+			sizeof(struct blocker_extents)) /
+		sizeof(struct blocker_extent);
+	if (xext->max_extents < max)
+		max = xext->max_extents;
+
+	/* clamp the range to the object first, so that its end cannot wrap */
+	length = 0;
+	if (xext->offset < size) {
+		length = xext->length;
+		if (length > size - xext->offset)
+			length = size - xext->offset;
+	}
+	offset = xext->offset;
+	end = offset + length;
+	xext->nr_extents = 0;
+	while (offset < end && xext->nr_extents < max &&
+			!next_data_extent(fd, offset, end, &start, &stop)) {
+		xext->extents[xext->nr_extents].offset = start;
+		xext->extents[xext->nr_extents].length = stop - start;
+		xext->nr_extents++;
+		offset = stop;
+	}
+	/* continue from the next extent, or we are done */
+	if (offset < end && xext->nr_extents == max)
+		xext->next = offset;
+	else
+		xext->next = xext->offset + length;
+	xext->magic = BLOCKER_EXTENTS_REPLY;
+}
+
 static void handle_info(struct peerd *peer, struct peer_req *pr)
 {
 	struct pfiled *pfiled = __get_pfiled(peer);
@@ -1049,11 +1370,118 @@ static void handle_info(struct peerd *peer, struct peer_req *pr)
 
 	size = (uint64_t)stat.st_size;
 	xinfo->size = size;
+	fill_extents(pfiled, fd, req, data, size);
 
 	XSEGLOG2(&lc, I, "Handle info completed for pr: %p, req: %p", pr, pr->req);
 	pfiled_complete(peer, pr);
 }
 
+static const char *copy_method_names[NR_COPY_METHODS] = {
+	"reflink", "copy_file_range", "chunked copy"
+};
+
+/* Errors meaning that the filesystem cannot copy by a method at all */
+static int copy_unsupported(int err)
+{
+	return err == EOPNOTSUPP || err == ENOTTY || err == ENOSYS ||
+		err == EXDEV;
+}
+
+static void disable_copy_method(struct pfiled *pfiled, int method)
+{
+	if (pfiled->copy_disabled & (1 << method))
+		return;
+	__sync_fetch_and_or(&pfiled->copy_disabled, 1 << method);
+	XSEGLOG2(&lc, W, "Filesystem does not support %s, not trying it again",
+			copy_method_names[method]);
+}
+
+/*
+ * Make the first size bytes of dst share their extents with those of src.
+ * Either all of them are shared, or none.
+ */
+static int copy_reflink(struct pfiled *pfiled, int dst, int src, off_t size,
+		off_t src_size)
+{
+	struct file_clone_range range;
+	int r;
+
+	if (size == src_size) {
+		r = ioctl(dst, FICLONE, src);
+	} else {
+		/* Fails if size is not block aligned */
+		range.src_fd = src;
+		range.src_offset = 0;
+		range.src_length = size;
+		range.dest_offset = 0;
+		r = ioctl(dst, FICLONERANGE, &range);
+	}
+	if (r < 0 && copy_unsupported(errno))
+		disable_copy_method(pfiled, COPY_REFLINK);
+	return r;
+}
+
+static ssize_t __copy_file_range(int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out,
+			len, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * The following copy src to dst from offset c up to size, and return the
+ * offset up to which they copied.
+ */
+static off_t copy_range(struct pfiled *pfiled, int dst, int src, off_t c,
+		off_t size)
+{
+	loff_t in, out;
+	ssize_t bytes;
+
+	while (c < size) {
+		in = out = c;
+		bytes = __copy_file_range(src, &in, dst, &out, size - c, 0);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0 && copy_unsupported(errno))
+			disable_copy_method(pfiled, COPY_RANGE);
+		if (bytes <= 0)
+			break;
+		c += bytes;
+	}
+	return c;
+}
+
+static off_t copy_chunked(struct pfiled *pfiled, int dst, int src, off_t c,
+		off_t size)
+{
+	char *chunk;
+	ssize_t bytes, len;
+
+	/* aligned for --directio */
+	if (posix_memalign((void **)&chunk, 512, COPY_CHUNK_SIZE)) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return c;
+	}
+
+	while (c < size) {
+		len = min(size - c, COPY_CHUNK_SIZE);
+		bytes = pfiled_read(pfiled, src, chunk, len, c);
+		if (bytes <= 0)
+			break;
+		if (pfiled_write(pfiled, dst, chunk, bytes, c) != bytes)
+			break;
+		c += bytes;
+	}
+	free(chunk);
+	return c;
+}
+
 static void handle_copy(struct peerd *peer, struct peer_req *pr)
 {
 	struct pfiled *pfiled = __get_pfiled(peer);
@@ -1062,18 +1490,13 @@ static void handle_copy(struct peerd *peer, struct peer_req *pr)
 	char *target = xseg_get_target(peer->xseg, req);
 	char *data = xseg_get_data(peer->xseg, req);
 	struct xseg_request_copy *xcopy = (struct xseg_request_copy *)data;
-	struct stat st;
-	char *buf = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE);
+	struct stat st, dst_st;
 	int src = -1, dst = -1, r = -1;
-	ssize_t c = 0, bytes;
-	ssize_t limit = 0;
+	int method = COPY_REFLINK, sparse;
+	off_t c = 0, start, stop;
+	off_t limit = 0;
 
 	XSEGLOG2(&lc, I, "Handle copy started for pr: %p, req: %p", pr, pr->req);
-	if (!buf){
-		XSEGLOG2(&lc, E, "Out of memory");
-		pfiled_fail(peer, pr);
-		return;
-	}
 
 	r = is_target_valid_len(pfiled, xcopy->target, xcopy->targetlen, READ);
 	if (r < 0) {
@@ -1096,22 +1519,61 @@ static void handle_copy(struct peerd *peer, struct peer_req *pr)
 
 	r = fstat(src, &st);
 	if (r < 0){
-		XSEGLOG2(&lc, E, "fail in stat for src %s", buf);
+		XSEGLOG2(&lc, E, "fail in stat for src %.*s",
+				xcopy->targetlen, xcopy->target);
 		goto out;
 	}
 
-	c = 0;
-
+	/*
+	 * Try to share the extents of src first, which takes neither time nor
+	 * space, and then to let the kernel copy it, which also avoids the page
+	 * cache on filesystems that can copy by themselves. Each method picks
+	 * up where the previous one stopped.
+	 */
 	limit = min(req->size, st.st_size);
+	if (!(pfiled->copy_disabled & (1 << COPY_REFLINK)) &&
+			copy_reflink(pfiled, dst, src, limit, st.st_size) == 0)
+		c = limit;
+
+	/* Holes of src need not be copied to an empty dst */
+	sparse = c < limit && !pfiled->nosparse &&
+		fstat(dst, &dst_st) == 0 && dst_st.st_size == 0;
 	while (c < limit) {
-		bytes = sendfile(dst, src, NULL, limit - c);
-		if (bytes < 0) {
-			XSEGLOG2(&lc, E, "Copy failed for %s", buf);
-			r = -1;
-			goto out;
+		start = c;
+		stop = limit;
+		if (sparse && next_data_extent(src, c, limit, &start, &stop)) {
+			c = limit;
+			break;
 		}
-		c += bytes;
+		c = start;
+		if (!(pfiled->copy_disabled & (1 << COPY_RANGE))) {
+			method = COPY_RANGE;
+			c = copy_range(pfiled, dst, src, c, stop);
+		}
+		if (c < stop) {
+			method = COPY_CHUNKED;
+			c = copy_chunked(pfiled, dst, src, c, stop);
+		}
+		if (c < stop)
+			break;
+	}
+	/* A trailing hole must still count in the size of dst */
+	if (sparse && c == limit && limit && (fstat(dst, &dst_st) < 0 ||
+			dst_st.st_size < limit)) {
+		if (pfiled_write(pfiled, dst, "", 1, limit - 1) != 1)
+			c = limit - 1;
+	}
+	if (c < limit) {
+		XSEGLOG2(&lc, E, "Copy failed for %.*s after %lld bytes",
+				xcopy->targetlen, xcopy->target,
+				(long long)c);
+		r = -1;
+		goto out;
 	}
+	__sync_fetch_and_add(&pfiled->copies[method], 1);
+	XSEGLOG2(&lc, I, "Copied %lld bytes of %.*s by %s", (long long)c,
+			xcopy->targetlen, xcopy->target,
+			copy_method_names[method]);
 	r = 0;
 
 out:
@@ -1121,7 +1583,6 @@ out:
 
 	if (src > 0)
 		close(src);
-	free(buf);
 	if (r < 0) {
 		XSEGLOG2(&lc, E, "Handle copy failed for pr: %p, req: %p", pr, pr->req);
 		pfiled_fail(peer, pr);
@@ -1274,7 +1735,6 @@ static void handle_hash(struct peerd *peer, struct peer_req *pr)
 	char name[XSEG_MAX_TARGETLEN + 1];
 
 	unsigned char *object_data = NULL;
-	unsigned char sha[SHA256_DIGEST_SIZE];
 	struct xseg_reply_hash *xreply;
 
 	target = xseg_get_target(peer->xseg, req);
@@ -1333,23 +1793,12 @@ static void handle_hash(struct peerd *peer, struct peer_req *pr)
 		r = -1;
 		goto out;
 	}
-	sum = c;
-
-	//rstrip here in case zeros were written in the end
-	trailing_zeros = 0;
-	for (;trailing_zeros < sum; trailing_zeros++)
-		if (object_data[sum - trailing_zeros - 1])
-			break;
+	//calculate hash name, stripping trailing zeros
+	sum = hash_object_data(object_data, c, hash_name);
+	trailing_zeros = c - sum;
 
 	XSEGLOG2(&lc, D, "Read %llu, Trainling zeros %llu",
-			sum, trailing_zeros);
-
-	sum -= trailing_zeros;
-	//calculate hash name
-	SHA256(object_data, sum, sha);
-
-	hexlify(sha, SHA256_DIGEST_SIZE, hash_name);
-	hash_name[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+			c, trailing_zeros);
 
 
 	r = create_path(pathname, pfiled, hash_name, HEXLIFIED_SHA256_DIGEST_SIZE, 1);
@@ -1501,11 +1950,9 @@ out:
 	return ret;
 }
 
-static int __try_lock(struct pfiled *pfiled, char *tmpfile, char *lockfile,
-			uint32_t flags, int fd)
+static int __write_lock_id(struct pfiled *pfiled, int fd)
 {
-	int r, direct;
-	XSEGLOG2(&lc, D, "Started. Lockfile: %s, Tmpfile:%s", lockfile, tmpfile);
+	int r;
 
 	r = pfiled_write(pfiled, fd, pfiled->uniquestr, pfiled->uniquestr_len, 0);
 	if (r < 0 || r < pfiled->uniquestr_len) {
@@ -1515,9 +1962,17 @@ static int __try_lock(struct pfiled *pfiled, char *tmpfile, char *lockfile,
 	if (r < 0) {
 		return -1;
 	}
+	return 0;
+}
 
-	direct = pfiled->directio;
-//	direct = 0;
+/*
+ * Try once to take the lock, by linking the tmpfile to the lockfile.
+ * Returns 0 if we hold the lock, 1 if someone else does, -1 on error.
+ */
+static int __try_lock(struct pfiled *pfiled, char *tmpfile, char *lockfile)
+{
+	int r;
+	XSEGLOG2(&lc, D, "Started. Lockfile: %s, Tmpfile:%s", lockfile, tmpfile);
 
 	while (link(tmpfile, lockfile) < 0) {
 		//actual error
@@ -1526,21 +1981,292 @@ static int __try_lock(struct pfiled *pfiled, char *tmpfile, char *lockfile,
 					tmpfile, lockfile);
 			return -1;
 		}
-		r = __locked_by(lockfile, pfiled->uniquestr, pfiled->uniquestr_len, direct);
+		r = __locked_by(lockfile, pfiled->uniquestr,
+				pfiled->uniquestr_len, pfiled->directio);
 		if (!r) {
 			break;
 		}
-		if (flags & XF_NOSYNC) {
-			XSEGLOG2(&lc, D, "Could not get lock file %s, "
-					"XF_NOSYNC set. Aborting", lockfile);
-			return -1;
+		/* retry if the lock file was just removed */
+		if (r != -2) {
+			XSEGLOG2(&lc, D, "Lockfile %s held", lockfile);
+			return 1;
 		}
-		sleep(1);
 	}
 	XSEGLOG2(&lc, D, "Finished. Lockfile: %s", lockfile);
 	return 0;
 }
 
+static uint64_t lock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Lock waits
+ *
+ * A request that finds its lock held does not keep its peer thread. It is
+ * parked on the waiters list, with its tmpfile, and its peer thread goes on
+ * serving other requests. A waiter is marked ready when the lock is released
+ * by this peer (handle_release), when the lock watcher thread sees the lock
+ * file removed through inotify, or when it is time to poll the lock again or
+ * to give up. Marked waiters are retried by the peer threads, from their loop
+ * (see filed_peerd_loop), so that the requests are only ever handled by peer
+ * threads.
+ */
+
+/* Must be called with lock_mutex held */
+static void __mark_ready(struct pfiled *pfiled, struct lock_waiter *w)
+{
+	if (w->ready)
+		return;
+	w->ready = 1;
+	pfiled->lock_ready++;
+}
+
+/*
+ * Watch the directory of the lock file of w for its removal. Adding the watch
+ * of a directory that is already watched returns its existing wd.
+ *
+ * Must be called with lock_mutex held, so that the watch cannot be removed by
+ * __unwatch() before w is on the waiters list.
+ */
+static void __watch(struct pfiled *pfiled, struct lock_waiter *w)
+{
+	char *slash = strrchr(w->lockfile, '/');
+
+	w->wd = -1;
+	if (pfiled->inotify_fd < 0 || pfiled->finalized || !slash)
+		return;
+	*slash = 0;
+	w->wd = inotify_add_watch(pfiled->inotify_fd, w->lockfile,
+			IN_DELETE|IN_MOVED_FROM);
+	*slash = '/';
+	if (w->wd < 0)
+		XSEGLOG2(&lc, W, "Cannot watch lock %s, polling it", w->name);
+}
+
+/*
+ * Remove the watch of w, unless another waiter still uses it. w must not be on
+ * the waiters list.
+ *
+ * Must be called with lock_mutex held.
+ */
+static void __unwatch(struct pfiled *pfiled, struct lock_waiter *w)
+{
+	struct lock_waiter *o;
+
+	if (w->wd < 0 || pfiled->finalized)
+		return;
+	/* The watch of a directory is shared by all its waiters */
+	for (o = pfiled->lock_waiters; o; o = o->next) {
+		if (o->wd == w->wd)
+			return;
+	}
+	inotify_rm_watch(pfiled->inotify_fd, w->wd);
+}
+
+static void lock_wait_done(struct peerd *peer, struct lock_waiter *w, int ret)
+{
+	struct pfiled *pfiled = __get_pfiled(peer);
+	struct peer_req *pr = w->pr;
+
+	pthread_mutex_lock(&pfiled->lock_mutex);
+	__unwatch(pfiled, w);
+	pthread_mutex_unlock(&pfiled->lock_mutex);
+
+	if (close(w->fd) < 0)
+		XSEGLOG2(&lc, W, "Error closing %s", w->tmpfile);
+	if (unlink(w->tmpfile) < 0)
+		XSEGLOG2(&lc, E, "Error unlinking %s", w->tmpfile);
+
+	if (ret < 0) {
+		XSEGLOG2(&lc, I, "Failed to acquire lock %s", w->name);
+		pfiled_fail(peer, pr);
+	} else {
+		XSEGLOG2(&lc, I, "Acquired lock %s", w->name);
+		pfiled_complete(peer, pr);
+	}
+	free(w);
+}
+
+/* Put w on the waiters list, watching its lock file */
+static void lock_queue(struct pfiled *pfiled, struct lock_waiter *w)
+{
+	pthread_mutex_lock(&pfiled->lock_mutex);
+	__watch(pfiled, w);
+	w->next = pfiled->lock_waiters;
+	pfiled->lock_waiters = w;
+	/* The lock may have been released before we watched it */
+	if (access(w->lockfile, F_OK) < 0)
+		__mark_ready(pfiled, w);
+	pthread_mutex_unlock(&pfiled->lock_mutex);
+}
+
+/* Park a request until its lock may be free. Takes over fd on success. */
+static int lock_wait(struct peerd *peer, struct peer_req *pr, int fd,
+		char *name, char *tmpfile, char *lockfile)
+{
+	struct pfiled *pfiled = __get_pfiled(peer);
+	struct lock_waiter *w = malloc(sizeof(struct lock_waiter));
+	uint64_t now = lock_now();
+
+	if (!w) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return -1;
+	}
+	w->pr = pr;
+	w->fd = fd;
+	w->ready = 0;
+	w->retry = now + LOCK_POLL_MS;
+	w->deadline = pfiled->lock_timeout ? now + pfiled->lock_timeout : 0;
+	strncpy(w->name, name, MAX_FILENAME_SIZE - 1);
+	w->name[MAX_FILENAME_SIZE - 1] = 0;
+	strcpy(w->tmpfile, tmpfile);
+	strcpy(w->lockfile, lockfile);
+
+	lock_queue(pfiled, w);
+	XSEGLOG2(&lc, I, "Waiting for lock %s", w->name);
+	return 0;
+}
+
+/* Mark the waiters of a lock file ready */
+static void lock_released(struct peerd *peer, char *lockfile)
+{
+	struct pfiled *pfiled = __get_pfiled(peer);
+	struct lock_waiter *w;
+	int woken = 0;
+
+	if (!pfiled->lock_waiters)
+		return;
+
+	pthread_mutex_lock(&pfiled->lock_mutex);
+	for (w = pfiled->lock_waiters; w; w = w->next) {
+		if (!strcmp(w->lockfile, lockfile)) {
+			__mark_ready(pfiled, w);
+			woken = 1;
+		}
+	}
+	pthread_mutex_unlock(&pfiled->lock_mutex);
+	if (woken)
+		xseg_signal(peer->xseg, peer->portno_start);
+}
+
+/*
+ * Retry the ready waiters, or all of them when terminating. Returns whether
+ * there were any.
+ */
+static int lock_drain(struct peerd *peer)
+{
+	struct pfiled *pfiled = __get_pfiled(peer);
+	struct lock_waiter *w, **prev, *list = NULL;
+	int terminating = isTerminate();
+	int r;
+
+	/* avoid taking the mutex when idle */
+	if (!pfiled->lock_ready && !(terminating && pfiled->lock_waiters))
+		return 0;
+
+	pthread_mutex_lock(&pfiled->lock_mutex);
+	prev = &pfiled->lock_waiters;
+	while ((w = *prev)) {
+		if (w->ready || terminating) {
+			*prev = w->next;
+			w->next = list;
+			list = w;
+			if (w->ready)
+				pfiled->lock_ready--;
+		} else {
+			prev = &w->next;
+		}
+	}
+	pthread_mutex_unlock(&pfiled->lock_mutex);
+
+	while ((w = list)) {
+		list = w->next;
+		r = __try_lock(pfiled, w->tmpfile, w->lockfile);
+		if (r == 1 && terminating) {
+			XSEGLOG2(&lc, W, "Terminating, giving up on lock %s",
+					w->name);
+			r = -1;
+		} else if (r == 1 && w->deadline && lock_now() >= w->deadline) {
+			XSEGLOG2(&lc, W, "Timed out waiting for lock %s",
+					w->name);
+			r = -1;
+		}
+		if (r != 1) {
+			lock_wait_done(peer, w, r);
+			continue;
+		}
+
+		/*
+		 * Still held, wait again. The watch of w may have been removed
+		 * meanwhile by a waiter of the same directory that finished.
+		 */
+		w->ready = 0;
+		w->retry = lock_now() + LOCK_POLL_MS;
+		lock_queue(pfiled, w);
+	}
+	return 1;
+}
+
+/*
+ * The lock watcher thread marks the waiters ready on the removal of their lock
+ * file, on their poll time and on their deadline.
+ */
+static void *lock_watcher(void *arg)
+{
+	struct peerd *peer = (struct peerd *)arg;
+	struct pfiled *pfiled = __get_pfiled(peer);
+	struct lock_waiter *w;
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	char events[4096] __attribute__((aligned(8)));
+	char *name, *p;
+	ssize_t len;
+	uint64_t now;
+	int woken;
+
+	pfd.fd = pfiled->inotify_fd;
+	pfd.events = POLLIN;
+	while (!isTerminate()) {
+		len = 0;
+		if (poll(&pfd, pfd.fd >= 0 ? 1 : 0, LOCK_POLL_MS / 2) > 0)
+			len = read(pfiled->inotify_fd, events, sizeof(events));
+
+		woken = 0;
+		now = lock_now();
+		pthread_mutex_lock(&pfiled->lock_mutex);
+		for (p = events; len > 0 && p < events + len;
+				p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (!ev->len)
+				continue;
+			for (w = pfiled->lock_waiters; w; w = w->next) {
+				name = strrchr(w->lockfile, '/');
+				if (w->wd == ev->wd && name &&
+						!strcmp(name + 1, ev->name)) {
+					__mark_ready(pfiled, w);
+					woken = 1;
+				}
+			}
+		}
+		for (w = pfiled->lock_waiters; w; w = w->next) {
+			if (now >= w->retry ||
+					(w->deadline && now >= w->deadline)) {
+				__mark_ready(pfiled, w);
+				woken = 1;
+			}
+		}
+		pthread_mutex_unlock(&pfiled->lock_mutex);
+		if (woken)
+			xseg_signal(peer->xseg, peer->portno_start);
+	}
+	return NULL;
+}
+
 static void handle_acquire(struct peerd *peer, struct peer_req *pr)
 {
 	int r, ret = -1;
@@ -1618,9 +2344,23 @@ static void handle_acquire(struct peerd *peer, struct peer_req *pr)
 	} else {
 		XSEGLOG2(&lc, D, "Tmpfile %s created. Trying to get lock",
 				tmpfile_pathname);
-		r = __try_lock(pfiled, tmpfile_pathname, lockfile_pathname,
-				req->flags, fd);
-		if (r < 0){
+		r = __write_lock_id(pfiled, fd);
+		if (!r)
+			r = __try_lock(pfiled, tmpfile_pathname,
+					lockfile_pathname);
+		if (r > 0 && req->flags & XF_NOSYNC) {
+			XSEGLOG2(&lc, D, "Could not get lock file %s, "
+					"XF_NOSYNC set. Aborting", buf);
+		} else if (r > 0 && !lock_wait(peer, pr, fd, buf,
+					tmpfile_pathname, lockfile_pathname)) {
+			/* the waiter owns the tmpfile now */
+			free(buf);
+			free(tmpfile);
+			free(lockfile_pathname);
+			free(tmpfile_pathname);
+			return;
+		}
+		if (r){
 			XSEGLOG2(&lc, E, "Trying to get lock %s failed", buf);
 			ret = -1;
 		} else {
@@ -1646,6 +2386,7 @@ out:
 		pfiled_complete(peer, pr);
 	}
 	free(buf);
+	free(tmpfile);
 	free(lockfile_pathname);
 	free(tmpfile_pathname);
 	return;
@@ -1693,6 +2434,7 @@ static void handle_release(struct peerd *peer, struct peer_req *pr)
 			XSEGLOG2(&lc, E, "Could not unlink %s", pathname);
 			goto out;
 		}
+		lock_released(peer, pathname);
 	} else {
 		r = -1;
 	}
@@ -1736,6 +2478,8 @@ int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
 			handle_release(peer, pr); break;
 		case X_HASH:
 			handle_hash(peer, pr); break;
+		case X_DISCARD:
+			handle_discard(peer, pr); break;
 		case X_SYNC:
 		default:
 			handle_unknown(peer, pr);
@@ -1743,6 +2487,49 @@ int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
 	return 0;
 }
 
+/*
+ * This function substitutes the default generic_peerd_loop of peer.c.
+ * Apart from checking the ports, it also retries the lock waiters.
+ */
+int filed_peerd_loop(void *arg)
+{
+	struct thread *t = (struct thread *) arg;
+	struct peerd *peer = t->peer;
+	char *id = t->arg;
+	struct xseg *xseg = peer->xseg;
+	xport portno_start = peer->portno_start;
+	xport portno_end = peer->portno_end;
+	pid_t pid = syscall(SYS_gettid);
+	uint64_t threshold = peer->threshold;
+	threshold /= (1 + portno_end - portno_start);
+	threshold += 1;
+	uint64_t loops;
+	int c;
+
+	XSEGLOG2(&lc, I, "%s has tid %u.\n", id, pid);
+	xseg_init_local_signal(xseg, peer->portno_start);
+	for (;!(isTerminate() && all_peer_reqs_free(peer));) {
+		for(loops = threshold; loops > 0; loops--) {
+			if (loops == 1)
+				xseg_prepare_wait(xseg, peer->portno_start);
+			/*
+			 * Retry the waiters after prepare_wait, so that a
+			 * waiter marked ready before it is not missed until
+			 * the next signal.
+			 */
+			c = lock_drain(peer);
+			c |= check_ports(peer, t);
+			if (c)
+				loops = threshold;
+		}
+		XSEGLOG2(&lc, I, "%s goes to sleep\n", id);
+		xseg_wait_signal(xseg, peer->sd, 10000000UL);
+		xseg_cancel_wait(xseg, peer->portno_start);
+		XSEGLOG2(&lc, I, "%s woke up\n", id);
+	}
+	return 0;
+}
+
 int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 {
 	/*
@@ -1760,6 +2547,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	struct fio *fio;
 	struct pfiled *pfiled = malloc(sizeof(struct pfiled));
 	struct rlimit rlim;
+	char dir_hash[MAX_DIR_HASH_LEN + 1];
 	struct xcache_ops c_ops = {
 		.on_node_init = cache_node_init,
 		.on_init = cache_init,
@@ -1774,6 +2562,19 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 
 	pfiled->maxfds = 2 * peer->nr_ops;
 	pfiled->migrate = 0; /* false by default */
+	pfiled->copy_disabled = 0;
+	memset(pfiled->copies, 0, sizeof(pfiled->copies));
+	pfiled->dir_hash = DIR_HASH_SHA256;
+	pfiled->nosparse = 0;
+	pfiled->punch_disabled = 0;
+	pfiled->vpath_fd = -1;
+	pfiled->leaf_dirs = NULL;
+	pfiled->lock_timeout = 0;
+	pfiled->lock_waiters = NULL;
+	pfiled->lock_ready = 0;
+	pfiled->inotify_fd = -1;
+	pfiled->finalized = 0;
+	pthread_mutex_init(&pfiled->lock_mutex, NULL);
 
 	for (i = 0; i < peer->nr_ops; i++) {
 		peer->peer_reqs[i].priv = malloc(sizeof(struct fio));
@@ -1789,6 +2590,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	}
 
 	pfiled->vpath[0] = 0;
+	dir_hash[0] = 0;
 	pfiled->prefix[0] = 0;
 	pfiled->uniquestr[0] = 0;
 
@@ -1799,8 +2601,23 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	READ_ARG_STRING("--uniquestr", pfiled->uniquestr, MAX_UNIQUESTR_LEN);
 	READ_ARG_BOOL("--directio", pfiled->directio);
 	READ_ARG_BOOL("--pithos-migrate", pfiled->migrate);
+	READ_ARG_ULONG("--lock-timeout", pfiled->lock_timeout);
+	READ_ARG_BOOL("--no-sparse", pfiled->nosparse);
+	READ_ARG_STRING("--dir-hash", dir_hash, MAX_DIR_HASH_LEN);
 	END_READ_ARGS();
 
+	if (!dir_hash[0] || !strcmp(dir_hash, "sha256")) {
+		pfiled->dir_hash = DIR_HASH_SHA256;
+	} else if (!strcmp(dir_hash, "fnv1a")) {
+		pfiled->dir_hash = DIR_HASH_FNV1A;
+	} else {
+		XSEGLOG2(&lc, E, "Invalid --dir-hash %s", dir_hash);
+		usage(argv[0]);
+		return -1;
+	}
+
+	pfiled->lock_timeout *= 1000;
+
 	pfiled->uniquestr_len = strlen(pfiled->uniquestr);
 	pfiled->prefix_len = strlen(pfiled->prefix);
 
@@ -1816,6 +2633,17 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		pfiled->vpath[++pfiled->vpath_len]= 0;
 	}
 
+	pfiled->vpath_fd = open(pfiled->vpath, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (pfiled->vpath_fd < 0) {
+		XSEGLOG2(&lc, E, "Cannot open archipelago directory %s",
+				pfiled->vpath);
+		return -1;
+	}
+	/* 2MB, only touched pages are backed */
+	pfiled->leaf_dirs = calloc(NR_LEAF_DIRS / 64, sizeof(uint64_t));
+	if (!pfiled->leaf_dirs)
+		XSEGLOG2(&lc, W, "Cannot allocate the directory bitmap");
+
 	r = getrlimit(RLIMIT_NOFILE, &rlim);
 	if (r < 0) {
 		XSEGLOG2(&lc, E, "Could not get limit for max fds");
@@ -1834,12 +2662,42 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		return -1;
 	}
 
+	pfiled->inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (pfiled->inotify_fd < 0)
+		XSEGLOG2(&lc, W, "Cannot initialize inotify, lock waits will "
+				"be polled");
+	r = pthread_create(&pfiled->lock_watcher, NULL, lock_watcher, peer);
+	if (r) {
+		XSEGLOG2(&lc, E, "Cannot start the lock watcher thread");
+		return -1;
+	}
+	peer->peerd_loop = filed_peerd_loop;
+
 out:
 	return ret;
 }
 
 void custom_peer_finalize(struct peerd *peer)
 {
+	struct pfiled *pfiled = __get_pfiled(peer);
+	int i, finalized;
+
+	/* called by each thread, but only the first one tears down */
+	pthread_mutex_lock(&pfiled->lock_mutex);
+	finalized = pfiled->finalized;
+	pfiled->finalized = 1;
+	pthread_mutex_unlock(&pfiled->lock_mutex);
+	if (finalized)
+		return;
+
+	/* the watcher takes lock_mutex, so do not hold it while joining */
+	pthread_join(pfiled->lock_watcher, NULL);
+	if (pfiled->inotify_fd >= 0)
+		close(pfiled->inotify_fd);
+
+	for (i = 0; i < NR_COPY_METHODS; i++)
+		XSEGLOG2(&lc, I, "Copies by %s: %llu", copy_method_names[i],
+				(unsigned long long)pfiled->copies[i]);
 	/*
 	we could close all fds, but we can let the system do it for us.
 	*/
@@ -36,6 +36,33 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define WRITE 1
 #define READ 2
 
+/* Ways to copy an object, tried in this order */
+#define COPY_REFLINK		0	/* share the extents, FICLONE(RANGE) */
+#define COPY_RANGE		1	/* in-kernel copy, copy_file_range */
+#define COPY_CHUNKED		2	/* read and write in chunks */
+#define NR_COPY_METHODS		3
+#define COPY_CHUNK_SIZE		(1024 * 1024)
+
+/* Zero writes smaller than this are written, not punched */
+#define ZERO_PUNCH_MIN		4096
+
+/*
+ * Lock waits. Waiters are retried when the lock file is removed, as seen by
+ * inotify, and every LOCK_POLL_MS, for releases by other hosts, which inotify
+ * does not see on network filesystems.
+ */
+#define LOCK_POLL_MS		250
+
+/*
+ * Objects are placed in a 3-level directory tree, named after the first 3
+ * bytes of a hash of their name, e.g. ab/cd/ef/<name>, so there are at most
+ * NR_LEAF_DIRS leaf directories.
+ */
+#define NR_LEAF_DIRS		(1 << 24)
+#define DIR_HASH_SHA256		0	/* the original layout */
+#define DIR_HASH_FNV1A		1	/* cheaper, for new deployments only */
+#define MAX_DIR_HASH_LEN	16
+
 /* fdcache_node flags */
 #define READY (1 << 1)
 
@@ -45,6 +72,20 @@ struct fdcache_entry {
 	volatile unsigned int flags;
 };
 
+/* A request waiting for a lock held by someone else */
+struct lock_waiter {
+	struct peer_req *pr;
+	struct lock_waiter *next;
+	int fd;				/* of the tmpfile */
+	int wd;				/* inotify watch of the lock's directory */
+	int ready;			/* to be retried by a peer thread */
+	uint64_t deadline;		/* ms, 0 for none */
+	uint64_t retry;			/* ms, when to poll the lock again */
+	char name[MAX_FILENAME_SIZE];
+	char tmpfile[MAX_PATH_SIZE + MAX_FILENAME_SIZE];
+	char lockfile[MAX_PATH_SIZE + MAX_FILENAME_SIZE];
+};
+
 /* pfiled context */
 struct pfiled {
 	uint32_t vpath_len;
@@ -57,6 +98,20 @@ struct pfiled {
 	char uniquestr[MAX_UNIQUESTR_LEN + 1];
 	struct xcache cache;
 	uint32_t migrate;
+	volatile uint32_t copy_disabled;	/* copy methods not supported */
+	uint64_t copies[NR_COPY_METHODS];	/* copies done by each method */
+	uint32_t dir_hash;
+	uint32_t nosparse;
+	volatile uint32_t punch_disabled;
+	int vpath_fd;				/* paths are opened relative to it */
+	uint64_t *leaf_dirs;			/* bitmap of existing leaf dirs */
+	uint64_t lock_timeout;			/* ms, 0 to wait forever */
+	pthread_mutex_t lock_mutex;		/* protects the following */
+	struct lock_waiter *lock_waiters;
+	volatile uint32_t lock_ready;		/* waiters marked ready */
+	int inotify_fd;
+	pthread_t lock_watcher;
+	int finalized;
 };
 
 /*
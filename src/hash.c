@@ -134,3 +134,25 @@ void merkle_hash(unsigned char *hashes, unsigned long len,
 	memcpy(hash, buf, SHA256_DIGEST_SIZE);
 }
 
+
+/*
+ * Calculate the name of a content-addressed object. Trailing zeros are
+ * stripped before hashing, so that an object and its zero padded version get
+ * the same name. The null terminated hex representation of the hash is stored
+ * in hex.
+ * Returns the length of the data that was hashed.
+ */
+uint64_t hash_object_data(unsigned char *data, uint64_t len,
+		char hex[HEXLIFIED_SHA256_DIGEST_SIZE + 1])
+{
+	unsigned char sha[SHA256_DIGEST_SIZE];
+
+	while (len && !data[len - 1])
+		len--;
+
+	SHA256(data, len, sha);
+	hexlify(sha, SHA256_DIGEST_SIZE, hex);
+	hex[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+
+	return len;
+}
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <openssl/sha.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #ifndef SHA256_DIGEST_SIZE
 #define SHA256_DIGEST_SIZE 32
@@ -31,3 +32,6 @@ void unhexlify(char *hex, unsigned char *data);
 
 void merkle_hash(unsigned char *hashes, unsigned long len,
 		unsigned char hash[SHA256_DIGEST_SIZE]);
+
+uint64_t hash_object_data(unsigned char *data, uint64_t len,
+		char hex[HEXLIFIED_SHA256_DIGEST_SIZE + 1]);
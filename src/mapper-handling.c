@@ -52,54 +52,54 @@ char * null_terminate(char *target, uint32_t targetlen)
 int __set_node(struct mapper_io *mio, struct xseg_request *req,
 			struct map_node *mn)
 {
-	int r = 0;
+	struct xindex *index = mio->copyups_nodes;
+	xindex_handler h, old;
+
 	if (mn){
 		XSEGLOG2(&lc, D, "Inserting (req: %lx, mapnode: %lx) on mio %lx",
 				req, mn, mio);
-		r = xhash_insert(mio->copyups_nodes, (xhashidx) req, (xhashidx) mn);
-		if (r == -XHASH_ERESIZE) {
-			xhashidx shift = xhash_grow_size_shift(mio->copyups_nodes);
-			xhash_t *new_hashmap = xhash_resize(mio->copyups_nodes, shift, 0, NULL);
-			if (!new_hashmap)
-				return -1;
-			mio->copyups_nodes = new_hashmap;
-			r = xhash_insert(mio->copyups_nodes, (xhashidx) req, (xhashidx) mn);
+		h = xindex_alloc_init(index, (char *)req);
+		if (h == NoIndexEntry) {
+			XSEGLOG2(&lc, E, "Insertion of (%lx, %lx) on mio %lx failed",
+					req, mn, mio);
+			return -1;
 		}
-		if (r < 0)
+		xindex_set_entry(index, h, mn);
+		old = xindex_insert(index, h);
+		if (old != h) {
 			XSEGLOG2(&lc, E, "Insertion of (%lx, %lx) on mio %lx failed",
 					req, mn, mio);
+			if (old != NoIndexEntry)
+				xindex_put(index, old);
+			xindex_put(index, h);
+			return -1;
+		}
 	}
 	else {
 		XSEGLOG2(&lc, D, "Deleting req: %lx from mio %lx",
 				req, mio);
-		r = xhash_delete(mio->copyups_nodes, (xhashidx) req);
-		if (r == -XHASH_ERESIZE) {
-			xhashidx shift = xhash_shrink_size_shift(mio->copyups_nodes);
-			xhash_t *new_hashmap = xhash_resize(mio->copyups_nodes, shift, 0, NULL);
-			if (!new_hashmap)
-				return -1;
-			mio->copyups_nodes = new_hashmap;
-			r = xhash_delete(mio->copyups_nodes, (xhashidx) req);
-		}
-		else if (r == -XHASH_ENOENT) {
+		h = xindex_lookup(index, (char *)req);
+		if (h == NoIndexEntry) {
 			XSEGLOG2(&lc, W, "%lx not found on mio %lx", req, mio);
 			return -1;
 		}
-		if (r < 0)
-			XSEGLOG2(&lc, E, "Deletion of %lx on mio %lx failed",
-					req, mio);
+		/* the reference of the lookup, and the one set with it */
+		xindex_put(index, h);
+		xindex_put(index, h);
 	}
-	return r;
+	return 0;
 }
 
 struct map_node * __get_node(struct mapper_io *mio, struct xseg_request *req)
 {
 	struct map_node *mn;
-	int r = xhash_lookup(mio->copyups_nodes, (xhashidx) req, (xhashidx *) &mn);
-	if (r < 0){
+	xindex_handler h = xindex_lookup(mio->copyups_nodes, (char *)req);
+	if (h == NoIndexEntry){
 		XSEGLOG2(&lc, W, "Cannot find req %lx on mio %lx", req, mio);
 		return NULL;
 	}
+	mn = xindex_get_entry(mio->copyups_nodes, h);
+	xindex_put(mio->copyups_nodes, h);
 	XSEGLOG2(&lc, D, "Found mapnode %lx req %lx on mio %lx", mn, req, mio);
 	return mn;
 }
@@ -116,6 +116,7 @@ int send_request(struct peer_req *pr, struct xseg_request *req)
 				req, pr);
 		return -1;
 	}
+	peer_trace(pr, req, PEER_TRACE_SUBMIT);
 	xport p = xseg_submit(peer->xseg, req, pr->portno, X_ALLOC);
 	if (p == NoPort){
 		XSEGLOG2(&lc, E, "Cannot submit request %p, pr: %p",
@@ -349,6 +350,10 @@ struct xseg_request * __write_map_metadata(struct peer_req *pr, struct map *map)
 			write_map_header_v2(map, (struct v2_header_struct *)&hdr);
 			header_size = v2_mapheader_size;
 			break;
+		case MAP_V3:
+			write_map_header_v3(map, (struct v3_header_struct *)&hdr);
+			header_size = v3_mapheader_size;
+			break;
 		default:
 			XSEGLOG2(&lc, E, "Invalid version %u found", map->version);
 			goto out_err;
@@ -651,6 +656,9 @@ int load_map_metadata(struct peer_req *pr, struct map *map)
 		case MAP_V2:
 			r = read_map_header_v2(map, (struct v2_header_struct *)data);
 			break;
+		case MAP_V3:
+			r = read_map_header_v3(map, (struct v3_header_struct *)data);
+			break;
 		default:
 			XSEGLOG2(&lc, E, "Loaded invalid version %u > "
 					"latest version %u",
@@ -686,6 +694,7 @@ int load_map(struct peer_req *pr, struct map *map)
 	struct map_ops *prev_mops;
 	uint64_t v0_size = NO_V0SIZE;
 	uint64_t nr_objs = 0;
+	uint64_t i;
 
 	XSEGLOG2(&lc, I, "Loading map %s", map->volume);
 
@@ -700,6 +709,14 @@ int load_map(struct peer_req *pr, struct map *map)
 	if (r < 0)
 		goto out_err;
 
+	/* Older versions do not keep the epoch of each object. Writable objects
+	 * are the ones of the current epoch.
+	 */
+	if (map->version < MAP_V3 && map->objects) {
+		for (i = 0; i < map->nr_objs; i++)
+			map->objects[i].epoch = map->epoch;
+	}
+
 	v0_size = pr->req->v0_size;
 	if (map->version == MAP_V0 && v0_size != NO_V0SIZE) {
 		nr_objs =__calc_map_obj(v0_size, MAPPER_DEFAULT_BLOCKSIZE);
@@ -784,6 +801,7 @@ struct xseg_request * __snapshot_object(struct peer_req *pr,
 		XSEGLOG2(&lc, E, "Cannot set request data for object %s", mn->object);
 		goto out_put;
 	}
+	peer_trace(pr, req, PEER_TRACE_SUBMIT);
 	p = xseg_submit(peer->xseg, req, pr->portno, X_ALLOC);
 	if (p == NoPort) {
 		XSEGLOG2(&lc, E, "Cannot submit for object %s", mn->object);
@@ -888,6 +906,7 @@ copyup_zeroblock:
 	newmn.flags = 0;
 	newmn.flags |= MF_OBJECT_WRITABLE;
 	newmn.flags |= MF_OBJECT_ARCHIP;
+	newmn.epoch = map->epoch;
 	strncpy(newmn.object, new_target, newtargetlen);
 	newmn.object[newtargetlen] = 0;
 	newmn.objectlen = newtargetlen;
@@ -934,6 +953,7 @@ static int __copyup_copy_cb(struct peer_req *pr, struct xseg_request *req,
 	newmn.flags = 0;
 	newmn.flags |= MF_OBJECT_WRITABLE;
 	newmn.flags |= MF_OBJECT_ARCHIP;
+	newmn.epoch = map->epoch;
 	strncpy(newmn.object, target, req->targetlen);
 	newmn.object[req->targetlen] = 0;
 	newmn.objectlen = req->targetlen;
@@ -967,7 +987,7 @@ static int __copyup_write_cb(struct peer_req *pr, struct xseg_request *req,
 	data = xseg_get_data(peer->xseg, req);
 	map->mops->read_object(&tmp, (unsigned char *)data);
 	/* old object should not be writable */
-	if (mn->flags & MF_OBJECT_WRITABLE) {
+	if (object_writable(mn)) {
 		XSEGLOG2(&lc, E, "map node %s has wrong flags", mn->object);
 		return -1;
 	}
@@ -976,6 +996,7 @@ static int __copyup_write_cb(struct peer_req *pr, struct xseg_request *req,
 	mn->object[tmp.objectlen] = 0;
 	mn->objectlen = tmp.objectlen;
 	mn->flags = tmp.flags;
+	mn->epoch = map->epoch;
 	return 0;
 }
 
@@ -1230,6 +1251,153 @@ out_err:
 	return NULL;
 }
 
+/*
+ * Discard of whole objects.
+ *
+ * The map node is pointed to the zero block first, and the old object is
+ * deleted after the map is updated, so that a failure never leaves the map
+ * pointing to a deleted object. Objects that are not writable are shared with
+ * snapshots or the parent of a clone and are left alone.
+ */
+static int __discard_write_cb(struct peer_req *pr, struct xseg_request *req,
+		struct map_node *mn)
+{
+	struct peerd *peer = pr->peer;
+	struct mapperd *mapper = __get_mapperd(peer);
+	struct mapper_io *mio = __get_mapper_io(pr);
+	struct map *map = mn->map;
+	struct xseg_request *xreq;
+	struct map_node tmp;
+	char old[MAX_OBJECT_LEN + 1];
+	uint32_t oldlen = mn->objectlen;
+	int writable = object_writable(mn);
+	char *data;
+
+	//assert mn->state & MF_OBJECT_WRITING
+	mn->state &= ~MF_OBJECT_WRITING;
+
+	strncpy(old, mn->object, oldlen);
+	old[oldlen] = 0;
+
+	/* update object on cache */
+	data = xseg_get_data(peer->xseg, req);
+	map->mops->read_object(&tmp, (unsigned char *)data);
+	strncpy(mn->object, tmp.object, tmp.objectlen);
+	mn->object[tmp.objectlen] = 0;
+	mn->objectlen = tmp.objectlen;
+	mn->flags = tmp.flags;
+
+	if (!writable)
+		return 1;
+
+	xreq = get_request(pr, mapper->bportno, old, oldlen, 0);
+	if (!xreq) {
+		XSEGLOG2(&lc, W, "Cannot get request to delete discarded "
+				"object %s", old);
+		return 1;
+	}
+	xreq->op = X_DELETE;
+	xreq->size = xreq->datalen;
+	xreq->offset = 0;
+	if (__set_node(mio, xreq, mn) < 0) {
+		XSEGLOG2(&lc, W, "Cannot set map node for object %s", old);
+		put_request(pr, xreq);
+		return 1;
+	}
+	if (send_request(pr, xreq) < 0) {
+		XSEGLOG2(&lc, W, "Cannot delete discarded object %s", old);
+		__set_node(mio, xreq, NULL);
+		put_request(pr, xreq);
+		return 1;
+	}
+	XSEGLOG2(&lc, I, "Deleting discarded object %s", old);
+	return 0;
+}
+
+void discard_cb(struct peer_req *pr, struct xseg_request *req)
+{
+	struct peerd *peer = pr->peer;
+	struct mapper_io *mio = __get_mapper_io(pr);
+	struct map_node *mn = __get_node(mio, req);
+	int r;
+
+	if (!mn){
+		XSEGLOG2(&lc, E, "Cannot get map node");
+		goto out_err;
+	}
+	__set_node(mio, req, NULL);
+
+	if (req->op == X_DELETE) {
+		/* the map no longer points to it, so just leak it */
+		if (req->state & XS_FAILED)
+			XSEGLOG2(&lc, W, "Deletion of discarded object %s "
+					"failed", null_terminate(
+					xseg_get_target(peer->xseg, req),
+					req->targetlen));
+		goto out_done;
+	}
+
+	if (req->state & XS_FAILED){
+		XSEGLOG2(&lc, E, "Req failed");
+		mn->state &= ~MF_OBJECT_WRITING;
+		signal_mapnode(mn);
+		goto out_err;
+	}
+	r = __discard_write_cb(pr, req, mn);
+	XSEGLOG2(&lc, I, "Object %s [%llu] discarded", mn->object,
+			(unsigned long long) mn->objectidx);
+	signal_mapnode(mn);
+	if (!r)
+		goto out;
+
+out_done:
+	mio->pending_reqs--;
+	signal_pr(pr);
+out:
+	put_request(pr, req);
+	return;
+
+out_err:
+	mio->pending_reqs--;
+	XSEGLOG2(&lc, D, "Mio->pending_reqs: %u", mio->pending_reqs);
+	mio->err = 1;
+	signal_pr(pr);
+	goto out;
+}
+
+struct xseg_request * __discard_object(struct peer_req *pr,
+		struct map_node *mn)
+{
+	struct peerd *peer = pr->peer;
+	struct mapper_io *mio = __get_mapper_io(pr);
+	struct map *map = mn->map;
+	struct xseg_request *req;
+	struct map_node newmn;
+	int r;
+
+	/* construct a tmp map_node for writing purposes */
+	newmn = *mn;
+	newmn.flags = MF_OBJECT_ZERO;
+	strncpy(newmn.object, zero_block, ZERO_BLOCK_LEN);
+	newmn.object[ZERO_BLOCK_LEN] = 0;
+	newmn.objectlen = ZERO_BLOCK_LEN;
+	req = __object_write(peer, pr, map, &newmn);
+	if (!req){
+		XSEGLOG2(&lc, E, "Object write returned error for object %s"
+				"\n\t of map %s [%llu]",
+				mn->object, map->volume, (unsigned long long) mn->objectidx);
+		return NULL;
+	}
+	r = __set_node(mio, req, mn);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
+	}
+	mn->state |= MF_OBJECT_WRITING;
+	XSEGLOG2(&lc, I, "Discarding object %s [%llu]. Pending writing.",
+			mn->object, (unsigned long long) mn->objectidx);
+	return req;
+}
+
 #if 0
 struct xseg_request * __delete_map(struct peer_req *pr, struct map *map)
 {
@@ -1261,6 +1429,7 @@ struct xseg_request * __delete_map(struct peer_req *pr, struct map *map)
 		goto out_put;
 	}
 	/* do not check return value. just make sure there is no node set */
+	peer_trace(pr, req, PEER_TRACE_SUBMIT);
 	xport p = xseg_submit(peer->xseg, req, pr->portno, X_ALLOC);
 	if (p == NoPort){
 		XSEGLOG2(&lc, E, "Cannot submit request for map %s", map->volume);
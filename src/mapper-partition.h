@@ -0,0 +1,50 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPERPARTITION_H
+
+#define MAPPERPARTITION_H
+
+#include <stdint.h>
+
+/*
+ * Maps can be partitioned among several mapperd processes, each running its
+ * own scheduler on its own core. Partition i listens on the port of the first
+ * partition plus i, and the maps of a volume are only handled by the partition
+ * its name hashes to. Requests that reach another partition are forwarded to
+ * it, but peers that know the number of partitions can send them there
+ * directly.
+ */
+
+/* FNV-1a hash of the volume name */
+static inline uint32_t mapper_partition(char *volume, uint32_t volumelen,
+		uint32_t nr_partitions)
+{
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	if (nr_partitions <= 1)
+		return 0;
+
+	for (i = 0; i < volumelen; i++) {
+		hash ^= (unsigned char)volume[i];
+		hash *= 16777619U;
+	}
+	return hash % nr_partitions;
+}
+
+#endif /* end MAPPERPARTITION_H */
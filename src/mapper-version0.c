@@ -91,7 +91,7 @@ int read_map_v0(struct map *m, unsigned char * data)
 		map_node[i].waiters = 0;
 		map_node[i].state = 0;
 		map_node[i].ref = 1;
-		map_node[i].cond = st_cond_new(); //FIXME err check;
+		map_node[i].cond = NULL;
 		read_object_v0(&map_node[i], data+pos);
 		pos += v0_objectsize_in_map;
 	}
@@ -50,7 +50,7 @@ int read_object_v1(struct map_node *mn, unsigned char *buf)
 
 void object_to_map_v1(unsigned char* buf, struct map_node *mn)
 {
-	buf[0] = (mn->flags & MF_OBJECT_WRITABLE)? 1 : 0;
+	buf[0] = object_writable(mn) ? 1 : 0;
 	//assert !(mn->flags & MF_OBJECT_ARCHIP)
 	if (buf[0]){
 		/* strip common prefix */
@@ -106,7 +106,7 @@ int read_map_v1(struct map *m, unsigned char *data)
 		map_node[i].waiters = 0;
 		map_node[i].ref = 1;
 		map_node[i].state = 0;
-		map_node[i].cond = st_cond_new(); //FIXME err check;
+		map_node[i].cond = NULL;
 		read_object_v1(&map_node[i], data+pos);
 		pos += v1_objectsize_in_map;
 	}
@@ -179,7 +179,8 @@ static void object_to_map_v2(unsigned char* buf, struct map_node *mn)
 	uint32_t *objectlen;
 	uint32_t len;
 	buf[0] = 0;
-	buf[0] |= mn->flags & MF_OBJECT_WRITABLE;
+	if (object_writable(mn))
+		buf[0] |= MF_OBJECT_WRITABLE;
 	buf[0] |= mn->flags & MF_OBJECT_ARCHIP;
 	buf[0] |= mn->flags & MF_OBJECT_ZERO;
 	buf[0] |= mn->flags & MF_OBJECT_DELETED;
@@ -239,7 +240,7 @@ static struct xseg_request * prepare_write_chunk(struct peer_req *pr,
 	pos = 0;
 	for (obj = chunk->start; obj < chunk->start + chunk->nr; obj++) {
 		mn = &map->objects[obj];
-		object_to_map_v2((unsigned char *)(data+pos), mn);
+		map->mops->object_to_map((unsigned char *)(data+pos), mn);
 		pos += v2_objectsize_in_map;
 	}
 
@@ -299,7 +300,7 @@ struct xseg_request * prepare_write_objects_v2(struct peer_req *pr,
 	return prepare_write_chunk(pr, map, chunks);
 }
 
-static struct xseg_request * prepare_write_object_v2(struct peer_req *pr,
+struct xseg_request * prepare_write_object_v2(struct peer_req *pr,
 				struct map *map, struct map_node *mn)
 {
 	struct peerd *peer = pr->peer;
@@ -310,7 +311,7 @@ static struct xseg_request * prepare_write_object_v2(struct peer_req *pr,
 	if (!req)
 		return NULL;
 	data = xseg_get_data(peer->xseg, req);
-	object_to_map_v2((unsigned char *)data, mn);
+	map->mops->object_to_map((unsigned char *)data, mn);
 	return req;
 }
 
@@ -347,7 +348,7 @@ int read_map_objects_v2(struct map *map, unsigned char *data, uint64_t start, ui
 	map_node = map->objects;
 
 	for (i = start; i < nr; i++) {
-		r = read_object_v2(&map_node[i], data+pos);
+		r = map->mops->read_object(&map_node[i], data+pos);
 		if (r < 0) {
 			XSEGLOG2(&lc, E, "Map %s: Could not read object %llu",
 					map->volume, i);
@@ -425,7 +426,7 @@ out_err:
 	return -1;
 }
 
-static int delete_map_data_v2(struct peer_req *pr, struct map *map)
+int delete_map_data_v2(struct peer_req *pr, struct map *map)
 {
 	int r;
 	struct mapper_io *mio = __get_mapper_io(pr);
@@ -537,7 +538,7 @@ static int write_objects_v2(struct peer_req *pr, struct map *map, uint64_t start
 	return (mio->err ? -1 : 0);
 }
 
-static int write_map_data_v2(struct peer_req *pr, struct map *map)
+int write_map_data_v2(struct peer_req *pr, struct map *map)
 {
 	return write_objects_v2(pr, map, 0, map->nr_objs);
 }
@@ -689,7 +690,7 @@ out:
 	return (mio->err ? -1 : 0);
 }
 
-static int load_map_data_v2(struct peer_req *pr, struct map *map)
+int load_map_data_v2(struct peer_req *pr, struct map *map)
 {
 	return load_map_objects_v2(pr, map, 0, map->nr_objs);
 }
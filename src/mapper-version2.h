@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <peer.h>
 
 struct map;
+struct map_node;
 
 /* Maximum length of an object name in memory */
 #define v2_max_objectlen 123
@@ -62,6 +63,16 @@ struct v2_header_struct {
 
 extern struct map_ops v2_ops;
 
+/* The chunked storage of the map objects is shared with the v3 maps. Objects
+ * are read and written through the object_to_map and read_object ops of the
+ * map.
+ */
+struct xseg_request * prepare_write_object_v2(struct peer_req *pr,
+		struct map *map, struct map_node *mn);
+int load_map_data_v2(struct peer_req *pr, struct map *map);
+int write_map_data_v2(struct peer_req *pr, struct map *map);
+int delete_map_data_v2(struct peer_req *pr, struct map *map);
+
 int read_map_header_v2(struct map *map, struct v2_header_struct *v2_hdr);
 void write_map_header_v2(struct map *map, struct v2_header_struct *v2_hdr);
 
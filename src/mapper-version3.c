@@ -0,0 +1,104 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <mapper.h>
+#include <mapper-version3.h>
+#include <xseg/xseg.h>
+#include <stdlib.h>
+#include <asm/byteorder.h>
+
+/* v3 functions */
+
+static int read_object_v3(struct map_node *mn, unsigned char *buf)
+{
+	struct v3_object_on_disk *obj = (struct v3_object_on_disk *)buf;
+	char c = obj->flags;
+
+	mn->flags = 0;
+	mn->flags |= MF_OBJECT_WRITABLE & c;
+	mn->flags |= MF_OBJECT_ARCHIP & c;
+	mn->flags |= MF_OBJECT_ZERO & c;
+	mn->flags |= MF_OBJECT_DELETED & c;
+	mn->epoch = __be32_to_cpu(obj->epoch);
+	mn->objectlen = strnlen((char *)obj->object, v3_max_objectlen);
+	if (!mn->objectlen) {
+		XSEGLOG2(&lc, E, "Invalid object len %u", mn->objectlen);
+		return -1;
+	}
+
+	memcpy(mn->object, obj->object, mn->objectlen);
+	mn->object[mn->objectlen] = 0;
+
+	return 0;
+}
+
+static void object_to_map_v3(unsigned char* buf, struct map_node *mn)
+{
+	struct v3_object_on_disk *obj = (struct v3_object_on_disk *)buf;
+
+	obj->flags = 0;
+	if (object_writable(mn))
+		obj->flags |= MF_OBJECT_WRITABLE;
+	obj->flags |= mn->flags & MF_OBJECT_ARCHIP;
+	obj->flags |= mn->flags & MF_OBJECT_ZERO;
+	obj->flags |= mn->flags & MF_OBJECT_DELETED;
+	obj->epoch = __cpu_to_be32(mn->epoch & v3_max_epoch);
+
+	if (mn->objectlen > v3_max_objectlen) {
+		XSEGLOG2(&lc, E, "Invalid object len %u", mn->objectlen);
+	}
+
+	memset(obj->object, 0, v3_max_objectlen);
+	memcpy(obj->object, mn->object, mn->objectlen);
+}
+
+struct map_ops v3_ops = {
+	.object_to_map = object_to_map_v3,
+	.read_object = read_object_v3,
+	.prepare_write_object = prepare_write_object_v2,
+	.load_map_data = load_map_data_v2,
+	.write_map_data = write_map_data_v2,
+	.delete_map_data = delete_map_data_v2
+};
+
+void write_map_header_v3(struct map *map, struct v3_header_struct *v3_hdr)
+{
+	v3_hdr->signature = __cpu_to_be32(MAP_SIGNATURE);
+	v3_hdr->version = __cpu_to_be32(MAP_V3);
+	v3_hdr->size = __cpu_to_be64(map->size);
+	v3_hdr->blocksize = __cpu_to_be32(map->blocksize);
+	v3_hdr->flags = __cpu_to_be32(map->flags);
+	v3_hdr->epoch = __cpu_to_be64(map->epoch);
+}
+
+int read_map_header_v3(struct map *map, struct v3_header_struct *v3_hdr)
+{
+	uint32_t version = __be32_to_cpu(v3_hdr->version);
+	if(version != MAP_V3) {
+		return -1;
+	}
+	map->version = version;
+	map->signature = __be32_to_cpu(v3_hdr->signature);
+	map->size = __be64_to_cpu(v3_hdr->size);
+	map->blocksize = __be32_to_cpu(v3_hdr->blocksize);
+	map->flags = __be32_to_cpu(v3_hdr->flags);
+	map->epoch = __be64_to_cpu(v3_hdr->epoch);
+	map->nr_objs = calc_map_obj(map);
+	map->mops = &v3_ops;
+
+	return 0;
+}
@@ -48,6 +48,9 @@ void custom_peer_usage()
 	fprintf(stderr, "Custom peer options: \n"
 			"-bp  : port for block blocker(!)\n"
 			"-mbp : port for map blocker\n"
+			"--partitions : mapperd processes sharing the maps, "
+			"on consecutive ports (default: 1)\n"
+			"--partition-port : port of the first partition\n"
 			"\n");
 }
 
@@ -185,9 +188,10 @@ inline void put_mapnode(struct map_node *mn)
 {
 	mn->ref--;
 	//XSEGLOG2(&lc, D, "mapnode %p: ref: %u", mn, mn->ref);
-	if (!mn->ref){
+	if (!mn->ref && mn->cond){
 		//clean up mn
 		st_cond_destroy(mn->cond);
+		mn->cond = NULL;
 	}
 }
 
@@ -205,7 +209,7 @@ int initialize_map_objects(struct map *map)
 		map_node[i].waiters = 0;
 		map_node[i].state = 0;
 		map_node[i].ref = 1;
-		map_node[i].cond = st_cond_new(); //FIXME err check;
+		map_node[i].cond = NULL;
 	}
 	return 0;
 }
@@ -379,7 +383,7 @@ static int do_copyups(struct peer_req *pr, struct r2o *mns, int n)
 				}
 			}
 
-			if (!(mn->flags & MF_OBJECT_WRITABLE)) {
+			if (!object_writable(mn)) {
 				//calc new_target, copy up object
 				if (__copyup_object(pr, mn) == NULL){
 					XSEGLOG2(&lc, E, "Error in copy up object");
@@ -622,11 +626,8 @@ static int do_hash(struct peer_req *pr, struct map *map)
 
 static int do_snapshot(struct peer_req *pr, struct map *map)
 {
-	uint64_t i;
 	struct peerd *peer = pr->peer;
 	//struct mapper_io *mio = __get_mapper_io(pr);
-	struct map_node *mn;
-	uint64_t nr_objs;
 	struct map *snap_map;
 	struct xseg_request_snapshot *xsnapshot;
 	char *snapname;
@@ -649,7 +650,7 @@ static int do_snapshot(struct peer_req *pr, struct map *map)
 		XSEGLOG2(&lc, E, "Map was not opened exclusively");
 		return -1;
 	}
-	if (map->epoch == UINT64_MAX) {
+	if (map->epoch == MAX_MAP_EPOCH) {
 		XSEGLOG2(&lc, E, "Max epoch reached for %s", map->volume);
 		return -1;
 	}
@@ -677,53 +678,34 @@ static int do_snapshot(struct peer_req *pr, struct map *map)
 	snap_map->epoch = 0;
 	//snap_map->flags &= ~MF_MAP_DELETED;
 	snap_map->flags = MF_MAP_READONLY;
+	/* The objects must be written with their epochs, even if a map of an
+	 * older version with this name was deleted.
+	 */
+	snap_map->version = MAP_LATEST_VERSION;
+	snap_map->mops = MAP_LATEST_MOPS;
 	snap_map->objects = map->objects;
 	snap_map->size = map->size;
 	snap_map->blocksize = map->blocksize;
 	snap_map->nr_objs = map->nr_objs;
 
 
-	nr_objs = map->nr_objs;
-
-	//set all map_nodes read only;
-	//TODO, maybe skip that check and add an epoch number on each object.
-	//Then we can check if object is writable iff object epoch == map epoch
+	/* Make sure all pending operations on all objects are completed, so
+	 * that no copy up, issued before this request, writes an object of
+	 * the current epoch after the snapshot.
+	 */
 	wait_all_map_objects_ready(map);
-	for (i = 0; i < nr_objs; i++) {
-		mn = get_mapnode(map, i);
-		if (!mn) {
-			XSEGLOG2(&lc, E, "Could not get map node %llu for map %s",
-					i, map->volume);
-			goto out_err;
-		}
-
-		// make sure all pending operations on all objects are completed
-		// Basically make sure, that no previously copy up operation,
-		// will mess with our state.
-		// This works, since only a map_w, that was processed before
-		// this request, can have issued an object write request which
-		// may be pending. Since the objects are processed in the same
-		// order by the copyup operation and the snapshot operation, we
-		// can be sure, that no previously ready objects, have changed
-		// their state into not read.
-		// No other operation that manipulated map objects can occur
-		// simutaneously with snapshot operation.
-		if (mn->state & MF_OBJECT_NOT_READY)
-			XSEGLOG2(&lc, E, "BUG: object not ready");
-	//		wait_on_mapnode(mn, mn->state & MF_OBJECT_NOT_READY);
 
-		mn->flags &= ~MF_OBJECT_WRITABLE;
-		put_mapnode(mn);
-	}
-	//increase epoch
+	/* Objects of the previous epochs are not writable, so increasing the
+	 * epoch makes all objects read only without touching them. Only the
+	 * map header needs to be written.
+	 */
 	map->epoch++;
-	//write map
-	r = write_map(pr, map);
+	r = write_map_metadata(pr, map);
 	if (r < 0) {
 		XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
-		/* Not restoring epoch or writable status here, is not
-		 * devastating, since this is not the common case, and it can
-		 * only cause unneeded copy-on-write operations.
+		/* Not restoring epoch here, is not devastating, since this is
+		 * not the common case, and it can only cause unneeded
+		 * copy-on-write operations.
 		 */
 		goto out_err;
 	}
@@ -805,7 +787,7 @@ static int do_destroy(struct peer_req *pr, struct map *map)
 
 		if (mn->flags & MF_OBJECT_ZERO
 			|| mn->flags & MF_OBJECT_DELETED
-			|| !(mn->flags & MF_OBJECT_ARCHIP && mn->flags & MF_OBJECT_WRITABLE)) {
+			|| !(mn->flags & MF_OBJECT_ARCHIP && object_writable(mn))) {
 			//only remove writable archipelago objects.
 			//skip already deleted
 			XSEGLOG2(&lc, D, "Skipping object %s", mn->object);
@@ -814,7 +796,7 @@ static int do_destroy(struct peer_req *pr, struct map *map)
 		}
 		XSEGLOG2(&lc, D, "%s flags:\n  Writable: %s\n  Zero: %s\n"
 				"  Deleted: %s\n  Archip: %s", mn->object,
-				(mn->flags & MF_OBJECT_WRITABLE ? "yes" : "no"),
+				(object_writable(mn) ? "yes" : "no"),
 				(mn->flags & MF_OBJECT_ZERO? "yes" : "no"),
 				(mn->flags & MF_OBJECT_DELETED? "yes" : "no"),
 				(mn->flags & MF_OBJECT_ARCHIP? "yes" : "no"));
@@ -862,7 +844,7 @@ static int rename_map(struct peer_req *pr, struct map *map,
 	struct peerd *peer = pr->peer;
 	struct mapper_io *mio = __get_mapper_io(pr);
 	struct map_node *mn;
-	uint64_t nr_objs;
+	uint64_t nr_objs, old_epoch;
 	struct map *new_map;
 	struct xseg_request_rename *xrename;
 	int r;
@@ -897,7 +879,7 @@ static int rename_map(struct peer_req *pr, struct map *map,
 		XSEGLOG2(&lc, E, "Rename destination exists");
 		goto out_close;
 	}
-	if (new_map->epoch == UINT64_MAX) {
+	if (new_map->epoch == MAX_MAP_EPOCH) {
 		XSEGLOG2(&lc, E, "Max epoch reached for %s", new_map->volume);
 		goto out_close;
 	}
@@ -912,16 +894,39 @@ static int rename_map(struct peer_req *pr, struct map *map,
 
 	nr_objs = map->nr_objs;
 
-	//TODO, maybe skip that check and add an epoch number on each object.
-	//Then we can check if object is writable iff object epoch == map epoch
 	wait_all_map_objects_ready(map);
 
+	/* Writable objects remain writable in the epoch of the new map. Objects
+	 * of older epochs are not, even if the new map had reached their epoch
+	 * before. The map moves to the new epoch along with its objects, since
+	 * objects are stored as writable only if they are writable by their
+	 * map.
+	 */
+	old_epoch = map->epoch;
+	for (i = 0; i < nr_objs; i++) {
+		mn = &map->objects[i];
+		if (object_writable(mn))
+			mn->epoch = new_map->epoch;
+		else
+			mn->flags &= ~MF_OBJECT_WRITABLE;
+	}
+	map->epoch = new_map->epoch;
+
 	//write new map
 	r = write_map(pr, new_map);
 	if (r < 0) {
 		XSEGLOG2(&lc, E, "Cannot write map %s", new_map->volume);
+		/* only the objects of the map are marked writable by now */
+		for (i = 0; i < nr_objs; i++) {
+			mn = &map->objects[i];
+			if (mn->flags & MF_OBJECT_WRITABLE)
+				mn->epoch = old_epoch;
+		}
+		map->epoch = old_epoch;
 		goto out_unset;
 	}
+	/* the old map must be removed with its own epoch */
+	map->epoch = old_epoch;
 	XSEGLOG2(&lc, I, "New map %s created", new_map->volume);
 	new_map->objects = NULL;
 
@@ -1084,6 +1089,165 @@ static int do_mapw(struct peer_req *pr, struct map *map)
 	return 0;
 }
 
+/*
+ * Discard a range of the map. Whole objects are pointed to the zero block and
+ * deleted here, at most MAPPER_DISCARD_BATCH at a time. The parts of the range
+ * that do not cover whole objects are replied as segments, for the caller to
+ * discard on the blockers. Parts of objects that are zero or shared with
+ * other maps are left as they are.
+ */
+static int do_discard(struct peer_req *pr, struct map *map)
+{
+	struct peerd *peer = pr->peer;
+	struct mapper_io *mio = __get_mapper_io(pr);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	uint64_t rem_size, obj_index, obj_offset, obj_size, end, size;
+	uint32_t nr_objs, nr_segs, idx, i, j;
+	struct map_node *mn;
+	struct r2o *mns;
+	char buf[XSEG_MAX_TARGETLEN];
+	struct xseg_reply_map *reply;
+	int r = 0;
+
+	if (map->flags & MF_MAP_READONLY) {
+		XSEGLOG2(&lc, E, "Cannot discard on a read only map");
+		return -1;
+	}
+	if (pr->req->offset + pr->req->size > map->size) {
+		XSEGLOG2(&lc, E, "Invalid offset/size: offset: %llu, "
+				"size: %llu, map size: %llu",
+				pr->req->offset, pr->req->size, map->size);
+		return -1;
+	}
+
+	nr_objs = pr->req->size ? calc_nr_obj(map, pr->req) : 0;
+	mns = malloc(sizeof(struct r2o) * (nr_objs + 1));
+	if (!mns){
+		XSEGLOG2(&lc, E, "Cannot allocate mns");
+		return -1;
+	}
+
+	map->users++;
+	mio->pending_reqs = 0;
+	mio->cb = discard_cb;
+	mio->err = 0;
+
+	idx = 0;
+	rem_size = pr->req->size;
+	obj_index = pr->req->offset / map->blocksize;
+	obj_offset = pr->req->offset & (map->blocksize -1); //modulo
+	while (rem_size > 0) {
+		obj_size = (obj_offset + rem_size > map->blocksize) ?
+			map->blocksize - obj_offset : rem_size;
+		mn = get_mapnode(map, obj_index);
+		if (!mn) {
+			XSEGLOG2(&lc, E, "Cannot find obj_index %llu\n",
+					(unsigned long long) obj_index);
+			r = -1;
+			goto out;
+		}
+		mns[idx].mn = mn;
+		mns[idx].offset = obj_offset;
+		mns[idx].size = obj_size;
+		idx++;
+		if (mn->flags & MF_OBJECT_DELETED) {
+			XSEGLOG2(&lc, E, "Trying to discard deleted object %s",
+					mn->object);
+			r = -1;
+			goto out;
+		}
+		rem_size -= obj_size;
+		obj_index++;
+		obj_offset = 0;
+	}
+
+	nr_segs = 0;
+	for (i = 0; i < idx && !mio->err; i++) {
+		mn = mns[i].mn;
+		/* the last object of the map may be smaller than blocksize */
+		end = mn->objectidx * map->blocksize + mns[i].offset +
+			mns[i].size;
+		if (mns[i].offset || (mns[i].size < map->blocksize &&
+					end < map->size)) {
+			if (object_writable(mn) &&
+					!(mn->flags & MF_OBJECT_ZERO))
+				nr_segs++;
+			continue;
+		}
+		if (mn->state & MF_OBJECT_NOT_READY)
+			wait_on_mapnode(mn, mn->state & MF_OBJECT_NOT_READY);
+		if (mn->flags & MF_OBJECT_ZERO)
+			continue;
+		if (mio->pending_reqs >= MAPPER_DISCARD_BATCH)
+			wait_on_pr(pr, mio->pending_reqs >= MAPPER_DISCARD_BATCH);
+		if (mio->err)
+			break;
+		if (__discard_object(pr, mn) == NULL) {
+			XSEGLOG2(&lc, E, "Error in discard object");
+			mio->err = 1;
+		} else {
+			mio->pending_reqs++;
+		}
+	}
+	if (mio->pending_reqs > 0)
+		wait_on_pr(pr, mio->pending_reqs > 0);
+	if (mio->err) {
+		XSEGLOG2(&lc, E, "Discard of whole objects failed");
+		r = -1;
+		goto out;
+	}
+
+	/* resize request to fit reply */
+	size = sizeof(struct xseg_reply_map) +
+		nr_segs * sizeof(struct xseg_reply_map_scatterlist);
+	strncpy(buf, target, pr->req->targetlen);
+	r = xseg_resize_request(peer->xseg, pr->req, pr->req->targetlen, size);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot resize request");
+		goto out;
+	}
+	target = xseg_get_target(peer->xseg, pr->req);
+	strncpy(target, buf, pr->req->targetlen);
+
+	/* structure reply */
+	reply = (struct xseg_reply_map *) xseg_get_data(peer->xseg, pr->req);
+	reply->cnt = nr_segs;
+	for (i = 0, j = 0; i < idx && j < nr_segs; i++) {
+		mn = mns[i].mn;
+		end = mn->objectidx * map->blocksize + mns[i].offset +
+			mns[i].size;
+		if (!mns[i].offset && (mns[i].size == map->blocksize ||
+					end == map->size))
+			continue;
+		if (!object_writable(mn) ||
+				(mn->flags & MF_OBJECT_ZERO))
+			continue;
+		strncpy(reply->segs[j].target, mn->object, mn->objectlen);
+		reply->segs[j].targetlen = mn->objectlen;
+		reply->segs[j].offset = mns[i].offset;
+		reply->segs[j].size = mns[i].size;
+		reply->segs[j].flags = 0;
+		j++;
+	}
+	/* a node may have changed while waiting on the whole objects */
+	reply->cnt = j;
+	XSEGLOG2(&lc, I, "Discard of map %s, range: %llu-%llu completed. "
+			"Partial objects: %u", map->volume,
+			(unsigned long long) pr->req->offset,
+			(unsigned long long) (pr->req->offset + pr->req->size),
+			reply->cnt);
+out:
+	for (i = 0; i < idx; i++) {
+		put_mapnode(mns[i].mn);
+	}
+	free(mns);
+	mio->cb = NULL;
+	if (--map->users){
+		signal_all_objects_ready(map);
+	}
+	return r;
+}
+
 //here map is the parent map
 static int do_clone(struct peer_req *pr, struct map *map)
 {
@@ -1123,7 +1287,7 @@ static int do_clone(struct peer_req *pr, struct map *map)
 	}
 
 	/* Make sure, we can take at least one snapshot of the new volume */
-	if (map->epoch >= UINT64_MAX - 2) {
+	if (map->epoch >= MAX_MAP_EPOCH - 2) {
 		XSEGLOG2(&lc, E, "Max epoch reached for %s", clonemap->volume);
 		goto out_close;
 	}
@@ -1143,37 +1307,48 @@ static int do_clone(struct peer_req *pr, struct map *map)
 	}
 
 	clonemap->blocksize = MAPPER_DEFAULT_BLOCKSIZE;
-	//alloc and init map_nodes
 	c = calc_map_obj(clonemap);
+	clonemap->nr_objs = c;
+
+	/* Objects of a snapshot are never writable, so a clone of the same
+	 * size can be written straight from the nodes of the snapshot, as
+	 * done when taking the snapshot.
+	 */
+	if (c == map->nr_objs) {
+		clonemap->objects = map->objects;
+		r = write_map(pr, clonemap);
+		clonemap->objects = NULL;
+		if (r < 0){
+			XSEGLOG2(&lc, E, "Cannot write map %s", clonemap->volume);
+			goto out_close;
+		}
+		goto out_done;
+	}
+
+	//alloc and init map_nodes
 	map_nodes = calloc(c, sizeof(struct map_node));
 	if (!map_nodes){
 		goto out_close;
 	}
+	memcpy(map_nodes, map->objects, map->nr_objs * sizeof(struct map_node));
 	clonemap->objects = map_nodes;
-	clonemap->nr_objs = c;
 	for (i = 0; i < c; i++) {
-		mn = get_mapnode(map, i);
-		if (mn) {
-			strncpy(map_nodes[i].object, mn->object, mn->objectlen);
-			map_nodes[i].objectlen = mn->objectlen;
-			map_nodes[i].flags = 0;
-			if (mn->flags & MF_OBJECT_ARCHIP)
-				map_nodes[i].flags |= MF_OBJECT_ARCHIP;
-			if (mn->flags & MF_OBJECT_ZERO)
-				map_nodes[i].flags |= MF_OBJECT_ZERO;
-			put_mapnode(mn);
+		mn = &map_nodes[i];
+		if (i < map->nr_objs) {
+			mn->flags &= MF_OBJECT_ARCHIP | MF_OBJECT_ZERO;
 		} else {
-			strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
-			map_nodes[i].objectlen = ZERO_BLOCK_LEN;
-			map_nodes[i].flags = MF_OBJECT_ZERO;
+			strncpy(mn->object, zero_block, ZERO_BLOCK_LEN);
+			mn->objectlen = ZERO_BLOCK_LEN;
+			mn->object[mn->objectlen] = 0; //NULL terminate
+			mn->flags = MF_OBJECT_ZERO;
 		}
-		map_nodes[i].object[map_nodes[i].objectlen] = 0; //NULL terminate
-		map_nodes[i].state = 0;
-		map_nodes[i].objectidx = i;
-		map_nodes[i].map = clonemap;
-		map_nodes[i].ref = 1;
-		map_nodes[i].waiters = 0;
-		map_nodes[i].cond = st_cond_new(); //FIXME errcheck;
+		mn->epoch = 0;
+		mn->state = 0;
+		mn->objectidx = i;
+		mn->map = clonemap;
+		mn->ref = 1;
+		mn->waiters = 0;
+		mn->cond = NULL;
 	}
 
 	r = write_map(pr, clonemap);
@@ -1182,6 +1357,7 @@ static int do_clone(struct peer_req *pr, struct map *map)
 		goto out_close;
 	}
 
+out_done:
 	XSEGLOG2(&lc, I, "Cloning map %s to %s completed",
 			map->volume, clonemap->volume);
 	close_map(pr, clonemap);
@@ -1219,51 +1395,30 @@ static int truncate_map(struct peer_req *pr, struct map *map, uint64_t offset)
     * extend mapfile with zero blocks.
     */
    if (nr_objs > old_nr_objs) {
-           struct map_node *map_nodes = calloc(nr_objs, sizeof(struct map_node));
+           /* No object is in flight, so the nodes can be moved. Only the
+            * new zero objects need to be initialized.
+            */
+           struct map_node *map_nodes = realloc(map->objects,
+                           nr_objs * sizeof(struct map_node));
            if (!map_nodes) {
                    XSEGLOG2(&lc, E, "Cannot allocate %llu nr_objs", nr_objs);
                    goto out_unset;
            }
+           map->objects = map_nodes;
            uint64_t i;
-           for (i = 0; i < old_nr_objs; i++) {
-                   mn = get_mapnode(map, i);
-                   if (mn) {
-                           strncpy(map_nodes[i].object, mn->object, mn->objectlen);
-                           map_nodes[i].objectlen = mn->objectlen;
-                           map_nodes[i].flags = 0;
-                           if (mn->flags & MF_OBJECT_ARCHIP)
-                                   map_nodes[i].flags |= MF_OBJECT_ARCHIP;
-                           if (mn->flags & MF_OBJECT_ZERO)
-                                   map_nodes[i].flags |= MF_OBJECT_ZERO;
-                           put_mapnode(mn);
-                   } else {
-                           strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
-                           map_nodes[i].objectlen = ZERO_BLOCK_LEN;
-                           map_nodes[i].flags = MF_OBJECT_ZERO;
-                   }
-                   map_nodes[i].object[map_nodes[i].objectlen] = 0;
-                   map_nodes[i].state = 0;
-                   map_nodes[i].objectidx = i;
-                   map_nodes[i].map = map;
-                   map_nodes[i].ref = 1;
-                   map_nodes[i].waiters = 0;
-                   map_nodes[i].cond = st_cond_new();
-           }
-
            for (i = old_nr_objs; i < nr_objs; i++) {
                    strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
                    map_nodes[i].objectlen = ZERO_BLOCK_LEN;
                    map_nodes[i].flags = MF_OBJECT_ZERO;
                    map_nodes[i].object[map_nodes[i].objectlen] = 0;
+                   map_nodes[i].epoch = map->epoch;
                    map_nodes[i].state = 0;
                    map_nodes[i].objectidx = i;
                    map_nodes[i].map = map;
                    map_nodes[i].ref = 1;
                    map_nodes[i].waiters = 0;
-                   map_nodes[i].cond = st_cond_new();
+                   map_nodes[i].cond = NULL;
            }
-           free(map->objects);
-           map->objects = map_nodes;
    }
    map->size = offset;
    map->nr_objs = nr_objs;
@@ -1509,7 +1664,7 @@ void * handle_clone(struct peer_req *pr)
 			r = -1;
 			goto out;
 		}
-		if (map->epoch >= UINT64_MAX - 2) {
+		if (map->epoch >= MAX_MAP_EPOCH - 2) {
 			XSEGLOG2(&lc, E, "Max epoch reached for %s", map->volume);
 			close_map(pr, map);
 			put_map(map);
@@ -1547,7 +1702,7 @@ void * handle_clone(struct peer_req *pr)
 			map_nodes[i].map = map;
 			map_nodes[i].ref = 1;
 			map_nodes[i].waiters = 0;
-			map_nodes[i].cond = st_cond_new(); //FIXME errcheck;
+			map_nodes[i].cond = NULL;
 		}
 		r = write_map(pr, map);
 		if (r < 0){
@@ -1609,7 +1764,7 @@ void * handle_create(struct peer_req *pr)
 		r = -1;
 		goto out;
 	}
-	if (map->epoch >= UINT64_MAX - 2) {
+	if (map->epoch >= MAX_MAP_EPOCH - 2) {
 		XSEGLOG2(&lc, E, "Max epoch reached for %s", map->volume);
 		close_map(pr, map);
 		put_map(map);
@@ -1676,6 +1831,7 @@ void * handle_create(struct peer_req *pr)
 		map_nodes[i].flags = 0;
 		if (!(mapdata->segs[i].flags & XF_MAPFLAG_READONLY)) {
 			map_nodes[i].flags |= MF_OBJECT_WRITABLE;
+			map_nodes[i].epoch = map->epoch;
 		}
 		if (!strncmp(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN)) {
 			map_nodes[i].flags |= MF_OBJECT_ZERO;
@@ -1689,7 +1845,7 @@ void * handle_create(struct peer_req *pr)
 		map_nodes[i].map = map;
 		map_nodes[i].ref = 1;
 		map_nodes[i].waiters = 0;
-		map_nodes[i].cond = st_cond_new(); //FIXME errcheck;
+		map_nodes[i].cond = NULL;
 	}
 
 
@@ -1742,6 +1898,20 @@ void * handle_mapw(struct peer_req *pr)
 	return NULL;
 }
 
+void * handle_discard(struct peer_req *pr)
+{
+	struct peerd *peer = pr->peer;
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	int r = map_action(do_discard, pr, target, pr->req->targetlen,
+				MF_ARCHIP|MF_LOAD|MF_EXCLUSIVE|MF_FORCE);
+	if (r < 0)
+		fail(peer, pr);
+	else
+		complete(peer, pr);
+	ta--;
+	return NULL;
+}
+
 void * handle_destroy(struct peer_req *pr)
 {
 	struct peerd *peer = pr->peer;
@@ -1854,13 +2024,40 @@ void * handle_truncate(struct peer_req *pr)
 }
 
 
+/*
+ * Pass the request on to the partition that owns its volume. Requests that
+ * involve a second volume (clone, snapshot, rename) are handled by the
+ * partition of their target, which opens the second map itself. The storage
+ * lock of the map keeps them safe, as with mappers of different hosts.
+ */
+static int forward_to_partition(struct peerd *peer, struct peer_req *pr)
+{
+	struct mapperd *mapper = __get_mapperd(peer);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	uint32_t partition;
+
+	partition = mapper_partition(target, pr->req->targetlen,
+			mapper->nr_partitions);
+	if (partition == mapper->partition)
+		return 0;
+
+	XSEGLOG2(&lc, D, "Forwarding request %lx to partition %u",
+			pr->req, partition);
+	if (forward_request(peer, pr, mapper->partition_port + partition) < 0)
+		fail(peer, pr);
+	return 1;
+}
+
 int dispatch_accepted(struct peerd *peer, struct peer_req *pr,
 			struct xseg_request *req)
 {
-	//struct mapperd *mapper = __get_mapperd(peer);
+	struct mapperd *mapper = __get_mapperd(peer);
 	struct mapper_io *mio = __get_mapper_io(pr);
 	void *(*action)(struct peer_req *) = NULL;
 
+	if (mapper->nr_partitions > 1 && forward_to_partition(peer, pr))
+		return 0;
+
 	//mio->state = ACCEPTED;
 	mio->err = 0;
 	mio->cb = NULL;
@@ -1871,6 +2068,7 @@ int dispatch_accepted(struct peerd *peer, struct peer_req *pr,
 		case X_CLONE: action = handle_clone; break;
 		case X_MAPR: action = handle_mapr; break;
 		case X_MAPW: action = handle_mapw; break;
+		case X_DISCARD: action = handle_discard; break;
 		case X_SNAPSHOT: action = handle_snapshot; break;
 		case X_INFO: action = handle_info; break;
 		case X_DELETE: action = handle_destroy; break;
@@ -1945,10 +2143,20 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	peer->priv = mapper;
 	//mapper = mapperd;
 	mapper->hashmaps = xhash_new(3, 0, XHASH_STRING);
+	/*
+	 * The requests of all map I/O are indexed together. The index is
+	 * sized for the most requests the mapper may have in flight, so it
+	 * never grows.
+	 */
+	if (xindex_init(&mapper->copyups_nodes, MAPPER_MAX_REQUESTS, NULL,
+				XINDEX_INTEGER, NULL) < 0) {
+		XSEGLOG2(&lc, E, "Cannot allocate index of requests");
+		return -1;
+	}
 
 	for (i = 0; i < peer->nr_ops; i++) {
 		struct mapper_io *mio = malloc(sizeof(struct mapper_io));
-		mio->copyups_nodes = xhash_new(3, 0, XHASH_INTEGER);
+		mio->copyups_nodes = &mapper->copyups_nodes;
 		mio->pending_reqs = 0;
 		mio->err = 0;
 		mio->active = 0;
@@ -1957,9 +2165,14 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 
 	mapper->bportno = -1;
 	mapper->mbportno = -1;
+	mapper->nr_partitions = 1;
+	mapper->partition = 0;
+	mapper->partition_port = peer->portno_start;
 	BEGIN_READ_ARGS(argc, argv);
 	READ_ARG_ULONG("-bp", mapper->bportno);
 	READ_ARG_ULONG("-mbp", mapper->mbportno);
+	READ_ARG_ULONG("--partitions", mapper->nr_partitions);
+	READ_ARG_ULONG("--partition-port", mapper->partition_port);
 	END_READ_ARGS();
 	if (mapper->bportno == -1){
 		XSEGLOG2(&lc, E, "Portno for blocker must be provided");
@@ -1971,13 +2184,33 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		usage(argv[0]);
 		return -1;
 	}
+	if (!mapper->nr_partitions) {
+		XSEGLOG2(&lc, E, "partitions must be positive");
+		return -1;
+	}
+	if (mapper->nr_partitions > 1) {
+		if (peer->portno_start != peer->portno_end ||
+				peer->portno_start < mapper->partition_port ||
+				peer->portno_start >= mapper->partition_port +
+				mapper->nr_partitions) {
+			XSEGLOG2(&lc, E, "A partition must listen on a single "
+					"port of the %u ports starting at %u",
+					mapper->nr_partitions,
+					mapper->partition_port);
+			return -1;
+		}
+		mapper->partition = peer->portno_start - mapper->partition_port;
+		XSEGLOG2(&lc, I, "Mapper partition %u of %u",
+				mapper->partition, mapper->nr_partitions);
+	}
 
 	const struct sched_param param = { .sched_priority = 99 };
 	sched_setscheduler(syscall(SYS_gettid), SCHED_FIFO, &param);
 	/* FIXME maybe place it in peer
 	 * should be done for each port (sportno to eportno)
 	 */
-	xseg_set_max_requests(peer->xseg, peer->portno_start, 5000);
+	xseg_set_max_requests(peer->xseg, peer->portno_start,
+			MAPPER_MAX_REQUESTS);
 	xseg_set_freequeue_size(peer->xseg, peer->portno_start, 3000, 0);
 
 	req_cond = st_cond_new();
@@ -24,14 +24,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <hash.h>
 #include <peer.h>
 #include <xseg/protocol.h>
+#include <xindex.h>
+#include <mapper-partition.h>
 #include <mapper-version0.h>
 #include <mapper-version1.h>
 #include <mapper-version2.h>
+#include <mapper-version3.h>
 
 /* Alternative, each header file could define an appropriate MAP_V# */
-enum {MAP_V0, MAP_V1, MAP_V2};
-#define MAP_LATEST_VERSION MAP_V2
-#define MAP_LATEST_MOPS &v2_ops
+enum {MAP_V0, MAP_V1, MAP_V2, MAP_V3};
+#define MAP_LATEST_VERSION MAP_V3
+#define MAP_LATEST_MOPS &v3_ops
+
+/* maximum epoch of a map, bounded by the epochs kept for the objects */
+#define MAX_MAP_EPOCH ((uint64_t)v3_max_epoch)
 
 struct header_struct {
 	uint32_t signature;
@@ -62,6 +68,10 @@ struct header_struct {
 #error 	"XSEG_MAX_TARGETLEN should be at least MAX_OBJECT_LEN"
 #endif
 
+#if MAX_OBJECT_LEN < v3_max_objectlen
+#error "MAX_OBJECT_LEN is smaller than v3_max_objectlen"
+#endif
+
 #if MAX_OBJECT_LEN < v2_max_objectlen
 #error "MAX_OBJECT_LEN is smaller than v2_max_objectlen"
 #endif
@@ -116,6 +126,8 @@ struct map_ops {
 #define MF_ARCHIP	(1 << 3)
 
 #define MAPPER_DEFAULT_BLOCKSIZE (1<<22)
+#define MAPPER_DISCARD_BATCH 32	/* whole objects discarded at once */
+#define MAPPER_MAX_REQUESTS 5000	/* requests of the mapper in flight */
 
 #define MAPPER_PREFIX "archip_"
 #define MAPPER_PREFIX_LEN 7
@@ -156,10 +168,11 @@ struct map_node {
 	uint64_t objectidx;	/* FIXME this is probably not needed */
 	uint32_t objectlen;
 	char object[MAX_OBJECT_LEN + 1]; 	/* NULL terminated string */
+	uint64_t epoch;		/* map epoch the object was written in */
 	struct map *map;
 	volatile uint32_t ref;
 	volatile uint32_t waiters;
-	st_cond_t cond;
+	st_cond_t cond;		/* created on the first wait */
 };
 
 
@@ -224,10 +237,14 @@ struct mapperd {
 	xport bportno;		/* blocker that accesses data */
 	xport mbportno;		/* blocker that accesses maps */
 	xhash_t *hashmaps; // hash_function(target) --> struct map
+	struct xindex copyups_nodes;	/* (xseg_request) --> (map_node) */
+	uint32_t nr_partitions;	/* mapperd processes sharing the maps */
+	uint32_t partition;	/* partition of this mapperd */
+	xport partition_port;	/* port of the first partition */
 };
 
 struct mapper_io {
-	xhash_t *copyups_nodes;		/* hash map (xseg_request) --> (corresponding map_node of copied up object)*/
+	struct xindex *copyups_nodes;	/* index of the mapper: (xseg_request) --> (corresponding map_node of copied up object)*/
 	volatile int err;		/* error flag */
 	cb_t cb;
 	volatile int active;
@@ -246,8 +263,11 @@ struct mapper_io {
 		st_cond_wait(__pr->cond);	\
 	} while (__condition__)
 
+/* map nodes get a condition variable only when a thread first waits on them */
 #define wait_on_mapnode(__mn, __condition__)	\
 	do {					\
+		if (!__mn->cond)		\
+			__mn->cond = st_cond_new();	\
 		ta--;				\
 		__mn->waiters++;		\
 		XSEGLOG2(&lc, D, "Waiting on map node %lx %s, waiters: %u, \
@@ -347,6 +367,18 @@ static inline uint64_t calc_map_obj(struct map *map)
 	return __calc_map_obj(map->size, map->blocksize);
 }
 
+/*
+ * An object is writable iff it was written by the map in its current epoch.
+ * Objects of older epochs are shared with snapshots and must be copied up.
+ * Objects of read only maps are never writable, so their nodes can be shared
+ * with clones.
+ */
+static inline int object_writable(struct map_node *mn)
+{
+	return (mn->flags & MF_OBJECT_WRITABLE) && mn->epoch == mn->map->epoch
+		&& !(mn->map->flags & MF_MAP_READONLY);
+}
+
 static inline int is_valid_blocksize(uint64_t x) {
 	   return (x && !(x & (x - 1)) && x > MIN_BLOCKSIZE);
 }
@@ -385,4 +417,6 @@ struct map_node * get_mapnode(struct map *map, uint64_t objindex);
 void put_mapnode(struct map_node *mn);
 struct xseg_request * __object_delete(struct peer_req *pr, struct map_node *mn);
 void object_delete_cb(struct peer_req *pr, struct xseg_request *req);
+struct xseg_request * __discard_object(struct peer_req *pr, struct map_node *mn);
+void discard_cb(struct peer_req *pr, struct xseg_request *req);
 #endif /* end MAPPER_H */
@@ -16,28 +16,88 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <pthread.h>
 #include <xseg/xseg.h>
 #include <peer.h>
 #include <sys/time.h>
+#include <xtrace.h>
 
 #define INPUT_BUF_SIZE 256
 #define MAX_NR_ARGS 100
 
 struct monitord {
 	uint32_t mon_portno;
+	int tracing;
+	struct xtrace trace;
+	pthread_mutex_t trace_lock;
 };
 
 struct monitor_io {
 	uint32_t src_portno;
 	void *src_priv;
+	struct timespec start;	/* when the request was forwarded */
 };
 
 void custom_peer_usage()
 {
-	return;
+	fprintf(stderr, "Custom peer options:\n"
+		"  --trace <path>: Record the forwarded requests to a trace\n"
+		"                  file, which can be replayed by archip-bench\n"
+		"\n");
+}
+
+/*
+ * Record a request that has been completed by its destination. The trace is
+ * shared by all peer threads.
+ */
+static void trace_request(struct peerd *peer, struct peer_req *pr)
+{
+	struct monitord *monitor = peer->priv;
+	struct monitor_io *mio = pr->priv;
+	struct xseg_request *req = pr->req;
+	struct xtrace_record rec;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ts = xtrace_ts(&monitor->trace, &mio->start);
+	rec.latency = xtrace_ts(&monitor->trace, &now) - rec.ts;
+	rec.offset = req->offset;
+	rec.size = req->size;
+	rec.op = req->op;
+	rec.flags = req->flags;
+	rec.targetlen = req->targetlen;
+	rec.state = (req->state & XS_SERVED) ? XTRACE_SERVED : XTRACE_FAILED;
+
+	pthread_mutex_lock(&monitor->trace_lock);
+	if (monitor->tracing && xtrace_write(&monitor->trace, &rec,
+				xseg_get_target(peer->xseg, req)) < 0) {
+		XSEGLOG2(&lc, E, "Cannot write to trace: %s", strerror(errno));
+		monitor->tracing = 0;
+	}
+	pthread_mutex_unlock(&monitor->trace_lock);
+}
+
+static void stop_tracing(struct peerd *peer)
+{
+	struct monitord *monitor = peer->priv;
+
+	pthread_mutex_lock(&monitor->trace_lock);
+	if (monitor->tracing) {
+		XSEGLOG2(&lc, I, "Recorded %llu requests",
+				(unsigned long long)monitor->trace.records);
+		if (xtrace_close(&monitor->trace) < 0)
+			XSEGLOG2(&lc, E, "Cannot close trace: %s",
+					strerror(errno));
+		monitor->tracing = 0;
+	}
+	pthread_mutex_unlock(&monitor->trace_lock);
 }
 
 static int forward(struct peerd *peer, struct peer_req *pr)
@@ -70,13 +130,19 @@ static int complete_forwarded(struct peerd *peer, struct peer_req *pr)
 int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *xreq,
 		enum dispatch_reason reason)
 {
+	struct monitord *monitor = peer->priv;
+	struct monitor_io *mio = pr->priv;
 	struct xseg_request *req = pr->req;
 	if (req->state & (XS_SERVED | XS_FAILED)){
 		log_pr("completing", pr);
+		if (monitor->tracing)
+			trace_request(peer, pr);
 		complete_forwarded(peer, pr);
 	}
 	else {
 		log_pr("forwarding", pr);
+		if (monitor->tracing)
+			clock_gettime(CLOCK_MONOTONIC, &mio->start);
 		forward(peer,pr);
 	}
 	return 0;
@@ -162,8 +228,10 @@ void main_loop(void)
 				continue;
 			};
 		}
-		else
+		else {
+			stop_tracing(peer);
 			exit(0);
+		}
 	}
 }
 
@@ -178,6 +246,8 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		return -1;
 	peer->priv = monitor;
 	monitor->mon_portno = NoPort;
+	monitor->tracing = 0;
+	pthread_mutex_init(&monitor->trace_lock, NULL);
 	
 	
 	for (i = 0; i < peer->nr_ops; i++) {
@@ -194,6 +264,16 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 			i+=1;
 			continue;
 		}
+		if (!strcmp(argv[i], "--trace") && (i + 1 < argc)) {
+			if (xtrace_create(&monitor->trace, argv[i+1]) < 0) {
+				XSEGLOG2(&lc, E, "Cannot create trace %s: %s",
+						argv[i+1], strerror(errno));
+				return -1;
+			}
+			monitor->tracing = 1;
+			i+=1;
+			continue;
+		}
 	}
 	main_peer = peer;
 
@@ -204,5 +284,6 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 
 void custom_peer_finalize(struct peerd *peer)
 {
+	stop_tracing(peer);
 	return;
 }
@@ -21,30 +21,44 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xseg.h>
 #include <xseg/protocol.h>
 #include <peer.h>
+#include <xindex.h>
+#include <mapper-partition.h>
 #include <sched.h>
 #include <sys/syscall.h>
+#include <time.h>
+#include <vlmcd.h>
 
 enum io_state_enum {
 	ACCEPTED = 0,
 	MAPPING = 1,
 	SERVING = 2,
-	CONCLUDED = 3
+	CONCLUDED = 3,
+	CACHE_FLUSHING = 4
 };
 
 #define VF_VOLUME_FROZEN (1 << 0)
 
+#define VLMC_DEFAULT_MAX_DISCARDS 2
+
 struct volume_info{
 	char name[XSEG_MAX_TARGETLEN + 1];
 	uint32_t flags;
 	uint32_t active_reqs;
 	struct xq *pending_reqs;
 	struct peer_req *pending_pr;
+	/* discard batches in flight and discards waiting for them */
+	uint32_t discards;
+	struct peer_req *discards_head, *discards_tail;
+	xindex_handler h;	/* in the index of volumes, while open */
 };
 
 struct vlmcd {
 	xport mportno;
 	xport bportno;
-	xhash_t *volumes; //hash [volumename] -> struct volume_info
+	struct xindex volumes; //index [volumename] -> struct volume_info
+	unsigned long max_discards;	/* discard batches per volume */
+	int cache_flush;		/* the blocker is a write-back cache */
+	unsigned long mapper_partitions;	/* mapperd processes at mportno */
 };
 
 struct vlmc_io {
@@ -54,6 +68,9 @@ struct vlmc_io {
 	struct xseg_request *mreq;
 	struct xseg_request **breqs;
 	unsigned long breq_len, breq_cnt;
+	struct vlmc_timing *timing;	/* requested by the client, if any */
+	struct timespec accepted, mapping, serving;
+	struct peer_req *next_discard;	/* next discard of the batch/queue */
 };
 
 void custom_peer_usage()
@@ -61,7 +78,21 @@ void custom_peer_usage()
 	fprintf(stderr, "Custom peer options: \n"
 			"-mp : mapper port\n"
 			"-bp : blocker port for blocks\n"
-			"\n");
+			"--max-discards : discard batches of a volume in flight "
+			"(default: %d)\n"
+			"--cache-flush : flush the volume at the blocker port on "
+			"flushes and closes\n"
+			"--mapper-partitions : mappers on consecutive ports from "
+			"the mapper port, sharing the volumes (default: 1)\n"
+			"\n", VLMC_DEFAULT_MAX_DISCARDS);
+}
+
+/* The mapper partition that handles the volume */
+static inline xport mapper_port(struct vlmcd *vlmc, char *target,
+		uint32_t targetlen)
+{
+	return vlmc->mportno + mapper_partition(target, targetlen,
+			vlmc->mapper_partitions);
 }
 
 static inline void __set_vio_state(struct vlmc_io *vio, enum io_state_enum state)
@@ -76,6 +107,57 @@ static inline enum io_state_enum __get_vio_state(struct vlmc_io *vio)
 	return state;
 }
 
+static inline uint64_t __elapsed_ns(struct timespec *start,
+		struct timespec *end)
+{
+	if (!start->tv_sec && !start->tv_nsec)
+		return 0;
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+}
+
+/* Return the timing the client asked for, see vlmcd.h */
+static struct vlmc_timing * __get_timing(struct peerd *peer,
+		struct xseg_request *req)
+{
+	struct vlmc_timing *timing;
+
+	if (req->op != X_READ && req->op != X_WRITE)
+		return NULL;
+	if (req->datalen < req->size + sizeof(struct vlmc_timing))
+		return NULL;
+	timing = (struct vlmc_timing *)(xseg_get_data(peer->xseg, req) +
+			req->size);
+	if (timing->magic != VLMC_TIMING_REQUEST)
+		return NULL;
+	return timing;
+}
+
+static void fill_timing(struct vlmc_io *vio)
+{
+	struct vlmc_timing *timing = vio->timing;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (vio->mapping.tv_sec || vio->mapping.tv_nsec) {
+		timing->queue = __elapsed_ns(&vio->accepted, &vio->mapping);
+		if (vio->serving.tv_sec || vio->serving.tv_nsec) {
+			timing->map = __elapsed_ns(&vio->mapping,
+					&vio->serving);
+			timing->io = __elapsed_ns(&vio->serving, &now);
+		} else {
+			timing->map = __elapsed_ns(&vio->mapping, &now);
+			timing->io = 0;
+		}
+	} else {
+		timing->queue = __elapsed_ns(&vio->accepted, &now);
+		timing->map = 0;
+		timing->io = 0;
+	}
+	timing->magic = VLMC_TIMING_REPLY;
+	vio->timing = NULL;
+}
+
 static inline struct vlmc_io * __get_vlmcio(struct peer_req *pr)
 {
 	return (struct vlmc_io *) pr->priv;
@@ -123,16 +205,53 @@ static int doubleup_queue(struct volume_info *vi)
 	return 0;
 }
 
+/*
+ * Volumes are indexed from their first request until they are closed. Their
+ * volume_info is allocated with the node of the index, once, and is reused
+ * along with its queue of pending requests.
+ */
+static void * volume_node_init(void *index_data)
+{
+	return calloc(1, sizeof(struct volume_info));
+}
+
+static int volume_init(void *index_data, void *user_data)
+{
+	struct volume_info *vi = (struct volume_info *) user_data;
+
+	vi->flags = 0;
+	vi->pending_pr = NULL;
+	vi->active_reqs = 0;
+	vi->discards = 0;
+	vi->discards_head = NULL;
+	vi->discards_tail = NULL;
+	return 0;
+}
+
+static void volume_free(void *index_data, void *user_data)
+{
+	struct volume_info *vi = (struct volume_info *) user_data;
+
+	if (vi->pending_reqs) {
+		xq_free(vi->pending_reqs);
+		free(vi->pending_reqs);
+	}
+	free(vi);
+}
+
 static struct volume_info * find_volume(struct vlmcd *vlmc, char *volume)
 {
 	struct volume_info *vi = NULL;
+	xindex_handler h;
 	XSEGLOG2(&lc, D, "looking up volume %s", volume);
-	int r = xhash_lookup(vlmc->volumes, (xhashidx) volume,
-			(xhashidx *) &vi);
-	if (r < 0){
+	h = xindex_lookup(&vlmc->volumes, volume);
+	if (h == NoIndexEntry){
 		XSEGLOG2(&lc, D, "looking up volume %s failed", volume);
 		return NULL;
 	}
+	/* the volume is kept by the reference it was inserted with */
+	vi = xindex_get_entry(&vlmc->volumes, h);
+	xindex_put(&vlmc->volumes, h);
 	XSEGLOG2(&lc, D, "looking up volume %s completed. VI: %lx",
 			volume, (unsigned long)vi);
 	return vi;
@@ -150,66 +269,44 @@ static struct volume_info * find_volume_len(struct vlmcd *vlmc, char *target,
 
 }
 
-static int insert_volume(struct vlmcd *vlmc, struct volume_info *vi)
+static struct volume_info * insert_volume(struct vlmcd *vlmc, char *name)
 {
-	int r = -1;
+	struct volume_info *vi;
+	xindex_handler h, old;
 
-	if (find_volume(vlmc, vi->name)){
-		XSEGLOG2(&lc, W, "Volume %s found in hash", vi->name);
-		return r;
+	XSEGLOG2(&lc, D, "Inserting volume %s, len: %d", name, strlen(name));
+	h = xindex_alloc_init(&vlmc->volumes, name);
+	if (h == NoIndexEntry){
+		XSEGLOG2(&lc, E, "Cannot allocate volume %s", name);
+		return NULL;
 	}
-
-	XSEGLOG2(&lc, D, "Inserting volume %s, len: %d (volume_info: %lx)", 
-			vi->name, strlen(vi->name), (unsigned long) vi);
-	r = xhash_insert(vlmc->volumes, (xhashidx) vi->name, (xhashidx) vi);
-	while (r == -XHASH_ERESIZE) {
-		xhashidx shift = xhash_grow_size_shift(vlmc->volumes);
-		xhash_t *new_hashmap = xhash_resize(vlmc->volumes, shift, 0, NULL);
-		if (!new_hashmap){
-			XSEGLOG2(&lc, E, "Cannot grow vlmc->volumes to sizeshift %llu",
-					(unsigned long long) shift);
-			return r;
-		}
-		vlmc->volumes = new_hashmap;
-		r = xhash_insert(vlmc->volumes, (xhashidx) vi->name, (xhashidx) vi);
+	vi = xindex_get_entry(&vlmc->volumes, h);
+	strcpy(vi->name, name);
+	old = xindex_insert(&vlmc->volumes, h);
+	if (old != h){
+		XSEGLOG2(&lc, W, "Volume %s found in hash", name);
+		if (old != NoIndexEntry)
+			xindex_put(&vlmc->volumes, old);
+		xindex_put(&vlmc->volumes, h);
+		return NULL;
 	}
+	vi->h = h;
 	XSEGLOG2(&lc, D, "Inserting volume %s, len: %d (volume_info: %lx) completed", 
 			vi->name, strlen(vi->name), (unsigned long) vi);
-
-	return r;
-
+	return vi;
 }
 
-static int remove_volume(struct vlmcd *vlmc, struct volume_info *vi)
+static void remove_volume(struct vlmcd *vlmc, struct volume_info *vi)
 {
-	int r = -1;
-
 	XSEGLOG2(&lc, D, "Removing volume %s, len: %d (volume_info: %lx)", 
 			vi->name, strlen(vi->name), (unsigned long) vi);
-	r = xhash_delete(vlmc->volumes, (xhashidx) vi->name);
-	while (r == -XHASH_ERESIZE) {
-		xhashidx shift = xhash_shrink_size_shift(vlmc->volumes);
-		xhash_t *new_hashmap = xhash_resize(vlmc->volumes, shift, 0, NULL);
-		if (!new_hashmap){
-			XSEGLOG2(&lc, E, "Cannot shrink vlmc->volumes to sizeshift %llu",
-					(unsigned long long) shift);
-			XSEGLOG2(&lc, E, "Removing volume %s, (volume_info: %lx) failed", 
-					vi->name, (unsigned long) vi);
-			return r;
-		}
-		vlmc->volumes = new_hashmap;
-		r = xhash_delete(vlmc->volumes, (xhashidx) vi->name);
-	}
-	if (r < 0)
-		XSEGLOG2(&lc, W, "Removing volume %s, len: %d (volume_info: %lx) failed", 
-			vi->name, strlen(vi->name), (unsigned long) vi);
-	else
-		XSEGLOG2(&lc, D, "Removing volume %s, len: %d (volume_info: %lx) completed", 
-			vi->name, strlen(vi->name), (unsigned long) vi);
-	return r;
+	xindex_put(&vlmc->volumes, vi->h);
 }
 
 static int do_accepted_pr(struct peerd *peer, struct peer_req *pr);
+static int do_mapping(struct peerd *peer, struct peer_req *pr,
+		struct volume_info *vi);
+static void start_discards(struct peerd *peer, struct volume_info *vi);
 
 static int conclude_pr(struct peerd *peer, struct peer_req *pr)
 {
@@ -221,6 +318,10 @@ static int conclude_pr(struct peerd *peer, struct peer_req *pr)
 	XSEGLOG2(&lc, D, "Concluding pr %lx, req: %lx vi: %lx", pr, pr->req, vi);
 
 	__set_vio_state(vio, CONCLUDED);
+	if (vio->timing)
+		fill_timing(vio);
+	if (pr->req->op == X_DISCARD)
+		pr->req->serviced = vio->err ? 0 : pr->req->size;
 	if (vio->err)
 		fail(peer, pr);
 	else
@@ -238,6 +339,140 @@ static int conclude_pr(struct peerd *peer, struct peer_req *pr)
 	return 0;
 }
 
+/*
+ * Discards.
+ *
+ * A fstrim of a large volume sends a flood of discards. To keep it from
+ * flooding the mapper, at most max_discards batches of discards of a volume
+ * are sent to the mapper at a time. The discards that arrive meanwhile are
+ * queued, and when a batch concludes, the queued discards that are contiguous
+ * to each other are sent as the next batch, with a single mapper request. The
+ * mapper discards the whole objects of the batch and replies with the parts of
+ * objects left, which are discarded on the blockers.
+ */
+static int conclude_discard(struct peerd *peer, struct peer_req *pr)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct vlmc_io *vio = __get_vlmcio(pr);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	struct volume_info *vi = find_volume_len(vlmc, target, pr->req->targetlen);
+	struct peer_req *next;
+	int err = vio->err;
+
+	XSEGLOG2(&lc, D, "Concluding discard batch of pr %lx", pr);
+	while (pr) {
+		vio = __get_vlmcio(pr);
+		next = vio->next_discard;
+		vio->next_discard = NULL;
+		vio->err = err;
+		conclude_pr(peer, pr);
+		pr = next;
+	}
+
+	if (vi) {
+		vi->discards--;
+		start_discards(peer, vi);
+	}
+	return 0;
+}
+
+static int send_discard(struct peerd *peer, struct peer_req *pr,
+		uint64_t offset, uint64_t size)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct vlmc_io *vio = __get_vlmcio(pr);
+	char *target, *mtarget;
+	void *dummy;
+	int r;
+	xport p;
+
+	target = xseg_get_target(peer->xseg, pr->req);
+	vio->mreq = xseg_get_request(peer->xseg, pr->portno,
+			mapper_port(vlmc, target, pr->req->targetlen), X_ALLOC);
+	if (!vio->mreq)
+		goto out_err;
+
+	/* use datalen 0. let mapper allocate buffer space as needed */
+	r = xseg_prep_request(peer->xseg, vio->mreq, pr->req->targetlen, 0);
+	if (r < 0)
+		goto out_put;
+	mtarget = xseg_get_target(peer->xseg, vio->mreq);
+	if (!mtarget)
+		goto out_put;
+
+	strncpy(mtarget, target, pr->req->targetlen);
+	vio->mreq->op = X_DISCARD;
+	vio->mreq->offset = offset;
+	vio->mreq->size = size;
+	vio->mreq->flags = 0;
+	xseg_set_req_data(peer->xseg, vio->mreq, pr);
+	__set_vio_state(vio, MAPPING);
+	peer_trace(pr, vio->mreq, PEER_TRACE_SUBMIT);
+	p = xseg_submit(peer->xseg, vio->mreq, pr->portno, X_ALLOC);
+	if (p == NoPort)
+		goto out_unset;
+	r = xseg_signal(peer->xseg, p);
+	if (r < 0)
+		XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+	XSEGLOG2(&lc, I, "Discard batch of pr %lx, range: %llu-%llu sent", pr,
+			(unsigned long long) offset,
+			(unsigned long long) (offset + size));
+	return 0;
+
+out_unset:
+	xseg_get_req_data(peer->xseg, vio->mreq, &dummy);
+out_put:
+	xseg_put_request(peer->xseg, vio->mreq, pr->portno);
+	vio->mreq = NULL;
+out_err:
+	XSEGLOG2(&lc, E, "Cannot send discard batch of pr %lx", pr);
+	return -1;
+}
+
+/* Send the queued discards of a volume, in batches, as far as allowed */
+static void start_discards(struct peerd *peer, struct volume_info *vi)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct peer_req *pr, *last;
+	uint64_t offset, end;
+
+	while (vi->discards < vlmc->max_discards && vi->discards_head) {
+		pr = last = vi->discards_head;
+		offset = pr->req->offset;
+		end = offset + pr->req->size;
+		vi->discards_head = __get_vlmcio(pr)->next_discard;
+		while (vi->discards_head &&
+				vi->discards_head->req->offset == end) {
+			last = vi->discards_head;
+			end += last->req->size;
+			vi->discards_head = __get_vlmcio(last)->next_discard;
+		}
+		__get_vlmcio(last)->next_discard = NULL;
+		if (!vi->discards_head)
+			vi->discards_tail = NULL;
+
+		vi->discards++;
+		if (send_discard(peer, pr, offset, end - offset) < 0) {
+			__get_vlmcio(pr)->err = 1;
+			conclude_discard(peer, pr);
+			/* conclude_discard started the rest */
+			return;
+		}
+	}
+}
+
+static void queue_discard(struct peerd *peer, struct volume_info *vi,
+		struct peer_req *pr)
+{
+	__get_vlmcio(pr)->next_discard = NULL;
+	if (vi->discards_tail)
+		__get_vlmcio(vi->discards_tail)->next_discard = pr;
+	else
+		vi->discards_head = pr;
+	vi->discards_tail = pr;
+	start_discards(peer, vi);
+}
+
 static int should_freeze_volume(struct xseg_request *req)
 {
 	if (req->op == X_CLOSE || req->op == X_SNAPSHOT || req->op == X_DELETE || 
@@ -247,14 +482,110 @@ static int should_freeze_volume(struct xseg_request *req)
 	return 0;
 }
 
-static int do_accepted_pr(struct peerd *peer, struct peer_req *pr)
+//FIXME Remove this suboperation of X_WRITE. Support only X_FLUSH.
+static int is_flush(struct xseg_request *req)
+{
+	return req->op == X_FLUSH || (req->op == X_WRITE && !req->size &&
+			(req->flags & (XF_FLUSH|XF_FUA)));
+}
+
+/*
+ * Complete a flush request, or a close whose cache flush failed, unfreeze
+ * the volume and start serving its pending requests.
+ */
+static void conclude_flush(struct peerd *peer, struct peer_req *pr,
+		struct volume_info *vi)
+{
+	xqindex xqi;
+
+	vi->flags &= ~VF_VOLUME_FROZEN;
+	XSEGLOG2(&lc, I, "Completing flush request");
+	pr->req->serviced = pr->req->op == X_WRITE ? pr->req->size : 0;
+	conclude_pr(peer, pr);
+	while (vi->pending_reqs && !(vi->flags & VF_VOLUME_FROZEN) &&
+			(xqi = __xq_pop_head(vi->pending_reqs)) != Noneidx) {
+		struct peer_req *ppr = (struct peer_req *) xqi;
+		do_accepted_pr(peer, ppr);
+	}
+}
+
+/*
+ * With --cache-flush, the blocker port is a write-back cache (wbcached), so
+ * the volume is flushed there too, with an X_FLUSH on the volume itself,
+ * before a flush completes or a close is sent to the mapper.
+ */
+static int send_cache_flush(struct peerd *peer, struct peer_req *pr,
+		struct volume_info *vi)
 {
 	struct vlmcd *vlmc = __get_vlmcd(peer);
 	struct vlmc_io *vio = __get_vlmcio(pr);
-	int r;
-	xport p;
-	char *target, *mtarget;
+	struct xseg_request *breq;
+	uint32_t targetlen = strlen(vi->name);
 	void *dummy;
+	xport p;
+	int r;
+
+	breq = xseg_get_request(peer->xseg, pr->portno, vlmc->bportno, X_ALLOC);
+	if (!breq)
+		goto out_err;
+	r = xseg_prep_request(peer->xseg, breq, targetlen, 0);
+	if (r < 0)
+		goto out_put;
+	strncpy(xseg_get_target(peer->xseg, breq), vi->name, targetlen);
+	breq->op = X_FLUSH;
+	breq->offset = 0;
+	breq->size = 0;
+	breq->flags = 0;
+	r = xseg_set_req_data(peer->xseg, breq, pr);
+	if (r < 0)
+		goto out_put;
+	__set_vio_state(vio, CACHE_FLUSHING);
+	peer_trace(pr, breq, PEER_TRACE_SUBMIT);
+	p = xseg_submit(peer->xseg, breq, pr->portno, X_ALLOC);
+	if (p == NoPort)
+		goto out_unset;
+	r = xseg_signal(peer->xseg, p);
+	if (r < 0)
+		XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+	return 0;
+
+out_unset:
+	xseg_get_req_data(peer->xseg, breq, &dummy);
+out_put:
+	xseg_put_request(peer->xseg, breq, pr->portno);
+out_err:
+	XSEGLOG2(&lc, E, "Cannot flush volume %s at the cache", vi->name);
+	vio->err = 1;
+	conclude_flush(peer, pr, vi);
+	return -1;
+}
+
+static int handle_cache_flush(struct peerd *peer, struct peer_req *pr,
+		struct xseg_request *req)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct vlmc_io *vio = __get_vlmcio(pr);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	struct volume_info *vi = find_volume_len(vlmc, target, pr->req->targetlen);
+
+	if (!(req->state & XS_SERVED)) {
+		XSEGLOG2(&lc, E, "Flush of volume %s at the cache failed",
+				vi->name);
+		vio->err = 1;
+	}
+	xseg_put_request(peer->xseg, req, pr->portno);
+
+	if (pr->req->op == X_CLOSE && !vio->err)
+		return do_mapping(peer, pr, vi);
+	conclude_flush(peer, pr, vi);
+	return 0;
+}
+
+static int do_accepted_pr(struct peerd *peer, struct peer_req *pr)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct vlmc_io *vio = __get_vlmcio(pr);
+	char *target;
 
 	struct volume_info *vi;
 
@@ -298,43 +629,40 @@ static int do_accepted_pr(struct peerd *peer, struct peer_req *pr)
 
 	vio->err = 0; //reset error state
 
-	if (pr->req->op == X_FLUSH) {
-               /* We have no active requests here.
-                * Unfreeze volume and start serving waiting/pending requests.
-                */
-		vi->flags &= ~VF_VOLUME_FROZEN;
-		XSEGLOG2(&lc, I, "Completing flush request");
-		pr->req->serviced = 0;
-		conclude_pr(peer, pr);
-		xqindex xqi;
-		while (vi->pending_reqs && !(vi->flags & VF_VOLUME_FROZEN) &&
-				(xqi = __xq_pop_head(vi->pending_reqs)) != Noneidx) {
-			struct peer_req *ppr = (struct peer_req *) xqi;
-			do_accepted_pr(peer, ppr);
-		}
+	if (is_flush(pr->req)) {
+		/* We have no active requests here. */
+		if (vlmc->cache_flush)
+			return send_cache_flush(peer, pr, vi);
+		conclude_flush(peer, pr, vi);
 		return 0;
 	}
 
-       //FIXME Remove this suboperation of X_WRITE. Support only X_FLUSH.
-	if (pr->req->op == X_WRITE && !pr->req->size &&
-			(pr->req->flags & (XF_FLUSH|XF_FUA))) {
-		//handle flush requests here, so we don't mess with mapper
-		//because of the -1 offset
-		vi->flags &= ~VF_VOLUME_FROZEN;
-		XSEGLOG2(&lc, I, "Completing flush request");
-		pr->req->serviced = pr->req->size;
-		conclude_pr(peer, pr);
-		xqindex xqi;
-		while (vi->pending_reqs && !(vi->flags & VF_VOLUME_FROZEN) &&
-				(xqi = __xq_pop_head(vi->pending_reqs)) != Noneidx) {
-			struct peer_req *ppr = (struct peer_req *) xqi;
-			do_accepted_pr(peer, ppr);
-		}
+	/* dirty data cached for the volume must not outlive its close */
+	if (pr->req->op == X_CLOSE && vlmc->cache_flush)
+		return send_cache_flush(peer, pr, vi);
+
+	if (pr->req->op == X_DISCARD) {
+		/* discards are not frozen, they are batched instead */
+		queue_discard(peer, vi, pr);
 		return 0;
 	}
 
+	return do_mapping(peer, pr, vi);
+}
+
+static int do_mapping(struct peerd *peer, struct peer_req *pr,
+		struct volume_info *vi)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct vlmc_io *vio = __get_vlmcio(pr);
+	char *target = xseg_get_target(peer->xseg, pr->req);
+	char *mtarget;
+	void *dummy;
+	xport p;
+	int r;
+
 	vio->mreq = xseg_get_request(peer->xseg, pr->portno,
-					vlmc->mportno, X_ALLOC);
+			mapper_port(vlmc, target, pr->req->targetlen), X_ALLOC);
 	if (!vio->mreq)
 		goto out_err;
 
@@ -372,6 +700,9 @@ static int do_accepted_pr(struct peerd *peer, struct peer_req *pr)
 	}
 	xseg_set_req_data(peer->xseg, vio->mreq, pr);
 	__set_vio_state(vio, MAPPING);
+	if (vio->timing)
+		clock_gettime(CLOCK_MONOTONIC, &vio->mapping);
+	peer_trace(pr, vio->mreq, PEER_TRACE_SUBMIT);
 	p = xseg_submit(peer->xseg, vio->mreq, pr->portno, X_ALLOC);
 	if (p == NoPort)
 		goto out_unset;
@@ -441,25 +772,23 @@ static int handle_accepted(struct peerd *peer, struct peer_req *pr,
 	char *target = xseg_get_target(peer->xseg, req);
 	struct volume_info *vi = find_volume_len(vlmc, target, req->targetlen);
 	XSEGLOG2(&lc, I, "Handle accepted for pr %lx, req %lx started", pr, req);
+
+	vio->timing = __get_timing(peer, req);
+	if (vio->timing) {
+		clock_gettime(CLOCK_MONOTONIC, &vio->accepted);
+		vio->mapping.tv_sec = vio->mapping.tv_nsec = 0;
+		vio->serving.tv_sec = vio->serving.tv_nsec = 0;
+	}
 	if (!vi){
-		vi = malloc(sizeof(struct volume_info));
+		char buf[XSEG_MAX_TARGETLEN + 1];
+		strncpy(buf, target, req->targetlen);
+		buf[req->targetlen] = 0;
+		vi = insert_volume(vlmc, buf);
 		if (!vi){
 			vio->err = 1;
 			conclude_pr(peer, pr);
 			return -1;
 		}
-		strncpy(vi->name, target, req->targetlen);
-		vi->name[req->targetlen] = 0;
-		vi->flags = 0;
-		vi->pending_pr = NULL;
-		vi->active_reqs = 0;
-		vi->pending_reqs = 0;
-		if (insert_volume(vlmc, vi) < 0){
-			vio->err = 1;
-			conclude_pr(peer, pr);
-			free(vi);
-			return -1;
-		}
 	}
 
 	if (vi->flags & VF_VOLUME_FROZEN){
@@ -556,10 +885,7 @@ static int mapping_close(struct peerd *peer, struct peer_req *pr)
 	if (!vi->pending_reqs || !xq_count(vi->pending_reqs)){
 		XSEGLOG2(&lc, I, "Volume %s (vi %lx) had no pending reqs. Removing",
 				vi->name, vi);
-		if (vi->pending_reqs)
-			xq_free(vi->pending_reqs);
 		remove_volume(vlmc, vi);
-		free(vi);
 	}
 	else {
 		xqindex xqi;
@@ -685,6 +1011,8 @@ static int mapping_readwrite(struct peerd *peer, struct peer_req *pr)
 
 	pos = 0;
 	__set_vio_state(vio, SERVING);
+	if (vio->timing)
+		clock_gettime(CLOCK_MONOTONIC, &vio->serving);
 	vio->breq_cnt = 0;
 	for (i = 0; i < vio->breq_len; i++) {
 		datalen = mreply->segs[i].size;
@@ -719,6 +1047,8 @@ static int mapping_readwrite(struct peerd *peer, struct peer_req *pr)
 		breq->offset = offset;
 		breq->size = datalen;
 		breq->op = pr->req->op;
+		/* a write-back cache writes FUA writes through */
+		breq->flags = pr->req->flags & XF_FUA;
 		target = xseg_get_target(peer->xseg, breq);
 		if (!target) {
 			vio->err = 1;
@@ -736,6 +1066,7 @@ static int mapping_readwrite(struct peerd *peer, struct peer_req *pr)
 		// this should work, right ?
 		breq->data = pr->req->data + pos;
 		pos += datalen;
+		peer_trace(pr, breq, PEER_TRACE_SUBMIT);
 		p = xseg_submit(peer->xseg, breq, pr->portno, X_ALLOC);
 		if (p == NoPort){
 			void *dummy;
@@ -764,6 +1095,97 @@ static int mapping_readwrite(struct peerd *peer, struct peer_req *pr)
 	return 0;
 }
 
+static int mapping_discard(struct peerd *peer, struct peer_req *pr)
+{
+	struct vlmcd *vlmc = __get_vlmcd(peer);
+	struct vlmc_io *vio = __get_vlmcio(pr);
+	struct xseg_reply_map *mreply = (struct xseg_reply_map *) xseg_get_data(peer->xseg, vio->mreq);
+	uint32_t targetlen;
+	struct xseg_request *breq;
+	char *target;
+	int i, r;
+	xport p;
+
+	if (vio->mreq->state & XS_FAILED){
+		XSEGLOG2(&lc, E, "req %lx (op: %d) failed",
+				(unsigned long)vio->mreq, vio->mreq->op);
+		xseg_put_request(peer->xseg, vio->mreq, pr->portno);
+		vio->mreq = NULL;
+		vio->err = 1;
+		conclude_discard(peer, pr);
+		return 0;
+	}
+
+	/* the whole objects are discarded, with nothing left for blockers */
+	if (!mreply || !mreply->cnt){
+		xseg_put_request(peer->xseg, vio->mreq, pr->portno);
+		vio->mreq = NULL;
+		conclude_discard(peer, pr);
+		return 0;
+	}
+
+	vio->breq_len = mreply->cnt;
+	vio->breqs = calloc(vio->breq_len, sizeof(struct xseg_request *));
+	if (!vio->breqs) {
+		xseg_put_request(peer->xseg, vio->mreq, pr->portno);
+		vio->mreq = NULL;
+		vio->err = 1;
+		conclude_discard(peer, pr);
+		return -1;
+	}
+
+	__set_vio_state(vio, SERVING);
+	vio->breq_cnt = 0;
+	for (i = 0; i < vio->breq_len; i++) {
+		targetlen = mreply->segs[i].targetlen;
+		breq = xseg_get_request(peer->xseg, pr->portno, vlmc->bportno, X_ALLOC);
+		if (!breq) {
+			vio->err = 1;
+			break;
+		}
+		r = xseg_prep_request(peer->xseg, breq, targetlen, 0);
+		if (r < 0) {
+			vio->err = 1;
+			xseg_put_request(peer->xseg, breq, pr->portno);
+			break;
+		}
+		breq->offset = mreply->segs[i].offset;
+		breq->size = mreply->segs[i].size;
+		breq->op = X_DISCARD;
+		target = xseg_get_target(peer->xseg, breq);
+		strncpy(target, mreply->segs[i].target, targetlen);
+		r = xseg_set_req_data(peer->xseg, breq, pr);
+		if (r < 0) {
+			vio->err = 1;
+			xseg_put_request(peer->xseg, breq, pr->portno);
+			break;
+		}
+		peer_trace(pr, breq, PEER_TRACE_SUBMIT);
+		p = xseg_submit(peer->xseg, breq, pr->portno, X_ALLOC);
+		if (p == NoPort){
+			void *dummy;
+			vio->err = 1;
+			xseg_get_req_data(peer->xseg, breq, &dummy);
+			xseg_put_request(peer->xseg, breq, pr->portno);
+			break;
+		}
+		r = xseg_signal(peer->xseg, p);
+		if (r < 0){
+			XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+		}
+		vio->breqs[i] = breq;
+		vio->breq_cnt++;
+	}
+	xseg_put_request(peer->xseg, vio->mreq, pr->portno);
+	vio->mreq = NULL;
+	if (vio->breq_cnt == 0) {
+		free(vio->breqs);
+		vio->breqs = NULL;
+		conclude_discard(peer, pr);
+	}
+	return 0;
+}
+
 static int handle_mapping(struct peerd *peer, struct peer_req *pr,
 				struct xseg_request *req)
 {
@@ -797,6 +1219,9 @@ static int handle_mapping(struct peerd *peer, struct peer_req *pr,
 		case X_MAPW:
 			mapping_readwrite(peer, pr);
 			break;
+		case X_DISCARD:
+			mapping_discard(peer, pr);
+			break;
 		default:
 			XSEGLOG2(&lc, W, "Invalid mreq op");
 			//vio->err = 1;
@@ -831,7 +1256,10 @@ static int handle_serving(struct peerd *peer, struct peer_req *pr,
 		free(vio->breqs);
 		vio->breqs = NULL;
 		vio->breq_len = 0;
-		conclude_pr(peer, pr);
+		if (pr->req->op == X_DISCARD)
+			conclude_discard(peer, pr);
+		else
+			conclude_pr(peer, pr);
 	}
 	return 0;
 }
@@ -858,6 +1286,9 @@ int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
 		case SERVING:
 			handle_serving(peer, pr, req);
 			break;
+		case CACHE_FLUSHING:
+			handle_cache_flush(peer, pr, req);
+			break;
 		case CONCLUDED:
 			XSEGLOG2(&lc, W, "invalid state. dispatch called for CONCLUDED");
 			break;
@@ -869,6 +1300,12 @@ int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
 }
 
 
+static struct xindex_ops volume_ops = {
+	.on_node_init = volume_node_init,
+	.on_init = volume_init,
+	.on_free = volume_free,
+};
+
 int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 {
 	struct vlmc_io *vio;
@@ -881,19 +1318,34 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 	}
 	peer->priv = (void *) vlmc;
 
-	vlmc->volumes = xhash_new(3, 0, XHASH_STRING);
-	if (!vlmc->volumes){
+	if (xindex_init(&vlmc->volumes, peer->nr_ops, &volume_ops,
+				XINDEX_STRING, vlmc) < 0){
 		XSEGLOG2(&lc, E, "Cannot alloc vlmc");
 		return -1;
 	}
 	vlmc->mportno = NoPort;
 	vlmc->bportno = NoPort;
+	vlmc->max_discards = VLMC_DEFAULT_MAX_DISCARDS;
+	vlmc->cache_flush = 0;
+	vlmc->mapper_partitions = 1;
 
         BEGIN_READ_ARGS(argc, argv);
 	READ_ARG_ULONG("-mp", vlmc->mportno);
 	READ_ARG_ULONG("-bp", vlmc->bportno);
+	READ_ARG_ULONG("--max-discards", vlmc->max_discards);
+	READ_ARG_BOOL("--cache-flush", vlmc->cache_flush);
+	READ_ARG_ULONG("--mapper-partitions", vlmc->mapper_partitions);
 	END_READ_ARGS();
 
+	if (!vlmc->max_discards) {
+		XSEGLOG2(&lc, E, "max-discards must be positive");
+		return -1;
+	}
+	if (!vlmc->mapper_partitions) {
+		XSEGLOG2(&lc, E, "mapper-partitions must be positive");
+		return -1;
+	}
+
 	if (vlmc->bportno == NoPort) {
 		XSEGLOG2(&lc, E, "bportno must be provided");
 		usage(argv[0]);
@@ -914,6 +1366,8 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 		vio->breqs = NULL;
 		vio->breq_cnt = 0;
 		vio->breq_len = 0;
+		vio->timing = NULL;
+		vio->next_discard = NULL;
 		xlock_release(&vio->lock);
 		peer->peer_reqs[i].priv = (void *) vio;
 	}
@@ -28,6 +28,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <fcntl.h>
 #include <errno.h>
 #include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
 #ifdef MT
 #include <pthread.h>
 #endif
@@ -53,6 +55,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_SPEC_LEN 128
 #define MAX_PIDFILE_LEN 512
 #define MAX_CPUS_LEN 512
+#define MAX_SPANS_LEN 512
+#define MAX_STATS_LEN 512
+#define DEFAULT_SPAN_SAMPLE 64
 
 /* Define the cpus on which the threads/process will be pinned */
 struct cpu_list {
@@ -68,6 +73,18 @@ struct log_ctx lc;
 uint32_t ta = 0;
 #endif
 
+/* Per-stage request tracing, see peer.h */
+static struct peer_trace_header *trace_map;
+static uint64_t trace_sample;
+static __thread struct peer_trace_ring *trace_ring;
+static __thread uint64_t trace_seq;
+static __thread uint64_t trace_id_base;
+
+/* Live statistics, see peer.h */
+static struct peer_stats_header *stats_map;
+static __thread struct peer_thread_stats *thread_stats;
+static struct peer_thread_stats *shared_stats;
+
 #ifdef MT
 struct peerd *global_peer;
 static pthread_key_t threadkey;
@@ -162,6 +179,197 @@ static int setup_signals(struct peerd *peer)
 	return r;
 }
 
+static int init_tracing(char *path, uint64_t sample, uint32_t nr_rings)
+{
+	size_t len = sizeof(struct peer_trace_header) +
+		nr_rings * sizeof(struct peer_trace_ring);
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, len) < 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	trace_map = map;
+	trace_map->version = PEER_TRACE_VERSION;
+	trace_map->nr_rings = nr_rings;
+	trace_map->ring_size = PEER_TRACE_RING_SIZE;
+	trace_map->sample = sample;
+	/* A tool must not use the file before the header is complete */
+	__sync_synchronize();
+	trace_map->magic = PEER_TRACE_MAGIC;
+	trace_sample = sample;
+	return 0;
+}
+
+/* Make the calling thread record its events to ring i */
+static void trace_thread(uint32_t i)
+{
+	if (!trace_map)
+		return;
+	trace_ring = (struct peer_trace_ring *)(trace_map + 1) + i;
+	trace_id_base = ((uint64_t)getpid() << 40) | ((uint64_t)(i & 0xff) << 32);
+}
+
+static int init_stats(char *path, uint32_t nr_threads, uint32_t nr_reqs)
+{
+	size_t len = sizeof(struct peer_stats_header) +
+		(nr_threads + 1) * sizeof(struct peer_thread_stats);
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, len) < 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	stats_map = map;
+	shared_stats = (struct peer_thread_stats *)(stats_map + 1) + nr_threads;
+	stats_map->version = PEER_STATS_VERSION;
+	stats_map->nr_threads = nr_threads;
+	stats_map->nr_ops = PEER_STATS_OPS;
+	stats_map->nr_buckets = PEER_STATS_BUCKETS;
+	stats_map->nr_reqs = nr_reqs;
+	stats_map->pid = getpid();
+	stats_map->started = time(NULL);
+	__sync_synchronize();
+	stats_map->magic = PEER_STATS_MAGIC;
+	return 0;
+}
+
+/* Make the calling thread count its requests to slot i */
+static void stats_thread(uint32_t i)
+{
+	if (!stats_map)
+		return;
+	thread_stats = (struct peer_thread_stats *)(stats_map + 1) + i;
+}
+
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Threads without a slot share the last one */
+static inline struct peer_thread_stats * stats_slot(void)
+{
+	return thread_stats ? thread_stats : shared_stats;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+	if (thread_stats)
+		*counter += value;
+	else
+		__sync_fetch_and_add(counter, value);
+}
+
+static inline void stats_accepted(struct peer_req *pr,
+		struct xseg_request *req)
+{
+	if (!stats_map || req->op >= PEER_STATS_OPS)
+		return;
+	stats_add(&stats_slot()->ops[req->op].accepted, 1);
+	pr->stats_ts = stats_now();
+}
+
+static inline void stats_concluded(struct peer_req *pr,
+		struct xseg_request *req, int served)
+{
+	struct peer_op_stats *stats;
+	uint64_t lat;
+	int bucket;
+
+	if (!stats_map || !pr->stats_ts)
+		return;
+	stats = &stats_slot()->ops[req->op];
+	if (!served) {
+		stats_add(&stats->failed, 1);
+		return;
+	}
+
+	lat = stats_now() - pr->stats_ts;
+	bucket = lat ? 64 - __builtin_clzll(lat) : 0;
+	if (bucket >= PEER_STATS_BUCKETS)
+		bucket = PEER_STATS_BUCKETS - 1;
+	stats_add(&stats->served, 1);
+	stats_add(&stats->bytes, req->serviced);
+	stats_add(&stats->lat_sum, lat);
+	stats_add(&stats->lat[bucket], 1);
+}
+
+/* The request was passed on, it is concluded by another peer */
+static inline void stats_forwarded(struct peer_req *pr, uint32_t op)
+{
+	if (!stats_map || !pr->stats_ts)
+		return;
+	stats_add(&stats_slot()->ops[op].forwarded, 1);
+}
+
+/* Decide whether an accepted request will be traced */
+static inline void trace_accepted(struct peer_req *pr)
+{
+	pr->trace_id = 0;
+	if (!trace_ring || ++trace_seq % trace_sample)
+		return;
+	pr->trace_id = trace_id_base | (trace_seq & 0xffffffffULL);
+}
+
+void __peer_trace(struct peer_req *pr, struct xseg_request *req,
+		enum peer_trace_stage stage)
+{
+	struct peer_trace_ring *ring = trace_ring;
+	struct peer_trace_event *ev;
+	struct timespec ts;
+	uint64_t head;
+
+	if (!ring || !req)
+		return;
+
+	head = ring->head;
+	if (head - ring->tail >= PEER_TRACE_RING_SIZE) {
+		ring->dropped++;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev = &ring->events[head & (PEER_TRACE_RING_SIZE - 1)];
+	ev->trace_id = pr->trace_id;
+	ev->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->req = (uint64_t)(unsigned long)req;
+	ev->offset = req->offset;
+	ev->size = req->size;
+	ev->op = req->op;
+	ev->stage = stage;
+	if (stage == PEER_TRACE_SUBMIT || stage == PEER_TRACE_RECEIVE)
+		ev->port = req->dst_portno;
+	else
+		ev->port = pr->portno;
+	ev->state = req->state;
+
+	/* The event must be written before the tool can see it */
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
 inline int canDefer(struct peerd *peer)
 {
 	return !(peer->defer_portno == NoPort);
@@ -276,6 +484,8 @@ inline void free_peer_req(struct peerd *peer, struct peer_req *pr)
 {
 	xqindex idx = pr - peer->peer_reqs;
 	pr->req = NULL;
+	pr->trace_id = 0;
+	pr->stats_ts = 0;
 #ifdef MT
 	struct thread *t = &peer->thread[pr->thread_no];
 	xq_append_head(&t->free_thread_reqs, idx, 1);
@@ -305,14 +515,6 @@ int all_peer_reqs_free(struct peerd *peer)
 	return 0;
 }
 
-struct timeval resp_start, resp_end, resp_accum = {0, 0};
-uint64_t responds = 0;
-void get_responds_stats(){
-		printf("Time waiting respond %lu.%06lu sec for %llu times.\n",
-				//(unsigned int)(t - peer->thread),
-				resp_accum.tv_sec, resp_accum.tv_usec, (long long unsigned int) responds);
-}
-
 //FIXME error check
 void fail(struct peerd *peer, struct peer_req *pr)
 {
@@ -321,6 +523,8 @@ void fail(struct peerd *peer, struct peer_req *pr)
 	if (req){
 		XSEGLOG2(&lc, D, "failing req %u", (unsigned int) (pr - peer->peer_reqs));
 		req->state |= XS_FAILED;
+		peer_trace(pr, req, PEER_TRACE_FAIL);
+		stats_concluded(pr, req, 0);
 		//xseg_set_req_data(peer->xseg, pr->req, NULL);
 		p = xseg_respond(peer->xseg, req, pr->portno, X_ALLOC);
 		xseg_signal(peer->xseg, p);
@@ -338,13 +542,10 @@ void complete(struct peerd *peer, struct peer_req *pr)
 	uint32_t p;
 	if (req){
 		req->state |= XS_SERVED;
+		peer_trace(pr, req, PEER_TRACE_COMPLETE);
+		stats_concluded(pr, req, 1);
 		//xseg_set_req_data(peer->xseg, pr->req, NULL);
-		//gettimeofday(&resp_start, NULL);
 		p = xseg_respond(peer->xseg, req, pr->portno, X_ALLOC);
-		//gettimeofday(&resp_end, NULL);
-		//responds++;
-		//timersub(&resp_end, &resp_start, &resp_end);
-		//timeradd(&resp_end, &resp_accum, &resp_accum);
 		//printf("xseg_signal: %u\n", p);
 		xseg_signal(peer->xseg, p);
 	}
@@ -363,6 +564,9 @@ static void handle_accepted(struct peerd *peer, struct peer_req *pr,
 	xreq->serviced = 0;
 	//xreq->state = XS_ACCEPTED;
 	pr->retval = 0;
+	trace_accepted(pr);
+	peer_trace(pr, req, PEER_TRACE_ACCEPT);
+	stats_accepted(pr, req);
 	dispatch(peer, pr, req, dispatch_accept);
 }
 
@@ -375,14 +579,6 @@ static void handle_received(struct peerd *peer, struct peer_req *pr,
 	dispatch(peer, pr, req, dispatch_receive);
 
 }
-struct timeval sub_start, sub_end, sub_accum = {0, 0};
-uint64_t submits = 0;
-void get_submits_stats(){
-		printf("Time waiting submit %lu.%06lu sec for %llu times.\n",
-				//(unsigned int)(t - peer->thread),
-				sub_accum.tv_sec, sub_accum.tv_usec, (long long unsigned int) submits);
-}
-
 int submit_peer_req(struct peerd *peer, struct peer_req *pr)
 {
 	uint32_t ret;
@@ -394,12 +590,8 @@ int submit_peer_req(struct peerd *peer, struct peer_req *pr)
 	if (ret < 0)
 		return -1;
 	//printf("pr: %x , req_data: %x \n", pr, xseg_get_req_data(peer->xseg, req));
-	//gettimeofday(&sub_start, NULL);
+	peer_trace(pr, req, PEER_TRACE_SUBMIT);
 	ret = xseg_submit(peer->xseg, req, pr->portno, X_ALLOC);
-	//gettimeofday(&sub_end, NULL);
-	//submits++;
-	//timersub(&sub_end, &sub_start, &sub_end);
-	//timeradd(&sub_end, &sub_accum, &sub_accum);
 	if (ret == NoPort)
 		return -1;
 	xseg_signal(peer->xseg, ret);
@@ -459,6 +651,7 @@ int check_ports(struct peerd *peer)
 			} else {
 				//maybe perform sanity check for pr
 				xseg_cancel_wait(xseg, i);
+				peer_trace(pr, received, PEER_TRACE_RECEIVE);
 				handle_received(peer, pr, received);
 				c = 1;
 			}
@@ -540,6 +733,8 @@ void *init_thread_loop(void *arg)
 	for (i = 0; thread_id[i]; i++) {}
 	t->arg = (void *)realloc(thread_id, i-1);
 	pthread_setspecific(threadkey, t);
+	trace_thread(thread_num);
+	stats_thread(thread_num);
 
 	//Start thread loop
 	(void)peer->peerd_loop(t);
@@ -572,20 +767,24 @@ int peerd_start_threads(struct peerd *peer)
 }
 #endif
 
-int defer_request(struct peerd *peer, struct peer_req *pr)
+/*
+ * Pass the request of pr on to the peer at dst. Its reply goes straight to the
+ * source of the request.
+ */
+int forward_request(struct peerd *peer, struct peer_req *pr, xport dst)
 {
 	int r;
 	xport p;
-	if (!canDefer(peer)){
-		XSEGLOG2(&lc, E, "Peer cannot defer requests");
-		return -1;
-	}
-	p = xseg_forward(peer->xseg, pr->req, peer->defer_portno, pr->portno,
-			X_ALLOC);
+	/* the request is no longer ours once forwarded */
+	uint32_t op = pr->req->op;
+
+	p = xseg_forward(peer->xseg, pr->req, dst, pr->portno, X_ALLOC);
 	if (p == NoPort){
-		XSEGLOG2(&lc, E, "Cannot defer request %lx", pr->req);
+		XSEGLOG2(&lc, E, "Cannot forward request %lx to port %u",
+				pr->req, dst);
 		return -1;
 	}
+	stats_forwarded(pr, op);
 	r = xseg_signal(peer->xseg, p);
 	if (r < 0) {
 		XSEGLOG2(&lc, W, "Cannot signal port %lu", p);
@@ -594,6 +793,15 @@ int defer_request(struct peerd *peer, struct peer_req *pr)
 	return 0;
 }
 
+int defer_request(struct peerd *peer, struct peer_req *pr)
+{
+	if (!canDefer(peer)){
+		XSEGLOG2(&lc, E, "Peer cannot defer requests");
+		return -1;
+	}
+	return forward_request(peer, pr, peer->defer_portno);
+}
+
 /*
  * generic_peerd_loop is a general-purpose port-checker loop that is
  * suitable both for multi-threaded and single-threaded peers.
@@ -663,6 +871,8 @@ static int init_peerd_loop(struct peerd *peer)
 		}
 	}
 
+	trace_thread(0);
+	stats_thread(0);
 	peer->peerd_loop(peer);
 	custom_peer_finalize(peer);
 	xseg_quit_local_signal(xseg, peer->portno_start);
@@ -777,6 +987,8 @@ malloc_fail:
 		peer->peer_reqs[i].retval = 0;
 		peer->peer_reqs[i].priv = NULL;
 		peer->peer_reqs[i].portno = NoPort;
+		peer->peer_reqs[i].trace_id = 0;
+		peer->peer_reqs[i].stats_ts = 0;
 #ifdef ST_THREADS
 		peer->peer_reqs[i].cond = st_cond_new(); //FIXME err check
 #endif
@@ -881,6 +1093,10 @@ void usage(char *argv0)
 #endif
 		"    --cpus    | No      | Coma-separated list of CPUs\n"
 		"              |         | to pin the process or threads\n"
+		"    --spans   | None    | Record the stages of a sample of\n"
+		"              |         | the requests to this file\n"
+		"    --span-sample | 64  | Trace one in this many requests\n"
+		"    --stats   | None    | Keep live statistics in this file\n"
 		"\n"
 	       );
 	custom_peer_usage();
@@ -898,6 +1114,7 @@ int main(int argc, char *argv[])
 	uint32_t nr_ops = 16;
 	uint32_t nr_threads = 1;
 	uint64_t threshold = 1000;
+	uint64_t span_sample = DEFAULT_SPAN_SAMPLE;
 	unsigned int debug_level = 0;
 	xport defer_portno = NoPort;
 	pid_t old_pid;
@@ -909,11 +1126,15 @@ int main(int argc, char *argv[])
 	char logfile[MAX_LOGFILE_LEN + 1];
 	char pidfile[MAX_PIDFILE_LEN + 1];
 	char cpus[MAX_CPUS_LEN + 1];
+	char spans[MAX_SPANS_LEN + 1];
+	char stats[MAX_STATS_LEN + 1];
 
 	logfile[0] = 0;
 	pidfile[0] = 0;
 	spec[0] = 0;
 	cpus[0] = 0;
+	spans[0] = 0;
+	stats[0] = 0;
 
 	//capture here -g spec, -n nr_ops, -p portno, -t nr_threads -v verbose level
 	// -dp xseg_portno to defer blocking requests
@@ -939,6 +1160,9 @@ int main(int argc, char *argv[])
 	READ_ARG_ULONG("--threshold", threshold);
 	READ_ARG_STRING("--cpus", cpus, MAX_CPUS_LEN);
 	READ_ARG_STRING("--pidfile", pidfile, MAX_PIDFILE_LEN);
+	READ_ARG_STRING("--spans", spans, MAX_SPANS_LEN);
+	READ_ARG_ULONG("--span-sample", span_sample);
+	READ_ARG_STRING("--stats", stats, MAX_STATS_LEN);
 	END_READ_ARGS();
 
 	if (help){
@@ -1036,6 +1260,27 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 	setup_signals(peer);
+	if (spans[0]) {
+		if (!span_sample) {
+			XSEGLOG2(&lc, E, "--span-sample must be positive");
+			r = -1;
+			goto out;
+		}
+		r = init_tracing(spans, span_sample, nr_threads);
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Cannot create span file %s: %s",
+					spans, strerror(errno));
+			goto out;
+		}
+	}
+	if (stats[0]) {
+		r = init_stats(stats, nr_threads, nr_ops);
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Cannot create stats file %s: %s",
+					stats, strerror(errno));
+			goto out;
+		}
+	}
 	r = custom_peer_init(peer, argc, argv);
 	if (r < 0)
 		goto out;
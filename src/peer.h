@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define PEER_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <xseg/xseg.h>
 #include <string.h>
 
@@ -58,6 +59,35 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 		continue;						\
 	}
 
+/*
+ * Discards.
+ *
+ * xseg has no discard op, so X_DISCARD is a peer-private op, numbered past the
+ * ops of xseg. An X_DISCARD request tells a peer that the range of its target
+ * from offset to offset + size is no longer used. It carries no data. vlmcd and
+ * the mapper accept it for volumes and the blockers for objects. A discarded
+ * range reads as zeros, unless the blocker cannot free it, in which case it
+ * may keep its data. Clients that are not built against this header, e.g.
+ * tests/tests.py, must use the same number.
+ */
+#define X_DISCARD	30
+
+/*
+ * xseg ops are enum constants, which the preprocessor cannot see, so check
+ * here that X_DISCARD is past all the ones the peers use.
+ */
+_Static_assert(X_DISCARD > X_PING && X_DISCARD > X_READ &&
+		X_DISCARD > X_WRITE && X_DISCARD > X_SYNC &&
+		X_DISCARD > X_TRUNCATE && X_DISCARD > X_DELETE &&
+		X_DISCARD > X_ACQUIRE && X_DISCARD > X_RELEASE &&
+		X_DISCARD > X_COPY && X_DISCARD > X_CLONE &&
+		X_DISCARD > X_INFO && X_DISCARD > X_MAPR &&
+		X_DISCARD > X_MAPW && X_DISCARD > X_OPEN &&
+		X_DISCARD > X_CLOSE && X_DISCARD > X_SNAPSHOT &&
+		X_DISCARD > X_HASH && X_DISCARD > X_CREATE &&
+		X_DISCARD > X_RENAME && X_DISCARD > X_FLUSH,
+		"X_DISCARD collides with the ops of xseg");
+
 
 
 
@@ -68,6 +98,8 @@ struct peer_req {
 	ssize_t retval;
 	xport portno;
 	void *priv;
+	uint64_t trace_id;	/* non-zero if the request is traced */
+	uint64_t stats_ts;	/* us, when accepted, if stats are kept */
 #ifdef ST_THREADS
 	st_cond_t cond;
 #endif
@@ -106,6 +138,112 @@ struct peerd {
 #endif
 };
 
+/*
+ * Per-stage request tracing
+ *
+ * With --spans <file>, a sample of the accepted requests is traced. Each
+ * traced request gets a trace ID, which is also given to the requests the
+ * peer sends on its behalf (e.g. the blocker requests of vlmcd or the copy-ups
+ * of the mapper). A timestamped event is recorded when the request is accepted
+ * and completed or failed, and when each of its sub-requests is submitted and
+ * received.
+ *
+ * Events go to the file, which is mapped in memory and holds one ring buffer
+ * per thread. Each ring has a single producer, its peer thread, and a single
+ * consumer, a tool such as tools/archip-spans, that drains it by advancing
+ * its tail. Events are dropped, and counted, when a ring is full.
+ */
+#define PEER_TRACE_MAGIC 0x4e415053	/* "SPAN" */
+#define PEER_TRACE_VERSION 1
+#define PEER_TRACE_RING_SIZE 4096	/* events, must be a power of 2 */
+
+enum peer_trace_stage {
+	PEER_TRACE_ACCEPT = 0,
+	PEER_TRACE_SUBMIT = 1,
+	PEER_TRACE_RECEIVE = 2,
+	PEER_TRACE_COMPLETE = 3,
+	PEER_TRACE_FAIL = 4
+};
+
+struct peer_trace_event {
+	uint64_t trace_id;
+	uint64_t ts;		/* ns, CLOCK_MONOTONIC */
+	uint64_t req;		/* pairs submits with receives */
+	uint64_t offset;
+	uint64_t size;
+	uint32_t op;
+	uint32_t stage;
+	uint32_t port;
+	uint32_t state;
+	uint64_t reserved;
+};
+
+struct peer_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_rings;
+	uint32_t ring_size;
+	uint64_t sample;	/* one in sample requests is traced */
+	uint64_t reserved[5];
+};
+
+struct peer_trace_ring {
+	volatile uint64_t head;	/* advanced by the peer */
+	uint64_t dropped;
+	uint64_t pad0[6];
+	volatile uint64_t tail;	/* advanced by the tool */
+	uint64_t pad1[7];
+	struct peer_trace_event events[PEER_TRACE_RING_SIZE];
+};
+
+/*
+ * Live statistics
+ *
+ * With --stats <file>, the peer counts the requests it accepts, serves, fails
+ * and forwards to other peers, per op, along with the bytes and the latency of
+ * the served ones. The counters live in the file, which is mapped in memory
+ * and holds a slot per thread, followed by a shared slot. Each thread slot is
+ * written only by its thread and is cache-line aligned, so counting needs
+ * neither atomics nor locks. Threads without a slot, such as helper threads
+ * that conclude requests, count to the shared slot with atomics. Readers, such
+ * as `archipelago stats`, sum all slots when asked.
+ *
+ * Latencies are counted in log2 buckets of microseconds: bucket i counts the
+ * requests that took less than 2^i us, but not less than 2^(i-1) us. The last
+ * bucket also counts all slower requests.
+ */
+#define PEER_STATS_MAGIC 0x54415453	/* "STAT" */
+#define PEER_STATS_VERSION 2
+#define PEER_STATS_OPS 32		/* ops with a higher number are ignored */
+#define PEER_STATS_BUCKETS 32
+
+struct peer_op_stats {
+	uint64_t accepted;
+	uint64_t served;
+	uint64_t failed;
+	uint64_t bytes;		/* serviced by the served requests */
+	uint64_t lat_sum;	/* us */
+	uint64_t forwarded;	/* deferred or forwarded to other peers */
+	uint64_t reserved[2];
+	uint64_t lat[PEER_STATS_BUCKETS];
+};
+
+struct peer_thread_stats {
+	struct peer_op_stats ops[PEER_STATS_OPS];
+};
+
+struct peer_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_threads;	/* there is a shared slot after theirs */
+	uint32_t nr_ops;	/* op slots of each thread */
+	uint32_t nr_buckets;
+	uint32_t nr_reqs;	/* peer requests, i.e. the max queue depth */
+	uint64_t pid;
+	uint64_t started;	/* seconds since the epoch */
+	uint64_t reserved[3];
+};
+
 enum dispatch_reason {
 	dispatch_accept = 0,
 	dispatch_receive = 1,
@@ -115,16 +253,17 @@ enum dispatch_reason {
 void fail(struct peerd *peer, struct peer_req *pr);
 void complete(struct peerd *peer, struct peer_req *pr);
 int defer_request(struct peerd *peer, struct peer_req *pr);
+int forward_request(struct peerd *peer, struct peer_req *pr, xport dst);
 void pending(struct peerd *peer, struct peer_req *req);
 void log_pr(char *msg, struct peer_req *pr);
 int canDefer(struct peerd *peer);
 void free_peer_req(struct peerd *peer, struct peer_req *pr);
 int submit_peer_req(struct peerd *peer, struct peer_req *pr);
-void get_submits_stats();
-void get_responds_stats();
 void usage();
 void print_req(struct xseg *xseg, struct xseg_request *req);
 int all_peer_reqs_free(struct peerd *peer);
+void __peer_trace(struct peer_req *pr, struct xseg_request *req,
+		enum peer_trace_stage stage);
 
 #ifdef MT
 int thread_execute(struct peerd *peer, void (*func)(void *arg), void *arg);
@@ -154,6 +293,17 @@ static inline int isTerminate(void)
 	return terminated;
 }
 
+/*
+ * Record an event of a traced request. This is all that untraced requests, and
+ * all requests when tracing is disabled, pay for.
+ */
+static inline void peer_trace(struct peer_req *pr, struct xseg_request *req,
+		enum peer_trace_stage stage)
+{
+	if (pr->trace_id)
+		__peer_trace(pr, req, stage);
+}
+
 /********************************
  *   mandatory peer functions   *
  ********************************/
@@ -15,706 +15,429 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * RADOS backend of the blocker core (see blocker.h), built as archip-radosd.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <xseg/xseg.h>
 #include <peer.h>
 #include <rados/librados.h>
 #include <xseg/protocol.h>
 #include <pthread.h>
-#include <openssl/sha.h>
-#include <ctype.h>
 #include <errno.h>
-#include <hash.h>
+#include <blocker.h>
 
 
-#define LOCK_SUFFIX "_lock"
-#define LOCK_SUFFIX_LEN 5
-#define HASH_SUFFIX "_hash"
-#define HASH_SUFFIX_LEN 5
-
 #define MAX_POOL_NAME 64
 #define MAX_CEPHXID_NAME 256
-#define MAX_OBJ_NAME (XSEG_MAX_TARGETLEN + LOCK_SUFFIX_LEN + 1)
 #define RADOS_LOCK_NAME "RadosLock"
 //#define RADOS_LOCK_COOKIE "Cookie"
 #define RADOS_LOCK_COOKIE "foo"
 #define RADOS_LOCK_TAG ""
 #define RADOS_LOCK_DESC ""
 
-void custom_peer_usage()
+/* Upper limit of concurrent sub-reads a single read can be split into */
+#define MAX_READ_SPLITS 16
+
+static void radosd_usage(void)
 {
 	fprintf(stderr, "Custom peer options:\n"
 		"--pool: Rados pool to connect\n"
-		"--cephx-id: Cephx id"
-		"\n");
+		"--cephx-id: Cephx id\n"
+		"--read-split: Split reads larger than this size (in bytes)\n"
+		"              into up to %d concurrent sub-reads.\n"
+		"              0 disables splitting (default: 0)"
+		"\n", MAX_READ_SPLITS);
 }
 
-enum rados_state {
-	ACCEPTED = 0,
-	PENDING = 1,
-	READING = 2,
-	WRITING = 3,
-	STATING = 4,
-	PREHASHING = 5,
-	POSTHASHING= 6
+/*
+ * Completion queue entry. Every operation in flight owns one. Plain
+ * operations use the entry embedded in their rados_io, while each sub-read of
+ * a split read uses one of the rados_io subreads.
+ */
+struct rados_cqe {
+	struct peer_req *pr;
+	ssize_t retval;
+	uint64_t offset;	/* sub-read range, relative to the read */
+	uint64_t size;
+	struct rados_cqe *next;
 };
 
 struct radosd {
 	rados_t cluster;
 	rados_ioctx_t ioctx;
 	char pool[MAX_POOL_NAME + 1];
+	uint64_t read_split;
+	/* head of the completion queue, see cq_push() */
+	struct rados_cqe * volatile cq_head;
 };
 
-struct rados_io{
-	char obj_name[MAX_OBJ_NAME + 1];
-	enum rados_state state;
-	uint64_t size;
-	char *second_name, *buf;
-	uint64_t read;
+/* per request state of the backend, kept in the priv of the blocker_io */
+struct rados_io {
+	char lock_name[BLOCKER_MAX_OBJ_NAME + BLOCKER_LOCK_SUFFIX_LEN + 1];
+	int lock_flag;		/* nosync for locks, force for unlocks */
 	uint64_t watch_handle;
 	pthread_t tid;
 	pthread_cond_t cond;
 	pthread_mutex_t m;
+	struct rados_cqe cqe;
+	rados_write_op_t write_op;
+	/* split read state */
+	char *target, *buf;
+	uint64_t offset, size;
+	struct rados_cqe subreads[MAX_READ_SPLITS];
+	uint32_t pending;
+	int err;
 };
 
-void rados_ack_cb(rados_completion_t c, void *arg)
+static void handle_split_read_cb(struct peerd *peer, struct rados_cqe *cqe);
+
+static inline struct radosd * __get_radosd(struct peerd *peer)
 {
-	struct peer_req *pr = (struct peer_req*) arg;
-	struct peerd *peer = pr->peer;
-	int ret = rados_aio_get_return_value(c);
-	pr->retval = ret;
-	rados_aio_release(c);
-	dispatch(peer, pr, pr->req, dispatch_internal);
+	return (struct radosd *) __get_blockerd(peer)->priv;
 }
 
-void rados_commit_cb(rados_completion_t c, void *arg)
+static inline struct rados_io * __get_rados_io(struct peer_req *pr)
 {
-	struct peer_req *pr = (struct peer_req*) arg;
-	struct peerd *peer = pr->peer;
-	int ret = rados_aio_get_return_value(c);
-	pr->retval = ret;
-	rados_aio_release(c);
-	dispatch(peer, pr, pr->req, dispatch_internal);
+	return (struct rados_io *) __get_blocker_io(pr)->priv;
 }
 
-static int do_aio_generic(struct peerd *peer, struct peer_req *pr, uint32_t op,
-		char *target, char *buf, uint64_t size, uint64_t offset)
+/*
+ * Completion queue.
+ *
+ * librados runs the completion callbacks on its own threads, and the lock
+ * operations run on threads of their own. Instead of re-entering the blocker
+ * core from there, they only store the return value, push the completion
+ * entry on a lock-free list and signal the peer. The list is drained by the
+ * peer threads (see radosd_peerd_loop), so the request state machines are
+ * only ever driven by peer threads.
+ *
+ * Producers push with a CAS on the list head. Consumers detach the whole list
+ * with an atomic exchange, so no ABA problem can arise and any number of peer
+ * threads may drain it.
+ */
+static void cq_push(struct radosd *rados, struct rados_cqe *cqe)
 {
-	struct radosd *rados = (struct radosd *) peer->priv;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-	int r;
+	struct rados_cqe *head;
 
-	rados_completion_t rados_compl;
-	switch (op) {
-		case X_READ:
-			r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
-			if (r < 0)
-				return -1;
-			r = rados_aio_read(rados->ioctx, target, rados_compl,
-					buf, size, offset);
-			break;
-		case X_WRITE:
-			r = rados_aio_create_completion(pr, NULL, rados_commit_cb, &rados_compl);
-			if (r < 0)
-				return -1;
-			r = rados_aio_write(rados->ioctx, target, rados_compl,
-					buf, size, offset);
-			break;
-		case X_DELETE:
-			r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
-			if (r < 0)
-				return -1;
-			r = rados_aio_remove(rados->ioctx, target, rados_compl);
-			break;
-		case X_INFO:
-			r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
-			if (r < 0)
-				return -1;
-			r = rados_aio_stat(rados->ioctx, target, rados_compl, &rio->size, NULL);
-			break;
-		default:
-			return -1;
-			break;
-	}
-	if (r < 0) {
-		rados_aio_release(rados_compl);
-	}
-	return r;
+	do {
+		head = rados->cq_head;
+		cqe->next = head;
+	} while (!__sync_bool_compare_and_swap(&rados->cq_head, head, cqe));
 }
 
-static int do_aio_read(struct peerd *peer, struct peer_req *pr)
+static void cq_complete(struct peerd *peer, struct rados_cqe *cqe,
+		ssize_t retval)
 {
-	struct xseg_request *req = pr->req;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-	char *data = xseg_get_data(peer->xseg, pr->req);
-
-	return do_aio_generic(peer, pr, X_READ, rio->obj_name,
-			data + req->serviced,
-			req->size - req->serviced,
-			req->offset + req->serviced);
+	cqe->retval = retval;
+	cq_push(__get_radosd(peer), cqe);
+	xseg_signal(peer->xseg, peer->portno_start);
 }
 
-static int do_aio_write(struct peerd *peer, struct peer_req *pr)
+static int cq_drain(struct peerd *peer)
 {
-	struct xseg_request *req = pr->req;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-	char *data = xseg_get_data(peer->xseg, pr->req);
-
-	return do_aio_generic(peer, pr, X_WRITE, rio->obj_name,
-			data + req->serviced,
-			req->size - req->serviced,
-			req->offset + req->serviced);
-}
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio;
+	struct rados_cqe *cqe, *next, *list = NULL;
+	struct peer_req *pr;
 
-int handle_delete(struct peerd *peer, struct peer_req *pr)
-{
-	int r;
-	//struct radosd *rados = (struct radosd *) peer->priv;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-
-	if (rio->state == ACCEPTED) {
-		XSEGLOG2(&lc, I, "Deleting %s", rio->obj_name);
-		rio->state = PENDING;
-		r = do_aio_generic(peer, pr, X_DELETE, rio->obj_name, NULL, 0, 0);
-		if (r < 0) {
-			XSEGLOG2(&lc, E, "Deletion of %s failed", rio->obj_name);
-			fail(peer, pr);
-		}
-	}
-	else {
-		if (pr->retval < 0){
-			XSEGLOG2(&lc, E, "Deletion of %s failed", rio->obj_name);
-			fail(peer, pr);
-		}
-		else {
-			XSEGLOG2(&lc, I, "Deletion of %s completed", rio->obj_name);
-			complete(peer, pr);
-		}
+	/* avoid bouncing the cache line of the head when idle */
+	if (!rados->cq_head)
+		return 0;
+
+	cqe = __sync_lock_test_and_set(&rados->cq_head, NULL);
+	if (!cqe)
+		return 0;
+
+	/* the list is LIFO, reverse it to handle completions in order */
+	while (cqe) {
+		next = cqe->next;
+		cqe->next = list;
+		list = cqe;
+		cqe = next;
 	}
-	return 0;
+
+	while (list) {
+		cqe = list;
+		pr = cqe->pr;
+		rio = __get_rados_io(pr);
+		/*
+		 * Fetch next before handling the entry, since the operation
+		 * may be resubmitted and pushed back on the queue meanwhile.
+		 */
+		list = cqe->next;
+		cqe->next = NULL;
+		if (cqe != &rio->cqe) {
+			handle_split_read_cb(peer, cqe);
+			continue;
+		}
+		if (rio->write_op) {
+			rados_release_write_op(rio->write_op);
+			rio->write_op = NULL;
+			/* nothing to discard in a missing object */
+			if (cqe->retval == -ENOENT)
+				cqe->retval = 0;
+		}
+		blocker_io_done(peer, pr, cqe->retval);
+	}
+	return 1;
 }
 
-int handle_info(struct peerd *peer, struct peer_req *pr)
+static void rados_complete_cb(rados_completion_t c, struct rados_cqe *cqe)
 {
-	int r;
-	struct xseg_request *req = pr->req;
-	//struct radosd *rados = (struct radosd *) peer->priv;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-	char *req_data;
-	struct xseg_reply_info *xinfo;
-	char buf[XSEG_MAX_TARGETLEN + 1];
-	char *target;
-
-	if (rio->state == ACCEPTED) {
-		XSEGLOG2(&lc, I, "Getting info of %s", rio->obj_name);
-		rio->state = PENDING;
-		r = do_aio_generic(peer, pr, X_INFO, rio->obj_name, NULL, 0, 0);
-		if (r < 0) {
-			XSEGLOG2(&lc, E, "Getting info of %s failed", rio->obj_name);
-			fail(peer, pr);
-		}
-	}
-	else {
-		if (req->datalen < sizeof(struct xseg_reply_info)) {
-			target = xseg_get_target(peer->xseg, req);
-			strncpy(buf, target, req->targetlen);
-			r = xseg_resize_request(peer->xseg, req, req->targetlen, sizeof(struct xseg_reply_info));
-			if (r < 0) {
-				XSEGLOG2(&lc, E, "Cannot resize request");
-				fail(peer, pr);
-				return 0;
-			}
-			target = xseg_get_target(peer->xseg, req);
-			strncpy(target, buf, req->targetlen);
-		}
+	ssize_t retval = rados_aio_get_return_value(c);
 
-		req_data = xseg_get_data(peer->xseg, req);
-		xinfo = (struct xseg_reply_info *)req_data;
-		if (pr->retval < 0){
-			xinfo->size = 0;
-			XSEGLOG2(&lc, E, "Getting info of %s failed", rio->obj_name);
-			fail(peer, pr);
-		}
-		else {
-			xinfo->size = rio->size;
-			pr->retval = sizeof(uint64_t);
-			XSEGLOG2(&lc, I, "Getting info of %s completed", rio->obj_name);
-			complete(peer, pr);
-		}
-	}
-	return 0;
+	rados_aio_release(c);
+	cq_complete(cqe->pr->peer, cqe, retval);
 }
 
-int handle_read(struct peerd *peer, struct peer_req *pr)
+void rados_ack_cb(rados_completion_t c, void *arg)
 {
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
-	struct xseg_request *req = pr->req;
-	char *data;
+	rados_complete_cb(c, (struct rados_cqe *) arg);
+}
 
-	if (req->datalen < req->size) {
-		XSEGLOG2(&lc, E, "Request datalen is less than req size");
-		return -1;
-	}
+void rados_commit_cb(rados_completion_t c, void *arg)
+{
+	rados_complete_cb(c, (struct rados_cqe *) arg);
+}
 
-	if (rio->state == ACCEPTED) {
-		if (!req->size) {
-			complete(peer, pr);
-			return 0;
-		}
-		rio->state = READING;
-		XSEGLOG2(&lc, I, "Reading %s", rio->obj_name);
-		if (do_aio_read(peer, pr) < 0) {
-			XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read",
-						rio->obj_name);
-			fail(peer, pr);
-		}
-	}
-	else if (rio->state == READING) {
-		XSEGLOG2(&lc, I, "Reading of %s callback", rio->obj_name);
-		data = xseg_get_data(peer->xseg, pr->req);
-		if (pr->retval > 0) {
-			req->serviced += pr->retval;
-		} else if (pr->retval == 0) {
-			XSEGLOG2(&lc, I, "Reading of %s reached end of file at "
-				"%llu bytes. Zeroing out rest", rio->obj_name,
-				(unsigned long long) req->serviced);
-			/* reached end of object. zero out rest of data
-			 * requested from this object
-			 */
-			memset(data + req->serviced, 0, req->size - req->serviced);
-			req->serviced = req->size;
-		} else {
-			XSEGLOG2(&lc, E, "Reading of %s failed", rio->obj_name);
-			/* pr->retval < 0 && pr->retval != -2 */
-			fail(peer, pr);
-			return 0;
-		}
-		if (req->serviced >= req->size) {
-			XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
-			complete(peer, pr);
-			return 0;
-		}
+static int __do_aio_read(struct peerd *peer, struct rados_cqe *cqe,
+		char *target, char *buf, uint64_t size, uint64_t offset)
+{
+	struct radosd *rados = __get_radosd(peer);
+	rados_completion_t rados_compl;
+	int r;
 
-		if (!req->size) {
-			/* should not happen */
-			fail(peer, pr);
-			return 0;
-		}
-		/* resubmit */
-		XSEGLOG2(&lc, I, "Resubmitting read of %s", rio->obj_name);
-		if (do_aio_read(peer, pr) < 0) {
-			XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
-					rio->obj_name);
-			fail(peer, pr);
-		}
-	}
-	else {
-		/* should not reach this */
-		printf("read request reached this\n");
-		fail(peer, pr);
-	}
-	return 0;
+	r = rados_aio_create_completion(cqe, rados_ack_cb, NULL, &rados_compl);
+	if (r < 0)
+		return -1;
+	r = rados_aio_read(rados->ioctx, target, rados_compl, buf, size,
+			offset);
+	if (r < 0)
+		rados_aio_release(rados_compl);
+	return r;
 }
 
-int handle_write(struct peerd *peer, struct peer_req *pr)
+static int do_aio_subread(struct peerd *peer, struct rados_cqe *cqe)
 {
-	if (pr->req->datalen < pr->req->size) {
-		XSEGLOG2(&lc, E, "Request datalen is less than req size");
-		return -1;
-	}
+	struct rados_io *rio = __get_rados_io(cqe->pr);
 
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
-	struct xseg_request *req = pr->req;
-	if (rio->state == ACCEPTED) {
-		if (!req->size) {
-			// for future use
-			if (req->flags & XF_FLUSH) {
-				complete(peer, pr);
-				return 0;
-			}
-			else {
-				complete(peer, pr);
-				return 0;
-			}
-		}
-		//should we ensure req->op = X_READ ?
-		rio->state = WRITING;
-		XSEGLOG2(&lc, I, "Writing %s", rio->obj_name);
-		if (do_aio_write(peer, pr) < 0) {
-			XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write",
-					rio->obj_name);
-			fail(peer, pr);
-		}
-	}
-	else if (rio->state == WRITING) {
-		/* rados writes return 0 if write succeeded or < 0 if failed
-		 * no resubmission occurs
-		 */
-		XSEGLOG2(&lc, I, "Writing of %s callback", rio->obj_name);
-		if (pr->retval == 0) {
-			XSEGLOG2(&lc, I, "Writing of %s completed", rio->obj_name);
-			req->serviced = req->size;
-			complete(peer, pr);
-			return 0;
-		}
-		else {
-			XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
-			fail(peer, pr);
-			return 0;
-		}
-	}
-	else {
-		/* should not reach this */
-		printf("write request reached this\n");
-		fail(peer, pr);
-	}
-	return 0;
+	return __do_aio_read(peer, cqe, rio->target, rio->buf + cqe->offset,
+			cqe->size, rio->offset + cqe->offset);
 }
 
-int handle_copy(struct peerd *peer, struct peer_req *pr)
+/*
+ * Drop @count sub-reads of a split read. The last one completes the read.
+ * Sub-reads of the same request may be handled concurrently by different peer
+ * threads, hence the atomic operations.
+ */
+static void split_read_put(struct peerd *peer, struct peer_req *pr,
+		uint32_t count)
 {
-	//struct radosd *rados = (struct radosd *) peer->priv;
-	struct xseg_request *req = pr->req;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-	int r;
-	struct xseg_request_copy *xcopy = (struct xseg_request_copy *)xseg_get_data(peer->xseg, req);
-
-	if (rio->state == ACCEPTED){
-		XSEGLOG2(&lc, I, "Copy of object %s to object %s started",
-				rio->second_name, rio->obj_name);
-		if (!req->size) {
-			complete(peer, pr); //or fail?
-			return 0;
-		}
+	struct rados_io *rio = __get_rados_io(pr);
 
-		rio->second_name = malloc(MAX_OBJ_NAME + 1);
-		if (!rio->second_name){
-			fail(peer, pr);
-			return -1;
-		}
-		//NULL terminate or fail if targetlen > MAX_OBJ_NAME ?
-		unsigned int end = (xcopy->targetlen > MAX_OBJ_NAME) ? MAX_OBJ_NAME : xcopy->targetlen;
-		strncpy(rio->second_name, xcopy->target, end);
-		rio->second_name[end] = 0;
+	if (__sync_sub_and_fetch(&rio->pending, count))
+		return;
 
-		rio->buf = malloc(req->size);
-		if (!rio->buf) {
-			r = -1;
-			goto out_src;
-		}
+	if (rio->err) {
+		XSEGLOG2(&lc, E, "Reading of %s failed", rio->target);
+		blocker_io_done(peer, pr, rio->err);
+		return;
+	}
+	/* every sub-read either got its data or zeroed its range */
+	blocker_io_done(peer, pr, rio->size);
+}
 
-		rio->state = READING;
-		rio->read = 0;
-		XSEGLOG2(&lc, I, "Reading %s", rio->second_name);
-		if (do_aio_generic(peer, pr, X_READ, rio->second_name, rio->buf + rio->read,
-			req->size - rio->read, req->offset + rio->read) < 0) {
-			XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read", rio->obj_name);
-			fail(peer, pr);
-			r = -1;
-			goto out_buf;
+/*
+ * Split a read into concurrent sub-reads on the same buffer. Each sub-read
+ * resubmits its short reads, and zeroes the rest of its range when it
+ * reaches the end of the object, so the read always completes in full.
+ */
+static void do_split_read(struct peerd *peer, struct peer_req *pr)
+{
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio = __get_rados_io(pr);
+	struct rados_cqe *cqe;
+	uint64_t chunk, offset;
+	uint32_t i, nr;
+
+	nr = (rio->size + rados->read_split - 1) / rados->read_split;
+	if (nr > MAX_READ_SPLITS)
+		nr = MAX_READ_SPLITS;
+	chunk = (rio->size + nr - 1) / nr;
+
+	rio->err = 0;
+	rio->pending = nr;
+	XSEGLOG2(&lc, I, "Reading %s in %u sub-reads", rio->target, nr);
+	for (i = 0, offset = 0; i < nr; i++, offset += chunk) {
+		cqe = &rio->subreads[i];
+		cqe->offset = offset;
+		cqe->size = (rio->size - offset < chunk) ?
+				rio->size - offset : chunk;
+		if (do_aio_subread(peer, cqe) < 0) {
+			XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
+					rio->target);
+			rio->err = -EIO;
+			/* drop the sub-reads that were never issued */
+			split_read_put(peer, pr, nr - i);
+			return;
 		}
 	}
-	else if (rio->state == READING){
-		XSEGLOG2(&lc, I, "Reading of %s callback", rio->obj_name);
-		if (pr->retval > 0)
-			rio->read += pr->retval;
-		else if (pr->retval == 0) {
-			XSEGLOG2(&lc, I, "Reading of %s reached end of file at "
-				"%llu bytes. Zeroing out rest",	rio->obj_name,
-				(unsigned long long) req->serviced);
-			memset(rio->buf + rio->read, 0, req->size - rio->read);
-			rio->read = req->size ;
-		}
-		else {
-			XSEGLOG2(&lc, E, "Reading of %s failed", rio->second_name);
-			r = -1;
-			goto out_buf;
-		}
+}
 
-		if (rio->read >= req->size) {
-			XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
-			//do_aio_write
-			rio->state = WRITING;
-			XSEGLOG2(&lc, I, "Writing %s", rio->obj_name);
-			if (do_aio_generic(peer, pr, X_WRITE, rio->obj_name,
-					rio->buf, req->size, req->offset) < 0) {
-				XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write", rio->obj_name);
-				r = -1;
-				goto out_buf;
-			}
-			return 0;
-		}
+static void handle_split_read_cb(struct peerd *peer, struct rados_cqe *cqe)
+{
+	struct peer_req *pr = cqe->pr;
+	struct rados_io *rio = __get_rados_io(pr);
 
-		XSEGLOG2(&lc, I, "Resubmitting read of %s", rio->obj_name);
-		if (do_aio_generic(peer, pr, X_READ, rio->second_name, rio->buf + rio->read,
-			req->size - rio->read, req->offset + rio->read) < 0) {
-			XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
-					rio->obj_name);
-			r = -1;
-			goto out_buf;
-		}
+	if (cqe->retval < 0) {
+		XSEGLOG2(&lc, E, "Sub-read of %s at %llu failed", rio->target,
+				(unsigned long long) cqe->offset);
+		rio->err = cqe->retval;
+		split_read_put(peer, pr, 1);
+		return;
 	}
-	else if (rio->state == WRITING){
-		XSEGLOG2(&lc, I, "Writing of %s callback", rio->obj_name);
-		if (pr->retval == 0) {
-			XSEGLOG2(&lc, I, "Writing of %s completed", rio->obj_name);
-			XSEGLOG2(&lc, I, "Copy of object %s to object %s completed", rio->second_name, rio->obj_name);
-			req->serviced = req->size;
-			r = 0;
-			goto out_buf;
-		}
-		else {
-			XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
-			XSEGLOG2(&lc, E, "Copy of object %s to object %s failed", rio->second_name, rio->obj_name);
-			r = -1;
-			goto out_buf;
-		}
+
+	if (cqe->retval == 0) {
+		XSEGLOG2(&lc, D, "Sub-read of %s reached end of file at "
+				"%llu bytes. Zeroing out rest", rio->target,
+				(unsigned long long) cqe->offset);
+		memset(rio->buf + cqe->offset, 0, cqe->size);
+		cqe->size = 0;
+	} else {
+		cqe->offset += cqe->retval;
+		cqe->size -= cqe->retval;
 	}
-	else {
-		XSEGLOG2(&lc, E, "Unknown state");
+
+	if (!cqe->size || rio->err) {
+		split_read_put(peer, pr, 1);
+		return;
 	}
-	return 0;
 
+	/* resubmit the rest of the sub-read */
+	XSEGLOG2(&lc, D, "Resubmitting sub-read of %s", rio->target);
+	if (do_aio_subread(peer, cqe) < 0) {
+		XSEGLOG2(&lc, E, "Sub-read of %s failed on do_aio_read",
+				rio->target);
+		rio->err = -EIO;
+		split_read_put(peer, pr, 1);
+	}
+}
 
-out_buf:
-	free(rio->buf);
-out_src:
-	free(rio->second_name);
+static int radosd_read(struct peerd *peer, struct peer_req *pr, char *target,
+		char *buf, uint64_t size, uint64_t offset)
+{
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio = __get_rados_io(pr);
+
+	if (rados->read_split && size > rados->read_split) {
+		rio->target = target;
+		rio->buf = buf;
+		rio->size = size;
+		rio->offset = offset;
+		do_split_read(peer, pr);
+		return 0;
+	}
+	return __do_aio_read(peer, &rio->cqe, target, buf, size, offset);
+}
 
-	rio->buf = NULL;
-	rio->second_name = NULL;
-	rio->read = 0;
+static int radosd_write(struct peerd *peer, struct peer_req *pr, char *target,
+		char *buf, uint64_t size, uint64_t offset)
+{
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio = __get_rados_io(pr);
+	rados_completion_t rados_compl;
+	int r;
 
+	r = rados_aio_create_completion(&rio->cqe, NULL, rados_commit_cb,
+			&rados_compl);
 	if (r < 0)
-		fail(peer ,pr);
-	else
-		complete(peer, pr);
-	return 0;
+		return -1;
+	r = rados_aio_write(rados->ioctx, target, rados_compl, buf, size,
+			offset);
+	if (r < 0)
+		rados_aio_release(rados_compl);
+	return r;
 }
 
-int handle_hash(struct peerd *peer, struct peer_req *pr)
+static int radosd_stat(struct peerd *peer, struct peer_req *pr, char *target,
+		uint64_t *size)
 {
-	//struct radosd *rados = (struct radosd *) peer->priv;
-	struct xseg_request *req = pr->req;
-	struct rados_io *rio = (struct rados_io *) pr->priv;
-	uint64_t trailing_zeros = 0;
-	unsigned char sha[SHA256_DIGEST_SIZE];
-	struct xseg_reply_hash *xreply;
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio = __get_rados_io(pr);
+	rados_completion_t rados_compl;
 	int r;
-	char hash_name[HEXLIFIED_SHA256_DIGEST_SIZE + 1];
-	uint32_t pos;
-
-	if (rio->state == ACCEPTED){
-		XSEGLOG2(&lc, I, "Starting hashing of object %s", rio->obj_name);
-		if (!req->size) {
-			fail(peer, pr); //or fail?
-			return 0;
-		}
-
-		rio->second_name = malloc(MAX_OBJ_NAME+1);
-		if (!rio->second_name){
-			return -1;
-		}
-		rio->buf = malloc(req->size);
-		if (!rio->buf) {
-			r = -1;
-			goto out_src;
-		}
-
-		rio->second_name[0] = 0;
-		rio->state = PREHASHING;
-		pos = 0;
-		strncpy(hash_name, rio->obj_name, strlen(rio->obj_name));
-		pos += strlen(rio->obj_name);
-		strncpy(hash_name+pos, HASH_SUFFIX, HASH_SUFFIX_LEN);
-		pos += HASH_SUFFIX_LEN;
-		hash_name[pos] = 0;
-
-		if (do_aio_generic(peer, pr, X_READ, hash_name, rio->second_name,
-			HEXLIFIED_SHA256_DIGEST_SIZE, 0) < 0) {
-			XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read", rio->obj_name);
-			fail(peer, pr);
-			r = -1;
-			goto out_buf;
-		}
-	} else if (rio->state == PREHASHING) {
-		if (rio->second_name[0] != 0) {
-			XSEGLOG2(&lc, D, "Precalculated hash found");
-			xreply = (struct xseg_reply_hash*)xseg_get_data(peer->xseg, req);
-			r = xseg_resize_request(peer->xseg, pr->req, pr->req->targetlen,
-					sizeof(struct xseg_reply_hash));
-			strncpy(xreply->target, rio->second_name, HEXLIFIED_SHA256_DIGEST_SIZE);
-			xreply->targetlen = HEXLIFIED_SHA256_DIGEST_SIZE;
-
-			XSEGLOG2(&lc, I, "Calculated %s as hash of %s",
-					rio->second_name, rio->obj_name);
-			req->serviced = req->size;
-			goto out_buf;
 
-		}
-		rio->state = READING;
-		rio->read = 0;
-		XSEGLOG2(&lc, I, "Reading %s", rio->obj_name);
-		if (do_aio_generic(peer, pr, X_READ, rio->obj_name, rio->buf + rio->read,
-			req->size - rio->read, req->offset + rio->read) < 0) {
-			XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read", rio->obj_name);
-			fail(peer, pr);
-			r = -1;
-			goto out_buf;
-		}
-	} else if (rio->state == READING){
-		XSEGLOG2(&lc, I, "Reading of %s callback", rio->obj_name);
-		if (pr->retval >= 0)
-			rio->read += pr->retval;
-		else {
-			XSEGLOG2(&lc, E, "Reading of %s failed", rio->second_name);
-			r = -1;
-			goto out_buf;
-		}
+	r = rados_aio_create_completion(&rio->cqe, rados_ack_cb, NULL,
+			&rados_compl);
+	if (r < 0)
+		return -1;
+	r = rados_aio_stat(rados->ioctx, target, rados_compl, size, NULL);
+	if (r < 0)
+		rados_aio_release(rados_compl);
+	return r;
+}
 
-		if (!pr->retval || rio->read >= req->size) {
-			XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
-			//rstrip here in case zeros were written in the end
-			for (;trailing_zeros < rio->read; trailing_zeros++)
-				if (rio->buf[rio->read-trailing_zeros -1])
-					break;
-			XSEGLOG2(&lc, D, "Read %llu, Trainling zeros %llu",
-					rio->read, trailing_zeros);
-
-			rio->read -= trailing_zeros;
-			SHA256((unsigned char *) rio->buf, rio->read, sha);
-			hexlify(sha, SHA256_DIGEST_SIZE, rio->second_name);
-			rio->second_name[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
-
-			xreply = (struct xseg_reply_hash*)xseg_get_data(peer->xseg, req);
-			r = xseg_resize_request(peer->xseg, pr->req, pr->req->targetlen,
-					sizeof(struct xseg_reply_hash));
-			strncpy(xreply->target, rio->second_name, HEXLIFIED_SHA256_DIGEST_SIZE);
-			xreply->targetlen = HEXLIFIED_SHA256_DIGEST_SIZE;
-
-			XSEGLOG2(&lc, I, "Calculated %s as hash of %s",
-					rio->second_name, rio->obj_name);
-
-
-			//aio_stat
-			rio->state = STATING;
-			r = do_aio_generic(peer, pr, X_INFO, rio->second_name, NULL, 0, 0);
-			if (r < 0){
-				XSEGLOG2(&lc, E, "Stating %s failed", rio->second_name);
-				r = -1;
-				goto out_buf;
-			}
-			return 0;
-		}
-		XSEGLOG2(&lc, I, "Resubmitting read of %s", rio->obj_name);
-		if (do_aio_generic(peer, pr, X_READ, rio->obj_name, rio->buf + rio->read,
-			req->size - rio->read, req->offset + rio->read) < 0) {
-			XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
-					rio->obj_name);
-			r = -1;
-			goto out_buf;
-		}
-		return 0;
-	} else if (rio->state == STATING){
-		if (pr->retval < 0){
-			//write
-			XSEGLOG2(&lc, I, "Stating %s failed. Writing.",
-							rio->second_name);
-			rio->state = WRITING;
-			if (do_aio_generic(peer, pr, X_WRITE, rio->second_name,
-						rio->buf, rio->read, 0) < 0) {
-				XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write", rio->second_name);
-				r = -1;
-				goto out_buf;
-			}
-			return 0;
-		}
-		else {
-			XSEGLOG2(&lc, I, "Stating %s completed Successfully."
-					"No need to write.", rio->second_name);
-			XSEGLOG2(&lc, I, "Hash of object %s to object %s completed",
-					rio->obj_name, rio->second_name);
-			req->serviced = req->size;
-			r = 0;
-			goto out_buf;
-		}
+static int radosd_remove(struct peerd *peer, struct peer_req *pr, char *target)
+{
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio = __get_rados_io(pr);
+	rados_completion_t rados_compl;
+	int r;
 
-	}
-	else if (rio->state == WRITING){
-		XSEGLOG2(&lc, I, "Writing of %s callback", rio->obj_name);
-		if (pr->retval == 0) {
-			XSEGLOG2(&lc, I, "Writing of %s completed", rio->second_name);
-			XSEGLOG2(&lc, I, "Hash of object %s to object %s completed",
-					rio->obj_name, rio->second_name);
-
-			pos = 0;
-			strncpy(hash_name, rio->obj_name, strlen(rio->obj_name));
-			pos += strlen(rio->obj_name);
-			strncpy(hash_name+pos, HASH_SUFFIX, HASH_SUFFIX_LEN);
-			pos += HASH_SUFFIX_LEN;
-			hash_name[pos] = 0;
-
-			rio->state = POSTHASHING;
-			if (do_aio_generic(peer, pr, X_WRITE, hash_name, rio->second_name,
-						HEXLIFIED_SHA256_DIGEST_SIZE, 0) < 0) {
-				XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write", hash_name);
-				r = -1;
-				goto out_buf;
-			}
-			return 0;
-		}
-		else {
-			XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
-			XSEGLOG2(&lc, E, "Hash of object %s failed",
-								rio->obj_name);
-			r = -1;
-			goto out_buf;
-		}
-	} else if (rio->state == POSTHASHING) {
-		XSEGLOG2(&lc, I, "Writing of prehashed value callback");
-		if (pr->retval == 0) {
-			XSEGLOG2(&lc, I, "Writing of prehashed value completed");
-			XSEGLOG2(&lc, I, "Hash of object %s to object %s completed",
-					rio->obj_name, rio->second_name);
+	r = rados_aio_create_completion(&rio->cqe, rados_ack_cb, NULL,
+			&rados_compl);
+	if (r < 0)
+		return -1;
+	r = rados_aio_remove(rados->ioctx, target, rados_compl);
+	if (r < 0)
+		rados_aio_release(rados_compl);
+	return r;
+}
 
-		}
-		else {
-			XSEGLOG2(&lc, E, "Writing of prehash failed");
-		}
-		req->serviced = req->size;
-		r = 0;
-		goto out_buf;
+/*
+ * Zero the discarded range. The OSDs free the zeroed extents, or truncate the
+ * object if the range reaches its end.
+ */
+static int radosd_discard(struct peerd *peer, struct peer_req *pr, char *target,
+		uint64_t size, uint64_t offset)
+{
+	struct radosd *rados = __get_radosd(peer);
+	struct rados_io *rio = __get_rados_io(pr);
+	rados_completion_t rados_compl;
+	int r;
 
-	}
-	else {
-		XSEGLOG2(&lc, E, "Unknown state");
+	/* zero does not create missing objects, but fails */
+	rio->write_op = rados_create_write_op();
+	if (!rio->write_op)
+		return -1;
+	rados_write_op_assert_exists(rio->write_op);
+	rados_write_op_zero(rio->write_op, offset, size);
+	r = rados_aio_create_completion(&rio->cqe, NULL, rados_commit_cb,
+			&rados_compl);
+	if (r < 0)
+		goto out_release;
+	r = rados_aio_write_op_operate(rio->write_op, rados->ioctx,
+			rados_compl, target, NULL, 0);
+	if (r < 0) {
+		rados_aio_release(rados_compl);
+		goto out_release;
 	}
 	return 0;
 
-
-out_buf:
-	free(rio->buf);
-out_src:
-	free(rio->second_name);
-
-	rio->buf = NULL;
-	rio->second_name = NULL;
-	rio->read = 0;
-
-	if (r < 0)
-		fail(peer ,pr);
-	else
-		complete(peer, pr);
-	return 0;
+out_release:
+	rados_release_write_op(rio->write_op);
+	rio->write_op = NULL;
+	return -1;
 }
 
-int spawnthread(struct peerd *peer, struct peer_req *pr,
-			void *(*func)(void *arg))
+static int spawnthread(struct peer_req *pr, void *(*func)(void *arg))
 {
-	//struct radosd *rados = (struct radosd *) peer->priv;
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
+	struct rados_io *rio = __get_rados_io(pr);
 
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
@@ -727,64 +450,64 @@ void watch_cb(uint8_t opcode, uint64_t ver, void *arg)
 {
 	//assert pr valid
 	struct peer_req *pr = (struct peer_req *)arg;
-	//struct radosd *rados = (struct radosd *) pr->peer->priv;
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
+	struct rados_io *rio = __get_rados_io(pr);
 
 	if (pr->req->op == X_ACQUIRE){
-		XSEGLOG2(&lc, I, "watch cb signaling rio of %s", rio->obj_name);
+		XSEGLOG2(&lc, I, "watch cb signaling rio of %s", rio->lock_name);
 		pthread_cond_signal(&rio->cond);
 	}
 	else
 		XSEGLOG2(&lc, E, "Invalid req op in watch_cb");
 }
 
+/*
+ * Lock operations block in librados, so they run on threads of their own and
+ * complete through the completion queue.
+ */
 void * lock_op(void *arg)
 {
 	struct peer_req *pr = (struct peer_req *)arg;
-	struct radosd *rados = (struct radosd *) pr->peer->priv;
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
-	uint32_t len = strlen(rio->obj_name);
-	strncpy(rio->obj_name + len, LOCK_SUFFIX, LOCK_SUFFIX_LEN);
-	rio->obj_name[len + LOCK_SUFFIX_LEN] = 0;
-
-	XSEGLOG2(&lc, I, "Starting lock op for %s", rio->obj_name);
-	if (!(pr->req->flags & XF_NOSYNC)){
-		if (rados_watch(rados->ioctx, rio->obj_name, 0,
+	struct radosd *rados = __get_radosd(pr->peer);
+	struct rados_io *rio = __get_rados_io(pr);
+	int nosync = rio->lock_flag;
+
+	XSEGLOG2(&lc, I, "Starting lock op for %s", rio->lock_name);
+	if (!nosync){
+		if (rados_watch(rados->ioctx, rio->lock_name, 0,
 				&rio->watch_handle, watch_cb, pr) < 0){
 			XSEGLOG2(&lc, E, "Rados watch failed for %s",
-					rio->obj_name);
-			fail(pr->peer, pr);
+					rio->lock_name);
+			cq_complete(pr->peer, &rio->cqe, -EIO);
 			return NULL;
 		}
 	}
 
 	/* passing flag 1 means renew lock */
-	while(rados_lock_exclusive(rados->ioctx, rio->obj_name, RADOS_LOCK_NAME,
+	while(rados_lock_exclusive(rados->ioctx, rio->lock_name, RADOS_LOCK_NAME,
 		RADOS_LOCK_COOKIE, RADOS_LOCK_DESC, NULL, LIBRADOS_LOCK_FLAG_RENEW) < 0){
-		if (pr->req->flags & XF_NOSYNC){
+		if (nosync){
 			XSEGLOG2(&lc, E, "Rados lock failed for %s",
-					rio->obj_name);
-			fail(pr->peer, pr);
+					rio->lock_name);
+			cq_complete(pr->peer, &rio->cqe, -EBUSY);
 			return NULL;
 		}
 		else{
 			XSEGLOG2(&lc, D, "rados lock for %s sleeping",
-					rio->obj_name);
+					rio->lock_name);
 			pthread_mutex_lock(&rio->m);
 			pthread_cond_wait(&rio->cond, &rio->m);
 			pthread_mutex_unlock(&rio->m);
 			XSEGLOG2(&lc, D, "rados lock for %s woke up",
-					rio->obj_name);
+					rio->lock_name);
 		}
 	}
-	if (!(pr->req->flags & XF_NOSYNC)){
-		if (rados_unwatch(rados->ioctx, rio->obj_name,
+	if (!nosync){
+		if (rados_unwatch(rados->ioctx, rio->lock_name,
 					rio->watch_handle) < 0){
 			XSEGLOG2(&lc, E, "Rados unwatch failed");
 		}
 	}
-	XSEGLOG2(&lc, I, "Successfull lock op for %s", rio->obj_name);
-	complete(pr->peer, pr);
+	cq_complete(pr->peer, &rio->cqe, 0);
 	return NULL;
 }
 
@@ -807,12 +530,12 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
 			break;
 		}
 
-		nr_lockers = rados_list_lockers(rados->ioctx, rio->obj_name,
+		nr_lockers = rados_list_lockers(rados->ioctx, rio->lock_name,
 				RADOS_LOCK_NAME, &exclusive, tag, &tag_len,
 				clients, &clients_len, cookies, &cookies_len,
 				addrs, &addrs_len);
 		if (nr_lockers < 0 && nr_lockers != -ERANGE) {
-			XSEGLOG2(&lc, E, "Could not list lockers for %s", rio->obj_name);
+			XSEGLOG2(&lc, E, "Could not list lockers for %s", rio->lock_name);
 			r = -1;
 			break;
 		} else if (nr_lockers == -ERANGE) {
@@ -823,12 +546,12 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
 		} else {
 			if (nr_lockers != 1) {
 				XSEGLOG2(&lc, E, "Number of lockers for %s != 1 !(%d)",
-						rio->obj_name, nr_lockers);
+						rio->lock_name, nr_lockers);
 				r = -1;
 				break;
 			} else if (!exclusive) {
 				XSEGLOG2(&lc, E, "Lock for %s is not exclusive",
-						rio->obj_name);
+						rio->lock_name);
 				r = -1;
 				break;
 			} else if (strcmp(RADOS_LOCK_TAG, tag)) {
@@ -837,7 +560,7 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
 				r = -1;
 				break;
 			}
-			r = rados_break_lock(rados->ioctx, rio->obj_name,
+			r = rados_break_lock(rados->ioctx, rio->lock_name,
 				RADOS_LOCK_NAME, clients, RADOS_LOCK_COOKIE);
 			break;
 		}
@@ -854,19 +577,16 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
 void * unlock_op(void *arg)
 {
 	struct peer_req *pr = (struct peer_req *)arg;
-	struct radosd *rados = (struct radosd *) pr->peer->priv;
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
-	uint32_t len = strlen(rio->obj_name);
-	strncpy(rio->obj_name + len, LOCK_SUFFIX, LOCK_SUFFIX_LEN);
-	rio->obj_name[len + LOCK_SUFFIX_LEN] = 0;
+	struct radosd *rados = __get_radosd(pr->peer);
+	struct rados_io *rio = __get_rados_io(pr);
 	int r;
 
-	XSEGLOG2(&lc, I, "Starting unlock op for %s", rio->obj_name);
-	if (pr->req->flags & XF_FORCE) {
+	XSEGLOG2(&lc, I, "Starting unlock op for %s", rio->lock_name);
+	if (rio->lock_flag) {
 		r = break_lock(rados, rio);
 	}
 	else {
-		r = rados_unlock(rados->ioctx, rio->obj_name, RADOS_LOCK_NAME,
+		r = rados_unlock(rados->ioctx, rio->lock_name, RADOS_LOCK_NAME,
 			RADOS_LOCK_COOKIE);
 	}
 	/* ENOENT means that the lock did not existed.
@@ -874,186 +594,191 @@ void * unlock_op(void *arg)
 	 */
 	//if (r < 0 && r != -ENOENT){
 	if (r < 0){
-		XSEGLOG2(&lc, E, "Rados unlock failed for %s (r: %d)", rio->obj_name, r);
-		fail(pr->peer, pr);
+		XSEGLOG2(&lc, E, "Rados unlock failed for %s (r: %d)", rio->lock_name, r);
+		cq_complete(pr->peer, &rio->cqe, r);
 	}
 	else {
-		if (rados_notify(rados->ioctx, rio->obj_name,
+		if (rados_notify(rados->ioctx, rio->lock_name,
 					0, NULL, 0) < 0) {
 			XSEGLOG2(&lc, E, "rados notify failed");
 		}
-		XSEGLOG2(&lc, I, "Successfull unlock op for %s", rio->obj_name);
-		complete(pr->peer, pr);
+		cq_complete(pr->peer, &rio->cqe, 0);
 	}
 	return NULL;
 }
 
-int handle_acquire(struct peerd *peer, struct peer_req *pr)
+static void lock_object_name(char *lock_name, char *target)
 {
-	int r = spawnthread(peer, pr, lock_op);
-	if (r < 0)
-		fail(pr->peer, pr);
-	return 0;
+	uint32_t len = strlen(target);
+
+	strncpy(lock_name, target, len);
+	strncpy(lock_name + len, BLOCKER_LOCK_SUFFIX, BLOCKER_LOCK_SUFFIX_LEN);
+	lock_name[len + BLOCKER_LOCK_SUFFIX_LEN] = 0;
 }
 
+static int radosd_lock(struct peerd *peer, struct peer_req *pr, char *target,
+		int nosync)
+{
+	struct rados_io *rio = __get_rados_io(pr);
 
-int handle_release(struct peerd *peer, struct peer_req *pr)
+	lock_object_name(rio->lock_name, target);
+	rio->lock_flag = nosync;
+	return spawnthread(pr, lock_op) ? -1 : 0;
+}
+
+static int radosd_unlock(struct peerd *peer, struct peer_req *pr, char *target,
+		int force)
 {
-	int r = spawnthread(peer, pr, unlock_op);
-	if (r < 0)
-		fail(pr->peer, pr);
+	struct rados_io *rio = __get_rados_io(pr);
+
+	lock_object_name(rio->lock_name, target);
+	rio->lock_flag = force;
+	return spawnthread(pr, unlock_op) ? -1 : 0;
+}
+
+/*
+ * This function substitutes the default generic_peerd_loop of peer.c.
+ * Apart from checking the ports, it also drains the completion queue.
+ */
+int radosd_peerd_loop(void *arg)
+{
+	struct thread *t = (struct thread *) arg;
+	struct peerd *peer = t->peer;
+	char *id = t->arg;
+	struct xseg *xseg = peer->xseg;
+	xport portno_start = peer->portno_start;
+	xport portno_end = peer->portno_end;
+	pid_t pid = syscall(SYS_gettid);
+	uint64_t threshold = peer->threshold;
+	threshold /= (1 + portno_end - portno_start);
+	threshold += 1;
+	uint64_t loops;
+	int c;
+
+	XSEGLOG2(&lc, I, "%s has tid %u.\n", id, pid);
+	xseg_init_local_signal(xseg, peer->portno_start);
+	for (;!(isTerminate() && all_peer_reqs_free(peer));) {
+		for(loops = threshold; loops > 0; loops--) {
+			if (loops == 1)
+				xseg_prepare_wait(xseg, peer->portno_start);
+			/*
+			 * Drain the queue after prepare_wait, so that a
+			 * completion pushed before it is not missed until
+			 * the next signal.
+			 */
+			c = cq_drain(peer);
+			c |= check_ports(peer, t);
+			if (c)
+				loops = threshold;
+		}
+		XSEGLOG2(&lc, I, "%s goes to sleep\n", id);
+		xseg_wait_signal(xseg, peer->sd, 10000000UL);
+		xseg_cancel_wait(xseg, peer->portno_start);
+		XSEGLOG2(&lc, I, "%s woke up\n", id);
+	}
 	return 0;
 }
 
-int custom_peer_init(struct peerd *peer, int argc, char *argv[])
+static int radosd_init(struct peerd *peer, int argc, char *argv[])
 {
+	struct blockerd *blocker = __get_blockerd(peer);
+	struct blocker_io *bio;
 	int i, j;
 	struct radosd *rados = malloc(sizeof(struct radosd));
 	char *cephx_id = calloc(1, MAX_CEPHXID_NAME);
 	struct rados_io *rio;
-	if (!rados) {
+	if (!rados || !cephx_id) {
 		perror("malloc");
+		free(rados);
+		free(cephx_id);
 		return -1;
 	}
 	rados->pool[0] = 0;
+	rados->cq_head = NULL;
+	rados->read_split = 0;
 
 	BEGIN_READ_ARGS(argc, argv);
 	READ_ARG_STRING("--pool", rados->pool, MAX_POOL_NAME);
 	READ_ARG_STRING("--cephx-id", cephx_id, MAX_CEPHXID_NAME);
+	READ_ARG_ULONG("--read-split", rados->read_split);
 	END_READ_ARGS();
 
 	if (!rados->pool[0]){
 		XSEGLOG2(&lc, E , "Pool must be provided");
 		free(rados);
+		free(cephx_id);
 		usage(argv[0]);
 		return -1;
 	}
 
 	if (rados_create(&rados->cluster, (cephx_id[0] == '\0') ? NULL : cephx_id)< 0) {
 		XSEGLOG2(&lc, E, "Rados create failed!");
+		free(rados);
 		free(cephx_id);
 		return -1;
 	}
+	free(cephx_id);
 
 	if (rados_conf_read_file(rados->cluster, NULL) < 0){
 		XSEGLOG2(&lc, E, "Error reading rados conf files!");
+		rados_shutdown(rados->cluster);
+		free(rados);
 		return -1;
 	}
 	if (rados_connect(rados->cluster) < 0) {
 		XSEGLOG2(&lc, E, "Rados connect failed!");
 		rados_shutdown(rados->cluster);
 		free(rados);
-		free(cephx_id);
 		return -1;
 	}
 	if (rados_pool_lookup(rados->cluster, rados->pool) < 0) {
 		XSEGLOG2(&lc, E, "Pool does not exists. Try creating it first");
 		rados_shutdown(rados->cluster);
 		free(rados);
-		free(cephx_id);
 		return -1;
-		/*
-		if (rados_pool_create(rados->cluster, rados->pool) < 0){
-			XSEGLOG2(&lc, E, "Couldn't create pool %s", rados->pool);
-			rados_shutdown(rados->cluster);
-			free(rados);
-			return -1;
-		}
-		XSEGLOG2(&lc, I, "Pool created.");
-		*/
-
 	}
 	if (rados_ioctx_create(rados->cluster, rados->pool, &(rados->ioctx)) < 0){
 		XSEGLOG2(&lc, E, "ioctx create problem.");
 		rados_shutdown(rados->cluster);
 		free(rados);
-		free(cephx_id);
 		return -1;
 	}
-	peer->priv = (void *) rados;
 	for (i = 0; i < peer->nr_ops; i++) {
-		rio = malloc(sizeof(struct rados_io));
+		rio = calloc(1, sizeof(struct rados_io));
 		if (!rio) {
-			//ugly
-			//is this really necessary?
 			for (j = 0; j < i; j++) {
-				free(peer->peer_reqs[j].priv);
+				bio = __get_blocker_io(&peer->peer_reqs[j]);
+				free(bio->priv);
+				bio->priv = NULL;
 			}
+			rados_ioctx_destroy(rados->ioctx);
+			rados_shutdown(rados->cluster);
 			free(rados);
-			free(cephx_id);
 			perror("malloc");
 			return -1;
 		}
-		rio->buf = 0;
-		rio->read = 0;
-		rio->size = 0;
-		rio->second_name = 0;
-		rio->watch_handle = 0;
+		rio->cqe.pr = &peer->peer_reqs[i];
+		for (j = 0; j < MAX_READ_SPLITS; j++)
+			rio->subreads[j].pr = &peer->peer_reqs[i];
 		pthread_cond_init(&rio->cond, NULL);
 		pthread_mutex_init(&rio->m, NULL);
-		peer->peer_reqs[i].priv = (void *) rio;
+		__get_blocker_io(&peer->peer_reqs[i])->priv = (void *) rio;
 	}
+	blocker->priv = rados;
+	peer->peerd_loop = radosd_peerd_loop;
 	return 0;
 }
 
-// nothing to do here for now
-int custom_arg_parse(int argc, const char *argv[])
-{
-	return 0;
-}
-
-void custom_peer_finalize(struct peerd *peer)
-{
-	return;
-}
-
-int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
-		enum dispatch_reason reason)
-{
-	struct rados_io *rio = (struct rados_io *) (pr->priv);
-	char *target = xseg_get_target(peer->xseg, pr->req);
-	unsigned int end = (pr->req->targetlen > MAX_OBJ_NAME) ?
-		MAX_OBJ_NAME : pr->req->targetlen;
-
-	if (reason == dispatch_accept) {
-		strncpy(rio->obj_name, target, end);
-		rio->obj_name[end] = 0;
-		rio->state = ACCEPTED;
-		rio->read = 0;
-	}
-
-	switch (pr->req->op){
-		case X_READ:
-			handle_read(peer, pr); break;
-		case X_WRITE:
-			handle_write(peer, pr); break;
-		case X_DELETE:
-			if (canDefer(peer))
-				defer_request(peer, pr);
-			else
-				handle_delete(peer, pr);
-			break;
-		case X_INFO:
-			if (canDefer(peer))
-				defer_request(peer, pr);
-			else
-				handle_info(peer, pr);
-			break;
-		case X_COPY:
-			if (canDefer(peer))
-				defer_request(peer, pr);
-			else
-				handle_copy(peer, pr);
-			break;
-		case X_ACQUIRE:
-			handle_acquire(peer, pr); break;
-		case X_RELEASE:
-			handle_release(peer, pr); break;
-		case X_HASH:
-			handle_hash(peer, pr); break;
-
-		default:
-			fail(peer, pr);
-	}
-	return 0;
-}
+struct blocker_backend blocker_backend = {
+	.name = "rados",
+	.caps = BLOCKER_CAP_DISCARD,
+	.init = radosd_init,
+	.usage = radosd_usage,
+	.read = radosd_read,
+	.write = radosd_write,
+	.stat = radosd_stat,
+	.remove = radosd_remove,
+	.discard = radosd_discard,
+	.lock = radosd_lock,
+	.unlock = radosd_unlock
+};
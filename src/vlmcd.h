@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VLMCD_H
+
+#define VLMCD_H
+
+#include <stdint.h>
+
+/*
+ * Timing of reads and writes served by vlmcd.
+ *
+ * A client asks for it by allocating the data buffer of a request with room
+ * for a struct vlmc_timing right after the request's size, and setting its
+ * magic to VLMC_TIMING_REQUEST. When vlmcd concludes the request, it fills
+ * the time the request spent in each stage, in nanoseconds, and sets the magic
+ * to VLMC_TIMING_REPLY. Requests without it are not timed at all.
+ */
+#define VLMC_TIMING_REQUEST	0x51455254434d4c56ULL	/* "VLMCTREQ" */
+#define VLMC_TIMING_REPLY	0x50455254434d4c56ULL	/* "VLMCTREP" */
+
+struct vlmc_timing {
+	uint64_t magic;
+	uint64_t queue;		/* accepted until sent to the mapper */
+	uint64_t map;		/* waiting for the mapper */
+	uint64_t io;		/* waiting for the blockers */
+};
+
+#endif /* end of VLMCD_H */
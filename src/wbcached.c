@@ -0,0 +1,1817 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write-back cache of volume objects.
+ *
+ * wbcached sits between vlmcd and the blocker (-bp). Small writes to the
+ * writable objects of volumes (<volume>_<epoch>_<index>) are kept in memory
+ * and acknowledged once they are in a local journal, and are written back
+ * later, so that many small guest writes to an object become a few large
+ * writes of its dirty ranges. Everything else is passed through.
+ *
+ * Memory: dirty data lives in buckets of a global pool (--cache-size). A
+ * volume may not hold more than --volume-limit of it. Writes that find no
+ * room, larger writes and FUA writes are written through to the blocker;
+ * the dirty copies they overlap are updated, so that no older data is ever
+ * written back over them.
+ *
+ * Flushes: an X_FLUSH request with a volume as its target (vlmcd sends one
+ * with --cache-flush) completes when all the data that was dirty when it
+ * arrived has been written back, that of other volumes included. Objects are
+ * grouped by the volume in their name, which a rename does not change: the
+ * renamed map keeps writing to the objects it had. A flush of the volume
+ * under its new name must therefore not miss them. Requests other than reads
+ * and writes on an object wait for its dirty data to be written back first,
+ * e.g. the copy-ups of the mapper read the object at the blocker.
+ *
+ * Journal: every write, written back or through, as well as discards and
+ * deletes, is appended to the journal (--journal) before it is acknowledged.
+ * On start, the records of the journal are replayed to the blocker in order.
+ * Once half of the journal is used, all dirty data is written back and the
+ * journal starts over; writes that find it full wait for that.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <xseg/xseg.h>
+#include <xseg/protocol.h>
+#include <peer.h>
+
+#define WB_OBJECT_SHIFT 22
+#define WB_OBJECT_SIZE (1UL << WB_OBJECT_SHIFT)
+#define WB_SECTOR_SHIFT 9
+#define WB_SECTOR_SIZE (1UL << WB_SECTOR_SHIFT)
+#define WB_SECTORS (WB_OBJECT_SIZE >> WB_SECTOR_SHIFT)
+#define WB_BITMAP_WORDS (WB_SECTORS / 64)
+#define WB_BUCKET_SHIFT 16
+#define WB_BUCKET_SIZE (1UL << WB_BUCKET_SHIFT)
+#define WB_BUCKETS (WB_OBJECT_SIZE >> WB_BUCKET_SHIFT)
+#define WB_BUCKET_SECTORS (WB_BUCKET_SIZE >> WB_SECTOR_SHIFT)
+
+/* "_<epoch>_<index>", in hex, see mapper-handling.c */
+#define WB_OBJECT_SUFFIX_LEN (1 + 16 + 1 + 16)
+
+#define WB_DEFAULT_CACHE_SIZE 256	/* MiB */
+#define WB_DEFAULT_VOLUME_LIMIT 64	/* MiB */
+#define WB_DEFAULT_MAX_WRITE 512	/* KiB */
+#define WB_DEFAULT_MAX_FLUSHES 16
+#define WB_DEFAULT_JOURNAL_SIZE 512	/* MiB */
+
+#define WB_JOURNAL_MAGIC 0x4c4e524a4243574fULL	/* "OWCBJRNL" */
+#define WB_JOURNAL_VERSION 1
+#define WB_JOURNAL_START 4096
+#define WB_RECORD_MAGIC 0x44524345
+#define WB_RECORD_HEADER 512
+
+enum wb_record_type {
+	WB_RECORD_WRITE = 0,
+	WB_RECORD_DISCARD = 1,
+	WB_RECORD_DELETE = 2
+};
+
+struct wb_journal_super {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t pad;
+	uint64_t gen;
+	uint64_t nonce;
+};
+
+/*
+ * A record is a header sector followed by its data, padded to a sector. The
+ * checksum is seeded with the nonce of the journal, which is regenerated
+ * whenever the journal starts over, so that guest data cannot pass for a
+ * record.
+ */
+struct wb_record {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t gen;
+	uint64_t seq;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t sum;
+	uint32_t targetlen;
+	char target[XSEG_MAX_TARGETLEN];
+};
+
+union wb_record_block {
+	struct wb_record rec;
+	char pad[WB_RECORD_HEADER];
+};
+
+struct wb_journal {
+	int fd;
+	uint64_t size;
+	uint64_t pos;			/* where the next record goes */
+	uint64_t gen, seq, nonce;
+	uint32_t inflight;		/* records reserved, not yet written */
+	int draining;			/* all dirty data is being written back */
+	int dead;			/* cannot be written, writes go through */
+	struct peer_req *waiters;	/* writes that found it full */
+};
+
+struct wb_link {
+	struct wb_link *prev, *next;
+};
+
+#define wb_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct wb_volume {
+	char name[XSEG_MAX_TARGETLEN + 1];
+	struct wb_link objects;		/* its dirty objects */
+	uint64_t nr_objects;		/* all its objects */
+	uint64_t nr_buckets;
+};
+
+enum wb_state {
+	WB_IDLE = 0,
+	WB_PASSTHROUGH = 1,
+	WB_READ = 2,
+	WB_FLUSH = 3
+};
+
+struct wb_io {
+	enum wb_state state;
+	int err;
+	struct wb_object *obj;
+	struct peer_req *next;		/* in a list of waiting requests */
+	uint64_t flush_seq;		/* of a flush, the newest dirty object */
+	uint64_t cached[WB_BITMAP_WORDS]; /* sectors to overlay on a read */
+};
+
+/*
+ * A sector holds cached data if it is dirty, or is being written back. The
+ * buckets of an object are freed once they hold no such sectors and no read
+ * of the object, which may need them, is in flight.
+ */
+struct wb_object {
+	char name[XSEG_MAX_TARGETLEN + 1];
+	uint32_t namelen;
+	struct wb_volume *vol;
+	struct wb_link vol_link;	/* in the dirty objects of the volume */
+	struct wb_link dirty_link;	/* in the dirty objects of the cache */
+	int dirty_listed;
+	uint64_t dirty_seq;		/* when it was listed dirty */
+	char *buckets[WB_BUCKETS];
+	uint32_t nr_buckets;
+	uint64_t dirty[WB_BITMAP_WORDS];
+	uint64_t flushing[WB_BITMAP_WORDS];
+	uint32_t refs;			/* requests using it */
+	uint32_t readers;
+	uint32_t flush_writes;		/* write-back writes in flight */
+	int flush_err;
+	struct peer_req *waiters;	/* requests waiting for it to be clean */
+	struct peer_req flush_pr;	/* receives the write-back writes */
+	struct wb_io flush_io;
+};
+
+struct wbcached {
+	xport bportno;
+	unsigned long cache_size;	/* MiB */
+	unsigned long volume_limit;	/* MiB */
+	unsigned long max_write;	/* KiB */
+	unsigned long max_flushes;
+	uint64_t volume_buckets;
+	pthread_mutex_t lock;		/* protects everything below */
+	xhash_t *objects;
+	xhash_t *volumes;
+	struct wb_link dirty;		/* dirty objects, oldest first */
+	uint64_t nr_dirty;
+	uint64_t dirty_seq;		/* of the newest dirty object */
+	struct peer_req *flush_waiters;
+	uint64_t flushes;		/* objects being written back */
+	char *arena;
+	uint32_t *free_buckets;
+	uint64_t nr_buckets, nr_free;
+	struct wb_journal journal;
+	int finalized;
+	/* counters, logged on exit */
+	uint64_t written_back, written_through, flush_writes, flushed_bytes;
+};
+
+void custom_peer_usage()
+{
+	fprintf(stderr, "Custom peer options: \n"
+			"-bp : blocker port to cache\n"
+			"--journal : journal file of the dirty data\n"
+			"--journal-size : size of the journal in MiB (default: %d)\n"
+			"--cache-size : memory for dirty data in MiB (default: %d)\n"
+			"--volume-limit : dirty data of a volume in MiB (default: %d)\n"
+			"--max-write : larger writes are written through, in KiB "
+			"(default: %d)\n"
+			"--max-flushes : objects written back at a time, unless "
+			"flushed (default: %d)\n"
+			"\n", WB_DEFAULT_JOURNAL_SIZE, WB_DEFAULT_CACHE_SIZE,
+			WB_DEFAULT_VOLUME_LIMIT, WB_DEFAULT_MAX_WRITE,
+			WB_DEFAULT_MAX_FLUSHES);
+}
+
+static inline struct wbcached * __get_wbcached(struct peerd *peer)
+{
+	return (struct wbcached *) peer->priv;
+}
+
+static inline struct wb_io * __get_wbio(struct peer_req *pr)
+{
+	return (struct wb_io *) pr->priv;
+}
+
+static inline void wb_list_init(struct wb_link *l)
+{
+	l->prev = l->next = l;
+}
+
+static inline int wb_list_empty(struct wb_link *l)
+{
+	return l->next == l;
+}
+
+static inline void wb_list_add_tail(struct wb_link *head, struct wb_link *l)
+{
+	l->prev = head->prev;
+	l->next = head;
+	head->prev->next = l;
+	head->prev = l;
+}
+
+static inline void wb_list_del(struct wb_link *l)
+{
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+	wb_list_init(l);
+}
+
+static inline void push_waiter(struct peer_req **list, struct peer_req *pr)
+{
+	__get_wbio(pr)->next = *list;
+	*list = pr;
+}
+
+/* sector bitmaps */
+static inline int test_sector(uint64_t *map, uint64_t s)
+{
+	return !!(map[s / 64] & (1ULL << (s % 64)));
+}
+
+static inline void set_sector(uint64_t *map, uint64_t s)
+{
+	map[s / 64] |= 1ULL << (s % 64);
+}
+
+static int any_sector(uint64_t *map, uint64_t start, uint64_t end)
+{
+	uint64_t s;
+
+	for (s = start; s < end; s++) {
+		if (!(s % 64) && s + 64 <= end && !map[s / 64]) {
+			s += 63;
+			continue;
+		}
+		if (test_sector(map, s))
+			return 1;
+	}
+	return 0;
+}
+
+static inline int sector_cached(struct wb_object *obj, uint64_t s)
+{
+	return test_sector(obj->dirty, s) || test_sector(obj->flushing, s);
+}
+
+static inline int bucket_cached(struct wb_object *obj, uint32_t b)
+{
+	uint32_t w = b * (WB_BUCKET_SECTORS / 64);
+	uint32_t i;
+
+	for (i = 0; i < WB_BUCKET_SECTORS / 64; i++) {
+		if (obj->dirty[w + i] | obj->flushing[w + i])
+			return 1;
+	}
+	return 0;
+}
+
+static inline int object_dirty(struct wb_object *obj)
+{
+	int i;
+
+	for (i = 0; i < WB_BITMAP_WORDS; i++) {
+		if (obj->dirty[i])
+			return 1;
+	}
+	return 0;
+}
+
+/* The volume of a writable object, whose name ends with _<epoch>_<index> */
+static int object_volume_len(char *target, uint32_t targetlen)
+{
+	uint32_t i, start;
+
+	if (targetlen <= WB_OBJECT_SUFFIX_LEN)
+		return -1;
+	start = targetlen - WB_OBJECT_SUFFIX_LEN;
+	for (i = start; i < targetlen; i++) {
+		if (i == start || i == start + 17) {
+			if (target[i] != '_')
+				return -1;
+		} else if (!((target[i] >= '0' && target[i] <= '9') ||
+					(target[i] >= 'a' && target[i] <= 'f'))) {
+			return -1;
+		}
+	}
+	return start;
+}
+
+/*
+ * Journal
+ */
+static uint64_t journal_sum(uint64_t h, char *buf, uint64_t len)
+{
+	uint64_t i, w;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, buf + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	for (; i < len; i++)
+		h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static uint64_t journal_record_len(uint64_t size)
+{
+	return WB_RECORD_HEADER + ((size + WB_SECTOR_SIZE - 1) &
+			~(WB_SECTOR_SIZE - 1));
+}
+
+static int journal_write_super(struct wb_journal *j)
+{
+	char buf[WB_JOURNAL_START];
+	struct wb_journal_super *super = (struct wb_journal_super *)buf;
+
+	memset(buf, 0, sizeof(buf));
+	super->magic = WB_JOURNAL_MAGIC;
+	super->version = WB_JOURNAL_VERSION;
+	super->gen = j->gen;
+	super->nonce = j->nonce;
+	if (pwrite(j->fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+		XSEGLOG2(&lc, E, "Cannot write the journal superblock: %s",
+				strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Start the journal over, dropping all its records */
+static int journal_reset(struct wb_journal *j)
+{
+	uint64_t nonce = 0;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || read(fd, &nonce, sizeof(nonce)) != sizeof(nonce))
+		nonce = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+	if (fd >= 0)
+		close(fd);
+
+	j->gen++;
+	j->nonce = nonce ^ j->gen;
+	j->seq = 0;
+	j->pos = WB_JOURNAL_START;
+	j->draining = 0;
+	return journal_write_super(j);
+}
+
+/*
+ * Reserve room for a record. Must be called with the lock held. Returns -1
+ * if the journal is full.
+ */
+static int journal_reserve(struct wb_journal *j, uint64_t len, uint64_t *pos,
+		uint64_t *seq)
+{
+	if (j->pos + len > j->size) {
+		j->draining = 1;
+		return -1;
+	}
+	*pos = j->pos;
+	*seq = j->seq++;
+	j->pos += len;
+	j->inflight++;
+	if (j->pos - WB_JOURNAL_START > (j->size - WB_JOURNAL_START) / 2)
+		j->draining = 1;
+	return 0;
+}
+
+static int journal_append(struct wb_journal *j, uint32_t type, uint64_t pos,
+		uint64_t seq, char *target, uint32_t targetlen,
+		uint64_t offset, uint64_t size, char *data)
+{
+	static char zeros[WB_SECTOR_SIZE];
+	union wb_record_block block;
+	struct wb_record *rec = &block.rec;
+	struct iovec iov[3];
+	uint64_t pad = 0, sum;
+	int cnt = 1;
+	ssize_t r, len;
+
+	memset(&block, 0, sizeof(block));
+	rec->magic = WB_RECORD_MAGIC;
+	rec->type = type;
+	rec->gen = j->gen;
+	rec->seq = seq;
+	rec->offset = offset;
+	rec->size = size;
+	rec->targetlen = targetlen;
+	strncpy(rec->target, target, targetlen);
+
+	iov[0].iov_base = &block;
+	iov[0].iov_len = WB_RECORD_HEADER;
+	len = WB_RECORD_HEADER;
+	sum = journal_sum(j->nonce, (char *)&block, WB_RECORD_HEADER);
+	if (type == WB_RECORD_WRITE && size) {
+		iov[1].iov_base = data;
+		iov[1].iov_len = size;
+		sum = journal_sum(sum, data, size);
+		pad = journal_record_len(size) - WB_RECORD_HEADER - size;
+		cnt = 2;
+		if (pad) {
+			iov[2].iov_base = zeros;
+			iov[2].iov_len = pad;
+			cnt = 3;
+		}
+		len += size + pad;
+	}
+	rec->sum = sum;
+
+	r = pwritev(j->fd, iov, cnt, pos);
+	if (r != len) {
+		XSEGLOG2(&lc, E, "Cannot append to the journal: %s",
+				r < 0 ? strerror(errno) : "short write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Index of objects and volumes
+ */
+static void * hash_lookup(xhash_t *hash, char *name)
+{
+	void *val;
+
+	if (xhash_lookup(hash, (xhashidx) name, (xhashidx *) &val) < 0)
+		return NULL;
+	return val;
+}
+
+static int hash_insert(xhash_t **hash, char *name, void *val)
+{
+	int r = xhash_insert(*hash, (xhashidx) name, (xhashidx) val);
+
+	while (r == -XHASH_ERESIZE) {
+		xhashidx shift = xhash_grow_size_shift(*hash);
+		xhash_t *new_hash = xhash_resize(*hash, shift, 0, NULL);
+		if (!new_hash) {
+			XSEGLOG2(&lc, E, "Cannot grow hash to sizeshift %llu",
+					(unsigned long long) shift);
+			return r;
+		}
+		*hash = new_hash;
+		r = xhash_insert(*hash, (xhashidx) name, (xhashidx) val);
+	}
+	return r;
+}
+
+static int hash_delete(xhash_t **hash, char *name)
+{
+	int r = xhash_delete(*hash, (xhashidx) name);
+
+	while (r == -XHASH_ERESIZE) {
+		xhashidx shift = xhash_shrink_size_shift(*hash);
+		xhash_t *new_hash = xhash_resize(*hash, shift, 0, NULL);
+		if (!new_hash) {
+			XSEGLOG2(&lc, E, "Cannot shrink hash to sizeshift %llu",
+					(unsigned long long) shift);
+			return r;
+		}
+		*hash = new_hash;
+		r = xhash_delete(*hash, (xhashidx) name);
+	}
+	return r;
+}
+
+static struct wb_volume * get_volume(struct wbcached *wb, char *name,
+		uint32_t namelen)
+{
+	struct wb_volume *vol;
+	char buf[XSEG_MAX_TARGETLEN + 1];
+
+	strncpy(buf, name, namelen);
+	buf[namelen] = 0;
+	vol = hash_lookup(wb->volumes, buf);
+	if (vol)
+		return vol;
+
+	vol = calloc(1, sizeof(struct wb_volume));
+	if (!vol)
+		return NULL;
+	strcpy(vol->name, buf);
+	wb_list_init(&vol->objects);
+	if (hash_insert(&wb->volumes, vol->name, vol) < 0) {
+		free(vol);
+		return NULL;
+	}
+	return vol;
+}
+
+/*
+ * Look up the object of a request, or create it. Must be called with the lock
+ * held, and the reference it takes must be put.
+ */
+static struct wb_object * get_object(struct peerd *peer, char *target,
+		uint32_t targetlen, int create)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_object *obj;
+	char buf[XSEG_MAX_TARGETLEN + 1];
+	int vlen;
+
+	strncpy(buf, target, targetlen);
+	buf[targetlen] = 0;
+	obj = hash_lookup(wb->objects, buf);
+	if (obj) {
+		obj->refs++;
+		return obj;
+	}
+	if (!create)
+		return NULL;
+
+	vlen = object_volume_len(target, targetlen);
+	if (vlen < 0)
+		return NULL;
+	obj = calloc(1, sizeof(struct wb_object));
+	if (!obj) {
+		XSEGLOG2(&lc, E, "Cannot allocate object %s", buf);
+		return NULL;
+	}
+	strcpy(obj->name, buf);
+	obj->namelen = targetlen;
+	obj->vol = get_volume(wb, target, vlen);
+	if (!obj->vol) {
+		XSEGLOG2(&lc, E, "Cannot allocate the volume of %s", buf);
+		free(obj);
+		return NULL;
+	}
+	if (hash_insert(&wb->objects, obj->name, obj) < 0) {
+		XSEGLOG2(&lc, E, "Cannot index object %s", buf);
+		if (!obj->vol->nr_objects) {
+			hash_delete(&wb->volumes, obj->vol->name);
+			free(obj->vol);
+		}
+		free(obj);
+		return NULL;
+	}
+	obj->vol->nr_objects++;
+	wb_list_init(&obj->vol_link);
+	wb_list_init(&obj->dirty_link);
+	obj->flush_pr.peer = peer;
+	obj->flush_pr.portno = peer->portno_start;
+	obj->flush_pr.priv = &obj->flush_io;
+	obj->flush_io.state = WB_FLUSH;
+	obj->flush_io.obj = obj;
+	obj->refs = 1;
+	return obj;
+}
+
+static void maybe_free_object(struct wbcached *wb, struct wb_object *obj)
+{
+	struct wb_volume *vol = obj->vol;
+
+	if (obj->refs || obj->readers || obj->flush_writes ||
+			obj->dirty_listed || obj->nr_buckets || obj->waiters)
+		return;
+
+	hash_delete(&wb->objects, obj->name);
+	free(obj);
+	if (!--vol->nr_objects) {
+		hash_delete(&wb->volumes, vol->name);
+		free(vol);
+	}
+}
+
+static void put_object(struct wbcached *wb, struct wb_object *obj)
+{
+	obj->refs--;
+	maybe_free_object(wb, obj);
+}
+
+/*
+ * Buckets
+ */
+static char * get_bucket(struct wbcached *wb)
+{
+	if (!wb->nr_free)
+		return NULL;
+	return wb->arena +
+		((uint64_t)wb->free_buckets[--wb->nr_free] << WB_BUCKET_SHIFT);
+}
+
+static void put_bucket(struct wbcached *wb, char *bucket)
+{
+	wb->free_buckets[wb->nr_free++] =
+		(bucket - wb->arena) >> WB_BUCKET_SHIFT;
+}
+
+static inline int over_pressure(struct wbcached *wb)
+{
+	return wb->nr_buckets - wb->nr_free > wb->nr_buckets / 2 ||
+		wb->journal.draining;
+}
+
+/* Free the buckets that hold no cached sectors */
+static void release_buckets(struct wbcached *wb, struct wb_object *obj)
+{
+	uint32_t b;
+
+	if (obj->readers)
+		return;
+	for (b = 0; b < WB_BUCKETS && obj->nr_buckets; b++) {
+		if (!obj->buckets[b] || bucket_cached(obj, b))
+			continue;
+		put_bucket(wb, obj->buckets[b]);
+		obj->buckets[b] = NULL;
+		obj->nr_buckets--;
+		obj->vol->nr_buckets--;
+	}
+}
+
+/* Copy the bytes [lo, hi) of the object to dst, which starts at dst_off */
+static void copy_from_object(struct wb_object *obj, char *dst, uint64_t dst_off,
+		uint64_t lo, uint64_t hi)
+{
+	uint64_t len;
+
+	while (lo < hi) {
+		len = ((lo >> WB_BUCKET_SHIFT) + 1) << WB_BUCKET_SHIFT;
+		len = (len < hi ? len : hi) - lo;
+		memcpy(dst + (lo - dst_off), obj->buckets[lo >> WB_BUCKET_SHIFT] +
+				(lo & (WB_BUCKET_SIZE - 1)), len);
+		lo += len;
+	}
+}
+
+static void copy_to_object(struct wb_object *obj, char *src, uint64_t src_off,
+		uint64_t lo, uint64_t hi)
+{
+	uint64_t len;
+
+	while (lo < hi) {
+		len = ((lo >> WB_BUCKET_SHIFT) + 1) << WB_BUCKET_SHIFT;
+		len = (len < hi ? len : hi) - lo;
+		memcpy(obj->buckets[lo >> WB_BUCKET_SHIFT] +
+				(lo & (WB_BUCKET_SIZE - 1)), src + (lo - src_off), len);
+		lo += len;
+	}
+}
+
+/*
+ * Copy the cached sectors of the object that [offset, offset + size) covers,
+ * and the sectors of also, if given, to or from data.
+ */
+static void copy_cached(struct wb_object *obj, uint64_t *also, char *data,
+		uint64_t offset, uint64_t size, int to_object)
+{
+	uint64_t end = offset + size, s, e, lo, hi;
+
+	if (end > WB_OBJECT_SIZE)
+		end = WB_OBJECT_SIZE;
+	s = offset >> WB_SECTOR_SHIFT;
+	while ((s << WB_SECTOR_SHIFT) < end) {
+		if (!sector_cached(obj, s) && !(also && test_sector(also, s))) {
+			s++;
+			continue;
+		}
+		for (e = s + 1; (e << WB_SECTOR_SHIFT) < end &&
+				(sector_cached(obj, e) ||
+				 (also && test_sector(also, e))); e++)
+			;
+		lo = s << WB_SECTOR_SHIFT;
+		hi = e << WB_SECTOR_SHIFT;
+		lo = lo > offset ? lo : offset;
+		hi = hi < end ? hi : end;
+		if (to_object)
+			copy_to_object(obj, data, offset, lo, hi);
+		else
+			copy_from_object(obj, data, offset, lo, hi);
+		s = e;
+	}
+}
+
+static void list_dirty(struct wbcached *wb, struct wb_object *obj)
+{
+	if (obj->dirty_listed)
+		return;
+	wb_list_add_tail(&wb->dirty, &obj->dirty_link);
+	wb_list_add_tail(&obj->vol->objects, &obj->vol_link);
+	obj->dirty_listed = 1;
+	obj->dirty_seq = ++wb->dirty_seq;
+	wb->nr_dirty++;
+}
+
+/*
+ * A flush waits for the dirty objects listed up to its flush_seq. Move to done
+ * the flushes that do not wait for the object listed at seq, or, if err is
+ * set, the ones that do, failed.
+ */
+static void conclude_flushes(struct wbcached *wb, uint64_t seq, int err,
+		struct peer_req **done)
+{
+	struct peer_req *pr, **prev = &wb->flush_waiters;
+	struct wb_io *wio;
+
+	while ((pr = *prev)) {
+		wio = __get_wbio(pr);
+		if ((wio->flush_seq >= seq) != !!err) {
+			prev = &wio->next;
+			continue;
+		}
+		*prev = wio->next;
+		wio->err = err;
+		push_waiter(done, pr);
+	}
+}
+
+/*
+ * Take an object that has no cached data off the dirty lists, and complete
+ * the flushes that waited for no older dirty object.
+ */
+static void unlist_clean(struct wbcached *wb, struct wb_object *obj,
+		struct peer_req **done)
+{
+	struct wb_object *oldest;
+	uint64_t seq;
+
+	if (!obj->dirty_listed || obj->flush_writes || object_dirty(obj))
+		return;
+	wb_list_del(&obj->dirty_link);
+	wb_list_del(&obj->vol_link);
+	obj->dirty_listed = 0;
+	wb->nr_dirty--;
+
+	/* the flushes that do not wait for the oldest dirty object are done */
+	if (wb_list_empty(&wb->dirty)) {
+		seq = wb->dirty_seq + 1;
+	} else {
+		oldest = wb_entry(wb->dirty.next, struct wb_object, dirty_link);
+		seq = oldest->dirty_seq;
+	}
+	conclude_flushes(wb, seq, 0, done);
+}
+
+/*
+ * Write back
+ */
+static int send_flush_write(struct peerd *peer, struct wb_object *obj,
+		uint64_t s, uint64_t e)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct xseg_request *breq;
+	uint64_t offset = s << WB_SECTOR_SHIFT, size = (e - s) << WB_SECTOR_SHIFT;
+	char *target;
+	xport p;
+	int r;
+
+	breq = xseg_get_request(peer->xseg, obj->flush_pr.portno, wb->bportno,
+			X_ALLOC);
+	if (!breq) {
+		XSEGLOG2(&lc, W, "Cannot get request to write back %s",
+				obj->name);
+		return -1;
+	}
+	r = xseg_prep_request(peer->xseg, breq, obj->namelen, size);
+	if (r < 0) {
+		XSEGLOG2(&lc, W, "Cannot prepare request to write back %s",
+				obj->name);
+		goto out_put;
+	}
+	target = xseg_get_target(peer->xseg, breq);
+	strncpy(target, obj->name, obj->namelen);
+	breq->op = X_WRITE;
+	breq->offset = offset;
+	breq->size = size;
+	breq->flags = 0;
+	copy_from_object(obj, xseg_get_data(peer->xseg, breq), offset, offset,
+			offset + size);
+
+	r = xseg_set_req_data(peer->xseg, breq, &obj->flush_pr);
+	if (r < 0)
+		goto out_put;
+	p = xseg_submit(peer->xseg, breq, obj->flush_pr.portno, X_ALLOC);
+	if (p == NoPort) {
+		void *dummy;
+		xseg_get_req_data(peer->xseg, breq, &dummy);
+		goto out_put;
+	}
+	r = xseg_signal(peer->xseg, p);
+	if (r < 0)
+		XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+	obj->flush_writes++;
+	wb->flush_writes++;
+	wb->flushed_bytes += size;
+	return 0;
+
+out_put:
+	xseg_put_request(peer->xseg, breq, obj->flush_pr.portno);
+	return -1;
+}
+
+/*
+ * Write back the dirty ranges of an object, one write for each, unless they
+ * are already being written back. Must be called with the lock held.
+ */
+static void start_flush(struct peerd *peer, struct wb_object *obj)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	uint64_t s = 0, e, k;
+
+	if (obj->flush_writes)
+		return;
+
+	while (s < WB_SECTORS) {
+		if (!(s % 64) && !obj->dirty[s / 64]) {
+			s += 64;
+			continue;
+		}
+		if (!test_sector(obj->dirty, s)) {
+			s++;
+			continue;
+		}
+		for (e = s + 1; e < WB_SECTORS && test_sector(obj->dirty, e); e++)
+			;
+		if (send_flush_write(peer, obj, s, e) < 0)
+			break;
+		for (k = s; k < e; k++) {
+			obj->dirty[k / 64] &= ~(1ULL << (k % 64));
+			set_sector(obj->flushing, k);
+		}
+		s = e;
+	}
+	if (obj->flush_writes)
+		wb->flushes++;
+}
+
+static void flush_volume(struct peerd *peer, struct wb_volume *vol, int all)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_link *l, *next;
+
+	for (l = vol->objects.next; l != &vol->objects; l = next) {
+		next = l->next;
+		if (!all && wb->flushes >= wb->max_flushes)
+			break;
+		start_flush(peer, wb_entry(l, struct wb_object, vol_link));
+	}
+}
+
+/* Write back the oldest dirty objects, if dirty data is piling up */
+static void kick_flushes(struct peerd *peer)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_link *l, *next;
+
+	if (!over_pressure(wb))
+		return;
+	for (l = wb->dirty.next; l != &wb->dirty; l = next) {
+		next = l->next;
+		if (wb->flushes >= wb->max_flushes)
+			break;
+		start_flush(peer, wb_entry(l, struct wb_object, dirty_link));
+	}
+}
+
+static int flush_wanted(struct wbcached *wb, struct wb_object *obj)
+{
+	return obj->waiters || wb->flush_waiters || over_pressure(wb) ||
+		obj->vol->nr_buckets > wb->volume_buckets / 2;
+}
+
+/*
+ * Start the journal over once nothing it holds is needed anymore, and let
+ * the writes that found it full in.
+ */
+static void maybe_reset_journal(struct wbcached *wb, struct peer_req **retry)
+{
+	struct wb_journal *j = &wb->journal;
+	struct peer_req *pr;
+
+	if (j->dead || !j->draining || wb->nr_dirty || j->inflight)
+		return;
+	if (journal_reset(j) < 0) {
+		XSEGLOG2(&lc, E, "Journal is dead, writes go through from now on");
+		j->dead = 1;
+	}
+	while ((pr = j->waiters)) {
+		j->waiters = __get_wbio(pr)->next;
+		push_waiter(retry, pr);
+	}
+}
+
+static int handle_accepted(struct peerd *peer, struct peer_req *pr);
+
+static void finish_requests(struct peerd *peer, struct peer_req *done,
+		struct peer_req *retry)
+{
+	struct peer_req *pr;
+	struct wb_io *wio;
+
+	while ((pr = done)) {
+		wio = __get_wbio(pr);
+		done = wio->next;
+		if (wio->err) {
+			fail(peer, pr);
+		} else {
+			pr->req->serviced = pr->req->size;
+			complete(peer, pr);
+		}
+	}
+	while ((pr = retry)) {
+		retry = __get_wbio(pr)->next;
+		handle_accepted(peer, pr);
+	}
+}
+
+static int handle_flush_reply(struct peerd *peer, struct wb_object *obj,
+		struct xseg_request *breq)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct peer_req *done = NULL, *retry = NULL, *pr;
+	int failed = !(breq->state & XS_SERVED);
+	uint64_t s, e;
+
+	pthread_mutex_lock(&wb->lock);
+	s = breq->offset >> WB_SECTOR_SHIFT;
+	e = (breq->offset + breq->size) >> WB_SECTOR_SHIFT;
+	for (; s < e; s++) {
+		obj->flushing[s / 64] &= ~(1ULL << (s % 64));
+		if (failed)
+			set_sector(obj->dirty, s);
+	}
+	if (failed) {
+		XSEGLOG2(&lc, E, "Write back of %s at %llu failed", obj->name,
+				(unsigned long long)breq->offset);
+		obj->flush_err = 1;
+	}
+	xseg_put_request(peer->xseg, breq, obj->flush_pr.portno);
+
+	if (--obj->flush_writes) {
+		pthread_mutex_unlock(&wb->lock);
+		return 0;
+	}
+	wb->flushes--;
+	release_buckets(wb, obj);
+
+	if (obj->flush_err) {
+		/* keep the data, and fail whoever waits for it */
+		obj->flush_err = 0;
+		conclude_flushes(wb, obj->dirty_seq, 1, &done);
+		while ((pr = obj->waiters)) {
+			obj->waiters = __get_wbio(pr)->next;
+			obj->refs--;
+			__get_wbio(pr)->err = 1;
+			push_waiter(&done, pr);
+		}
+	} else {
+		unlist_clean(wb, obj, &done);
+		if (!obj->dirty_listed) {
+			while ((pr = obj->waiters)) {
+				obj->waiters = __get_wbio(pr)->next;
+				obj->refs--;
+				push_waiter(&retry, pr);
+			}
+		} else if (flush_wanted(wb, obj)) {
+			start_flush(peer, obj);
+		}
+	}
+
+	maybe_reset_journal(wb, &retry);
+	kick_flushes(peer);
+	maybe_free_object(wb, obj);
+	pthread_mutex_unlock(&wb->lock);
+
+	finish_requests(peer, done, retry);
+	return 0;
+}
+
+/*
+ * Requests
+ */
+static int passthrough(struct peerd *peer, struct peer_req *pr)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_io *wio = __get_wbio(pr);
+	struct xseg_request *req = pr->req, *breq;
+	char *target;
+	xport p;
+	int r;
+
+	if (wio->state != WB_READ)
+		wio->state = WB_PASSTHROUGH;
+
+	breq = xseg_get_request(peer->xseg, pr->portno, wb->bportno, X_ALLOC);
+	if (!breq) {
+		XSEGLOG2(&lc, E, "Cannot get request");
+		return -1;
+	}
+	r = xseg_prep_request(peer->xseg, breq, req->targetlen, req->datalen);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot prepare request");
+		goto out_put;
+	}
+	target = xseg_get_target(peer->xseg, breq);
+	strncpy(target, xseg_get_target(peer->xseg, req), req->targetlen);
+	breq->op = req->op;
+	breq->offset = req->offset;
+	breq->size = req->size;
+	breq->flags = req->flags;
+	breq->data = req->data;
+
+	r = xseg_set_req_data(peer->xseg, breq, pr);
+	if (r < 0)
+		goto out_put;
+	peer_trace(pr, breq, PEER_TRACE_SUBMIT);
+	p = xseg_submit(peer->xseg, breq, pr->portno, X_ALLOC);
+	if (p == NoPort) {
+		void *dummy;
+		xseg_get_req_data(peer->xseg, breq, &dummy);
+		goto out_put;
+	}
+	r = xseg_signal(peer->xseg, p);
+	if (r < 0)
+		XSEGLOG2(&lc, W, "Couldnt signal port %u", p);
+	return 0;
+
+out_put:
+	xseg_put_request(peer->xseg, breq, pr->portno);
+	return -1;
+}
+
+static int handle_passthrough_reply(struct peerd *peer, struct peer_req *pr,
+		struct xseg_request *breq)
+{
+	struct xseg_request *req = pr->req;
+	char buf[XSEG_MAX_TARGETLEN + 1];
+	char *target;
+	int r;
+
+	if (!(breq->state & XS_SERVED)) {
+		xseg_put_request(peer->xseg, breq, pr->portno);
+		fail(peer, pr);
+		return 0;
+	}
+
+	/* the blocker resized its request (e.g. for a hash reply) */
+	if (breq->data != req->data) {
+		if (req->datalen < breq->datalen) {
+			target = xseg_get_target(peer->xseg, req);
+			strncpy(buf, target, req->targetlen);
+			r = xseg_resize_request(peer->xseg, req,
+					req->targetlen, breq->datalen);
+			if (r < 0) {
+				XSEGLOG2(&lc, E, "Cannot resize request");
+				xseg_put_request(peer->xseg, breq, pr->portno);
+				fail(peer, pr);
+				return 0;
+			}
+			target = xseg_get_target(peer->xseg, req);
+			strncpy(target, buf, req->targetlen);
+		}
+		memcpy(xseg_get_data(peer->xseg, req),
+				xseg_get_data(peer->xseg, breq), breq->datalen);
+	}
+	req->serviced = breq->serviced;
+	xseg_put_request(peer->xseg, breq, pr->portno);
+	complete(peer, pr);
+	return 0;
+}
+
+/*
+ * Reads of objects with cached data are served from it, or read from the
+ * blocker and overlaid with it.
+ */
+static int handle_read(struct peerd *peer, struct peer_req *pr)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_io *wio = __get_wbio(pr);
+	struct xseg_request *req = pr->req;
+	char *target = xseg_get_target(peer->xseg, req);
+	struct wb_object *obj;
+	uint64_t s, e, end = req->offset + req->size;
+
+	if (!req->size || req->offset >= WB_OBJECT_SIZE ||
+			object_volume_len(target, req->targetlen) < 0)
+		return passthrough(peer, pr);
+
+	pthread_mutex_lock(&wb->lock);
+	obj = get_object(peer, target, req->targetlen, 0);
+	if (!obj) {
+		pthread_mutex_unlock(&wb->lock);
+		return passthrough(peer, pr);
+	}
+	s = req->offset >> WB_SECTOR_SHIFT;
+	e = ((end < WB_OBJECT_SIZE ? end : WB_OBJECT_SIZE) + WB_SECTOR_SIZE - 1)
+		>> WB_SECTOR_SHIFT;
+	if (!any_sector(obj->dirty, s, e) && !any_sector(obj->flushing, s, e)) {
+		put_object(wb, obj);
+		pthread_mutex_unlock(&wb->lock);
+		return passthrough(peer, pr);
+	}
+	if (end <= WB_OBJECT_SIZE) {
+		for (; s < e && sector_cached(obj, s); s++)
+			;
+	}
+	if (end <= WB_OBJECT_SIZE && s == e) {
+		copy_cached(obj, NULL, xseg_get_data(peer->xseg, req),
+				req->offset, req->size, 0);
+		put_object(wb, obj);
+		pthread_mutex_unlock(&wb->lock);
+		req->serviced = req->size;
+		complete(peer, pr);
+		return 0;
+	}
+
+	/*
+	 * The blocker may serve the read before a write back in flight, so
+	 * the sectors cached now are overlaid, even if written back by then.
+	 * Their buckets are kept until the read is overlaid.
+	 */
+	memset(wio->cached, 0, sizeof(wio->cached));
+	for (s = req->offset >> WB_SECTOR_SHIFT; s < e; s++) {
+		if (sector_cached(obj, s))
+			set_sector(wio->cached, s);
+	}
+	obj->readers++;
+	wio->obj = obj;
+	wio->state = WB_READ;
+	pthread_mutex_unlock(&wb->lock);
+
+	if (passthrough(peer, pr) < 0) {
+		pthread_mutex_lock(&wb->lock);
+		obj->readers--;
+		release_buckets(wb, obj);
+		put_object(wb, obj);
+		pthread_mutex_unlock(&wb->lock);
+		wio->obj = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int handle_read_reply(struct peerd *peer, struct peer_req *pr,
+		struct xseg_request *breq)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_io *wio = __get_wbio(pr);
+	struct wb_object *obj = wio->obj;
+	struct xseg_request *req = pr->req;
+	int failed = !(breq->state & XS_SERVED);
+	char *data = xseg_get_data(peer->xseg, req);
+
+	xseg_put_request(peer->xseg, breq, pr->portno);
+
+	pthread_mutex_lock(&wb->lock);
+	if (!failed)
+		copy_cached(obj, wio->cached, data, req->offset, req->size, 0);
+	obj->readers--;
+	release_buckets(wb, obj);
+	put_object(wb, obj);
+	pthread_mutex_unlock(&wb->lock);
+	wio->obj = NULL;
+
+	if (failed) {
+		fail(peer, pr);
+	} else {
+		/* blockers read zeros past the end of an object */
+		req->serviced = req->size;
+		complete(peer, pr);
+	}
+	return 0;
+}
+
+/* Buckets missing for the sectors [s, e) of an object */
+static uint32_t missing_buckets(struct wb_object *obj, uint64_t s, uint64_t e)
+{
+	uint32_t b, cnt = 0;
+
+	for (b = s / WB_BUCKET_SECTORS; b <= (e - 1) / WB_BUCKET_SECTORS; b++) {
+		if (!obj->buckets[b])
+			cnt++;
+	}
+	return cnt;
+}
+
+/*
+ * Writes are written back if they are small and aligned, and there is room
+ * for them, or written through otherwise. Either way, they are journaled
+ * first, unless the journal is dead.
+ */
+static int handle_write(struct peerd *peer, struct peer_req *pr)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_journal *j = &wb->journal;
+	struct xseg_request *req = pr->req;
+	char *target = xseg_get_target(peer->xseg, req);
+	char *data = xseg_get_data(peer->xseg, req);
+	struct peer_req *retry = NULL;
+	struct wb_object *obj;
+	uint64_t s, e, k, pos = 0, seq = 0;
+	uint32_t b;
+	int back, journaled, r = 0;
+
+	if (!req->size || object_volume_len(target, req->targetlen) < 0)
+		return passthrough(peer, pr);
+
+	pthread_mutex_lock(&wb->lock);
+	obj = get_object(peer, target, req->targetlen, 1);
+	if (!obj) {
+		pthread_mutex_unlock(&wb->lock);
+		return passthrough(peer, pr);
+	}
+
+	s = req->offset >> WB_SECTOR_SHIFT;
+	e = (req->offset + req->size + WB_SECTOR_SIZE - 1) >> WB_SECTOR_SHIFT;
+	back = !(req->flags & XF_FUA) && !j->dead &&
+		!(req->offset & (WB_SECTOR_SIZE - 1)) &&
+		!(req->size & (WB_SECTOR_SIZE - 1)) &&
+		req->size <= (wb->max_write << 10) &&
+		req->offset + req->size <= WB_OBJECT_SIZE;
+	if (back) {
+		b = missing_buckets(obj, s, e);
+		if (b > wb->nr_free ||
+				obj->vol->nr_buckets + b > wb->volume_buckets) {
+			back = 0;
+			flush_volume(peer, obj->vol, 0);
+			kick_flushes(peer);
+		}
+	}
+
+	journaled = !j->dead;
+	if (journaled && journal_reserve(j, journal_record_len(req->size),
+				&pos, &seq) < 0) {
+		XSEGLOG2(&lc, D, "Journal is full, write waits");
+		put_object(wb, obj);
+		push_waiter(&j->waiters, pr);
+		kick_flushes(peer);
+		maybe_reset_journal(wb, &retry);
+		pthread_mutex_unlock(&wb->lock);
+		finish_requests(peer, NULL, retry);
+		return 0;
+	}
+
+	if (back) {
+		for (b = s / WB_BUCKET_SECTORS; b <= (e - 1) / WB_BUCKET_SECTORS;
+				b++) {
+			if (obj->buckets[b])
+				continue;
+			obj->buckets[b] = get_bucket(wb);
+			obj->nr_buckets++;
+			obj->vol->nr_buckets++;
+		}
+		copy_to_object(obj, data, req->offset, req->offset,
+				req->offset + req->size);
+		for (k = s; k < e; k++)
+			set_sector(obj->dirty, k);
+		list_dirty(wb, obj);
+		wb->written_back++;
+		if (obj->vol->nr_buckets > wb->volume_buckets / 2)
+			flush_volume(peer, obj->vol, 0);
+	} else {
+		/*
+		 * Update the cached copies it overlaps, and keep them dirty,
+		 * since a write back in flight may carry older data.
+		 */
+		copy_cached(obj, NULL, data, req->offset, req->size, 1);
+		for (k = s; k < e && k < WB_SECTORS; k++) {
+			if (test_sector(obj->flushing, k))
+				set_sector(obj->dirty, k);
+		}
+		wb->written_through++;
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	if (journaled)
+		r = journal_append(j, WB_RECORD_WRITE, pos, seq, target,
+				req->targetlen, req->offset, req->size, data);
+
+	pthread_mutex_lock(&wb->lock);
+	if (journaled) {
+		j->inflight--;
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Journal is dead, writes go through "
+					"from now on");
+			j->dead = 1;
+		}
+	}
+	kick_flushes(peer);
+	maybe_reset_journal(wb, &retry);
+	put_object(wb, obj);
+	pthread_mutex_unlock(&wb->lock);
+
+	/* data that did not make it to the journal goes to the blocker too */
+	if (back && r == 0) {
+		req->serviced = req->size;
+		complete(peer, pr);
+	} else if (passthrough(peer, pr) < 0) {
+		fail(peer, pr);
+	}
+	finish_requests(peer, NULL, retry);
+	return 0;
+}
+
+/*
+ * Complete a flush of a volume once all the data that is dirty now is written
+ * back. The volume may have been renamed, and its objects be listed under its
+ * old name, so the dirty objects of all volumes are written back, those of
+ * the volume first.
+ */
+static int handle_flush(struct peerd *peer, struct peer_req *pr)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct xseg_request *req = pr->req;
+	char *target = xseg_get_target(peer->xseg, req);
+	char buf[XSEG_MAX_TARGETLEN + 1];
+	struct wb_volume *vol;
+	struct wb_link *l, *next;
+
+	strncpy(buf, target, req->targetlen);
+	buf[req->targetlen] = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb_list_empty(&wb->dirty)) {
+		pthread_mutex_unlock(&wb->lock);
+		req->serviced = req->size;
+		complete(peer, pr);
+		return 0;
+	}
+	XSEGLOG2(&lc, I, "Flushing volume %s", buf);
+	__get_wbio(pr)->flush_seq = wb->dirty_seq;
+	push_waiter(&wb->flush_waiters, pr);
+	vol = hash_lookup(wb->volumes, buf);
+	if (vol)
+		flush_volume(peer, vol, 1);
+	for (l = wb->dirty.next; l != &wb->dirty; l = next) {
+		next = l->next;
+		start_flush(peer, wb_entry(l, struct wb_object, dirty_link));
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return 0;
+}
+
+/*
+ * Wait until an object has no cached data. Must be called with the lock
+ * held. Returns 1 if the request was queued.
+ */
+static int wait_clean(struct peerd *peer, struct peer_req *pr, char *target,
+		uint32_t targetlen)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_object *obj;
+
+	if (object_volume_len(target, targetlen) < 0)
+		return 0;
+	obj = get_object(peer, target, targetlen, 0);
+	if (!obj)
+		return 0;
+	if (!obj->dirty_listed) {
+		put_object(wb, obj);
+		return 0;
+	}
+	/* the reference is put when it is woken up */
+	push_waiter(&obj->waiters, pr);
+	start_flush(peer, obj);
+	return 1;
+}
+
+/*
+ * Other requests on objects, e.g. the copy-ups, hashes and deletes of the
+ * mapper, see the objects at the blocker, so their dirty data is written
+ * back first. Discards and deletes are journaled, so that a replay does not
+ * undo them.
+ */
+static int handle_other(struct peerd *peer, struct peer_req *pr)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_journal *j = &wb->journal;
+	struct xseg_request *req = pr->req;
+	char *target = xseg_get_target(peer->xseg, req);
+	struct xseg_request_copy *xcopy;
+	struct peer_req *retry = NULL;
+	uint64_t pos = 0, seq = 0;
+	uint32_t type;
+	int journaled = 0, r;
+
+	pthread_mutex_lock(&wb->lock);
+	if (wait_clean(peer, pr, target, req->targetlen))
+		goto out_unlock;
+	if (req->op == X_COPY && req->datalen >= sizeof(*xcopy)) {
+		xcopy = (struct xseg_request_copy *)
+			xseg_get_data(peer->xseg, req);
+		if (xcopy->targetlen <= XSEG_MAX_TARGETLEN &&
+				wait_clean(peer, pr, xcopy->target,
+					xcopy->targetlen))
+			goto out_unlock;
+	}
+
+	if ((req->op == X_DISCARD || req->op == X_DELETE) && !j->dead &&
+			object_volume_len(target, req->targetlen) >= 0) {
+		if (journal_reserve(j, WB_RECORD_HEADER, &pos, &seq) < 0) {
+			push_waiter(&j->waiters, pr);
+			kick_flushes(peer);
+			maybe_reset_journal(wb, &retry);
+			goto out_unlock;
+		}
+		journaled = 1;
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	if (journaled) {
+		type = req->op == X_DELETE ? WB_RECORD_DELETE :
+			WB_RECORD_DISCARD;
+		r = journal_append(j, type, pos, seq, target, req->targetlen,
+				req->offset, req->size, NULL);
+		pthread_mutex_lock(&wb->lock);
+		j->inflight--;
+		if (r < 0) {
+			XSEGLOG2(&lc, E, "Journal is dead, writes go through "
+					"from now on");
+			j->dead = 1;
+		}
+		maybe_reset_journal(wb, &retry);
+		pthread_mutex_unlock(&wb->lock);
+	}
+
+	if (passthrough(peer, pr) < 0)
+		fail(peer, pr);
+	finish_requests(peer, NULL, retry);
+	return 0;
+
+out_unlock:
+	pthread_mutex_unlock(&wb->lock);
+	finish_requests(peer, NULL, retry);
+	return 0;
+}
+
+static int handle_accepted(struct peerd *peer, struct peer_req *pr)
+{
+	struct wb_io *wio = __get_wbio(pr);
+	int r;
+
+	wio->state = WB_IDLE;
+	wio->err = 0;
+	wio->obj = NULL;
+	wio->next = NULL;
+
+	switch (pr->req->op) {
+	case X_READ:
+		r = handle_read(peer, pr);
+		break;
+	case X_WRITE:
+		r = handle_write(peer, pr);
+		break;
+	case X_FLUSH:
+		r = handle_flush(peer, pr);
+		break;
+	default:
+		r = handle_other(peer, pr);
+		break;
+	}
+	if (r < 0)
+		fail(peer, pr);
+	return 0;
+}
+
+int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
+		enum dispatch_reason reason)
+{
+	struct wb_io *wio = __get_wbio(pr);
+
+	if (reason == dispatch_accept)
+		return handle_accepted(peer, pr);
+
+	switch (wio->state) {
+	case WB_FLUSH:
+		return handle_flush_reply(peer, wio->obj, req);
+	case WB_READ:
+		return handle_read_reply(peer, pr, req);
+	case WB_PASSTHROUGH:
+		return handle_passthrough_reply(peer, pr, req);
+	default:
+		XSEGLOG2(&lc, W, "Received request %p in invalid state", req);
+		xseg_put_request(peer->xseg, req, pr->portno);
+		return -1;
+	}
+}
+
+/*
+ * Replay
+ *
+ * Records of the current generation are looked for in the whole journal,
+ * since writes complete out of order and a crash may leave holes between
+ * records that were acknowledged. They are sent to the blocker one at a time,
+ * in order, before the peer starts serving requests.
+ */
+static int replay_record(struct peerd *peer, struct wb_record *rec, char *data)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct xseg *xseg = peer->xseg;
+	struct xseg_request *req;
+	xport srcport = peer->portno_start, p;
+	uint64_t datalen = rec->type == WB_RECORD_WRITE ? rec->size : 0;
+	int r;
+
+	req = xseg_get_request(xseg, srcport, wb->bportno, X_ALLOC);
+	if (!req) {
+		XSEGLOG2(&lc, E, "Cannot get request");
+		return -1;
+	}
+	r = xseg_prep_request(xseg, req, rec->targetlen, datalen);
+	if (r < 0) {
+		XSEGLOG2(&lc, E, "Cannot prepare request");
+		goto out_put;
+	}
+	strncpy(xseg_get_target(xseg, req), rec->target, rec->targetlen);
+	if (datalen)
+		memcpy(xseg_get_data(xseg, req), data, datalen);
+	req->offset = rec->offset;
+	req->size = rec->size;
+	req->flags = 0;
+	switch (rec->type) {
+	case WB_RECORD_WRITE: req->op = X_WRITE; break;
+	case WB_RECORD_DISCARD: req->op = X_DISCARD; break;
+	default: req->op = X_DELETE; break;
+	}
+
+	p = xseg_submit(xseg, req, srcport, X_ALLOC);
+	if (p == NoPort) {
+		XSEGLOG2(&lc, E, "Cannot submit request");
+		goto out_put;
+	}
+	xseg_signal(xseg, p);
+
+	while (!(req = xseg_receive(xseg, srcport, X_NONBLOCK))) {
+		if (isTerminate())
+			return -1;
+		usleep(100);
+	}
+	r = req->state & XS_SERVED ? 0 : -1;
+	if (xseg_put_request(xseg, req, srcport))
+		XSEGLOG2(&lc, W, "Cannot put request");
+	/* a discard or delete of an object that is gone is fine */
+	if (rec->type != WB_RECORD_WRITE)
+		return 0;
+	return r;
+
+out_put:
+	xseg_put_request(xseg, req, srcport);
+	return -1;
+}
+
+static int journal_replay(struct peerd *peer)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+	struct wb_journal *j = &wb->journal;
+	struct wb_journal_super super;
+	union wb_record_block block;
+	struct wb_record *rec = &block.rec;
+	uint64_t pos, sum, replayed = 0, next_seq = 0;
+	char *data;
+	int r = -1;
+
+	if (pread(j->fd, &super, sizeof(super), 0) != sizeof(super) ||
+			super.magic != WB_JOURNAL_MAGIC ||
+			super.version != WB_JOURNAL_VERSION) {
+		XSEGLOG2(&lc, I, "Initializing journal");
+		j->gen = 0;
+		return journal_reset(j);
+	}
+	j->gen = super.gen;
+	j->nonce = super.nonce;
+
+	data = malloc(WB_OBJECT_SIZE + WB_SECTOR_SIZE);
+	if (!data) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return -1;
+	}
+
+	pos = WB_JOURNAL_START;
+	while (pos + WB_RECORD_HEADER <= j->size) {
+		if (pread(j->fd, &block, WB_RECORD_HEADER, pos) !=
+				WB_RECORD_HEADER) {
+			XSEGLOG2(&lc, E, "Cannot read the journal: %s",
+					strerror(errno));
+			goto out;
+		}
+		if (rec->magic != WB_RECORD_MAGIC || rec->gen != j->gen ||
+				rec->type > WB_RECORD_DELETE ||
+				rec->targetlen > XSEG_MAX_TARGETLEN ||
+				rec->size > WB_OBJECT_SIZE ||
+				rec->seq < next_seq) {
+			pos += WB_SECTOR_SIZE;
+			continue;
+		}
+		sum = rec->sum;
+		rec->sum = 0;
+		rec->sum = journal_sum(j->nonce, (char *)&block,
+				WB_RECORD_HEADER);
+		if (rec->type == WB_RECORD_WRITE && rec->size) {
+			if (pos + journal_record_len(rec->size) > j->size ||
+					pread(j->fd, data, rec->size,
+						pos + WB_RECORD_HEADER) !=
+					rec->size) {
+				pos += WB_SECTOR_SIZE;
+				continue;
+			}
+			rec->sum = journal_sum(rec->sum, data, rec->size);
+		}
+		if (rec->sum != sum) {
+			pos += WB_SECTOR_SIZE;
+			continue;
+		}
+
+		if (replay_record(peer, rec, data) < 0) {
+			XSEGLOG2(&lc, E, "Cannot replay the write of %.*s at "
+					"%llu. Not starting, so as not to lose it",
+					rec->targetlen, rec->target,
+					(unsigned long long)rec->offset);
+			goto out;
+		}
+		replayed++;
+		next_seq = rec->seq + 1;
+		pos += rec->type == WB_RECORD_WRITE ?
+			journal_record_len(rec->size) : WB_RECORD_HEADER;
+	}
+
+	XSEGLOG2(&lc, I, "Replayed %llu journal records",
+			(unsigned long long)replayed);
+	r = journal_reset(j);
+out:
+	free(data);
+	return r;
+}
+
+int custom_peer_init(struct peerd *peer, int argc, char *argv[])
+{
+	struct wbcached *wb = malloc(sizeof(struct wbcached));
+	struct wb_journal *j;
+	struct wb_io *wio;
+	char journal[XSEG_MAX_TARGETLEN + 1];
+	unsigned long journal_size = WB_DEFAULT_JOURNAL_SIZE;
+	uint64_t i;
+
+	if (!wb) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return -1;
+	}
+	memset(wb, 0, sizeof(struct wbcached));
+	peer->priv = wb;
+	j = &wb->journal;
+	j->fd = -1;
+	wb->bportno = NoPort;
+	wb->cache_size = WB_DEFAULT_CACHE_SIZE;
+	wb->volume_limit = WB_DEFAULT_VOLUME_LIMIT;
+	wb->max_write = WB_DEFAULT_MAX_WRITE;
+	wb->max_flushes = WB_DEFAULT_MAX_FLUSHES;
+	pthread_mutex_init(&wb->lock, NULL);
+	wb_list_init(&wb->dirty);
+	journal[0] = 0;
+
+	BEGIN_READ_ARGS(argc, argv);
+	READ_ARG_ULONG("-bp", wb->bportno);
+	READ_ARG_STRING("--journal", journal, XSEG_MAX_TARGETLEN);
+	READ_ARG_ULONG("--journal-size", journal_size);
+	READ_ARG_ULONG("--cache-size", wb->cache_size);
+	READ_ARG_ULONG("--volume-limit", wb->volume_limit);
+	READ_ARG_ULONG("--max-write", wb->max_write);
+	READ_ARG_ULONG("--max-flushes", wb->max_flushes);
+	END_READ_ARGS();
+
+	if (wb->bportno == NoPort) {
+		XSEGLOG2(&lc, E, "bportno must be provided");
+		usage(argv[0]);
+		return -1;
+	}
+	if (!journal[0]) {
+		XSEGLOG2(&lc, E, "A journal must be provided");
+		usage(argv[0]);
+		return -1;
+	}
+	if (!wb->max_flushes || !wb->max_write ||
+			(wb->max_write << 10) > WB_OBJECT_SIZE) {
+		XSEGLOG2(&lc, E, "Invalid --max-flushes or --max-write");
+		return -1;
+	}
+
+	wb->nr_buckets = ((uint64_t)wb->cache_size << 20) >> WB_BUCKET_SHIFT;
+	wb->volume_buckets = ((uint64_t)wb->volume_limit << 20) >>
+		WB_BUCKET_SHIFT;
+	if (!wb->nr_buckets || !wb->volume_buckets) {
+		XSEGLOG2(&lc, E, "Cache size and volume limit must be positive");
+		return -1;
+	}
+	wb->arena = malloc(wb->nr_buckets << WB_BUCKET_SHIFT);
+	wb->free_buckets = malloc(wb->nr_buckets * sizeof(uint32_t));
+	if (!wb->arena || !wb->free_buckets) {
+		XSEGLOG2(&lc, E, "Cannot allocate %lu MiB of buckets",
+				wb->cache_size);
+		return -1;
+	}
+	for (i = 0; i < wb->nr_buckets; i++)
+		wb->free_buckets[i] = wb->nr_buckets - 1 - i;
+	wb->nr_free = wb->nr_buckets;
+
+	wb->objects = xhash_new(10, 0, XHASH_STRING);
+	wb->volumes = xhash_new(3, 0, XHASH_STRING);
+	if (!wb->objects || !wb->volumes) {
+		XSEGLOG2(&lc, E, "Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < peer->nr_ops; i++) {
+		wio = calloc(1, sizeof(struct wb_io));
+		if (!wio) {
+			XSEGLOG2(&lc, E, "Out of memory");
+			return -1;
+		}
+		peer->peer_reqs[i].priv = wio;
+	}
+
+	/* journal records must be durable once written */
+	j->size = (uint64_t)journal_size << 20;
+	if (j->size < WB_JOURNAL_START + 2 * journal_record_len(WB_OBJECT_SIZE)) {
+		XSEGLOG2(&lc, E, "Journal of %lu MiB is too small",
+				journal_size);
+		return -1;
+	}
+	j->fd = open(journal, O_RDWR|O_CREAT|O_DSYNC|O_CLOEXEC, 0600);
+	if (j->fd < 0) {
+		XSEGLOG2(&lc, E, "Cannot open journal %s: %s", journal,
+				strerror(errno));
+		return -1;
+	}
+	if (ftruncate(j->fd, j->size) < 0) {
+		XSEGLOG2(&lc, E, "Cannot resize journal %s: %s", journal,
+				strerror(errno));
+		return -1;
+	}
+	if (journal_replay(peer) < 0)
+		return -1;
+
+	XSEGLOG2(&lc, I, "Caching writes to blocker port %u in %llu buckets "
+			"of %lu bytes", wb->bportno,
+			(unsigned long long)wb->nr_buckets, WB_BUCKET_SIZE);
+	return 0;
+}
+
+void custom_peer_finalize(struct peerd *peer)
+{
+	struct wbcached *wb = __get_wbcached(peer);
+
+	/* called by each thread */
+	pthread_mutex_lock(&wb->lock);
+	if (!wb->finalized) {
+		wb->finalized = 1;
+		XSEGLOG2(&lc, I, "Writes written back: %llu, written through: "
+				"%llu, write-back writes: %llu (%llu bytes), "
+				"dirty objects left: %llu",
+				(unsigned long long)wb->written_back,
+				(unsigned long long)wb->written_through,
+				(unsigned long long)wb->flush_writes,
+				(unsigned long long)wb->flushed_bytes,
+				(unsigned long long)wb->nr_dirty);
+	}
+	pthread_mutex_unlock(&wb->lock);
+}
@@ -0,0 +1,378 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xseg/xseg.h>
+#include <peer.h>
+#include <xindex.h>
+
+#define __handler(epoch, idx) (((xindex_handler)(epoch) << 32) | (idx))
+#define __handler_idx(h) ((uint32_t)((h) & 0xffffffffULL))
+#define __handler_epoch(h) ((uint32_t)((h) >> 32))
+
+static inline void __lock(struct xindex *index)
+{
+	xlock_acquire(&index->lock, 1);
+}
+
+static inline void __unlock(struct xindex *index)
+{
+	xlock_release(&index->lock);
+}
+
+/* Return the node of a handler, or NULL if the handler is stale */
+static struct xindex_entry * __get_xnode(struct xindex *index, xindex_handler h)
+{
+	struct xindex_entry *node;
+	uint32_t idx = __handler_idx(h);
+
+	if (h == NoIndexEntry || idx >= index->size)
+		return NULL;
+	node = &index->nodes[idx];
+	if (node->state == XINDEX_NODE_FREE ||
+			node->epoch != __handler_epoch(h))
+		return NULL;
+	return node;
+}
+
+static uint32_t __hash_shift(uint32_t size)
+{
+	uint32_t shift = 3;
+
+	/* keep the table at most half full */
+	while ((1ULL << shift) < 2ULL * size)
+		shift++;
+	return shift;
+}
+
+static int __init_nodes(struct xindex *index, uint32_t from, uint32_t to)
+{
+	struct xindex_entry *node;
+	uint32_t i;
+
+	for (i = from; i < to; i++) {
+		node = &index->nodes[i];
+		memset(node, 0, sizeof(struct xindex_entry));
+		node->state = XINDEX_NODE_FREE;
+		index->size = i + 1;
+		/* string keys point to the name, so it must not move */
+		if (index->type == XINDEX_STRING) {
+			node->name = malloc(XSEG_MAX_TARGETLEN + 1);
+			if (!node->name)
+				return -1;
+		}
+		if (index->ops.on_node_init) {
+			node->priv = index->ops.on_node_init(index->priv);
+			if (!node->priv)
+				return -1;
+		}
+	}
+	/* hand out the lower nodes first */
+	for (i = to; i > from; i--)
+		index->free_nodes[index->nr_free++] = i - 1;
+	return 0;
+}
+
+/*
+ * Double the pool of nodes. Handlers stay valid, since they refer to nodes by
+ * their position, and so do the user data and the names of the nodes, which
+ * are allocated apart from them.
+ */
+static int __grow(struct xindex *index)
+{
+	uint32_t old_size = index->size, new_size = index->size * 2;
+	struct xindex_entry *nodes;
+	uint32_t *free_nodes;
+	xhash_t *entries;
+
+	XSEGLOG2(&lc, W, "Index %p is full, growing it to %u entries",
+			index, new_size);
+	nodes = realloc(index->nodes, new_size * sizeof(struct xindex_entry));
+	if (!nodes)
+		return -1;
+	index->nodes = nodes;
+	free_nodes = realloc(index->free_nodes, new_size * sizeof(uint32_t));
+	if (!free_nodes)
+		return -1;
+	index->free_nodes = free_nodes;
+	entries = xhash_resize(index->entries, __hash_shift(new_size), 0, NULL);
+	if (!entries)
+		return -1;
+	index->entries = entries;
+	return __init_nodes(index, old_size, new_size);
+}
+
+int xindex_init(struct xindex *index, uint32_t xindex_size,
+		struct xindex_ops *ops, int type, void *priv)
+{
+	if (!xindex_size || (type != XINDEX_INTEGER && type != XINDEX_STRING))
+		return -1;
+
+	memset(index, 0, sizeof(struct xindex));
+	xlock_release(&index->lock);
+	index->type = type;
+	index->priv = priv;
+	if (ops)
+		index->ops = *ops;
+
+	index->nodes = calloc(xindex_size, sizeof(struct xindex_entry));
+	index->free_nodes = calloc(xindex_size, sizeof(uint32_t));
+	index->entries = xhash_new(__hash_shift(xindex_size), 0,
+			type == XINDEX_STRING ? XHASH_STRING : XHASH_INTEGER);
+	if (!index->nodes || !index->free_nodes || !index->entries)
+		goto out_err;
+	if (__init_nodes(index, 0, xindex_size) < 0)
+		goto out_err;
+	return 0;
+
+out_err:
+	xindex_close(index);
+	xindex_free(index);
+	return -1;
+}
+
+/* Drop the hash table. Entries still referenced are no longer found. */
+void xindex_close(struct xindex *index)
+{
+	if (index->entries)
+		xhash_free(index->entries);
+	index->entries = NULL;
+}
+
+void xindex_free(struct xindex *index)
+{
+	uint32_t i;
+
+	for (i = 0; i < index->size; i++) {
+		if (index->ops.on_free && index->nodes[i].priv)
+			index->ops.on_free(index->priv, index->nodes[i].priv);
+		free(index->nodes[i].name);
+	}
+	free(index->nodes);
+	free(index->free_nodes);
+	index->nodes = NULL;
+	index->free_nodes = NULL;
+	index->size = 0;
+	index->nr_free = 0;
+}
+
+static void __free_node(struct xindex *index, uint32_t idx)
+{
+	struct xindex_entry *node = &index->nodes[idx];
+
+	node->state = XINDEX_NODE_FREE;
+	node->ref = 0;
+	if (!++node->epoch && index->ops.on_recycle_handler)
+		index->ops.on_recycle_handler(index->priv, node->priv);
+	index->free_nodes[index->nr_free++] = idx;
+}
+
+/*
+ * Claim an entry for name, with a reference for the caller. It is not found
+ * by lookups until it is inserted.
+ */
+xindex_handler xindex_alloc_init(struct xindex *index, char *name)
+{
+	struct xindex_entry *node;
+	xindex_handler h;
+	void *priv;
+	uint32_t idx;
+
+	if (index->type == XINDEX_STRING && strlen(name) > XSEG_MAX_TARGETLEN)
+		return NoIndexEntry;
+
+	__lock(index);
+	if (!index->nr_free && __grow(index) < 0) {
+		__unlock(index);
+		XSEGLOG2(&lc, E, "Cannot grow index %p", index);
+		return NoIndexEntry;
+	}
+	idx = index->free_nodes[--index->nr_free];
+	node = &index->nodes[idx];
+	node->state = XINDEX_NODE_CLAIMED;
+	node->ref = 1;
+	if (index->type == XINDEX_STRING) {
+		strcpy(node->name, name);
+		node->key = (xhashidx)node->name;
+	} else {
+		node->key = (xhashidx)name;
+	}
+	/* the node may move once unlocked */
+	priv = node->priv;
+	h = __handler(node->epoch, idx);
+	__unlock(index);
+
+	if (index->ops.on_init && index->ops.on_init(index->priv, priv)) {
+		__lock(index);
+		__free_node(index, idx);
+		__unlock(index);
+		return NoIndexEntry;
+	}
+	return h;
+}
+
+/* Return the entry of name, with a reference for the caller */
+xindex_handler xindex_lookup(struct xindex *index, char *name)
+{
+	struct xindex_entry *node;
+	xhashidx idx;
+	int r;
+
+	__lock(index);
+	r = xhash_lookup(index->entries, (xhashidx)name, &idx);
+	if (r < 0) {
+		__unlock(index);
+		return NoIndexEntry;
+	}
+	node = &index->nodes[idx];
+	node->ref++;
+	__unlock(index);
+	return __handler(node->epoch, idx);
+}
+
+/*
+ * Index a claimed entry. If an entry of the same name is already indexed, it
+ * is returned instead, with a reference for the caller, who must put the
+ * entry it tried to insert.
+ */
+xindex_handler xindex_insert(struct xindex *index, xindex_handler h)
+{
+	struct xindex_entry *node, *old;
+	xhashidx idx;
+	xhash_t *entries;
+	int r;
+
+	__lock(index);
+	node = __get_xnode(index, h);
+	if (!node || node->state != XINDEX_NODE_CLAIMED) {
+		__unlock(index);
+		return NoIndexEntry;
+	}
+	if (xhash_lookup(index->entries, node->key, &idx) >= 0) {
+		old = &index->nodes[idx];
+		old->ref++;
+		__unlock(index);
+		return __handler(old->epoch, idx);
+	}
+
+	r = xhash_insert(index->entries, node->key, __handler_idx(h));
+	while (r == -XHASH_ERESIZE) {
+		entries = xhash_resize(index->entries,
+				xhash_grow_size_shift(index->entries), 0, NULL);
+		if (!entries)
+			break;
+		index->entries = entries;
+		r = xhash_insert(index->entries, node->key, __handler_idx(h));
+	}
+	if (r < 0) {
+		__unlock(index);
+		XSEGLOG2(&lc, E, "Cannot insert entry in index %p", index);
+		return NoIndexEntry;
+	}
+	node->state = XINDEX_NODE_ACTIVE;
+	__unlock(index);
+	return h;
+}
+
+void xindex_get(struct xindex *index, xindex_handler h)
+{
+	struct xindex_entry *node;
+
+	__lock(index);
+	node = __get_xnode(index, h);
+	if (node)
+		node->ref++;
+	__unlock(index);
+}
+
+/*
+ * Put a reference of an entry. The last one removes the entry from the
+ * index and frees its node.
+ */
+void xindex_put(struct xindex *index, xindex_handler h)
+{
+	struct xindex_entry *node;
+	xhash_t *entries;
+	void *priv;
+	int r;
+
+	__lock(index);
+	node = __get_xnode(index, h);
+	if (!node) {
+		__unlock(index);
+		XSEGLOG2(&lc, W, "Put of stale handler %llx on index %p",
+				(unsigned long long)h, index);
+		return;
+	}
+	if (--node->ref) {
+		__unlock(index);
+		return;
+	}
+	if (node->state == XINDEX_NODE_ACTIVE) {
+		r = xhash_delete(index->entries, node->key);
+		while (r == -XHASH_ERESIZE) {
+			entries = xhash_resize(index->entries,
+					xhash_shrink_size_shift(index->entries),
+					0, NULL);
+			if (!entries)
+				break;
+			index->entries = entries;
+			r = xhash_delete(index->entries, node->key);
+		}
+		if (r < 0)
+			XSEGLOG2(&lc, E, "Cannot remove entry from index %p",
+					index);
+	}
+	node->state = XINDEX_NODE_REMOVED;
+	priv = node->priv;
+	__unlock(index);
+
+	if (index->ops.on_put)
+		index->ops.on_put(index->priv, priv);
+
+	__lock(index);
+	__free_node(index, __handler_idx(h));
+	__unlock(index);
+}
+
+/* Return the user data of an entry, or NULL if the handler is stale */
+void * xindex_get_entry(struct xindex *index, xindex_handler h)
+{
+	struct xindex_entry *node;
+	void *priv = NULL;
+
+	__lock(index);
+	node = __get_xnode(index, h);
+	if (node)
+		priv = node->priv;
+	__unlock(index);
+	return priv;
+}
+
+/* Set the user data of an entry, for indexes without on_node_init */
+void xindex_set_entry(struct xindex *index, xindex_handler h, void *priv)
+{
+	struct xindex_entry *node;
+
+	__lock(index);
+	node = __get_xnode(index, h);
+	if (node)
+		node->priv = priv;
+	__unlock(index);
+}
@@ -0,0 +1,105 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XINDEX_H
+#define _XINDEX_H
+
+#include <stdint.h>
+#include <xseg/xseg.h>
+#include <xseg/xhash.h>
+
+/*
+ * xindex: a refcounted index of entries that live for as long as requests
+ * reference them (see docs/design/design_xindex.rst).
+ *
+ * Entries are claimed from a pool of nodes that is allocated once, and
+ * indexed by a hash table sized for the pool, so that claiming, indexing and
+ * removing an entry allocates nothing and rehashes nothing. Should the pool
+ * run out, it is doubled.
+ *
+ * A handler keeps the epoch of its entry in its upper 32 bits and the node
+ * of the entry in its lower 32 bits. An entry leaves the index when its last
+ * reference is put, which starts a new epoch for its node and invalidates all
+ * handlers of the entry.
+ */
+
+#define XINDEX_INTEGER 0	/* keys are integers, e.g. request pointers */
+#define XINDEX_STRING 1		/* keys are strings, copied in the entry */
+
+typedef uint64_t xindex_handler;
+#define NoIndexEntry ((xindex_handler)-1)
+
+enum xindex_node_state {
+	XINDEX_NODE_FREE = 0,
+	XINDEX_NODE_CLAIMED = 1,
+	XINDEX_NODE_ACTIVE = 2,
+	XINDEX_NODE_REMOVED = 3
+};
+
+struct xindex_ops {
+	/* the entry was claimed, non-zero to give it up */
+	int (*on_init)(void *index_data, void *user_data);
+	/* the last reference of the entry was put */
+	void (*on_put)(void *index_data, void *user_data);
+	/* the pool is freed, release what on_node_init allocated */
+	void (*on_free)(void *index_data, void *user_data);
+	/* a node was allocated, return its user data */
+	void *(*on_node_init)(void *index_data);
+	/* the epoch of the entry wrapped around */
+	void (*on_recycle_handler)(void *index_data, void *user_data);
+};
+
+struct xindex_entry {
+	uint32_t state;
+	uint32_t epoch;
+	uint32_t ref;
+	xhashidx key;
+	char *name;		/* allocated apart, since nodes move on growth */
+	void *priv;
+};
+
+struct xindex {
+	struct xlock lock;
+	int type;
+	uint32_t size;
+	uint32_t nr_free;
+	uint32_t *free_nodes;
+	struct xindex_entry *nodes;
+	xhash_t *entries;
+	struct xindex_ops ops;
+	void *priv;
+};
+
+int xindex_init(struct xindex *index, uint32_t xindex_size,
+		struct xindex_ops *ops, int type, void *priv);
+void xindex_close(struct xindex *index);
+void xindex_free(struct xindex *index);
+
+/*
+ * For XINDEX_INTEGER indexes, name is the key itself, cast to a pointer.
+ */
+xindex_handler xindex_alloc_init(struct xindex *index, char *name);
+xindex_handler xindex_lookup(struct xindex *index, char *name);
+xindex_handler xindex_insert(struct xindex *index, xindex_handler h);
+
+void xindex_get(struct xindex *index, xindex_handler h);
+void xindex_put(struct xindex *index, xindex_handler h);
+
+void * xindex_get_entry(struct xindex *index, xindex_handler h);
+void xindex_set_entry(struct xindex *index, xindex_handler h, void *priv);
+
+#endif /* _XINDEX_H */
@@ -0,0 +1,123 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <xtrace.h>
+
+int xtrace_create(struct xtrace *xt, char *path)
+{
+	struct xtrace_header hdr;
+	struct timespec now;
+
+	xt->fp = fopen(path, "w");
+	if (!xt->fp)
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &xt->start);
+	xt->records = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = XTRACE_MAGIC;
+	hdr.version = XTRACE_VERSION;
+	hdr.start_sec = now.tv_sec;
+	hdr.start_nsec = now.tv_nsec;
+	if (fwrite(&hdr, sizeof(hdr), 1, xt->fp) != 1) {
+		fclose(xt->fp);
+		xt->fp = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int xtrace_open(struct xtrace *xt, char *path)
+{
+	struct xtrace_header hdr;
+
+	xt->fp = fopen(path, "r");
+	if (!xt->fp)
+		return -1;
+	xt->records = 0;
+
+	if (fread(&hdr, sizeof(hdr), 1, xt->fp) != 1 ||
+			hdr.magic != XTRACE_MAGIC ||
+			hdr.version != XTRACE_VERSION) {
+		fclose(xt->fp);
+		xt->fp = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+	xt->start.tv_sec = hdr.start_sec;
+	xt->start.tv_nsec = hdr.start_nsec;
+	return 0;
+}
+
+int xtrace_write(struct xtrace *xt, struct xtrace_record *rec, char *target)
+{
+	if (fwrite(rec, sizeof(*rec), 1, xt->fp) != 1)
+		return -1;
+	if (rec->targetlen &&
+			fwrite(target, rec->targetlen, 1, xt->fp) != 1)
+		return -1;
+	xt->records++;
+	return 0;
+}
+
+/*
+ * Read the next record and its target, which is null-terminated. The target
+ * buffer must have room for maxlen + 1 bytes.
+ */
+int xtrace_read(struct xtrace *xt, struct xtrace_record *rec, char *target,
+		uint32_t maxlen)
+{
+	if (fread(rec, sizeof(*rec), 1, xt->fp) != 1) {
+		if (feof(xt->fp))
+			return 0;
+		return -1;
+	}
+	if (rec->targetlen > maxlen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (rec->targetlen &&
+			fread(target, rec->targetlen, 1, xt->fp) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	target[rec->targetlen] = 0;
+	xt->records++;
+	return 1;
+}
+
+int xtrace_close(struct xtrace *xt)
+{
+	int r;
+
+	if (!xt->fp)
+		return 0;
+	r = fclose(xt->fp);
+	xt->fp = NULL;
+	return r ? -1 : 0;
+}
+
+/* Nanoseconds from the start of the capture to ts (CLOCK_MONOTONIC) */
+uint64_t xtrace_ts(struct xtrace *xt, struct timespec *ts)
+{
+	return (ts->tv_sec - xt->start.tv_sec) * 1000000000ULL +
+		ts->tv_nsec - xt->start.tv_nsec;
+}
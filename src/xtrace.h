@@ -0,0 +1,79 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XTRACE_H
+
+#define XTRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Traces of xseg request streams.
+ *
+ * A trace file starts with a struct xtrace_header, followed by one struct
+ * xtrace_record per request, each one followed by the targetlen bytes of the
+ * request's target (not null-terminated). Records are written when requests
+ * complete, so they are not necessarily sorted by their timestamp. All
+ * fields are in native byte order.
+ */
+
+#define XTRACE_MAGIC 0x43525458		/* "XTRC" */
+#define XTRACE_VERSION 1
+
+#define XTRACE_SERVED 0
+#define XTRACE_FAILED 1
+
+struct xtrace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start_sec;	/* wall clock time of the start of the capture */
+	uint64_t start_nsec;
+};
+
+struct xtrace_record {
+	uint64_t ts;		/* ns from the start of the capture */
+	uint64_t latency;	/* ns until the request was completed */
+	uint64_t offset;
+	uint64_t size;
+	uint32_t op;
+	uint32_t flags;		/* xseg request flags */
+	uint16_t targetlen;
+	uint16_t state;		/* XTRACE_SERVED or XTRACE_FAILED */
+	uint32_t reserved;
+};
+
+struct xtrace {
+	FILE *fp;
+	struct timespec start;	/* CLOCK_MONOTONIC start of the capture */
+	uint64_t records;
+};
+
+/*
+ * All functions return -1 on failure, with errno set. xtrace_read() returns 0
+ * at the end of the trace and 1 if it read a record.
+ */
+int xtrace_create(struct xtrace *xt, char *path);
+int xtrace_open(struct xtrace *xt, char *path);
+int xtrace_write(struct xtrace *xt, struct xtrace_record *rec, char *target);
+int xtrace_read(struct xtrace *xt, struct xtrace_record *rec, char *target,
+		uint32_t maxlen);
+int xtrace_close(struct xtrace *xt);
+uint64_t xtrace_ts(struct xtrace *xt, struct timespec *ts);
+
+#endif /* end of XTRACE_H */
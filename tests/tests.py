@@ -15,7 +15,7 @@
 
 import archipelago
 from archipelago.common import Xseg_ctx, Request, Filed, Mapperd, Vlmcd, Radosd, \
-        Error, Segment
+        Memd, Cached, Wbcached, Error, Segment
 from archipelago.archipelago import start_peer, stop_peer
 import random as rnd
 import unittest2 as unittest
@@ -23,6 +23,7 @@ from xseg.xprotocol import *
 from xseg.xseg_api import *
 import ctypes
 import os
+import re
 from copy import copy
 from sets import Set
 from binascii import hexlify, unhexlify
@@ -30,6 +31,11 @@ from hashlib import sha256
 from struct import pack
 import pwd
 import grp
+import signal
+import time
+
+# peer-private op, see src/peer.h
+X_DISCARD = 30
 
 def get_random_string(length=64, repeat=16):
     nr_repeats = length//repeat
@@ -411,6 +417,20 @@ class XsegTest(unittest.TestCase):
 
     send_and_evaluate_rename = evaluate(send_rename)
 
+    def send_flush(self, dst, target):
+        req = self.get_req(X_FLUSH, dst, target)
+        req.submit()
+        return req
+
+    send_and_evaluate_flush = evaluate(send_flush)
+
+    def send_discard(self, dst, target, size=0, offset=0):
+        req = self.get_req(X_DISCARD, dst, target, size=size, offset=offset)
+        req.submit()
+        return req
+
+    send_and_evaluate_discard = evaluate(send_discard)
+
     def get_filed(self, args, clean=False):
         path = args['archip_dir']
         if not os.path.exists(path):
@@ -439,6 +459,18 @@ class XsegTest(unittest.TestCase):
     def get_vlmcd(self, args):
         return Vlmcd(user=self.user, group=self.group, **args)
 
+    def get_memd(self, args):
+        return Memd(user=self.user, group=self.group, **args)
+
+    def get_cached(self, args):
+        return Cached(user=self.user, group=self.group, **args)
+
+    def get_wbcached(self, args, clean=False):
+        journal = args['journal']
+        if clean and os.path.exists(journal):
+            os.remove(journal)
+        return Wbcached(user=self.user, group=self.group, **args)
+
 class VlmcdTest(XsegTest):
     bfiled_args = {
             'role': 'vlmctest-blockerb',
@@ -562,6 +594,39 @@ class VlmcdTest(XsegTest):
         self.send_and_evaluate_read(self.vlmcdport, volume, size=datalen,
                 expected_data=data)
 
+    def test_discard(self):
+        blocksize = self.blocksize
+        volume = "myvolume"
+        snap = "mysnapshot"
+        volsize = 10*1024*1024
+        size = 2*blocksize
+        partial = 64*1024
+        data = get_random_string(size, 16)
+        # the whole first object and a part of the second one
+        expected = '\x00' * (blocksize + partial) + data[blocksize + partial:]
+
+        self.send_and_evaluate_discard(self.vlmcdport, volume, size=size,
+                expected=False)
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.send_and_evaluate_write(self.vlmcdport, volume, data=data,
+                serviced=size)
+        self.send_and_evaluate_snapshot(self.vlmcdport, volume, snap=snap)
+        self.send_and_evaluate_write(self.vlmcdport, volume, data=data,
+                serviced=size)
+        self.send_and_evaluate_discard(self.vlmcdport, volume,
+                size=blocksize + partial, serviced=blocksize + partial)
+        self.send_and_evaluate_read(self.vlmcdport, volume, size=size,
+                expected_data=expected)
+        # only writable objects are freed, so the snapshot keeps its data
+        self.send_and_evaluate_read(self.vlmcdport, snap, size=size,
+                expected_data=data)
+        # discarding a discarded range changes nothing
+        self.send_and_evaluate_discard(self.vlmcdport, volume,
+                size=blocksize, serviced=blocksize)
+        self.send_and_evaluate_read(self.vlmcdport, volume, size=size,
+                expected_data=expected)
+
     def test_clone_snapshot(self):
         volume = "myvolume"
         snap = "mysnapshot"
@@ -1254,6 +1319,30 @@ class BlockerTest(object):
         self.send_and_evaluate_read(self.blockerport, target, size=datalen,
                 expected=False)
 
+    def test_discard(self):
+        datalen = 3*4096
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+        expected = data[:4096] + '\x00' * 4096 + data[8192:]
+        xinfo = self.get_reply_info(datalen)
+
+        # a missing object has nothing to discard
+        self.send_and_evaluate_discard(self.blockerport, target, size=4096,
+                offset=4096, serviced=4096)
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_discard(self.blockerport, target, size=4096,
+                offset=4096, serviced=4096)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=expected)
+        self.send_and_evaluate_info(self.blockerport, target, expected_data=xinfo)
+        # an unaligned range reads as zeros too
+        expected = expected[:100] + '\x00' * 200 + expected[300:]
+        self.send_and_evaluate_discard(self.blockerport, target, size=200,
+                offset=100, serviced=200)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=expected)
+
     def test_hash(self):
         datalen = 1024
         data = '\x00'*datalen
@@ -1366,6 +1455,245 @@ class RadosdTest(BlockerTest, XsegTest):
         stop_peer(self.blocker)
         super(RadosdTest, self).tearDown()
 
+class CachedTest(XsegTest):
+    # a slow blocker, so that reads meet while a block is being fetched
+    memd_args = {
+            'role': 'cachedtest-blocker',
+            'spec': XsegTest.spec,
+            'nr_ops': 16,
+            'portno_start': 0,
+            'portno_end': 0,
+            'daemon': True,
+            'log_level': 3,
+            'arena_size': 64,
+            'latency': 200000,
+            }
+    cached_args = {
+            'role': 'cachedtest-cache',
+            'spec': XsegTest.spec,
+            'nr_ops': 16,
+            'portno_start': 1,
+            'portno_end': 1,
+            'daemon': True,
+            'log_level': 3,
+            'blocker_port': 0,
+            'cache_size': 16,
+            'admission': False,
+            }
+    cache_blocksize = 128*1024
+
+    def setUp(self):
+        super(CachedTest, self).setUp()
+        try:
+            self.blocker = self.get_memd(self.memd_args)
+            self.cached = self.get_cached(self.cached_args)
+            self.blockerport = self.blocker.portno_start
+            self.cacheport = self.cached.portno_start
+            start_peer(self.blocker)
+            start_peer(self.cached)
+        except Exception as e:
+            print e
+            stop_peer(self.cached)
+            stop_peer(self.blocker)
+            super(CachedTest, self).tearDown()
+            raise e
+
+    def tearDown(self):
+        stop_peer(self.cached)
+        stop_peer(self.blocker)
+        super(CachedTest, self).tearDown()
+
+    def get_counters(self):
+        # cached logs its block counters when it stops
+        stop_peer(self.cached)
+        counters = None
+        with open(self.cached.logfile) as f:
+            for line in f:
+                m = re.search(r'Block hits: (\d+), misses: (\d+), '
+                        r'coalesced: (\d+)', line)
+                if m:
+                    counters = [int(c) for c in m.groups()]
+        self.assertIsNotNone(counters)
+        return counters
+
+    def test_hit(self):
+        datalen = 2*self.cache_blocksize
+        data = get_random_string(datalen, 16)
+        target = sha256(data).hexdigest()
+
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_read(self.cacheport, target, size=datalen,
+                expected_data=data)
+        # hash objects never change, so the cached blocks are still served
+        self.send_and_evaluate_delete(self.blockerport, target)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected=False)
+        self.send_and_evaluate_read(self.cacheport, target, size=datalen,
+                expected_data=data)
+
+        hits, misses, coalesced = self.get_counters()
+        self.assertEqual(misses, 2)
+        self.assertEqual(hits, 2)
+        self.assertEqual(coalesced, 0)
+
+    def test_coalesce(self):
+        datalen = 2*self.cache_blocksize
+        data = get_random_string(datalen, 16)
+        target = sha256(data).hexdigest()
+
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        reqs = Set([])
+        reqs.add(self.send_read(self.cacheport, target, size=datalen))
+        reqs.add(self.send_read(self.cacheport, target, size=datalen))
+        while len(reqs) > 0:
+            req = self.xseg.wait_requests(reqs)
+            self.evaluate_req(req, data=data)
+            reqs.remove(req)
+            self.assertTrue(req.put())
+
+        # the second read waited for the fetches of the first one
+        hits, misses, coalesced = self.get_counters()
+        self.assertEqual(misses, 2)
+        self.assertEqual(coalesced, 2)
+        self.assertEqual(hits, 0)
+
+class WbcachedTest(XsegTest):
+    filed_args = {
+            'role': 'wbcachedtest-blocker',
+            'spec': XsegTest.spec,
+            'nr_ops': 16,
+            'archip_dir': '/tmp/wbfiledtest/',
+            'prefix': 'archip_',
+            'portno_start': 0,
+            'portno_end': 0,
+            'daemon': True,
+            'log_level': 3,
+            'direct': False,
+            }
+    wbcached_args = {
+            'role': 'wbcachedtest-cache',
+            'spec': XsegTest.spec,
+            'nr_ops': 16,
+            'portno_start': 1,
+            'portno_end': 1,
+            'daemon': True,
+            'log_level': 3,
+            'blocker_port': 0,
+            'journal': '/tmp/wbcachedtest.journal',
+            'journal_size': 64,
+            }
+
+    def setUp(self):
+        super(WbcachedTest, self).setUp()
+        try:
+            self.blocker = self.get_filed(self.filed_args, clean=True)
+            self.wbcached = self.get_wbcached(self.wbcached_args, clean=True)
+            self.blockerport = self.blocker.portno_start
+            self.cacheport = self.wbcached.portno_start
+            start_peer(self.blocker)
+            start_peer(self.wbcached)
+        except Exception as e:
+            print e
+            stop_peer(self.wbcached)
+            stop_peer(self.blocker)
+            super(WbcachedTest, self).tearDown()
+            raise e
+
+    def tearDown(self):
+        stop_peer(self.wbcached)
+        stop_peer(self.blocker)
+        super(WbcachedTest, self).tearDown()
+
+    def test_flush_renamed(self):
+        # A renamed volume keeps writing to the objects of its old name
+        volume = "myvolume"
+        newvolume = "newvolume"
+        datalen = 4096
+        data = get_random_string(datalen, 16)
+        target = self.get_object_name(volume, 1, 0)
+
+        self.send_and_evaluate_write(self.cacheport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected=False)
+        self.send_and_evaluate_flush(self.cacheport, newvolume)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+
+    def test_write_back_read(self):
+        volume = "myvolume"
+        datalen = 8192
+        data = get_random_string(datalen, 16)
+        data2 = get_random_string(4096, 16)
+        target = self.get_object_name(volume, 1, 0)
+
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_write(self.cacheport, target, data=data2,
+                offset=4096, serviced=4096)
+        # the dirty data is not at the blocker yet, but reads see it
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+        self.send_and_evaluate_read(self.cacheport, target, size=datalen,
+                expected_data=data[:4096] + data2)
+
+    def test_flush(self):
+        volume = "myvolume"
+        volume2 = "myvolume2"
+        datalen = 4096
+        data = get_random_string(datalen, 16)
+        data2 = get_random_string(datalen, 16)
+        target = self.get_object_name(volume, 1, 0)
+        target2 = self.get_object_name(volume, 1, 1)
+
+        # a volume without dirty data flushes at once
+        self.send_and_evaluate_flush(self.cacheport, volume2)
+        self.send_and_evaluate_write(self.cacheport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_write(self.cacheport, target2, data=data2,
+                offset=datalen, serviced=datalen)
+        self.send_and_evaluate_flush(self.cacheport, volume)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+        self.send_and_evaluate_read(self.blockerport, target2, size=datalen,
+                offset=datalen, expected_data=data2)
+        self.send_and_evaluate_read(self.cacheport, target, size=datalen,
+                expected_data=data)
+
+    def test_replay(self):
+        volume = "myvolume"
+        datalen = 4096
+        data = get_random_string(datalen, 16)
+        target = self.get_object_name(volume, 1, 0)
+
+        self.send_and_evaluate_write(self.cacheport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected=False)
+
+        # kill it, so that the dirty data is only in the journal
+        pid = self.wbcached.get_pid()
+        os.kill(pid, signal.SIGKILL)
+        while True:
+            try:
+                os.kill(pid, 0)
+            except OSError:
+                break
+            time.sleep(0.1)
+        os.remove(self.wbcached.pidfile)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected=False)
+
+        # the journal is replayed before requests are served
+        self.wbcached = self.get_wbcached(self.wbcached_args)
+        start_peer(self.wbcached)
+        self.send_and_evaluate_read(self.cacheport, target, size=datalen,
+                expected_data=data)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+
 if __name__=='__main__':
     init()
     unittest.main()